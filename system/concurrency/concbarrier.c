@@ -39,7 +39,7 @@ void barrier_init(barrier_t *b, int n) {
   b->n_threads = n;
   pthread_mutex_init(&b->mutex, NULL);
   sem_init(&b->turnstile1, 0, 0);  // Initially closed
-  sem_init(&b->turnstile2, 0, 1);  // Initially open for reset
+  sem_init(&b->turnstile2, 0, 0);  // Initially closed; the last thread to leave opens it
 }
 
 /**
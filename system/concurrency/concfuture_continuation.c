@@ -0,0 +1,523 @@
+/*
+ * Allocation-free Futures with continuations (then / when_all / when_any)
+ *
+ * concfuture_threadpool.c mallocs a Future per submit and gives each one its
+ * own mutex and condition variable. The only way to consume a result is
+ * future_get(), which blocks, so a task graph A -> B needs a thread parked on
+ * A just to start B.
+ *
+ * This version changes three things:
+ *
+ *  - State is a single atomic word. future_get() spins briefly and then
+ *    parks on that word with FUTEX_WAIT; completion only calls FUTEX_WAKE if
+ *    a waiter announced itself by setting the WAITERS bit.
+ *
+ *  - Futures and continuation edges come from fixed-size slabs owned by the
+ *    pool. The free lists are lock-free (Treiber stacks with a tag against
+ *    ABA). Only when a slab runs dry do we fall back to malloc.
+ *
+ *  - A Future carries a lock-free list of continuations. then() schedules a
+ *    dependent task on the pool when its input completes; when_all() and
+ *    when_any() are completed directly by the last / first input. Nobody
+ *    blocks while the graph runs.
+ *
+ * Lifetime: every Future is reference counted. The caller owns one reference
+ * to each Future it gets back and drops it with future_release().
+ *
+ * Compilation:
+ *   gcc concfuture_continuation.c -O2 -pthread -o concfuture_continuation
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline int futex_wait(atomic_int *futex, int expected) {
+  return syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline int futex_wake(atomic_int *futex, int count) {
+  return syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* =========================
+   Slab allocator
+   ========================= */
+
+/*
+ * A slab is an array of equally sized objects with a lock-free free list.
+ * The list head packs a 32-bit object index with a 32-bit tag that is bumped
+ * on every pop, so a stale CAS can never succeed (ABA).
+ */
+#define SLAB_NIL UINT32_MAX
+
+typedef struct {
+  char *mem;                 // n * objsize bytes
+  size_t objsize;            // Size of one object
+  uint32_t n;                // Number of objects
+  _Atomic uint32_t *next;    // next[i] = free-list successor of object i
+  _Atomic uint64_t head;     // (tag << 32) | index of first free object
+  atomic_long heap_allocs;   // Fallback allocations when the slab was empty
+} Slab;
+
+void slab_init(Slab *s, size_t objsize, uint32_t n) {
+  s->mem = malloc(objsize * n);
+  s->objsize = objsize;
+  s->n = n;
+  s->next = malloc(sizeof(*s->next) * n);
+  for (uint32_t i = 0; i < n; i++) atomic_store(&s->next[i], i + 1 < n ? i + 1 : SLAB_NIL);
+  atomic_store(&s->head, n ? 0 : SLAB_NIL);
+  atomic_store(&s->heap_allocs, 0);
+}
+
+void slab_destroy(Slab *s) {
+  free(s->mem);
+  free(s->next);
+}
+
+void *slab_alloc(Slab *s) {
+  uint64_t head = atomic_load(&s->head);
+  while (1) {
+    uint32_t idx = (uint32_t)head;
+    if (idx == SLAB_NIL) {
+      atomic_fetch_add_explicit(&s->heap_allocs, 1, memory_order_relaxed);
+      return malloc(s->objsize);
+    }
+    uint64_t tag = (head >> 32) + 1;
+    uint64_t next = (tag << 32) | atomic_load(&s->next[idx]);
+    if (atomic_compare_exchange_weak(&s->head, &head, next)) {
+      return s->mem + (size_t)idx * s->objsize;
+    }
+  }
+}
+
+void slab_free(Slab *s, void *p) {
+  char *c = p;
+  if (c < s->mem || c >= s->mem + (size_t)s->n * s->objsize) {
+    free(p);  // Came from the malloc fallback
+    return;
+  }
+  uint32_t idx = (c - s->mem) / s->objsize;
+  uint64_t head = atomic_load(&s->head);
+  do {
+    atomic_store(&s->next[idx], (uint32_t)head);
+  } while (!atomic_compare_exchange_weak(&s->head, &head, (head & ~(uint64_t)UINT32_MAX) | idx));
+}
+
+/* =========================
+   Future
+   ========================= */
+
+/* Bits of Future.state */
+#define FUTURE_PENDING 0
+#define FUTURE_READY 1
+#define FUTURE_WAITERS 2  // Some thread is (about to be) parked in future_get
+
+typedef enum {
+  KIND_TASK,  // Runs task(arg) on the pool
+  KIND_THEN,  // Runs cont(input, arg) on the pool once the input completes
+  KIND_ALL,   // Completes when `remaining` inputs have completed
+  KIND_ANY    // Completes with the first input to finish
+} FutureKind;
+
+typedef struct ContNode ContNode;
+typedef struct ThreadPool ThreadPool;
+
+typedef struct Future {
+  atomic_int state;  // FUTURE_PENDING / FUTURE_READY, plus FUTURE_WAITERS
+  atomic_int refs;   // Owners: the caller plus whoever will complete it
+  void *result;      // Valid once FUTURE_READY is visible (acquire)
+
+  _Atomic(ContNode *) conts;  // Continuations to run on completion
+
+  FutureKind kind;
+  union {
+    void *(*task)(void *);          // KIND_TASK
+    void *(*cont)(void *, void *);  // KIND_THEN
+  };
+  void *arg;
+  void *input;              // KIND_THEN: result of the completed input
+  atomic_int remaining;     // KIND_ALL: inputs not yet complete
+  ThreadPool *pool;
+
+  struct Future *next;  // Next future in the run queue
+} Future;
+
+/*
+ * An edge from an input Future to a dependent one. Pushed onto the input's
+ * `conts` list; the list is swapped to CONTS_CLOSED when the input completes
+ * so later registrations fire immediately instead.
+ */
+struct ContNode {
+  Future *target;
+  ContNode *next;
+};
+
+static ContNode conts_closed_sentinel;
+#define CONTS_CLOSED (&conts_closed_sentinel)
+
+/* =========================
+   Thread Pool
+   ========================= */
+
+struct ThreadPool {
+  pthread_t *threads;
+  int num_threads;
+
+  Future *queue_head;
+  Future *queue_tail;
+  pthread_mutex_t queue_mutex;
+  pthread_cond_t queue_cond;
+  int shutdown;
+
+  Slab futures;  // Slab of Future objects
+  Slab edges;    // Slab of ContNode objects
+};
+
+static void pool_enqueue(ThreadPool *pool, Future *f) {
+  f->next = NULL;
+  pthread_mutex_lock(&pool->queue_mutex);
+  if (pool->queue_tail)
+    pool->queue_tail->next = f;
+  else
+    pool->queue_head = f;
+  pool->queue_tail = f;
+  pthread_cond_signal(&pool->queue_cond);
+  pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+static Future *future_alloc(ThreadPool *pool, FutureKind kind, int refs) {
+  Future *f = slab_alloc(&pool->futures);
+  atomic_store_explicit(&f->state, FUTURE_PENDING, memory_order_relaxed);
+  atomic_store_explicit(&f->refs, refs, memory_order_relaxed);
+  atomic_store_explicit(&f->conts, NULL, memory_order_relaxed);
+  f->result = NULL;
+  f->kind = kind;
+  f->arg = NULL;
+  f->input = NULL;
+  f->pool = pool;
+  f->next = NULL;
+  return f;
+}
+
+/*
+ * Drop one reference; the last one returns the Future to the slab.
+ */
+void future_release(Future *f) {
+  if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+    slab_free(&f->pool->futures, f);
+  }
+}
+
+static void future_complete(Future *f, void *result);
+
+/*
+ * Called when an input of `target` completes with `result`.
+ */
+static void fire_edge(Future *target, Future *input, void *result) {
+  switch (target->kind) {
+    case KIND_THEN:
+      target->input = result;
+      pool_enqueue(target->pool, target);
+      break;
+    case KIND_ALL:
+      if (atomic_fetch_sub_explicit(&target->remaining, 1, memory_order_acq_rel) == 1) {
+        future_complete(target, NULL);
+      }
+      break;
+    case KIND_ANY: {
+      // Only the first input to get here completes the combinator; the
+      // others just drop the reference their edge held.
+      int expected = 1;
+      if (atomic_compare_exchange_strong(&target->remaining, &expected, 0)) {
+        future_complete(target, input);
+      } else {
+        future_release(target);
+      }
+      break;
+    }
+    case KIND_TASK:
+      break;
+  }
+}
+
+/*
+ * Register `target` as a dependent of `input`. If `input` has already
+ * completed, the edge fires right away on the calling thread.
+ */
+static void future_add_edge(Future *input, Future *target) {
+  ContNode *node = slab_alloc(&input->pool->edges);
+  node->target = target;
+
+  ContNode *head = atomic_load_explicit(&input->conts, memory_order_acquire);
+  while (head != CONTS_CLOSED) {
+    node->next = head;
+    if (atomic_compare_exchange_weak_explicit(&input->conts, &head, node, memory_order_release,
+                                              memory_order_acquire)) {
+      return;
+    }
+  }
+  slab_free(&input->pool->edges, node);
+  fire_edge(target, input, input->result);
+}
+
+/*
+ * Publish the result, run continuations, wake blocked getters, and drop the
+ * producer's reference.
+ */
+static void future_complete(Future *f, void *result) {
+  f->result = result;
+  int prev = atomic_fetch_or_explicit(&f->state, FUTURE_READY, memory_order_acq_rel);
+
+  ContNode *node = atomic_exchange_explicit(&f->conts, CONTS_CLOSED, memory_order_acq_rel);
+  while (node) {
+    ContNode *next = node->next;
+    fire_edge(node->target, f, result);
+    slab_free(&f->pool->edges, node);
+    node = next;
+  }
+
+  if (prev & FUTURE_WAITERS) futex_wake(&f->state, INT_MAX);
+  future_release(f);
+}
+
+/*
+ * Block until the Future completes and return its result.
+ */
+void *future_get(Future *f) {
+  for (int spins = 0; spins < 100; spins++) {
+    if (atomic_load_explicit(&f->state, memory_order_acquire) & FUTURE_READY) return f->result;
+  }
+
+  int s = atomic_load_explicit(&f->state, memory_order_acquire);
+  while (!(s & FUTURE_READY)) {
+    if (!(s & FUTURE_WAITERS) &&
+        !atomic_compare_exchange_weak(&f->state, &s, s | FUTURE_WAITERS)) {
+      continue;  // s was reloaded by the failed CAS
+    }
+    futex_wait(&f->state, FUTURE_PENDING | FUTURE_WAITERS);
+    s = atomic_load_explicit(&f->state, memory_order_acquire);
+  }
+  return f->result;
+}
+
+int future_is_ready(Future *f) {
+  return atomic_load_explicit(&f->state, memory_order_acquire) & FUTURE_READY;
+}
+
+/* =========================
+   Worker thread
+   ========================= */
+
+void *worker_thread(void *arg) {
+  ThreadPool *pool = arg;
+
+  while (1) {
+    pthread_mutex_lock(&pool->queue_mutex);
+    while (!pool->queue_head && !pool->shutdown) {
+      pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+    }
+    if (!pool->queue_head) {  // shutdown and drained
+      pthread_mutex_unlock(&pool->queue_mutex);
+      break;
+    }
+    Future *f = pool->queue_head;
+    pool->queue_head = f->next;
+    if (!pool->queue_head) pool->queue_tail = NULL;
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    void *res = f->kind == KIND_TASK ? f->task(f->arg) : f->cont(f->input, f->arg);
+    future_complete(f, res);
+  }
+
+  return NULL;
+}
+
+/* =========================
+   Thread pool API
+   ========================= */
+
+/*
+ * Create a pool with `num_threads` workers and room for `slab_size` live
+ * futures (and as many continuation edges) before falling back to malloc.
+ */
+ThreadPool *threadpool_create(int num_threads, uint32_t slab_size) {
+  ThreadPool *pool = malloc(sizeof(ThreadPool));
+
+  pool->num_threads = num_threads;
+  pool->threads = malloc(sizeof(pthread_t) * num_threads);
+  pool->queue_head = NULL;
+  pool->queue_tail = NULL;
+  pool->shutdown = 0;
+  pthread_mutex_init(&pool->queue_mutex, NULL);
+  pthread_cond_init(&pool->queue_cond, NULL);
+
+  slab_init(&pool->futures, sizeof(Future), slab_size);
+  slab_init(&pool->edges, sizeof(ContNode), slab_size);
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&pool->threads[i], NULL, worker_thread, pool);
+  }
+  return pool;
+}
+
+/*
+ * Submit task(arg) to the pool.
+ */
+Future *threadpool_submit(ThreadPool *pool, void *(*task)(void *), void *arg) {
+  Future *f = future_alloc(pool, KIND_TASK, 2);  // caller + completion
+  f->task = task;
+  f->arg = arg;
+  pool_enqueue(pool, f);
+  return f;
+}
+
+/*
+ * Run cont(result of f, arg) on the pool once f completes.
+ */
+Future *future_then(Future *f, void *(*cont)(void *input, void *arg), void *arg) {
+  Future *g = future_alloc(f->pool, KIND_THEN, 2);  // caller + completion
+  g->cont = cont;
+  g->arg = arg;
+  future_add_edge(f, g);
+  return g;
+}
+
+/*
+ * Completes (with a NULL result) once all n futures have completed, or right
+ * away if n is 0; `pool` is passed explicitly for that case. Read the
+ * individual results from the inputs.
+ */
+Future *future_when_all(ThreadPool *pool, Future **fs, int n) {
+  Future *all = future_alloc(pool, KIND_ALL, 2);  // caller + completion
+  if (n == 0) {
+    future_complete(all, NULL);
+    return all;
+  }
+  atomic_store(&all->remaining, n);
+  for (int i = 0; i < n; i++) future_add_edge(fs[i], all);
+  return all;
+}
+
+/*
+ * Completes with the first of the n futures to finish; the result is that
+ * Future pointer (the caller still owns its reference to it). n must be at
+ * least 1: with no inputs there is nothing to finish first.
+ */
+Future *future_when_any(Future **fs, int n) {
+  // caller + one per edge; the winning edge passes its reference to the
+  // completion, which drops it.
+  Future *any = future_alloc(fs[0]->pool, KIND_ANY, 1 + n);
+  atomic_store(&any->remaining, 1);
+  for (int i = 0; i < n; i++) future_add_edge(fs[i], any);
+  return any;
+}
+
+/*
+ * Finish queued work, stop the workers and free the pool.
+ */
+void threadpool_destroy(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->queue_mutex);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->queue_cond);
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  for (int i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->queue_mutex);
+  pthread_cond_destroy(&pool->queue_cond);
+  slab_destroy(&pool->futures);
+  slab_destroy(&pool->edges);
+  free(pool->threads);
+  free(pool);
+}
+
+/* =========================
+   Example tasks
+   ========================= */
+
+/* Results are passed as intptr_t cast to void *, so no allocations. */
+
+void *load_value(void *arg) { return arg; }
+
+void *square(void *input, void *arg) {
+  (void)arg;
+  intptr_t n = (intptr_t)input;
+  return (void *)(n * n);
+}
+
+void *add(void *input, void *arg) { return (void *)((intptr_t)input + (intptr_t)arg); }
+
+void *slow_value(void *arg) {
+  usleep((intptr_t)arg * 1000);
+  return arg;
+}
+
+/* =========================
+   Main
+   ========================= */
+
+#define FAN_OUT 1000
+
+int main(void) {
+  ThreadPool *pool = threadpool_create(4, 4096);
+
+  /* Chain: 7 -> square -> +1 */
+  Future *a = threadpool_submit(pool, load_value, (void *)7);
+  Future *b = future_then(a, square, NULL);
+  Future *c = future_then(b, add, (void *)1);
+  printf("then chain: 7^2 + 1 = %ld\n", (long)(intptr_t)future_get(c));
+  future_release(a);
+  future_release(b);
+  future_release(c);
+
+  /* Fan-out / fan-in: sum of squares 0..FAN_OUT-1 */
+  Future *squares[FAN_OUT];
+  for (intptr_t i = 0; i < FAN_OUT; i++) {
+    Future *v = threadpool_submit(pool, load_value, (void *)i);
+    squares[i] = future_then(v, square, NULL);
+    future_release(v);
+  }
+  Future *all = future_when_all(pool, squares, FAN_OUT);
+  future_get(all);
+  long sum = 0;
+  for (int i = 0; i < FAN_OUT; i++) {
+    sum += (intptr_t)squares[i]->result;
+    future_release(squares[i]);
+  }
+  future_release(all);
+  printf("when_all: sum of squares below %d = %ld\n", FAN_OUT, sum);
+
+  /* when_all of nothing is complete at once */
+  Future *none = future_when_all(pool, NULL, 0);
+  printf("when_all of 0 futures ready: %s\n", future_is_ready(none) ? "yes" : "no");
+  future_release(none);
+
+  /* when_any: the fastest of three sleepers wins */
+  Future *racers[3] = {
+      threadpool_submit(pool, slow_value, (void *)30),
+      threadpool_submit(pool, slow_value, (void *)5),
+      threadpool_submit(pool, slow_value, (void *)60),
+  };
+  Future *any = future_when_any(racers, 3);
+  Future *winner = future_get(any);
+  printf("when_any: first to finish slept %ld ms\n", (long)(intptr_t)winner->result);
+  future_release(any);
+  for (int i = 0; i < 3; i++) {
+    future_get(racers[i]);
+    future_release(racers[i]);
+  }
+
+  printf("malloc fallbacks: futures=%ld edges=%ld\n", atomic_load(&pool->futures.heap_allocs),
+         atomic_load(&pool->edges.heap_allocs));
+  threadpool_destroy(pool);
+  return 0;
+}
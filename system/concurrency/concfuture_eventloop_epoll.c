@@ -0,0 +1,596 @@
+/*
+ * Future implementation in C, using an event loop driven by epoll and a
+ * hierarchical timing wheel
+ *
+ * concfuture_eventloop.c round-robins a list of tasks and calls step() on
+ * every one of them until all are done. A task waiting for something still
+ * gets called over and over, so the loop spins at 100% CPU.
+ *
+ * Here a task's step() can instead *park* the task:
+ *
+ *   eventloop_sleep(loop, task, ms)              wake after a delay
+ *   eventloop_wait_fd(loop, task, fd, ev, ms)    wake when fd is ready
+ *                                                (or after ms, if ms >= 0)
+ *
+ * and return TASK_WAIT. Parked tasks are not on the run queue at all; they
+ * are referenced only from the timing wheel or from epoll. When nothing is
+ * runnable the loop blocks in epoll_wait with a timeout equal to the next
+ * timer, so thousands of idle tasks cost no CPU.
+ *
+ * Timing wheel (1 ms ticks, 4 levels of 64 slots, ~4.6 hours of range):
+ *  - Level L holds timers due in the current level-(L+1) window; the slot is
+ *    bits [6L, 6L+6) of the expiry tick. Insert and cancel are O(1)
+ *    (intrusive doubly linked lists).
+ *  - When level L-1 wraps, the next level-L slot is cascaded down.
+ *  - A 64-bit occupancy bitmap per level finds the next expiry quickly.
+ *  - Timers beyond the wheel's range wait on an overflow list.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/* =========================
+   Future
+   ========================= */
+
+typedef struct {
+  int completed;
+  void *result;
+} Future;
+
+Future *future_create(void) {
+  Future *f = malloc(sizeof(Future));
+  f->completed = 0;
+  f->result = NULL;
+  return f;
+}
+
+void future_complete(Future *f, void *result) {
+  f->completed = 1;
+  f->result = result;
+}
+
+/* =========================
+   Timer
+   ========================= */
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)  // Slots per level
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE_BITS (WHEEL_BITS * WHEEL_LEVELS)
+
+typedef struct Timer {
+  uint64_t expires;    // Absolute tick
+  struct Timer *prev;  // Links within a wheel slot (or the overflow list)
+  struct Timer *next;
+  struct Timer **slot; // List head we are on; NULL when not armed
+  int level;           // -1 for the overflow list
+  void (*fire)(struct Timer *);
+} Timer;
+
+typedef struct {
+  uint64_t now;  // Current tick; every timer with expires <= now has fired
+  Timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+  uint64_t occupied[WHEEL_LEVELS];  // Bit s set iff slots[level][s] non-empty
+  Timer *overflow;                  // Beyond WHEEL_RANGE_BITS
+  int count;                        // Armed timers
+} TimerWheel;
+
+void wheel_init(TimerWheel *w, uint64_t now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+static void wheel_link(TimerWheel *w, Timer *t, Timer **head, int level) {
+  t->prev = NULL;
+  t->next = *head;
+  if (*head) (*head)->prev = t;
+  *head = t;
+  t->slot = head;
+  t->level = level;
+  if (level >= 0) w->occupied[level] |= 1ULL << (head - w->slots[level]);
+}
+
+/*
+ * Place an armed timer in the right list. Requires t->expires > w->now.
+ */
+static void wheel_place(TimerWheel *w, Timer *t) {
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    int shift = WHEEL_BITS * (level + 1);
+    // Lowest level whose parent window contains both now and the expiry.
+    if ((t->expires >> shift) == (w->now >> shift)) {
+      int idx = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+      wheel_link(w, t, &w->slots[level][idx], level);
+      return;
+    }
+  }
+  wheel_link(w, t, &w->overflow, -1);
+}
+
+/*
+ * Arm a timer to fire at absolute tick `expires`. O(1). Returns 0 if the
+ * expiry is already due (the timer is not armed; the caller should act now).
+ */
+int wheel_add(TimerWheel *w, Timer *t, uint64_t expires) {
+  t->expires = expires;
+  t->slot = NULL;
+  if (expires <= w->now) return 0;
+  wheel_place(w, t);
+  w->count++;
+  return 1;
+}
+
+/*
+ * Disarm a timer. O(1). Safe to call on a timer that isn't armed.
+ */
+void wheel_cancel(TimerWheel *w, Timer *t) {
+  if (!t->slot) return;
+  if (t->prev)
+    t->prev->next = t->next;
+  else
+    *t->slot = t->next;
+  if (t->next) t->next->prev = t->prev;
+  if (t->level >= 0 && !*t->slot) {
+    w->occupied[t->level] &= ~(1ULL << (t->slot - w->slots[t->level]));
+  }
+  t->slot = NULL;
+  w->count--;
+}
+
+/*
+ * Re-place every timer of one list relative to the current tick.
+ */
+static void wheel_cascade(TimerWheel *w, Timer **head, int level) {
+  Timer *t = *head;
+  *head = NULL;
+  if (level >= 0) w->occupied[level] &= ~(1ULL << (head - w->slots[level]));
+  while (t) {
+    Timer *next = t->next;
+    wheel_place(w, t);
+    t = next;
+  }
+}
+
+/*
+ * Advance the wheel to tick `target`, firing every timer that expires on
+ * the way.
+ */
+void wheel_advance(TimerWheel *w, uint64_t target) {
+  if (w->count == 0) {  // Nothing to fire; skip the idle stretch.
+    if (target > w->now) w->now = target;
+    return;
+  }
+
+  while (w->now < target) {
+    w->now++;
+
+    // On a window boundary, pull the next slots down, highest level first,
+    // so timers cascaded from level L can be cascaded again from L-1.
+    if ((w->now & ((1ULL << WHEEL_RANGE_BITS) - 1)) == 0) wheel_cascade(w, &w->overflow, -1);
+    for (int level = WHEEL_LEVELS - 1; level >= 1; level--) {
+      if ((w->now & ((1ULL << (WHEEL_BITS * level)) - 1)) == 0) {
+        int idx = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        wheel_cascade(w, &w->slots[level][idx], level);
+      }
+    }
+
+    Timer **head = &w->slots[0][w->now & WHEEL_MASK];
+    while (*head) {
+      Timer *t = *head;
+      wheel_cancel(w, t);
+      t->fire(t);  // May re-arm this or other timers
+    }
+    if (w->count == 0) {
+      w->now = target;
+      return;
+    }
+  }
+}
+
+/*
+ * Lower bound on the number of ticks until the next timer fires (or until a
+ * cascade that might produce one). -1 if no timer is armed.
+ */
+int64_t wheel_next_timeout(TimerWheel *w) {
+  if (w->count == 0) return -1;
+
+  uint64_t best = UINT64_MAX;
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    int shift = WHEEL_BITS * level;
+    int cur = (w->now >> shift) & WHEEL_MASK;
+    // Slots after the current one (the current slot is already processed).
+    uint64_t ahead = cur == WHEEL_MASK ? 0 : w->occupied[level] & (~0ULL << (cur + 1));
+    if (ahead) {
+      uint64_t window = w->now >> (shift + WHEEL_BITS) << (shift + WHEEL_BITS);
+      uint64_t when = window | ((uint64_t)__builtin_ctzll(ahead) << shift);
+      if (when < best) best = when;
+    }
+  }
+  if (w->overflow) {
+    uint64_t when = ((w->now >> WHEEL_RANGE_BITS) + 1) << WHEEL_RANGE_BITS;
+    if (when < best) best = when;
+  }
+  return best == UINT64_MAX ? -1 : (int64_t)(best - w->now);
+}
+
+/* =========================
+   Task
+   ========================= */
+
+/* Return values of Task.step */
+#define TASK_YIELD 0  // Run me again soon
+#define TASK_DONE 1   // Finished; free me
+#define TASK_WAIT 2   // Parked via eventloop_sleep / eventloop_wait_fd
+
+/* Why a parked task was woken (Task.wake_reason) */
+#define WAKE_NONE 0
+#define WAKE_TIMER 1
+#define WAKE_FD 2
+
+typedef struct EventLoop EventLoop;
+
+typedef struct Task {
+  int (*step)(struct Task *);
+  void *state;
+  Future *future;
+  struct Task *next;  // Run queue link
+
+  EventLoop *loop;
+  Timer timer;       // Sleep or fd-wait timeout
+  int fd;            // fd registered with epoll, or -1
+  int fd_waiting;    // 1 while parked on fd
+  int wake_reason;   // WAKE_TIMER or WAKE_FD
+  uint32_t revents;  // epoll events when woken by WAKE_FD
+} Task;
+
+/* =========================
+   Event Loop
+   ========================= */
+
+struct EventLoop {
+  Task *ready_head;  // Runnable tasks (FIFO)
+  Task *ready_tail;
+  int parked;        // Tasks waiting on timers or fds
+
+  int epfd;
+  TimerWheel wheel;
+  uint64_t start_ms;  // Monotonic ms at tick 0
+
+  long wakeups;  // epoll_wait returns, for the demo's statistics
+};
+
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t loop_tick(EventLoop *loop) { return monotonic_ms() - loop->start_ms; }
+
+static void ready_push(EventLoop *loop, Task *task) {
+  task->next = NULL;
+  if (loop->ready_tail)
+    loop->ready_tail->next = task;
+  else
+    loop->ready_head = task;
+  loop->ready_tail = task;
+}
+
+static Task *ready_pop(EventLoop *loop) {
+  Task *task = loop->ready_head;
+  if (task) {
+    loop->ready_head = task->next;
+    if (!loop->ready_head) loop->ready_tail = NULL;
+  }
+  return task;
+}
+
+/*
+ * Wake a parked task, cancelling whichever of timer / fd did not fire.
+ */
+static void task_wake(Task *task, int reason) {
+  EventLoop *loop = task->loop;
+  wheel_cancel(&loop->wheel, &task->timer);
+  if (task->fd_waiting) {
+    // Registered with EPOLLONESHOT, so it's already disarmed if it fired;
+    // on timeout disarm it explicitly.
+    if (reason != WAKE_FD) {
+      struct epoll_event ev = {0};
+      epoll_ctl(loop->epfd, EPOLL_CTL_MOD, task->fd, &ev);
+    }
+    task->fd_waiting = 0;
+  }
+  task->wake_reason = reason;
+  loop->parked--;
+  ready_push(loop, task);
+}
+
+static void task_timer_fired(Timer *t) {
+  Task *task = (Task *)((char *)t - offsetof(Task, timer));
+  task_wake(task, WAKE_TIMER);
+}
+
+EventLoop *eventloop_create(void) {
+  EventLoop *loop = malloc(sizeof(EventLoop));
+  loop->ready_head = NULL;
+  loop->ready_tail = NULL;
+  loop->parked = 0;
+  loop->epfd = epoll_create1(0);
+  if (loop->epfd < 0) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  loop->start_ms = monotonic_ms();
+  wheel_init(&loop->wheel, 0);
+  loop->wakeups = 0;
+  return loop;
+}
+
+void eventloop_destroy(EventLoop *loop) {
+  close(loop->epfd);
+  free(loop);
+}
+
+/*
+ * Add a new task; it runs on the next loop iteration.
+ */
+void eventloop_add(EventLoop *loop, Task *task) {
+  task->loop = loop;
+  task->fd = -1;
+  task->fd_waiting = 0;
+  task->wake_reason = WAKE_NONE;
+  task->revents = 0;
+  task->timer.slot = NULL;
+  task->timer.fire = task_timer_fired;
+  ready_push(loop, task);
+}
+
+/*
+ * Park `task` for `ms` milliseconds. Call from step() and return TASK_WAIT.
+ */
+void eventloop_sleep(EventLoop *loop, Task *task, int ms) {
+  loop->parked++;
+  if (!wheel_add(&loop->wheel, &task->timer, loop->wheel.now + (ms > 0 ? ms : 0))) {
+    task_wake(task, WAKE_TIMER);  // Zero delay: just requeue
+  }
+}
+
+/*
+ * Park `task` until `fd` has any of `events` (EPOLLIN / EPOLLOUT), or until
+ * `timeout_ms` elapses if it is >= 0. Call from step() and return TASK_WAIT.
+ * Check task->wake_reason on the next step.
+ */
+void eventloop_wait_fd(EventLoop *loop, Task *task, int fd, uint32_t events, int timeout_ms) {
+  struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = task};
+
+  // Register once per fd and re-arm with MOD afterwards.
+  if (task->fd == fd) {
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) perror("epoll_ctl MOD");
+  } else {
+    if (task->fd >= 0) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, task->fd, NULL);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) perror("epoll_ctl ADD");
+    task->fd = fd;
+  }
+  task->fd_waiting = 1;
+  loop->parked++;
+
+  if (timeout_ms >= 0 && !wheel_add(&loop->wheel, &task->timer, loop->wheel.now + timeout_ms)) {
+    task_wake(task, WAKE_TIMER);
+  }
+}
+
+/*
+ * Run until no task is runnable or parked.
+ */
+void eventloop_run(EventLoop *loop) {
+  struct epoll_event events[64];
+
+  while (loop->ready_head || loop->parked) {
+    // Run each currently runnable task once. Tasks made runnable meanwhile
+    // wait for the next round so timers and I/O get a look in.
+    Task *last = loop->ready_tail;
+    Task *task;
+    while (last && (task = ready_pop(loop))) {
+      int is_last = task == last;
+      int r = task->step(task);
+      if (r == TASK_DONE) {
+        if (task->fd >= 0) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, task->fd, NULL);
+        free(task);
+      } else if (r == TASK_YIELD) {
+        ready_push(loop, task);
+      }
+      if (is_last) break;
+    }
+
+    // Block only if nothing is runnable.
+    int timeout = 0;
+    if (!loop->ready_head) {
+      int64_t ticks = wheel_next_timeout(&loop->wheel);
+      timeout = ticks < 0 ? -1 : ticks > INT32_MAX ? INT32_MAX : (int)ticks;
+      if (timeout < 0 && !loop->parked) break;
+    }
+
+    int n = epoll_wait(loop->epfd, events, 64, timeout);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    if (timeout != 0) loop->wakeups++;
+    for (int i = 0; i < n; i++) {
+      Task *t = events[i].data.ptr;
+      t->revents = events[i].events;
+      task_wake(t, WAKE_FD);
+    }
+
+    wheel_advance(&loop->wheel, loop_tick(loop));
+  }
+}
+
+/* =========================
+   Example async tasks
+   ========================= */
+
+/*
+ * The counter task from concfuture_eventloop.c, now sleeping 10 ms between
+ * steps instead of being polled continuously.
+ */
+typedef struct {
+  int counter;
+} CounterState;
+
+int counter_step(Task *task) {
+  CounterState *s = task->state;
+
+  if (s->counter < 5) {
+    printf("Counter step %d\n", s->counter);
+    s->counter++;
+    eventloop_sleep(task->loop, task, 10);
+    return TASK_WAIT;
+  }
+
+  int *result = malloc(sizeof(int));
+  *result = s->counter;
+  future_complete(task->future, result);
+  free(s);
+  return TASK_DONE;
+}
+
+/*
+ * Idle task: sleeps `rounds` times for a pseudo-random 50..549 ms.
+ */
+typedef struct {
+  int rounds;
+  unsigned seed;
+} SleeperState;
+
+long sleepers_done = 0;
+
+int sleeper_step(Task *task) {
+  SleeperState *s = task->state;
+  if (s->rounds-- == 0) {
+    sleepers_done++;
+    free(s);
+    return TASK_DONE;
+  }
+  s->seed = s->seed * 1103515245 + 12345;
+  eventloop_sleep(task->loop, task, 50 + (s->seed >> 16) % 500);
+  return TASK_WAIT;
+}
+
+/*
+ * Reader: waits on a pipe with a 1 s timeout. Writer: sleeps, then writes.
+ */
+typedef struct {
+  int fd;
+  int started;
+} PipeState;
+
+int pipe_reader_step(Task *task) {
+  PipeState *s = task->state;
+  if (!s->started) {
+    s->started = 1;
+    eventloop_wait_fd(task->loop, task, s->fd, EPOLLIN, 1000);
+    return TASK_WAIT;
+  }
+  if (task->wake_reason == WAKE_TIMER) {
+    printf("pipe reader: timed out\n");
+  } else {
+    char buf[64];
+    ssize_t n = read(s->fd, buf, sizeof buf - 1);
+    buf[n > 0 ? n : 0] = '\0';
+    printf("pipe reader: got \"%s\"\n", buf);
+  }
+  free(s);
+  return TASK_DONE;
+}
+
+int pipe_writer_step(Task *task) {
+  PipeState *s = task->state;
+  if (!s->started) {
+    s->started = 1;
+    eventloop_sleep(task->loop, task, 200);
+    return TASK_WAIT;
+  }
+  if (write(s->fd, "hello", 5) != 5) perror("write");
+  free(s);
+  return TASK_DONE;
+}
+
+static Task *task_new(int (*step)(Task *), void *state, Future *future) {
+  Task *task = malloc(sizeof(Task));
+  task->step = step;
+  task->state = state;
+  task->future = future;
+  return task;
+}
+
+static double cpu_seconds(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* =========================
+   Main
+   ========================= */
+
+#define NUM_SLEEPERS 10000
+
+int main(void) {
+  EventLoop *loop = eventloop_create();
+
+  // Counter task with a Future, as in concfuture_eventloop.c.
+  Future *f = future_create();
+  CounterState *cs = malloc(sizeof(CounterState));
+  cs->counter = 0;
+  eventloop_add(loop, task_new(counter_step, cs, f));
+
+  // fd readiness.
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    return 1;
+  }
+  PipeState *rs = malloc(sizeof(PipeState));
+  *rs = (PipeState){.fd = fds[0], .started = 0};
+  PipeState *ws = malloc(sizeof(PipeState));
+  *ws = (PipeState){.fd = fds[1], .started = 0};
+  eventloop_add(loop, task_new(pipe_reader_step, rs, NULL));
+  eventloop_add(loop, task_new(pipe_writer_step, ws, NULL));
+
+  // Many idle tasks.
+  for (int i = 0; i < NUM_SLEEPERS; i++) {
+    SleeperState *s = malloc(sizeof(SleeperState));
+    s->rounds = 4;
+    s->seed = i;
+    eventloop_add(loop, task_new(sleeper_step, s, NULL));
+  }
+
+  uint64_t wall_start = monotonic_ms();
+  double cpu_start = cpu_seconds();
+  eventloop_run(loop);
+
+  if (f->completed) {
+    int *value = f->result;
+    printf("Future result: %d\n", *value);
+    free(value);
+  }
+  printf("%ld sleepers x 4 naps: wall %lu ms, cpu %.0f ms, %ld epoll wakeups\n", sleepers_done,
+         (unsigned long)(monotonic_ms() - wall_start), (cpu_seconds() - cpu_start) * 1000,
+         loop->wakeups);
+
+  close(fds[0]);
+  close(fds[1]);
+  free(f);
+  eventloop_destroy(loop);
+  return 0;
+}
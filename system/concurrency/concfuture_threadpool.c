@@ -1,11 +1,16 @@
 /*
  * Future implementation in C, with a Thread pool
+ *
+ * The pool records queue wait, run time, queue depth and per-worker
+ * utilization (see concpool_stats.h); pool_stats_print() dumps them.
  */
 #include <pthread.h>  // POSIX threads (pthread_* APIs)
 #include <stdio.h>    // printf
 #include <stdlib.h>   // malloc, free
 #include <unistd.h>   // sleep
 
+#include "concpool_stats.h"  // PoolStats, TaskTimes
+
 /* =========================
    Future
    ========================= */
@@ -25,6 +30,8 @@ typedef struct Future {
   pthread_mutex_t mutex;  // Protects access to completed/result
   pthread_cond_t cond;    // Used to wait for task completion
 
+  TaskTimes times;  // Submit/start/finish timestamps
+
   struct Future *next;  // Next future in the task queue
 } Future;
 
@@ -47,6 +54,8 @@ typedef struct {
   pthread_cond_t queue_cond;    // Signals when new tasks arrive
 
   int shutdown;  // Flag to stop workers
+
+  PoolStats stats;  // Wait/run histograms and per-worker utilization
 } ThreadPool;
 
 /* =========================
@@ -59,6 +68,7 @@ typedef struct {
  */
 void *worker_thread(void *arg) {
   ThreadPool *pool = (ThreadPool *)arg;  // Get thread pool
+  int id = pool_stats_worker_id(&pool->stats);  // Index for per-worker stats
 
   while (1) {
     pthread_mutex_lock(&pool->queue_mutex);
@@ -84,7 +94,9 @@ void *worker_thread(void *arg) {
     pthread_mutex_unlock(&pool->queue_mutex);
 
     /* Execute task */
+    pool_stats_start(&pool->stats, &f->times);
     void *res = f->task(f->arg);  // Run the task function
+    pool_stats_finish(&pool->stats, id, &f->times);
 
     // Store the result and signal completion
     pthread_mutex_lock(&f->mutex);
@@ -113,6 +125,7 @@ ThreadPool *threadpool_create(int num_threads) {
   pool->queue_head = NULL;
   pool->queue_tail = NULL;
   pool->shutdown = 0;
+  pool_stats_init(&pool->stats);
 
   // Initialize queue synchronization primitives
   pthread_mutex_init(&pool->queue_mutex, NULL);
@@ -145,6 +158,8 @@ Future *threadpool_submit(ThreadPool *pool, void *(*task)(void *), void *arg) {
 
   pthread_mutex_lock(&pool->queue_mutex);
 
+  pool_stats_submit(&pool->stats, &f->times);  // Timestamp and sample queue depth
+
   // Append Future to the queue
   if (pool->queue_tail)
     pool->queue_tail->next = f;
@@ -245,6 +260,10 @@ int main(void) {
   // Print results
   printf("Results: %d %d %d\n", *r1, *r2, *r3);
 
+  // Print pool statistics as text and as JSON
+  pool_stats_print(&pool->stats, stdout, STATS_TEXT);
+  pool_stats_print(&pool->stats, stdout, STATS_JSON);
+
   // Free task results
   free(r1);
   free(r2);
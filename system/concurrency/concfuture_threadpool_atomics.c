@@ -1,12 +1,25 @@
 /*
  * Future imolementation in C, using C11 atomics
+ *
+ * The pool records queue wait, run time, queue depth and per-worker
+ * utilization (see concpool_stats.h); pool_stats_print() dumps them.
+ *
+ * Idle workers park on an eventcount instead of polling the queue, and
+ * future_get() parks on the Future's completed word. Neither side makes a
+ * system call unless somebody is actually asleep.
  */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "concpool_stats.h"
+
 /* =========================================
    Lock-free Queue (Michael Scott Queue)
    ========================================= */
@@ -73,15 +86,65 @@ void *lfqueue_dequeue(LFQueue *q) {
   }
 }
 
+/* =========================
+   Eventcount
+   ========================= */
+
+/*
+ * Lets a thread sleep until some condition (here: queue non-empty) may have
+ * become true, without a lock around the condition.
+ *
+ * Waiter:   ec_prepare() -> re-check condition -> ec_wait() or ec_cancel()
+ * Notifier: make condition true -> ec_notify()
+ *
+ * ec_prepare() registers the waiter before it re-checks, and ec_notify()
+ * looks for waiters only after the condition changed (all seq_cst). So
+ * either the notifier sees the waiter and bumps seq, making the FUTEX_WAIT
+ * return at once, or the waiter's re-check sees the new item. When no one
+ * waits, ec_notify() is a single load.
+ */
+typedef struct {
+  atomic_uint seq;
+  atomic_int waiters;
+} EventCount;
+
+static inline long futex(void *addr, int op, unsigned val) {
+  return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static inline unsigned ec_prepare(EventCount *ec) {
+  atomic_fetch_add(&ec->waiters, 1);
+  return atomic_load(&ec->seq);
+}
+
+static inline void ec_cancel(EventCount *ec) { atomic_fetch_sub(&ec->waiters, 1); }
+
+static inline void ec_wait(EventCount *ec, unsigned key) {
+  if (atomic_load(&ec->seq) == key) futex(&ec->seq, FUTEX_WAIT_PRIVATE, key);
+  atomic_fetch_sub(&ec->waiters, 1);
+}
+
+static inline void ec_notify(EventCount *ec, int count) {
+  if (atomic_load(&ec->waiters) == 0) return;
+  atomic_fetch_add(&ec->seq, 1);
+  futex(&ec->seq, FUTEX_WAKE_PRIVATE, count);
+}
+
 /* =========================
    Future
    ========================= */
 
+/* Future.completed values */
+#define FUTURE_PENDING 0
+#define FUTURE_DONE 1
+#define FUTURE_WAITING 2  // Pending, and a future_get() caller is asleep
+
 typedef struct {
   void *(*task)(void *);
   void *arg;
   void *result;
   atomic_int completed;
+  TaskTimes times;
 } Future;
 
 /* =========================
@@ -92,27 +155,48 @@ typedef struct {
   pthread_t *threads;
   int num_threads;
   LFQueue queue;
+  EventCount work;  // Signalled on enqueue and shutdown
   atomic_int shutdown;
+  PoolStats stats;
 } ThreadPool;
 
+/* Dequeue attempts before a worker parks */
+#define SPIN_TRIES 64
+
 /* =========================
    Worker Thread
    ========================= */
 
 void *worker_thread(void *arg) {
   ThreadPool *pool = arg;
+  int id = pool_stats_worker_id(&pool->stats);
 
   while (!atomic_load(&pool->shutdown)) {
-    Future *f = lfqueue_dequeue(&pool->queue);
+    Future *f = NULL;
+    for (int i = 0; i < SPIN_TRIES && !(f = lfqueue_dequeue(&pool->queue)); i++) {
+    }
 
     if (!f) {
-      sched_yield(); /* reduce CPU pressure */
-      continue;
+      /* Park until an enqueue or shutdown */
+      unsigned key = ec_prepare(&pool->work);
+      if ((f = lfqueue_dequeue(&pool->queue)) || atomic_load(&pool->shutdown)) {
+        ec_cancel(&pool->work);
+      } else {
+        ec_wait(&pool->work, key);
+        continue;
+      }
+      if (!f) break;
     }
 
+    pool_stats_start(&pool->stats, &f->times);
     void *res = f->task(f->arg);
+    pool_stats_finish(&pool->stats, id, &f->times);
     f->result = res;
-    atomic_store_explicit(&f->completed, 1, memory_order_release);
+    /* The waiter may free f as soon as it sees DONE; the wake only uses the address */
+    if (atomic_exchange_explicit(&f->completed, FUTURE_DONE, memory_order_acq_rel) ==
+        FUTURE_WAITING) {
+      futex(&f->completed, FUTEX_WAKE_PRIVATE, INT_MAX);
+    }
   }
 
   return NULL;
@@ -127,6 +211,9 @@ ThreadPool *threadpool_create(int n) {
   pool->num_threads = n;
   pool->threads = malloc(sizeof(pthread_t) * n);
   atomic_store(&pool->shutdown, 0);
+  atomic_store(&pool->work.seq, 0);
+  atomic_store(&pool->work.waiters, 0);
+  pool_stats_init(&pool->stats);
 
   lfqueue_init(&pool->queue);
 
@@ -142,16 +229,26 @@ Future *threadpool_submit(ThreadPool *pool, void *(*task)(void *), void *arg) {
   f->task = task;
   f->arg = arg;
   f->result = NULL;
-  atomic_store(&f->completed, 0);
+  atomic_store(&f->completed, FUTURE_PENDING);
 
+  pool_stats_submit(&pool->stats, &f->times);
   lfqueue_enqueue(&pool->queue, f);
+  ec_notify(&pool->work, 1);
   return f;
 }
 
-/* Spin-wait future */
+/* Spin briefly, then sleep until the worker marks the future done */
 void *future_get(Future *f) {
-  while (!atomic_load_explicit(&f->completed, memory_order_acquire)) {
-    sched_yield();
+  for (int i = 0; i < SPIN_TRIES; i++) {
+    if (atomic_load_explicit(&f->completed, memory_order_acquire) == FUTURE_DONE) {
+      return f->result;
+    }
+  }
+
+  int state = FUTURE_PENDING;
+  atomic_compare_exchange_strong(&f->completed, &state, FUTURE_WAITING);
+  while (atomic_load_explicit(&f->completed, memory_order_acquire) != FUTURE_DONE) {
+    futex(&f->completed, FUTEX_WAIT_PRIVATE, FUTURE_WAITING);
   }
   return f->result;
 }
@@ -162,6 +259,7 @@ void future_destroy(Future *f) {
 
 void threadpool_destroy(ThreadPool *pool) {
   atomic_store(&pool->shutdown, 1);
+  ec_notify(&pool->work, INT_MAX);
 
   for (int i = 0; i < pool->num_threads; i++) {
     pthread_join(pool->threads[i], NULL);
@@ -203,6 +301,9 @@ int main(void) {
 
   printf("Results: %d %d %d\n", *r1, *r2, *r3);
 
+  pool_stats_print(&pool->stats, stdout, STATS_TEXT);
+  pool_stats_print(&pool->stats, stdout, STATS_JSON);
+
   free(r1);
   free(r2);
   free(r3);
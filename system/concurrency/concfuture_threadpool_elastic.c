@@ -0,0 +1,414 @@
+/*
+ * Future implementation in C, with an elastic Thread pool
+ *
+ * concfuture_threadpool.c starts a fixed number of workers that all sleep on
+ * one condition variable. That has two problems under bursty load:
+ *  - the size is a guess: too small and bursts queue up, too large and the
+ *    idle threads just hold memory,
+ *  - pthread_cond_signal wakes an arbitrary waiter, and the broadcast on
+ *    shutdown (or any spurious wake) makes every idle worker contend for the
+ *    queue mutex at once.
+ *
+ * This version:
+ *  - parks each idle worker on its own futex word. Idle workers sit on a LIFO
+ *    list; a submit pops exactly one and wakes exactly that one. LIFO keeps
+ *    recently-run (cache-warm) workers busy and lets the others time out.
+ *  - grows the pool, up to max_workers, when the queue has been non-empty
+ *    with no idle worker for longer than grow_delay,
+ *  - retires a worker, down to min_workers, after it has been parked for
+ *    idle_timeout without being woken.
+ *
+ * Compilation:
+ *   gcc concfuture_threadpool_elastic.c -O2 -pthread -o concfuture_threadpool_elastic
+ */
+#define _GNU_SOURCE
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+static inline int futex_wait(atomic_int *futex, int expected, const struct timespec *timeout) {
+  return syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, expected, timeout, NULL, 0);
+}
+
+static inline int futex_wake(atomic_int *futex, int count) {
+  return syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* =========================
+   Future
+   ========================= */
+
+typedef struct Future {
+  void *(*task)(void *);
+  void *arg;
+  void *result;
+
+  int completed;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  struct Future *next;
+} Future;
+
+/* =========================
+   Thread Pool
+   ========================= */
+
+typedef struct ThreadPool ThreadPool;
+
+/*
+ * A worker parks on `wake`: 0 = parked, 1 = handed work (or shutdown).
+ * It is on the pool's idle list exactly while parked and not yet woken.
+ */
+typedef struct Worker {
+  _Alignas(CACHE_LINE) atomic_int wake;
+  ThreadPool *pool;
+  struct Worker *idle_prev;
+  struct Worker *idle_next;
+} Worker;
+
+typedef struct {
+  int min_workers;
+  int max_workers;
+  int grow_delay_us;    // Backlog age before another worker is started
+  int idle_timeout_ms;  // Parked this long without work: retire
+} PoolConfig;
+
+struct ThreadPool {
+  PoolConfig cfg;
+
+  Future *queue_head;
+  Future *queue_tail;
+  int queue_len;
+  uint64_t backlog_since;  // When the queue last became non-empty with nobody idle; 0 = no backlog
+
+  Worker *idle_head;  // LIFO of parked workers
+  int num_idle;
+  int num_workers;    // Started and not yet exited
+
+  pthread_mutex_t queue_mutex;
+  pthread_cond_t exit_cond;  // Signalled when num_workers drops to 0
+
+  int shutdown;
+
+  // Statistics, under queue_mutex
+  int peak_workers;
+  long spawned;
+  long retired;
+  long wakeups;
+};
+
+static void idle_push(ThreadPool *pool, Worker *w) {
+  w->idle_prev = NULL;
+  w->idle_next = pool->idle_head;
+  if (pool->idle_head) pool->idle_head->idle_prev = w;
+  pool->idle_head = w;
+  pool->num_idle++;
+}
+
+static void idle_remove(ThreadPool *pool, Worker *w) {
+  if (w->idle_prev)
+    w->idle_prev->idle_next = w->idle_next;
+  else
+    pool->idle_head = w->idle_next;
+  if (w->idle_next) w->idle_next->idle_prev = w->idle_prev;
+  pool->num_idle--;
+}
+
+static int spawn_worker(ThreadPool *pool);
+
+/*
+ * Called with queue_mutex held after the queue changed. Returns 1 if the
+ * caller should start a worker (the slot is already reserved).
+ */
+static int need_worker(ThreadPool *pool) {
+  if (pool->queue_len == 0 || pool->num_idle > 0) {
+    pool->backlog_since = 0;
+    return 0;
+  }
+  uint64_t now = now_ns();
+  if (pool->backlog_since == 0) pool->backlog_since = now;
+  // With no workers at all (min_workers == 0 and the pool has shrunk), nobody
+  // would come back to check the backlog after grow_delay: start one now.
+  if (pool->num_workers >= pool->cfg.max_workers ||
+      (pool->num_workers > 0 &&
+       now - pool->backlog_since < (uint64_t)pool->cfg.grow_delay_us * 1000)) {
+    return 0;
+  }
+  pool->backlog_since = now;  // Give the new worker grow_delay to catch up
+  pool->num_workers++;
+  if (pool->num_workers > pool->peak_workers) pool->peak_workers = pool->num_workers;
+  pool->spawned++;
+  return 1;
+}
+
+/* =========================
+   Worker thread
+   ========================= */
+
+void *worker_thread(void *arg) {
+  Worker *w = arg;
+  ThreadPool *pool = w->pool;
+
+  pthread_mutex_lock(&pool->queue_mutex);
+  while (1) {
+    if (pool->queue_head) {
+      Future *f = pool->queue_head;
+      pool->queue_head = f->next;
+      if (!pool->queue_head) pool->queue_tail = NULL;
+      pool->queue_len--;
+      int grow = need_worker(pool);
+      pthread_mutex_unlock(&pool->queue_mutex);
+
+      if (grow) spawn_worker(pool);
+
+      void *res = f->task(f->arg);
+
+      pthread_mutex_lock(&f->mutex);
+      f->result = res;
+      f->completed = 1;
+      pthread_cond_signal(&f->cond);
+      pthread_mutex_unlock(&f->mutex);
+
+      pthread_mutex_lock(&pool->queue_mutex);
+      continue;
+    }
+
+    if (pool->shutdown) break;
+
+    // Park. A submit removes us from the idle list and sets wake = 1 before
+    // calling futex_wake, so a wake between unlock and futex_wait is not lost.
+    atomic_store_explicit(&w->wake, 0, memory_order_relaxed);
+    idle_push(pool, w);
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    struct timespec timeout = {pool->cfg.idle_timeout_ms / 1000,
+                               (pool->cfg.idle_timeout_ms % 1000) * 1000000L};
+    uint64_t deadline = now_ns() + (uint64_t)pool->cfg.idle_timeout_ms * 1000000;
+    int timed_out = 0;
+    while (atomic_load_explicit(&w->wake, memory_order_acquire) == 0) {
+      if (now_ns() >= deadline) {
+        timed_out = 1;
+        break;
+      }
+      futex_wait(&w->wake, 0, &timeout);
+    }
+
+    pthread_mutex_lock(&pool->queue_mutex);
+    if (timed_out && atomic_load_explicit(&w->wake, memory_order_relaxed) == 0) {
+      // Nobody claimed us: still on the idle list.
+      idle_remove(pool, w);
+      if (pool->num_workers > pool->cfg.min_workers) {
+        pool->retired++;
+        break;
+      }
+    }
+  }
+
+  pool->num_workers--;
+  if (pool->num_workers == 0) pthread_cond_signal(&pool->exit_cond);
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  free(w);
+  return NULL;
+}
+
+/*
+ * Start a worker whose slot was already counted in num_workers.
+ */
+static int spawn_worker(ThreadPool *pool) {
+  Worker *w = aligned_alloc(CACHE_LINE, sizeof(Worker));
+  atomic_init(&w->wake, 0);
+  w->pool = pool;
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rc = pthread_create(&thread, &attr, worker_thread, w);
+  pthread_attr_destroy(&attr);
+
+  if (rc != 0) {
+    free(w);
+    pthread_mutex_lock(&pool->queue_mutex);
+    pool->num_workers--;
+    pool->spawned--;
+    if (pool->num_workers == 0) pthread_cond_signal(&pool->exit_cond);
+    pthread_mutex_unlock(&pool->queue_mutex);
+    return -1;
+  }
+  return 0;
+}
+
+/* =========================
+   Thread pool API
+   ========================= */
+
+ThreadPool *threadpool_create(PoolConfig cfg) {
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+  pool->cfg = cfg;
+
+  pthread_mutex_init(&pool->queue_mutex, NULL);
+  pthread_cond_init(&pool->exit_cond, NULL);
+
+  pool->num_workers = cfg.min_workers;
+  pool->peak_workers = cfg.min_workers;
+  pool->spawned = cfg.min_workers;
+  for (int i = 0; i < cfg.min_workers; i++) spawn_worker(pool);
+
+  return pool;
+}
+
+Future *threadpool_submit(ThreadPool *pool, void *(*task)(void *), void *arg) {
+  Future *f = malloc(sizeof(Future));
+
+  f->task = task;
+  f->arg = arg;
+  f->result = NULL;
+  f->completed = 0;
+  f->next = NULL;
+
+  pthread_mutex_init(&f->mutex, NULL);
+  pthread_cond_init(&f->cond, NULL);
+
+  pthread_mutex_lock(&pool->queue_mutex);
+
+  if (pool->queue_tail)
+    pool->queue_tail->next = f;
+  else
+    pool->queue_head = f;
+  pool->queue_tail = f;
+  pool->queue_len++;
+
+  // Hand the task to exactly one parked worker, if any. The wake is issued
+  // while holding queue_mutex: the worker cannot retire (and free itself)
+  // without taking it, so `w` is still valid.
+  Worker *w = pool->idle_head;
+  if (w) {
+    idle_remove(pool, w);
+    atomic_store_explicit(&w->wake, 1, memory_order_release);
+    futex_wake(&w->wake, 1);
+    pool->wakeups++;
+  }
+  int grow = need_worker(pool);
+
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  if (grow) spawn_worker(pool);
+
+  return f;
+}
+
+void *future_get(Future *f) {
+  pthread_mutex_lock(&f->mutex);
+  while (!f->completed) {
+    pthread_cond_wait(&f->cond, &f->mutex);
+  }
+  pthread_mutex_unlock(&f->mutex);
+  return f->result;
+}
+
+void future_destroy(Future *f) {
+  pthread_mutex_destroy(&f->mutex);
+  pthread_cond_destroy(&f->cond);
+  free(f);
+}
+
+int threadpool_num_workers(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->queue_mutex);
+  int n = pool->num_workers;
+  pthread_mutex_unlock(&pool->queue_mutex);
+  return n;
+}
+
+/*
+ * Run the remaining queued tasks, then stop every worker.
+ */
+void threadpool_destroy(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->queue_mutex);
+  pool->shutdown = 1;
+  while (pool->idle_head) {
+    Worker *w = pool->idle_head;
+    idle_remove(pool, w);
+    atomic_store_explicit(&w->wake, 1, memory_order_release);
+    futex_wake(&w->wake, 1);
+  }
+  while (pool->num_workers > 0) {
+    pthread_cond_wait(&pool->exit_cond, &pool->queue_mutex);
+  }
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  pthread_mutex_destroy(&pool->queue_mutex);
+  pthread_cond_destroy(&pool->exit_cond);
+  free(pool);
+}
+
+/* =========================
+   Example task
+   ========================= */
+
+void *work_task(void *arg) {
+  int ms = *(int *)arg;
+  struct timespec ts = {0, ms * 1000000L};
+  nanosleep(&ts, NULL);
+  return NULL;
+}
+
+/* =========================
+   Main
+   ========================= */
+
+#define BURSTS 3
+#define BURST_SIZE 400
+
+int main(void) {
+  PoolConfig cfg = {
+      .min_workers = 1,
+      .max_workers = 16,
+      .grow_delay_us = 500,
+      .idle_timeout_ms = 100,
+  };
+  ThreadPool *pool = threadpool_create(cfg);
+  int task_ms = 2;
+  Future *futures[BURST_SIZE];
+
+  for (int b = 0; b < BURSTS; b++) {
+    uint64_t start = now_ns();
+    for (int i = 0; i < BURST_SIZE; i++) {
+      futures[i] = threadpool_submit(pool, work_task, &task_ms);
+    }
+    for (int i = 0; i < BURST_SIZE; i++) {
+      future_get(futures[i]);
+      future_destroy(futures[i]);
+    }
+    printf("burst %d: %d tasks in %.1f ms, %d workers at the end\n", b, BURST_SIZE,
+           (now_ns() - start) / 1e6, threadpool_num_workers(pool));
+
+    // Quiet period: the extra workers time out and retire.
+    struct timespec quiet = {0, 300 * 1000000L};
+    nanosleep(&quiet, NULL);
+    printf("  after 300 ms idle: %d workers\n", threadpool_num_workers(pool));
+  }
+
+  pthread_mutex_lock(&pool->queue_mutex);
+  printf("spawned %ld, retired %ld, peak %d workers, %ld targeted wakeups\n", pool->spawned,
+         pool->retired, pool->peak_workers, pool->wakeups);
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  threadpool_destroy(pool);
+  return 0;
+}
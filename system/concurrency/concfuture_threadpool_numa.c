@@ -0,0 +1,753 @@
+/*
+ * Future implementation in C, with a NUMA- and CPU-affinity-aware thread pool
+ *
+ * concfuture_threadpool.c starts N unpinned workers with default stacks and
+ * one shared queue. On a multi-socket machine that means:
+ *  - every submit and every dequeue bounces the queue lock between sockets,
+ *  - a task's data is often on the other node from the worker running it,
+ *  - the scheduler migrates workers freely, losing cache warmth.
+ *
+ * This version:
+ *  - discovers the topology from sysfs (/sys/devices/system/node/nodeN/
+ *    cpulist and distance); without sysfs NUMA info it assumes one node,
+ *  - spreads workers over nodes in proportion to their CPU count and can pin
+ *    each worker to its node (PIN_NODE) or to one core (PIN_CORE),
+ *  - gives every worker a stack allocated on its own node,
+ *  - keeps one submission queue per node. threadpool_submit() uses the
+ *    caller's node; workers drain their own node first and only then steal
+ *    from other nodes, nearest (by sysfs distance) first,
+ *  - allocates Futures from per-node free lists, and exposes node_alloc() so
+ *    task data can live on the node that will run it,
+ *  - sends submits for a node that got no workers (fewer threads than CPUs)
+ *    to the nearest node that has some.
+ *
+ * Memory is bound with the mbind(2) syscall directly, so no libnuma is
+ * needed. If mbind is unavailable the kernel's first-touch policy applies.
+ *
+ * Compilation:
+ *   gcc concfuture_threadpool_numa.c -O2 -pthread -o concfuture_threadpool_numa
+ *
+ * Usage:
+ *   ./concfuture_threadpool_numa [core|node|none] [threads] [fake-nodes]
+ *
+ * With fake-nodes the online CPUs are split into that many made-up nodes
+ * instead of reading the real topology. Either way, a final check starts one
+ * worker over two made-up nodes and submits from the node without workers.
+ */
+#define _GNU_SOURCE
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CPUS 1024
+#define MAX_NODES 64
+#define CACHE_LINE 64
+#ifndef WORKER_STACK_SIZE
+#define WORKER_STACK_SIZE (256 * 1024)  // Sanitizer builds need more: -DWORKER_STACK_SIZE=...
+#endif
+#define FUTURES_PER_CHUNK 256
+
+/* =========================
+   Topology
+   ========================= */
+
+/*
+ * Nodes are kept in a compact array of those with CPUs; `id` is the kernel's
+ * number for the node, which may have gaps (memory-only or offline nodes).
+ * The pool refers to nodes by array index, the kernel (mbind, sysfs) by id.
+ */
+typedef struct {
+  int id;                   // Kernel node id (sysfs nodeN)
+  int num_cpus;
+  int cpus[MAX_CPUS];       // CPUs on this node
+  int distance[MAX_NODES];  // sysfs distance to every node, by kernel id
+  int by_distance[MAX_NODES];  // Other nodes (array indices), nearest first
+} NumaNode;
+
+typedef struct {
+  int num_nodes;
+  NumaNode nodes[MAX_NODES];
+  int cpu_to_node[MAX_CPUS];
+} Topology;
+
+/*
+ * Parse a sysfs cpulist such as "0-3,8-11" into `out`. Returns the count.
+ */
+static int parse_cpulist(const char *s, int *out, int max) {
+  int n = 0;
+  while (*s && *s != '\n') {
+    char *end;
+    int lo = strtol(s, &end, 10), hi = lo;
+    if (end == s) break;
+    if (*end == '-') hi = strtol(end + 1, &end, 10);
+    for (int c = lo; c <= hi && n < max; c++) out[n++] = c;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return n;
+}
+
+static int read_file(const char *path, char *buf, size_t size) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return -1;
+  size_t n = fread(buf, 1, size - 1, fp);
+  buf[n] = '\0';
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * CPU ids past MAX_CPUS don't fit cpu_to_node; drop them. Returns the count.
+ */
+static int drop_high_cpus(int *cpus, int n) {
+  int kept = 0;
+  for (int c = 0; c < n; c++) {
+    if (cpus[c] < MAX_CPUS) cpus[kept++] = cpus[c];
+  }
+  return kept;
+}
+
+/*
+ * Fill every node's by_distance list: the other nodes, nearest first.
+ */
+static void topology_order(Topology *topo) {
+  // Insertion sort; there are few nodes.
+  for (int n = 0; n < topo->num_nodes; n++) {
+    NumaNode *node = &topo->nodes[n];
+    int k = 0;
+    for (int m = 0; m < topo->num_nodes; m++) {
+      if (m == n) continue;
+      int j = k++;
+      int dist = node->distance[topo->nodes[m].id];
+      while (j > 0 && node->distance[topo->nodes[node->by_distance[j - 1]].id] > dist) {
+        node->by_distance[j] = node->by_distance[j - 1];
+        j--;
+      }
+      node->by_distance[j] = m;
+    }
+  }
+}
+
+void topology_discover(Topology *topo) {
+  char path[128], buf[4096];
+
+  memset(topo, 0, sizeof(*topo));
+  for (int c = 0; c < MAX_CPUS; c++) topo->cpu_to_node[c] = 0;
+
+  int node_ids[MAX_NODES];
+  int num_ids = 0;
+  if (read_file("/sys/devices/system/node/online", buf, sizeof buf) == 0) {
+    num_ids = parse_cpulist(buf, node_ids, MAX_NODES);
+  }
+  // Ids beyond MAX_NODES don't fit the distance table or the mbind mask.
+  while (num_ids > 0 && node_ids[num_ids - 1] >= MAX_NODES) num_ids--;
+
+  for (int i = 0; i < num_ids; i++) {
+    NumaNode *node = &topo->nodes[topo->num_nodes];
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node_ids[i]);
+    if (read_file(path, buf, sizeof buf) < 0) continue;
+    node->num_cpus = parse_cpulist(buf, node->cpus, MAX_CPUS);
+    node->num_cpus = drop_high_cpus(node->cpus, node->num_cpus);
+    if (node->num_cpus == 0) continue;  // Memory-only node
+    node->id = node_ids[i];
+
+    snprintf(path, sizeof path, "/sys/devices/system/node/node%d/distance", node_ids[i]);
+    if (read_file(path, buf, sizeof buf) == 0) {
+      char *s = buf;
+      // One column per online node, in the order of the online list.
+      for (int j = 0; j < num_ids; j++) node->distance[node_ids[j]] = strtol(s, &s, 10);
+    }
+    for (int c = 0; c < node->num_cpus; c++) topo->cpu_to_node[node->cpus[c]] = topo->num_nodes;
+    topo->num_nodes++;
+  }
+
+  if (topo->num_nodes == 0) {
+    // No NUMA information: a single node with every online CPU.
+    NumaNode *node = &topo->nodes[0];
+    if (read_file("/sys/devices/system/cpu/online", buf, sizeof buf) == 0) {
+      node->num_cpus = parse_cpulist(buf, node->cpus, MAX_CPUS);
+    }
+    if (node->num_cpus == 0) {
+      node->num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      if (node->num_cpus > MAX_CPUS) node->num_cpus = MAX_CPUS;
+      for (int c = 0; c < node->num_cpus; c++) node->cpus[c] = c;
+    }
+    node->num_cpus = drop_high_cpus(node->cpus, node->num_cpus);
+    node->id = 0;
+    node->distance[0] = 10;
+    topo->num_nodes = 1;
+  }
+
+  topology_order(topo);
+}
+
+/*
+ * Split the online CPUs round-robin into `num_nodes` made-up nodes, all at
+ * distance 20 from each other, to exercise multi-node paths on a one-node
+ * machine. With fewer CPUs than nodes, CPUs are shared and a shared CPU maps
+ * to the last node it was given to.
+ */
+void topology_split(Topology *topo, int num_nodes) {
+  char buf[4096];
+  int cpus[MAX_CPUS], num_cpus = 0;
+
+  if (num_nodes > MAX_NODES) num_nodes = MAX_NODES;
+  if (read_file("/sys/devices/system/cpu/online", buf, sizeof buf) == 0) {
+    num_cpus = drop_high_cpus(cpus, parse_cpulist(buf, cpus, MAX_CPUS));
+  }
+  if (num_cpus == 0) cpus[num_cpus++] = 0;
+
+  memset(topo, 0, sizeof(*topo));
+  topo->num_nodes = num_nodes;
+  for (int n = 0; n < num_nodes; n++) {
+    NumaNode *node = &topo->nodes[n];
+    node->id = n;
+    for (int m = 0; m < num_nodes; m++) node->distance[m] = m == n ? 10 : 20;
+    for (int c = n; c < num_cpus || node->num_cpus == 0; c += num_nodes) {
+      int cpu = cpus[c % num_cpus];
+      node->cpus[node->num_cpus++] = cpu;
+      topo->cpu_to_node[cpu] = n;
+    }
+  }
+  topology_order(topo);
+}
+
+/* =========================
+   Node-local memory
+   ========================= */
+
+/*
+ * Allocate `size` bytes whose pages prefer kernel node `node_id` (a
+ * NumaNode's `id`, not its index). Free with node_free(). Returns NULL if the
+ * mapping fails.
+ */
+void *node_alloc(size_t size, int node_id) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+
+  unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long)) + 1] = {0};
+  mask[node_id / (8 * sizeof(unsigned long))] |= 1UL << (node_id % (8 * sizeof(unsigned long)));
+  // Best effort: ENOSYS (no NUMA kernel) just leaves first-touch in place.
+  syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, MAX_NODES + 1, 0);
+  return p;
+}
+
+void node_free(void *p, size_t size) { munmap(p, size); }
+
+/* =========================
+   Future
+   ========================= */
+
+typedef struct Future {
+  void *(*task)(void *);
+  void *arg;
+  void *result;
+
+  int completed;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  int node;             // Node whose free list owns this Future
+  struct Future *next;  // Queue link, or free-list link
+} Future;
+
+/* =========================
+   Thread Pool
+   ========================= */
+
+typedef enum { PIN_NONE, PIN_NODE, PIN_CORE } PinMode;
+
+typedef struct ThreadPool ThreadPool;
+
+/*
+ * Per-node state. Each lives on its own cache lines and its memory prefers
+ * its node, so the common case never touches another socket.
+ */
+typedef struct {
+  _Alignas(CACHE_LINE) pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  Future *head;
+  Future *tail;
+  int idle;          // Workers of this node waiting on cond
+  int num_workers;
+  Future *free_list; // Recycled Futures owned by this node
+} NodeQueue;
+
+typedef struct {
+  ThreadPool *pool;
+  pthread_t thread;
+  int node;
+  int cpu;      // Pinned CPU for PIN_CORE, else -1
+  void *stack;  // Node-local stack
+  long executed;
+  long stolen;
+} Worker;
+
+struct ThreadPool {
+  Topology topo;
+  PinMode pin;
+  NodeQueue *queues[MAX_NODES];
+  int route[MAX_NODES];  // Node that takes submits for each node: itself,
+                         // or the nearest one with workers if it has none
+  Worker *workers;
+  int num_threads;
+  int shutdown;  // Written under every node's mutex
+};
+
+static Future *queue_pop(NodeQueue *q) {
+  Future *f = q->head;
+  if (f) {
+    q->head = f->next;
+    if (!q->head) q->tail = NULL;
+  }
+  return f;
+}
+
+/*
+ * Try the other nodes, nearest first. Uses trylock so a busy remote queue is
+ * skipped rather than waited on.
+ */
+static Future *steal(ThreadPool *pool, int node) {
+  NumaNode *n = &pool->topo.nodes[node];
+  for (int i = 0; i < pool->topo.num_nodes - 1; i++) {
+    NodeQueue *q = pool->queues[n->by_distance[i]];
+    if (pthread_mutex_trylock(&q->mutex) != 0) continue;
+    Future *f = queue_pop(q);
+    pthread_mutex_unlock(&q->mutex);
+    if (f) return f;
+  }
+  return NULL;
+}
+
+static void pin_worker(Worker *w) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (w->pool->pin == PIN_CORE) {
+    CPU_SET(w->cpu, &set);
+  } else if (w->pool->pin == PIN_NODE) {
+    NumaNode *n = &w->pool->topo.nodes[w->node];
+    for (int c = 0; c < n->num_cpus; c++) CPU_SET(n->cpus[c], &set);
+  } else {
+    return;
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * True if another node's queue has work, or is locked and so might be
+ * getting some. Called with our own queue's lock held, hence trylock.
+ */
+static int remote_pending(ThreadPool *pool, int node) {
+  NumaNode *n = &pool->topo.nodes[node];
+  for (int i = 0; i < pool->topo.num_nodes - 1; i++) {
+    NodeQueue *q = pool->queues[n->by_distance[i]];
+    if (pthread_mutex_trylock(&q->mutex) != 0) return 1;
+    int pending = q->head != NULL;
+    pthread_mutex_unlock(&q->mutex);
+    if (pending) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Next task for worker `w`: own node first, then steal, then sleep. Returns
+ * NULL on shutdown.
+ *
+ * A submit to another node wakes one of our workers only if that node has
+ * nobody idle, and it looks at our `idle` after queueing. So once idle is
+ * raised we look at the other queues again before waiting: a task queued
+ * after that look is followed by a signal we will be waiting for.
+ */
+static Future *worker_next(Worker *w) {
+  ThreadPool *pool = w->pool;
+  NodeQueue *q = pool->queues[w->node];
+
+  while (1) {
+    pthread_mutex_lock(&q->mutex);
+    Future *f = queue_pop(q);
+    int stop = pool->shutdown;
+    pthread_mutex_unlock(&q->mutex);
+    if (f || stop) return f;
+
+    if ((f = steal(pool, w->node))) {
+      w->stolen++;
+      return f;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+    if (!q->head && !pool->shutdown) {
+      q->idle++;
+      if (!remote_pending(pool, w->node)) pthread_cond_wait(&q->cond, &q->mutex);
+      q->idle--;
+    }
+    pthread_mutex_unlock(&q->mutex);
+  }
+}
+
+void *worker_thread(void *arg) {
+  Worker *w = arg;
+
+  pin_worker(w);
+
+  Future *f;
+  while ((f = worker_next(w))) {
+    void *res = f->task(f->arg);
+    w->executed++;
+
+    pthread_mutex_lock(&f->mutex);
+    f->result = res;
+    f->completed = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+  }
+
+  return NULL;
+}
+
+/* =========================
+   Thread pool API
+   ========================= */
+
+/*
+ * Create a pool with `num_threads` workers spread over the nodes of `topo`.
+ */
+ThreadPool *threadpool_create_topo(const Topology *topo, int num_threads, PinMode pin) {
+  ThreadPool *pool = malloc(sizeof(ThreadPool));
+  pool->topo = *topo;
+  pool->pin = pin;
+  pool->num_threads = num_threads;
+  pool->shutdown = 0;
+  pool->workers = calloc(num_threads, sizeof(Worker));
+
+  int total_cpus = 0;
+  for (int n = 0; n < pool->topo.num_nodes; n++) {
+    total_cpus += pool->topo.nodes[n].num_cpus;
+
+    NodeQueue *q = node_alloc(sizeof(NodeQueue), pool->topo.nodes[n].id);
+    if (!q) {
+      perror("node_alloc");
+      exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->head = q->tail = NULL;
+    q->idle = 0;
+    q->num_workers = 0;
+    q->free_list = NULL;
+    pool->queues[n] = q;
+  }
+
+  // Assign worker i to the node owning the i-th CPU (cycling), so workers
+  // are split in proportion to CPU count and consecutive workers fill a
+  // node before moving on.
+  for (int i = 0; i < num_threads; i++) {
+    Worker *w = &pool->workers[i];
+    int slot = i % total_cpus;
+    int n = 0;
+    while (slot >= pool->topo.nodes[n].num_cpus) slot -= pool->topo.nodes[n++].num_cpus;
+
+    w->pool = pool;
+    w->node = n;
+    w->cpu = pool->topo.nodes[n].cpus[slot];
+    pool->queues[n]->num_workers++;
+
+    // The stack is faulted in on the worker's node rather than ours.
+    w->stack = node_alloc(WORKER_STACK_SIZE, pool->topo.nodes[n].id);
+    if (!w->stack) {
+      perror("node_alloc");
+      exit(EXIT_FAILURE);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, w->stack, WORKER_STACK_SIZE);
+    if (pthread_create(&w->thread, &attr, worker_thread, w) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  // With fewer workers than CPUs the last nodes may get none; their submits
+  // go to the nearest node that has some.
+  for (int n = 0; n < pool->topo.num_nodes; n++) {
+    NumaNode *node = &pool->topo.nodes[n];
+    pool->route[n] = n;
+    for (int i = 0; !pool->queues[pool->route[n]]->num_workers && i < pool->topo.num_nodes - 1; i++) {
+      pool->route[n] = node->by_distance[i];
+    }
+  }
+
+  return pool;
+}
+
+/*
+ * Create a pool with `num_threads` workers spread over the NUMA nodes.
+ */
+ThreadPool *threadpool_create(int num_threads, PinMode pin) {
+  Topology *topo = malloc(sizeof(Topology));
+  topology_discover(topo);
+  ThreadPool *pool = threadpool_create_topo(topo, num_threads, pin);
+  free(topo);
+  return pool;
+}
+
+/*
+ * Node the calling thread is currently running on.
+ */
+int threadpool_current_node(ThreadPool *pool) {
+  int cpu = sched_getcpu();
+  return cpu >= 0 && cpu < MAX_CPUS ? pool->topo.cpu_to_node[cpu] : 0;
+}
+
+static Future *future_alloc(ThreadPool *pool, int node) {
+  NodeQueue *q = pool->queues[node];
+
+  pthread_mutex_lock(&q->mutex);
+  if (!q->free_list) {
+    // Carve a chunk of Futures out of node-local memory. Chunks are only
+    // returned to the OS when the process exits.
+    Future *chunk = node_alloc(sizeof(Future) * FUTURES_PER_CHUNK, pool->topo.nodes[node].id);
+    if (!chunk) {
+      perror("node_alloc");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < FUTURES_PER_CHUNK; i++) {
+      chunk[i].node = node;
+      pthread_mutex_init(&chunk[i].mutex, NULL);
+      pthread_cond_init(&chunk[i].cond, NULL);
+      chunk[i].next = q->free_list;
+      q->free_list = &chunk[i];
+    }
+  }
+  Future *f = q->free_list;
+  q->free_list = f->next;
+  pthread_mutex_unlock(&q->mutex);
+  return f;
+}
+
+/*
+ * Submit a task to a specific node's queue, or to the nearest node with
+ * workers if that one has none.
+ */
+Future *threadpool_submit_node(ThreadPool *pool, int node, void *(*task)(void *), void *arg) {
+  node = pool->route[node];
+  Future *f = future_alloc(pool, node);
+  f->task = task;
+  f->arg = arg;
+  f->result = NULL;
+  f->completed = 0;
+  f->next = NULL;
+
+  NodeQueue *q = pool->queues[node];
+  pthread_mutex_lock(&q->mutex);
+  if (q->tail)
+    q->tail->next = f;
+  else
+    q->head = f;
+  q->tail = f;
+  int local_idle = q->idle;
+  if (local_idle) pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->mutex);
+
+  if (!local_idle) {
+    // Everyone on that node is busy: wake an idle worker elsewhere, nearest
+    // first, so it can steal the task.
+    NumaNode *n = &pool->topo.nodes[node];
+    for (int i = 0; i < pool->topo.num_nodes - 1; i++) {
+      NodeQueue *other = pool->queues[n->by_distance[i]];
+      pthread_mutex_lock(&other->mutex);
+      int woke = other->idle > 0;
+      if (woke) pthread_cond_signal(&other->cond);
+      pthread_mutex_unlock(&other->mutex);
+      if (woke) break;
+    }
+  }
+  return f;
+}
+
+/*
+ * Submit a task to the caller's own node.
+ */
+Future *threadpool_submit(ThreadPool *pool, void *(*task)(void *), void *arg) {
+  return threadpool_submit_node(pool, threadpool_current_node(pool), task, arg);
+}
+
+void *future_get(Future *f) {
+  pthread_mutex_lock(&f->mutex);
+  while (!f->completed) {
+    pthread_cond_wait(&f->cond, &f->mutex);
+  }
+  pthread_mutex_unlock(&f->mutex);
+  return f->result;
+}
+
+/*
+ * Return a Future to its node's free list.
+ */
+void future_destroy(ThreadPool *pool, Future *f) {
+  NodeQueue *q = pool->queues[f->node];
+  pthread_mutex_lock(&q->mutex);
+  f->next = q->free_list;
+  q->free_list = f;
+  pthread_mutex_unlock(&q->mutex);
+}
+
+void threadpool_destroy(ThreadPool *pool) {
+  for (int n = 0; n < pool->topo.num_nodes; n++) {
+    NodeQueue *q = pool->queues[n];
+    pthread_mutex_lock(&q->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+  }
+
+  for (int i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+    node_free(pool->workers[i].stack, WORKER_STACK_SIZE);
+  }
+
+  for (int n = 0; n < pool->topo.num_nodes; n++) {
+    pthread_mutex_destroy(&pool->queues[n]->mutex);
+    pthread_cond_destroy(&pool->queues[n]->cond);
+    node_free(pool->queues[n], sizeof(NodeQueue));
+  }
+  free(pool->workers);
+  free(pool);
+}
+
+/* =========================
+   Example task
+   ========================= */
+
+/*
+ * Sums an array that was allocated on the submitting node.
+ */
+typedef struct {
+  long *data;
+  size_t len;
+  int node;
+} SumJob;
+
+void *sum_task(void *arg) {
+  SumJob *job = arg;
+  long s = 0;
+  for (size_t i = 0; i < job->len; i++) s += job->data[i];
+  return (void *)s;
+}
+
+/* =========================
+   Main
+   ========================= */
+
+#define JOBS_PER_NODE 8
+#define JOB_LEN (1 << 18)
+
+int main(int argc, char **argv) {
+  PinMode pin = PIN_CORE;
+  if (argc > 1 && !strcmp(argv[1], "node")) pin = PIN_NODE;
+  if (argc > 1 && !strcmp(argv[1], "none")) pin = PIN_NONE;
+
+  int nthreads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) {
+    fprintf(stderr, "threads must be at least 1\n");
+    exit(EXIT_FAILURE);
+  }
+  Topology *topo = malloc(sizeof(Topology));
+  if (argc > 3) {
+    topology_split(topo, atoi(argv[3]) > 0 ? atoi(argv[3]) : 1);
+  } else {
+    topology_discover(topo);
+  }
+  ThreadPool *pool = threadpool_create_topo(topo, nthreads, pin);
+
+  printf("%d node(s), %d worker(s), pinning: %s\n", pool->topo.num_nodes, nthreads,
+         pin == PIN_CORE ? "core" : pin == PIN_NODE ? "node" : "none");
+  for (int n = 0; n < pool->topo.num_nodes; n++) {
+    printf("  node %d: %d cpu(s), %d worker(s)\n", pool->topo.nodes[n].id, pool->topo.nodes[n].num_cpus,
+           pool->queues[n]->num_workers);
+  }
+
+  // Put each job's data on a node and submit it to that node's queue.
+  int njobs = JOBS_PER_NODE * pool->topo.num_nodes;
+  SumJob *jobs = malloc(sizeof(SumJob) * njobs);
+  Future **futures = malloc(sizeof(Future *) * njobs);
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int j = 0; j < njobs; j++) {
+    int node = j % pool->topo.num_nodes;
+    jobs[j].node = node;
+    jobs[j].len = JOB_LEN;
+    jobs[j].data = node_alloc(sizeof(long) * JOB_LEN, pool->topo.nodes[node].id);
+    if (!jobs[j].data) {
+      perror("node_alloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < JOB_LEN; i++) jobs[j].data[i] = i;
+    futures[j] = threadpool_submit_node(pool, node, sum_task, &jobs[j]);
+  }
+
+  long total = 0;
+  for (int j = 0; j < njobs; j++) {
+    total += (long)future_get(futures[j]);
+    future_destroy(pool, futures[j]);
+    node_free(jobs[j].data, sizeof(long) * JOB_LEN);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  printf("%d jobs, total = %ld, %.1f ms\n", njobs, total,
+         (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+  // Plain submit goes to whichever node main is running on.
+  SumJob local = {node_alloc(sizeof(long) * JOB_LEN, pool->topo.nodes[0].id), JOB_LEN, 0};
+  if (!local.data) {
+    perror("node_alloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < JOB_LEN; i++) local.data[i] = 1;
+  Future *f = threadpool_submit(pool, sum_task, &local);
+  printf("submitted from node %d, sum = %ld\n", threadpool_current_node(pool), (long)future_get(f));
+  future_destroy(pool, f);
+
+  long stolen = 0;
+  for (int i = 0; i < nthreads; i++) stolen += pool->workers[i].stolen;
+  printf("tasks stolen across nodes: %ld\n", stolen);
+
+  threadpool_destroy(pool);
+
+  // One worker, two nodes: node 1 has no workers, so what is submitted to it
+  // or from it (main pinned to its CPU) must run on node 0.
+  topology_split(topo, 2);
+  pool = threadpool_create_topo(topo, 1, PIN_NONE);
+  cpu_set_t saved, set;
+  sched_getaffinity(0, sizeof(saved), &saved);
+  CPU_ZERO(&set);
+  CPU_SET(topo->nodes[1].cpus[0], &set);
+  sched_setaffinity(0, sizeof(set), &set);
+
+  long routed = 0;
+  for (int j = 0; j < njobs; j++) {
+    futures[j] = j % 2 ? threadpool_submit_node(pool, 1, sum_task, &local)
+                       : threadpool_submit(pool, sum_task, &local);
+  }
+  for (int j = 0; j < njobs; j++) {
+    routed += futures[j]->node == 0 && (long)future_get(futures[j]) == JOB_LEN;
+    future_destroy(pool, futures[j]);
+  }
+  sched_setaffinity(0, sizeof(saved), &saved);
+  printf("1 worker on 2 nodes: %ld of %d tasks for the empty node ran on node 0%s\n", routed,
+         njobs, routed == njobs ? "" : "  WRONG");
+
+  threadpool_destroy(pool);
+  node_free(local.data, sizeof(long) * JOB_LEN);
+  free(topo);
+  free(jobs);
+  free(futures);
+  return 0;
+}
@@ -0,0 +1,443 @@
+/*
+ * Future implementation in C, with a Thread pool that has priority lanes and
+ * an earliest-deadline-first mode
+ *
+ * concfuture_threadpool.c runs every task from a single FIFO, so a short
+ * latency-critical task submitted behind a batch of bulk jobs waits for all
+ * of them. This version adds:
+ *
+ *  - Lanes. Each task is submitted to LANE_CRITICAL, LANE_NORMAL or
+ *    LANE_BULK. In POOL_LANES mode workers take the head of the highest
+ *    non-empty lane; each lane is FIFO internally.
+ *
+ *  - Starvation protection. Every lane has a max_wait. If the head of a
+ *    lower lane has waited longer than that, it is served before higher
+ *    lanes (the most overdue lane wins), so bulk work keeps trickling
+ *    through under a steady stream of critical tasks.
+ *
+ *  - EDF. In POOL_EDF mode every task has an absolute deadline, and workers
+ *    always take the earliest one from a binary min-heap. A task submitted
+ *    without a deadline gets submit time + its lane's default budget, so
+ *    lanes still mean something and nothing waits forever.
+ *
+ *  - Metrics per lane: submitted/completed counts, mean and max queue wait,
+ *    starvation promotions and deadline misses (finished after deadline).
+ *
+ * Compilation:
+ *   gcc concfuture_threadpool_priority.c -O2 -pthread -o concfuture_threadpool_priority
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#define MS (1000000ull)
+
+/* =========================
+   Future
+   ========================= */
+
+typedef enum { LANE_CRITICAL, LANE_NORMAL, LANE_BULK, NUM_LANES } Lane;
+
+static const char *lane_names[NUM_LANES] = {"critical", "normal", "bulk"};
+
+typedef struct Future {
+  void *(*task)(void *);
+  void *arg;
+  void *result;
+
+  int completed;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  Lane lane;
+  uint64_t submit_ns;
+  uint64_t deadline_ns;  // 0 = none (POOL_LANES only)
+
+  struct Future *next;  // Next future in the lane queue
+} Future;
+
+/* =========================
+   Thread Pool
+   ========================= */
+
+/*
+ * POOL_FIFO ignores lanes for ordering (they are still used for metrics),
+ * which is what concfuture_threadpool.c does.
+ */
+typedef enum { POOL_FIFO, POOL_LANES, POOL_EDF } PoolMode;
+
+typedef struct {
+  uint64_t max_wait_ns;  // POOL_LANES: head older than this jumps the queue
+  uint64_t budget_ns;    // POOL_EDF: default deadline = submit + budget
+} LaneConfig;
+
+static const LaneConfig default_lane_config[NUM_LANES] = {
+    {50 * MS, 5 * MS},      // critical
+    {200 * MS, 50 * MS},    // normal
+    {1000 * MS, 500 * MS},  // bulk
+};
+
+typedef struct {
+  long submitted;
+  long completed;
+  long promoted;         // Dequeued ahead of a higher lane by starvation protection
+  long deadline_misses;  // Finished after its deadline
+  uint64_t total_wait_ns;
+  uint64_t max_wait_ns;
+} LaneMetrics;
+
+typedef struct {
+  pthread_t *threads;
+  int num_threads;
+  PoolMode mode;
+  LaneConfig config[NUM_LANES];
+
+  // POOL_LANES: one FIFO per lane. POOL_FIFO queues everything on lane 0.
+  Future *lane_head[NUM_LANES];
+  Future *lane_tail[NUM_LANES];
+
+  // POOL_EDF: min-heap on deadline_ns
+  Future **heap;
+  int heap_size;
+  int heap_cap;
+
+  LaneMetrics metrics[NUM_LANES];  // Protected by queue_mutex
+
+  pthread_mutex_t queue_mutex;
+  pthread_cond_t queue_cond;
+
+  int shutdown;
+} ThreadPool;
+
+/* ---- EDF heap ---- */
+
+static void heap_push(ThreadPool *pool, Future *f) {
+  if (pool->heap_size == pool->heap_cap) {
+    pool->heap_cap = pool->heap_cap ? pool->heap_cap * 2 : 64;
+    pool->heap = realloc(pool->heap, sizeof(Future *) * pool->heap_cap);
+  }
+  int i = pool->heap_size++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (pool->heap[parent]->deadline_ns <= f->deadline_ns) break;
+    pool->heap[i] = pool->heap[parent];
+    i = parent;
+  }
+  pool->heap[i] = f;
+}
+
+static Future *heap_pop(ThreadPool *pool) {
+  if (pool->heap_size == 0) return NULL;
+  Future *top = pool->heap[0];
+  Future *last = pool->heap[--pool->heap_size];
+  int i = 0;
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= pool->heap_size) break;
+    if (child + 1 < pool->heap_size &&
+        pool->heap[child + 1]->deadline_ns < pool->heap[child]->deadline_ns) {
+      child++;
+    }
+    if (last->deadline_ns <= pool->heap[child]->deadline_ns) break;
+    pool->heap[i] = pool->heap[child];
+    i = child;
+  }
+  if (pool->heap_size > 0) pool->heap[i] = last;
+  return top;
+}
+
+/* ---- Lane selection ---- */
+
+static Future *lane_pop(ThreadPool *pool, int lane) {
+  Future *f = pool->lane_head[lane];
+  pool->lane_head[lane] = f->next;
+  if (!pool->lane_head[lane]) pool->lane_tail[lane] = NULL;
+  return f;
+}
+
+/*
+ * Pick the next task in POOL_LANES mode. Called with queue_mutex held.
+ */
+static Future *lanes_next(ThreadPool *pool, uint64_t now) {
+  int top = -1;
+  for (int l = 0; l < NUM_LANES; l++) {
+    if (pool->lane_head[l]) {
+      top = l;
+      break;
+    }
+  }
+  if (top < 0) return NULL;
+
+  // Among the lower lanes, find the head furthest past its max_wait.
+  int starving = -1;
+  uint64_t worst = 0;
+  for (int l = top + 1; l < NUM_LANES; l++) {
+    Future *head = pool->lane_head[l];
+    if (!head) continue;
+    uint64_t waited = now - head->submit_ns;
+    if (waited > pool->config[l].max_wait_ns && waited - pool->config[l].max_wait_ns >= worst) {
+      worst = waited - pool->config[l].max_wait_ns;
+      starving = l;
+    }
+  }
+  if (starving >= 0) {
+    pool->metrics[starving].promoted++;
+    return lane_pop(pool, starving);
+  }
+  return lane_pop(pool, top);
+}
+
+static int queue_empty(ThreadPool *pool) {
+  if (pool->mode == POOL_EDF) return pool->heap_size == 0;
+  for (int l = 0; l < NUM_LANES; l++) {
+    if (pool->lane_head[l]) return 0;
+  }
+  return 1;
+}
+
+/* =========================
+   Worker thread
+   ========================= */
+
+void *worker_thread(void *arg) {
+  ThreadPool *pool = (ThreadPool *)arg;
+
+  while (1) {
+    pthread_mutex_lock(&pool->queue_mutex);
+
+    while (queue_empty(pool) && !pool->shutdown) {
+      pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
+    }
+
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->queue_mutex);
+      break;
+    }
+
+    uint64_t now = now_ns();
+    Future *f = pool->mode == POOL_EDF ? heap_pop(pool) : lanes_next(pool, now);
+
+    LaneMetrics *m = &pool->metrics[f->lane];
+    uint64_t wait = now - f->submit_ns;
+    m->total_wait_ns += wait;
+    if (wait > m->max_wait_ns) m->max_wait_ns = wait;
+
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    void *res = f->task(f->arg);
+    uint64_t done = now_ns();
+
+    pthread_mutex_lock(&pool->queue_mutex);
+    m->completed++;
+    if (f->deadline_ns && done > f->deadline_ns) m->deadline_misses++;
+    pthread_mutex_unlock(&pool->queue_mutex);
+
+    pthread_mutex_lock(&f->mutex);
+    f->result = res;
+    f->completed = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->mutex);
+  }
+
+  return NULL;
+}
+
+/* =========================
+   Thread pool API
+   ========================= */
+
+ThreadPool *threadpool_create(int num_threads, PoolMode mode) {
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+
+  pool->num_threads = num_threads;
+  pool->threads = malloc(sizeof(pthread_t) * num_threads);
+  pool->mode = mode;
+  memcpy(pool->config, default_lane_config, sizeof(pool->config));
+
+  pthread_mutex_init(&pool->queue_mutex, NULL);
+  pthread_cond_init(&pool->queue_cond, NULL);
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&pool->threads[i], NULL, worker_thread, pool);
+  }
+
+  return pool;
+}
+
+/*
+ * Change a lane's starvation limit and default EDF budget (in ms).
+ */
+void threadpool_set_lane(ThreadPool *pool, Lane lane, int max_wait_ms, int budget_ms) {
+  pthread_mutex_lock(&pool->queue_mutex);
+  pool->config[lane].max_wait_ns = max_wait_ms * MS;
+  pool->config[lane].budget_ns = budget_ms * MS;
+  pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+/*
+ * Submit a task to a lane. `deadline_ms` is relative to now; 0 means no
+ * explicit deadline (POOL_EDF then uses the lane's budget).
+ */
+Future *threadpool_submit(ThreadPool *pool, void *(*task)(void *), void *arg, Lane lane,
+                          int deadline_ms) {
+  Future *f = malloc(sizeof(Future));
+
+  f->task = task;
+  f->arg = arg;
+  f->result = NULL;
+  f->completed = 0;
+  f->next = NULL;
+  f->lane = lane;
+  f->submit_ns = now_ns();
+  f->deadline_ns = deadline_ms > 0 ? f->submit_ns + deadline_ms * MS : 0;
+
+  pthread_mutex_init(&f->mutex, NULL);
+  pthread_cond_init(&f->cond, NULL);
+
+  pthread_mutex_lock(&pool->queue_mutex);
+
+  pool->metrics[lane].submitted++;
+  if (pool->mode == POOL_EDF) {
+    if (!f->deadline_ns) f->deadline_ns = f->submit_ns + pool->config[lane].budget_ns;
+    heap_push(pool, f);
+  } else {
+    int q = pool->mode == POOL_FIFO ? 0 : lane;
+    if (pool->lane_tail[q])
+      pool->lane_tail[q]->next = f;
+    else
+      pool->lane_head[q] = f;
+    pool->lane_tail[q] = f;
+  }
+
+  pthread_cond_signal(&pool->queue_cond);
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  return f;
+}
+
+void *future_get(Future *f) {
+  pthread_mutex_lock(&f->mutex);
+  while (!f->completed) {
+    pthread_cond_wait(&f->cond, &f->mutex);
+  }
+  pthread_mutex_unlock(&f->mutex);
+  return f->result;
+}
+
+void future_destroy(Future *f) {
+  pthread_mutex_destroy(&f->mutex);
+  pthread_cond_destroy(&f->cond);
+  free(f);
+}
+
+/*
+ * Copy the per-lane metrics into `out` (NUM_LANES entries).
+ */
+void threadpool_metrics(ThreadPool *pool, LaneMetrics *out) {
+  pthread_mutex_lock(&pool->queue_mutex);
+  memcpy(out, pool->metrics, sizeof(pool->metrics));
+  pthread_mutex_unlock(&pool->queue_mutex);
+}
+
+void threadpool_print_metrics(ThreadPool *pool) {
+  LaneMetrics m[NUM_LANES];
+  threadpool_metrics(pool, m);
+
+  printf("  %-9s %9s %9s %10s %10s %9s %7s\n", "lane", "submitted", "completed", "mean wait",
+         "max wait", "promoted", "missed");
+  for (int l = 0; l < NUM_LANES; l++) {
+    double mean = m[l].completed ? (double)m[l].total_wait_ns / m[l].completed / MS : 0;
+    printf("  %-9s %9ld %9ld %8.2fms %8.2fms %9ld %7ld\n", lane_names[l], m[l].submitted,
+           m[l].completed, mean, (double)m[l].max_wait_ns / MS, m[l].promoted,
+           m[l].deadline_misses);
+  }
+}
+
+void threadpool_destroy(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->queue_mutex);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->queue_cond);
+  pthread_mutex_unlock(&pool->queue_mutex);
+
+  for (int i = 0; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&pool->queue_mutex);
+  pthread_cond_destroy(&pool->queue_cond);
+
+  free(pool->heap);
+  free(pool->threads);
+  free(pool);
+}
+
+/* =========================
+   Example task
+   ========================= */
+
+/*
+ * Simulated work: sleeps for *arg milliseconds.
+ */
+void *work_task(void *arg) {
+  int ms = *(int *)arg;
+  struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+  return NULL;
+}
+
+/* =========================
+   Main
+   ========================= */
+
+#define NUM_BULK 200
+#define NUM_CRITICAL 40
+
+static int bulk_ms = 5;
+static int critical_ms = 1;
+
+/*
+ * Queue a backlog of bulk jobs, then trickle in critical requests with a
+ * 10 ms deadline while the backlog drains.
+ */
+static void run(const char *name, PoolMode mode) {
+  ThreadPool *pool = threadpool_create(4, mode);
+  Future *bulk[NUM_BULK], *critical[NUM_CRITICAL];
+
+  for (int i = 0; i < NUM_BULK; i++) {
+    bulk[i] = threadpool_submit(pool, work_task, &bulk_ms, LANE_BULK, 0);
+  }
+  for (int i = 0; i < NUM_CRITICAL; i++) {
+    critical[i] = threadpool_submit(pool, work_task, &critical_ms, LANE_CRITICAL, 10);
+    struct timespec ts = {0, 5 * MS};
+    nanosleep(&ts, NULL);
+  }
+
+  for (int i = 0; i < NUM_CRITICAL; i++) {
+    future_get(critical[i]);
+    future_destroy(critical[i]);
+  }
+  for (int i = 0; i < NUM_BULK; i++) {
+    future_get(bulk[i]);
+    future_destroy(bulk[i]);
+  }
+
+  printf("%s:\n", name);
+  threadpool_print_metrics(pool);
+  threadpool_destroy(pool);
+}
+
+int main(void) {
+  run("single FIFO", POOL_FIFO);
+  run("priority lanes", POOL_LANES);
+  run("EDF", POOL_EDF);
+  return 0;
+}
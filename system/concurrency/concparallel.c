@@ -0,0 +1,596 @@
+/*
+ * Data-parallel algorithms on a work-stealing thread pool (see concparallel.h)
+ *
+ * Pool
+ *  - One deque per worker, protected by its own mutex. The owner pushes and
+ *    pops at the bottom; thieves take from the top, i.e. the oldest and
+ *    usually largest piece of work. A separate inject deque receives the
+ *    root task of calls made from threads outside the pool.
+ *  - Idle workers park on an eventcount (`epoch` + `sleepers`). Spawning
+ *    bumps epoch and only issues FUTEX_WAKE if somebody is asleep.
+ *
+ * Fork/join
+ *  - Every parallel operation has a Join counter of outstanding tasks. A
+ *    worker waiting on a Join keeps running tasks (its own first, then
+ *    stolen ones), so nested parallel calls never deadlock the pool. An
+ *    outside thread sleeps on the counter's futex instead.
+ *
+ * Compilation (with a program using it):
+ *   gcc -O2 -pthread concparallel_bench.c concparallel.c -o concparallel_bench
+ */
+#define _GNU_SOURCE
+#include "concparallel.h"
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+#define DEQUE_CAP 4096      // A worker runs tasks inline while its deque is full
+#define IDLE_SPINS 64       // Rounds of stealing before parking
+#define SORT_MIN_BLOCK 4096 // Smallest sort/merge piece worth a task
+
+static inline int futex_wait(atomic_int *futex, int expected) {
+  return syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline int futex_wake(atomic_int *futex, int count) {
+  return syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* ----------------------- Tasks and deques ----------------------- */
+
+/*
+ * Outstanding tasks of one fork/join, plus JOIN_SLEEPING when an outside
+ * thread is parked on it. Keeping both in one word matters: the waiter may
+ * return (and its stack frame holding the Join vanish) as soon as the count
+ * hits zero, so the last finisher must not read the Join after decrementing.
+ */
+#define JOIN_SLEEPING (1 << 30)
+
+typedef struct {
+  atomic_int pending;
+} Join;
+
+typedef struct {
+  void (*fn)(void *arg, size_t lo, size_t hi);
+  void *arg;
+  size_t lo, hi;
+  Join *join;
+} Task;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  atomic_int size;  // Read without the lock to skip empty deques
+  size_t top;       // Next task to steal
+  size_t bottom;    // Next free slot
+  Task tasks[DEQUE_CAP];
+} Deque;
+
+static void deque_init(Deque *dq) {
+  pthread_mutex_init(&dq->mutex, NULL);
+  atomic_init(&dq->size, 0);
+  dq->top = dq->bottom = 0;
+}
+
+static int deque_push(Deque *dq, Task t) {
+  pthread_mutex_lock(&dq->mutex);
+  if (dq->bottom - dq->top == DEQUE_CAP) {
+    pthread_mutex_unlock(&dq->mutex);
+    return 0;
+  }
+  dq->tasks[dq->bottom++ % DEQUE_CAP] = t;
+  atomic_store_explicit(&dq->size, dq->bottom - dq->top, memory_order_relaxed);
+  pthread_mutex_unlock(&dq->mutex);
+  return 1;
+}
+
+static int deque_pop(Deque *dq, Task *t) {
+  if (atomic_load_explicit(&dq->size, memory_order_relaxed) == 0) return 0;
+  pthread_mutex_lock(&dq->mutex);
+  int ok = dq->bottom != dq->top;
+  if (ok) *t = dq->tasks[--dq->bottom % DEQUE_CAP];
+  atomic_store_explicit(&dq->size, dq->bottom - dq->top, memory_order_relaxed);
+  pthread_mutex_unlock(&dq->mutex);
+  return ok;
+}
+
+static int deque_steal(Deque *dq, Task *t) {
+  if (atomic_load_explicit(&dq->size, memory_order_relaxed) == 0) return 0;
+  if (pthread_mutex_trylock(&dq->mutex) != 0) return 0;
+  int ok = dq->bottom != dq->top;
+  if (ok) *t = dq->tasks[dq->top++ % DEQUE_CAP];
+  atomic_store_explicit(&dq->size, dq->bottom - dq->top, memory_order_relaxed);
+  pthread_mutex_unlock(&dq->mutex);
+  return ok;
+}
+
+/* ----------------------- Pool ----------------------- */
+
+typedef struct {
+  _Alignas(CACHE_LINE) Deque dq;
+  ParPool *pool;
+  int id;
+  unsigned rng;  // Victim selection
+  pthread_t thread;
+} Worker;
+
+struct ParPool {
+  Worker *workers;
+  int num_workers;
+  Deque inject;  // Root tasks from outside threads
+
+  _Alignas(CACHE_LINE) atomic_int epoch;
+  atomic_int sleepers;
+  atomic_int shutdown;
+};
+
+static _Thread_local Worker *self;
+
+static void notify(ParPool *pool) {
+  atomic_fetch_add(&pool->epoch, 1);
+  if (atomic_load(&pool->sleepers) > 0) futex_wake(&pool->epoch, 1);
+}
+
+static void run_task(Task *t) {
+  t->fn(t->arg, t->lo, t->hi);
+  Join *j = t->join;
+  // The wake only passes the address to the kernel, which is fine even if
+  // the waiter has already returned.
+  if (atomic_fetch_sub(&j->pending, 1) == (JOIN_SLEEPING | 1)) futex_wake(&j->pending, INT_MAX);
+}
+
+/*
+ * A worker whose deque is full runs the task inline. A thread outside the
+ * pool can't: tasks assume they run on one of its workers (they spawn onto
+ * `self`'s deque), so it waits for the workers to make room in the inject
+ * deque instead.
+ */
+static void spawn(ParPool *pool, Task t) {
+  atomic_fetch_add_explicit(&t.join->pending, 1, memory_order_relaxed);
+  if (self && self->pool == pool) {
+    if (!deque_push(&self->dq, t)) {
+      run_task(&t);
+      return;
+    }
+  } else {
+    while (!deque_push(&pool->inject, t)) {
+      notify(pool);
+      sched_yield();
+    }
+  }
+  notify(pool);
+}
+
+static int find_task(ParPool *pool, Worker *w, Task *t) {
+  if (w && deque_pop(&w->dq, t)) return 1;
+  if (deque_steal(&pool->inject, t)) return 1;
+
+  int n = pool->num_workers;
+  unsigned start = w ? (w->rng = w->rng * 1103515245 + 12345) >> 16 : 0;
+  for (int i = 0; i < n; i++) {
+    Worker *v = &pool->workers[(start + i) % n];
+    if (v != w && deque_steal(&v->dq, t)) return 1;
+  }
+  return 0;
+}
+
+static void join_wait(ParPool *pool, Join *j) {
+  if (self && self->pool == pool) {
+    Task t;
+    while (atomic_load(&j->pending) != 0) {
+      if (find_task(pool, self, &t)) {
+        run_task(&t);
+      } else {
+        sched_yield();
+      }
+    }
+    return;
+  }
+
+  int p;
+  while (((p = atomic_load(&j->pending)) & ~JOIN_SLEEPING) != 0) {
+    if (!(p & JOIN_SLEEPING) &&
+        !atomic_compare_exchange_weak(&j->pending, &p, p | JOIN_SLEEPING)) {
+      continue;
+    }
+    futex_wait(&j->pending, p | JOIN_SLEEPING);
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker *w = arg;
+  ParPool *pool = w->pool;
+  self = w;
+
+  int spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? IDLE_SPINS : 1;
+  Task t;
+  while (!atomic_load(&pool->shutdown)) {
+    int found = 0;
+    for (int i = 0; i < spin_limit && !found; i++) {
+      if ((found = find_task(pool, w, &t))) break;
+      sched_yield();
+    }
+    if (found) {
+      run_task(&t);
+      continue;
+    }
+
+    // Eventcount: anything spawned after we read epoch changes it, so the
+    // futex_wait below returns at once instead of missing the task.
+    int e = atomic_load(&pool->epoch);
+    if (find_task(pool, w, &t)) {
+      run_task(&t);
+      continue;
+    }
+    atomic_fetch_add(&pool->sleepers, 1);
+    if (!atomic_load(&pool->shutdown)) futex_wait(&pool->epoch, e);
+    atomic_fetch_sub(&pool->sleepers, 1);
+  }
+  return NULL;
+}
+
+ParPool *par_pool_create(int num_threads) {
+  if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  ParPool *pool = aligned_alloc(CACHE_LINE, sizeof(ParPool));
+  pool->workers = aligned_alloc(CACHE_LINE, sizeof(Worker) * num_threads);
+  pool->num_workers = num_threads;
+  deque_init(&pool->inject);
+  atomic_init(&pool->epoch, 0);
+  atomic_init(&pool->sleepers, 0);
+  atomic_init(&pool->shutdown, 0);
+
+  for (int i = 0; i < num_threads; i++) {
+    Worker *w = &pool->workers[i];
+    deque_init(&w->dq);
+    w->pool = pool;
+    w->id = i;
+    w->rng = i + 1;
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+  }
+  return pool;
+}
+
+void par_pool_destroy(ParPool *pool) {
+  atomic_store(&pool->shutdown, 1);
+  atomic_fetch_add(&pool->epoch, 1);
+  futex_wake(&pool->epoch, INT_MAX);
+  for (int i = 0; i < pool->num_workers; i++) pthread_join(pool->workers[i].thread, NULL);
+
+  for (int i = 0; i < pool->num_workers; i++) pthread_mutex_destroy(&pool->workers[i].dq.mutex);
+  pthread_mutex_destroy(&pool->inject.mutex);
+  free(pool->workers);
+  free(pool);
+}
+
+static ParPool *default_pool;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void default_pool_init(void) { default_pool = par_pool_create(0); }
+
+ParPool *par_default_pool(void) {
+  pthread_once(&default_once, default_pool_init);
+  return default_pool;
+}
+
+int par_pool_size(ParPool *pool) { return (pool ? pool : par_default_pool())->num_workers; }
+
+/*
+ * Run fn(arg, lo, hi) on a worker of `pool` and wait for it. Called from a
+ * worker this is a plain call.
+ */
+static void run_on_pool(ParPool *pool, void (*fn)(void *, size_t, size_t), void *arg, size_t lo,
+                        size_t hi) {
+  if (self && self->pool == pool) {
+    fn(arg, lo, hi);
+    return;
+  }
+  Join j = {0};
+  spawn(pool, (Task){fn, arg, lo, hi, &j});
+  join_wait(pool, &j);
+}
+
+/* ----------------------- parallel_for ----------------------- */
+
+typedef struct {
+  ParPool *pool;
+  par_range_fn body;
+  void *ctx;
+  size_t grain;
+  Join join;
+} ForJob;
+
+/*
+ * Lazy binary splitting: hand the right half to the deque only while our
+ * deque is empty. If it still holds work, thieves have enough to take and we
+ * just run the next grain-sized chunk.
+ */
+static void for_range(void *arg, size_t lo, size_t hi) {
+  ForJob *job = arg;
+  while (hi - lo > job->grain) {
+    if (atomic_load_explicit(&self->dq.size, memory_order_relaxed) > 0) {
+      job->body(lo, lo + job->grain, job->ctx);
+      lo += job->grain;
+      continue;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    spawn(job->pool, (Task){for_range, job, mid, hi, &job->join});
+    hi = mid;
+  }
+  if (lo < hi) job->body(lo, hi, job->ctx);
+}
+
+static void for_root(void *arg, size_t lo, size_t hi) {
+  ForJob *job = arg;
+  for_range(job, lo, hi);
+  join_wait(job->pool, &job->join);
+}
+
+void parallel_for(ParPool *pool, size_t begin, size_t end, size_t grain, par_range_fn body,
+                  void *ctx) {
+  if (begin >= end) return;
+  if (!pool) pool = par_default_pool();
+  if (grain == 0) {
+    grain = (end - begin) / (32 * (size_t)pool->num_workers);
+    if (grain == 0) grain = 1;
+  }
+
+  ForJob job = {pool, body, ctx, grain, {0}};
+  run_on_pool(pool, for_root, &job, begin, end);
+}
+
+/* ----------------------- parallel_reduce / parallel_scan ----------------------- */
+
+/*
+ * Blocks for reduce and scan: `grain` elements each, or 4 per worker.
+ */
+static size_t block_count(ParPool *pool, size_t n, size_t grain) {
+  size_t nb = grain ? (n + grain - 1) / grain : 4 * (size_t)pool->num_workers;
+  return nb > n ? n : nb;
+}
+
+typedef struct {
+  size_t begin, n, nb;
+  size_t elem_size;
+  char *acc;  // nb accumulators
+  const void *identity;
+  void (*map)(size_t, size_t, void *, void *);
+  par_combine_fn combine;
+  void *ctx;
+  char *data;  // parallel_scan input/output
+} BlockJob;
+
+static inline size_t block_lo(BlockJob *b, size_t k) { return b->begin + b->n * k / b->nb; }
+
+// Element copies in the scan loop; fixed sizes compile to a single move.
+static inline void copy_elem(void *dst, const void *src, size_t size) {
+  switch (size) {
+    case 4: memcpy(dst, src, 4); break;
+    case 8: memcpy(dst, src, 8); break;
+    case 16: memcpy(dst, src, 16); break;
+    default: memcpy(dst, src, size);
+  }
+}
+
+static void reduce_blocks(size_t lo, size_t hi, void *arg) {
+  BlockJob *b = arg;
+  for (size_t k = lo; k < hi; k++) {
+    void *acc = b->acc + k * b->elem_size;
+    memcpy(acc, b->identity, b->elem_size);
+    b->map(block_lo(b, k), block_lo(b, k + 1), acc, b->ctx);
+  }
+}
+
+void parallel_reduce(ParPool *pool, size_t begin, size_t end, size_t grain,
+                     void (*map)(size_t lo, size_t hi, void *acc, void *ctx),
+                     par_combine_fn combine, const void *identity, size_t elem_size, void *ctx,
+                     void *result) {
+  memcpy(result, identity, elem_size);
+  if (begin >= end) return;
+  if (!pool) pool = par_default_pool();
+
+  BlockJob b = {begin, end - begin, block_count(pool, end - begin, grain), elem_size, NULL,
+                identity, map, combine, ctx, NULL};
+  b.acc = malloc(b.nb * elem_size);
+  parallel_for(pool, 0, b.nb, 1, reduce_blocks, &b);
+
+  for (size_t k = 0; k < b.nb; k++) combine(result, b.acc + k * elem_size, ctx);
+  free(b.acc);
+}
+
+static void scan_sum_blocks(size_t lo, size_t hi, void *arg) {
+  BlockJob *b = arg;
+  for (size_t k = lo; k < hi; k++) {
+    void *acc = b->acc + k * b->elem_size;
+    memcpy(acc, b->identity, b->elem_size);
+    for (size_t i = block_lo(b, k); i < block_lo(b, k + 1); i++) {
+      b->combine(acc, b->data + i * b->elem_size, b->ctx);
+    }
+  }
+}
+
+static void scan_apply_blocks(size_t lo, size_t hi, void *arg) {
+  BlockJob *b = arg;
+  for (size_t k = lo; k < hi; k++) {
+    void *acc = b->acc + k * b->elem_size;  // Holds the sum of all earlier blocks
+    for (size_t i = block_lo(b, k); i < block_lo(b, k + 1); i++) {
+      char *x = b->data + i * b->elem_size;
+      b->combine(acc, x, b->ctx);
+      copy_elem(x, acc, b->elem_size);
+    }
+  }
+}
+
+/*
+ * Two passes over the data: sum each block, turn the block sums into
+ * exclusive prefixes (sequentially; there are only a few), then rescan each
+ * block starting from its prefix.
+ */
+void parallel_scan(ParPool *pool, void *data, size_t n, size_t elem_size, par_combine_fn combine,
+                   const void *identity, void *ctx) {
+  if (n == 0) return;
+  if (!pool) pool = par_default_pool();
+
+  BlockJob b = {0, n, block_count(pool, n, 0), elem_size, NULL, identity, NULL, combine, ctx,
+                data};
+  b.acc = malloc(b.nb * elem_size);
+  parallel_for(pool, 0, b.nb, 1, scan_sum_blocks, &b);
+
+  char *running = malloc(elem_size);
+  char *tmp = malloc(elem_size);
+  memcpy(running, identity, elem_size);
+  for (size_t k = 0; k < b.nb; k++) {
+    char *acc = b.acc + k * elem_size;
+    memcpy(tmp, acc, elem_size);
+    memcpy(acc, running, elem_size);
+    combine(running, tmp, ctx);
+  }
+  free(running);
+  free(tmp);
+
+  parallel_for(pool, 0, b.nb, 1, scan_apply_blocks, &b);
+  free(b.acc);
+}
+
+/* ----------------------- parallel_sort ----------------------- */
+
+typedef struct {
+  ParPool *pool;
+  size_t size;
+  int (*cmp)(const void *, const void *, void *);
+  void *ctx;
+  size_t block;  // Leaf size for sorting and merging
+} SortJob;
+
+/*
+ * Run a(arg_a) here and b(arg_b) as a stealable task, then wait for both.
+ */
+static void fork2(ParPool *pool, void (*a)(void *, size_t, size_t), void *arg_a,
+                  void (*b)(void *, size_t, size_t), void *arg_b) {
+  Join j = {0};
+  spawn(pool, (Task){b, arg_b, 0, 0, &j});
+  a(arg_a, 0, 0);
+  join_wait(pool, &j);
+}
+
+typedef struct {
+  SortJob *job;
+  char *a, *b, *out;
+  size_t na, nb;
+} MergeFrame;
+
+/*
+ * First index in b[0..n) whose element is not less than x.
+ */
+static size_t lower_bound(SortJob *job, const char *b, size_t n, const void *x) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (job->cmp(b + mid * job->size, x, job->ctx) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void merge_task(void *arg, size_t lo, size_t hi) {
+  (void)lo, (void)hi;
+  MergeFrame *m = arg;
+  SortJob *job = m->job;
+  size_t sz = job->size;
+
+  if (m->na + m->nb <= job->block) {
+    size_t i = 0, j = 0, k = 0;
+    while (i < m->na && j < m->nb) {
+      if (job->cmp(m->b + j * sz, m->a + i * sz, job->ctx) < 0)
+        memcpy(m->out + k++ * sz, m->b + j++ * sz, sz);
+      else
+        memcpy(m->out + k++ * sz, m->a + i++ * sz, sz);
+    }
+    memcpy(m->out + k * sz, m->a + i * sz, (m->na - i) * sz);
+    k += m->na - i;
+    memcpy(m->out + k * sz, m->b + j * sz, (m->nb - j) * sz);
+    return;
+  }
+
+  // Split the larger run at its middle, find that element's place in the
+  // other run, and merge the two lower and two upper parts in parallel.
+  MergeFrame left = *m, right = *m;
+  if (m->na < m->nb) {
+    left.a = m->b, left.na = m->nb, left.b = m->a, left.nb = m->na;
+    right = left;
+  }
+  size_t ma = left.na / 2;
+  size_t mb = lower_bound(job, left.b, left.nb, left.a + ma * sz);
+  memcpy(m->out + (ma + mb) * sz, left.a + ma * sz, sz);
+
+  left.na = ma;
+  left.nb = mb;
+  right.a = left.a + (ma + 1) * sz;
+  right.na -= ma + 1;
+  right.b = left.b + mb * sz;
+  right.nb -= mb;
+  right.out = m->out + (ma + mb + 1) * sz;
+
+  fork2(job->pool, merge_task, &left, merge_task, &right);
+}
+
+typedef struct {
+  SortJob *job;
+  char *src, *buf;
+  size_t n;
+  int to_buf;  // Leave the result in buf rather than src
+} SortFrame;
+
+static void sort_task(void *arg, size_t lo, size_t hi) {
+  (void)lo, (void)hi;
+  SortFrame *s = arg;
+  SortJob *job = s->job;
+  size_t sz = job->size;
+
+  if (s->n <= job->block) {
+    qsort_r(s->src, s->n, sz, job->cmp, job->ctx);
+    if (s->to_buf) memcpy(s->buf, s->src, s->n * sz);
+    return;
+  }
+
+  // Sort both halves into the other buffer, then merge back into ours.
+  size_t half = s->n / 2;
+  SortFrame left = {job, s->src, s->buf, half, !s->to_buf};
+  SortFrame right = {job, s->src + half * sz, s->buf + half * sz, s->n - half, !s->to_buf};
+  fork2(job->pool, sort_task, &left, sort_task, &right);
+
+  char *from = s->to_buf ? s->src : s->buf;
+  char *to = s->to_buf ? s->buf : s->src;
+  MergeFrame m = {job, from, from + half * sz, to, half, s->n - half};
+  merge_task(&m, 0, 0);
+}
+
+void parallel_sort(ParPool *pool, void *base, size_t n, size_t size,
+                   int (*cmp)(const void *, const void *, void *), void *ctx) {
+  if (n < 2) return;
+  if (!pool) pool = par_default_pool();
+
+  SortJob job = {pool, size, cmp, ctx, n / (4 * (size_t)pool->num_workers)};
+  if (job.block < SORT_MIN_BLOCK) job.block = SORT_MIN_BLOCK;
+  if (n <= job.block) {
+    qsort_r(base, n, size, cmp, ctx);
+    return;
+  }
+
+  char *buf = malloc(n * size);
+  SortFrame root = {&job, base, buf, n, 0};
+  run_on_pool(pool, sort_task, &root, 0, 0);
+  free(buf);
+}
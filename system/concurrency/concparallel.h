@@ -0,0 +1,151 @@
+// Data-parallel algorithms on a work-stealing thread pool.
+//
+// parallel_for, parallel_reduce, parallel_scan and parallel_sort split their
+// input into tasks that run on a pool of workers with one deque each. A
+// worker pushes and pops its own tasks at the bottom of its deque (LIFO, cache
+// friendly) and steals from the top of other deques when it runs dry.
+//
+// Calls may be nested: a task can itself call parallel_for, and a worker
+// waiting for its subtasks runs other tasks instead of blocking.
+//
+// Every function takes a pool; NULL means the default pool, created on first
+// use with one worker per online CPU.
+//
+// From C++ the header also provides lambda-friendly templates in namespace
+// par (see the end of the file).
+//
+// Build:
+//   gcc -O2 -pthread your.c concparallel.c
+//   g++ -std=c++17 -O2 -pthread your.cpp concparallel.c   (compile the .c as C)
+#ifndef CONCPARALLEL_H
+#define CONCPARALLEL_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ParPool ParPool;
+
+// Creates a pool with num_threads workers (0 = number of online CPUs).
+ParPool *par_pool_create(int num_threads);
+
+// Stops the workers. No parallel call may be running on the pool.
+void par_pool_destroy(ParPool *pool);
+
+// Returns the pool used when NULL is passed.
+ParPool *par_default_pool(void);
+
+int par_pool_size(ParPool *pool);
+
+// body(lo, hi, ctx) processes the indices [lo, hi).
+typedef void (*par_range_fn)(size_t lo, size_t hi, void *ctx);
+
+// *acc = *acc (op) *x, for an associative op.
+typedef void (*par_combine_fn)(void *acc, const void *x, void *ctx);
+
+// Calls body on disjoint subranges covering [begin, end).
+//
+// grain is the smallest subrange worth running as a separate task; 0 picks
+// one from the range size. Splitting is adaptive: a worker only splits its
+// range while its own deque is empty, i.e. while other workers may be
+// looking for something to steal, and otherwise runs grain-sized chunks.
+void parallel_for(ParPool *pool, size_t begin, size_t end, size_t grain, par_range_fn body,
+                  void *ctx);
+
+// Folds [begin, end) into *result.
+//
+// The range is cut into blocks; each block starts from a copy of identity
+// and map(lo, hi, acc, ctx) folds its indices into acc. The block results
+// are then combined left to right, so op need not be commutative.
+// identity and result point to objects of elem_size bytes.
+void parallel_reduce(ParPool *pool, size_t begin, size_t end, size_t grain,
+                     void (*map)(size_t lo, size_t hi, void *acc, void *ctx),
+                     par_combine_fn combine, const void *identity, size_t elem_size, void *ctx,
+                     void *result);
+
+// Inclusive prefix scan of n elements of elem_size bytes in place:
+// data[i] = data[0] op ... op data[i].
+//
+// Two passes over the data with a combine call per element in each, so it
+// beats a sequential loop only for costly ops or with several cores.
+void parallel_scan(ParPool *pool, void *data, size_t n, size_t elem_size, par_combine_fn combine,
+                   const void *identity, void *ctx);
+
+// Sorts like qsort_r(3): a parallel merge sort whose leaves use qsort_r and
+// whose merges are themselves split in parallel. Not stable. Needs a
+// temporary buffer of n * size bytes.
+void parallel_sort(ParPool *pool, void *base, size_t n, size_t size,
+                   int (*cmp)(const void *, const void *, void *), void *ctx);
+
+#ifdef __cplusplus
+}  // extern "C"
+
+#include <functional>
+#include <type_traits>
+
+namespace par {
+
+// par::parallel_for(0, n, [&](size_t i) { ... });
+template <class F>
+void parallel_for(size_t begin, size_t end, F &&f, size_t grain = 0, ParPool *pool = nullptr) {
+  using Fn = std::remove_reference_t<F>;
+  auto thunk = [](size_t lo, size_t hi, void *ctx) {
+    Fn &fn = *static_cast<Fn *>(ctx);
+    for (size_t i = lo; i < hi; i++) fn(i);
+  };
+  ::parallel_for(pool, begin, end, grain, thunk, const_cast<void *>(static_cast<const void *>(&f)));
+}
+
+// par::parallel_reduce(0, n, 0L, [&](size_t i) { return v[i]; }, std::plus<long>());
+template <class T, class Map, class Op>
+T parallel_reduce(size_t begin, size_t end, T identity, Map map, Op op, size_t grain = 0,
+                  ParPool *pool = nullptr) {
+  static_assert(std::is_trivially_copyable<T>::value, "T is copied bytewise");
+  struct Ctx {
+    Map *map;
+    Op *op;
+  } ctx{&map, &op};
+  auto fold = [](size_t lo, size_t hi, void *acc, void *c) {
+    Ctx *x = static_cast<Ctx *>(c);
+    T &a = *static_cast<T *>(acc);
+    for (size_t i = lo; i < hi; i++) a = (*x->op)(a, (*x->map)(i));
+  };
+  auto combine = [](void *acc, const void *v, void *c) {
+    Ctx *x = static_cast<Ctx *>(c);
+    T &a = *static_cast<T *>(acc);
+    a = (*x->op)(a, *static_cast<const T *>(v));
+  };
+  T result;
+  ::parallel_reduce(pool, begin, end, grain, fold, combine, &identity, sizeof(T), &ctx, &result);
+  return result;
+}
+
+template <class T, class Op>
+void parallel_scan(T *data, size_t n, T identity, Op op, ParPool *pool = nullptr) {
+  static_assert(std::is_trivially_copyable<T>::value, "T is copied bytewise");
+  auto combine = [](void *acc, const void *v, void *c) {
+    T &a = *static_cast<T *>(acc);
+    a = (*static_cast<Op *>(c))(a, *static_cast<const T *>(v));
+  };
+  ::parallel_scan(pool, data, n, sizeof(T), combine, &identity, &op);
+}
+
+template <class T, class Cmp = std::less<T>>
+void parallel_sort(T *data, size_t n, Cmp cmp = Cmp(), ParPool *pool = nullptr) {
+  static_assert(std::is_trivially_copyable<T>::value, "T is moved bytewise");
+  auto thunk = [](const void *a, const void *b, void *c) {
+    Cmp &less = *static_cast<Cmp *>(c);
+    const T &x = *static_cast<const T *>(a);
+    const T &y = *static_cast<const T *>(b);
+    return less(x, y) ? -1 : less(y, x) ? 1 : 0;
+  };
+  ::parallel_sort(pool, data, n, sizeof(T), thunk, &cmp);
+}
+
+}  // namespace par
+
+#endif /* __cplusplus */
+
+#endif /* CONCPARALLEL_H */
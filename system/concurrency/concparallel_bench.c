@@ -0,0 +1,203 @@
+/*
+ * Benchmarks for concparallel.c against sequential code
+ *
+ *  1. parallel_for / parallel_reduce: the fibonacci vs exponential race of
+ *     concprim05.c, run for millions of (digit, base) pairs instead of one.
+ *  2. parallel_scan: prefix sums of a long array.
+ *  3. parallel_sort: against qsort(3) and the Lomuto quicksort from
+ *     dsalgs/sorting/quicksort.c.
+ *
+ * Every parallel result is checked against the sequential one.
+ *
+ * Compilation:
+ *   gcc -O2 -pthread concparallel_bench.c concparallel.c -o concparallel_bench
+ *
+ * Usage:
+ *   ./concparallel_bench [threads] [n]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "concparallel.h"
+
+static ParPool *pool;
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double seq, double par) {
+  printf("  %-28s seq %8.1f ms   par %8.1f ms   speedup %5.2fx\n", name, seq * 1e3, par * 1e3,
+         seq / par);
+}
+
+/* ----------------------- Fibonacci vs exponential ----------------------- */
+
+// Same loops as fibonacci() and exponential() in concprim05.c.
+static unsigned long fibonacci(unsigned int digit) {
+  unsigned long previous = 1, current = 1;
+  for (unsigned int i = 2; i < digit; i++) {
+    current += previous;
+    previous = current - previous;
+  }
+  return current;
+}
+
+static unsigned long exponential(unsigned int digit, double base) {
+  double result = 1;
+  for (unsigned int i = 1; i < digit; i++) result *= base;
+  return (unsigned long)result;
+}
+
+// Race i uses digit 2..91 and a base between 1.5 and 1.7.
+static int fib_wins(size_t i) {
+  unsigned int digit = 2 + i % 90;
+  double base = 1.5 + (double)(i % 2000) / 10000;
+  return fibonacci(digit) > exponential(digit, base);
+}
+
+static void race_body(size_t lo, size_t hi, void *ctx) {
+  char *wins = ctx;
+  for (size_t i = lo; i < hi; i++) wins[i] = fib_wins(i);
+}
+
+static void race_count(size_t lo, size_t hi, void *acc, void *ctx) {
+  (void)ctx;
+  for (size_t i = lo; i < hi; i++) *(long *)acc += fib_wins(i);
+}
+
+static void add_long(void *acc, const void *x, void *ctx) {
+  (void)ctx;
+  *(long *)acc += *(const long *)x;
+}
+
+static void bench_race(size_t n) {
+  char *seq_wins = malloc(n), *par_wins = malloc(n);
+
+  double t0 = now_sec();
+  for (size_t i = 0; i < n; i++) seq_wins[i] = fib_wins(i);
+  double t1 = now_sec();
+  parallel_for(pool, 0, n, 0, race_body, par_wins);
+  double t2 = now_sec();
+  report("parallel_for (races)", t1 - t0, t2 - t1);
+  if (memcmp(seq_wins, par_wins, n) != 0) printf("  MISMATCH in parallel_for\n");
+
+  long seq = 0, par = 0, zero = 0;
+  t0 = now_sec();
+  for (size_t i = 0; i < n; i++) seq += fib_wins(i);
+  t1 = now_sec();
+  parallel_reduce(pool, 0, n, 0, race_count, add_long, &zero, sizeof(long), NULL, &par);
+  t2 = now_sec();
+  report("parallel_reduce (wins)", t1 - t0, t2 - t1);
+  printf("  fibonacci wins %ld of %zu races%s\n", par, n, seq == par ? "" : "  MISMATCH");
+
+  free(seq_wins);
+  free(par_wins);
+}
+
+/* ----------------------- Prefix sums ----------------------- */
+
+static void bench_scan(size_t n) {
+  long *seq = malloc(n * sizeof(long)), *par = malloc(n * sizeof(long));
+  for (size_t i = 0; i < n; i++) seq[i] = par[i] = (long)(i * 2654435761u % 1000);
+
+  double t0 = now_sec();
+  for (size_t i = 1; i < n; i++) seq[i] += seq[i - 1];
+  double t1 = now_sec();
+  long zero = 0;
+  parallel_scan(pool, par, n, sizeof(long), add_long, &zero, NULL);
+  double t2 = now_sec();
+  report("parallel_scan (prefix sum)", t1 - t0, t2 - t1);
+  if (memcmp(seq, par, n * sizeof(long)) != 0) printf("  MISMATCH in parallel_scan\n");
+
+  free(seq);
+  free(par);
+}
+
+/* ----------------------- Sorting ----------------------- */
+
+// dsalgs/sorting/quicksort.c
+static void swap(int *a, int *b) {
+  int tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+static int partition(int arr[], int l, int r) {
+  int pivot = arr[r];
+  int i = l - 1;
+  for (int j = l; j <= r - 1; j++) {
+    if (arr[j] < pivot) {
+      i++;
+      swap(&arr[i], &arr[j]);
+    }
+  }
+  swap(&arr[i + 1], &arr[r]);
+  return i + 1;
+}
+
+static void quicksort(int arr[], int l, int r) {
+  if (l < r) {
+    int pi = partition(arr, l, r);
+    quicksort(arr, l, pi - 1);
+    quicksort(arr, pi + 1, r);
+  }
+}
+
+static int cmp_int(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+static int cmp_int_r(const void *a, const void *b, void *ctx) {
+  (void)ctx;
+  return cmp_int(a, b);
+}
+
+static void bench_sort(size_t n) {
+  int *orig = malloc(n * sizeof(int));
+  int *a = malloc(n * sizeof(int)), *b = malloc(n * sizeof(int));
+  srand(1);
+  for (size_t i = 0; i < n; i++) orig[i] = rand();
+
+  memcpy(a, orig, n * sizeof(int));
+  memcpy(b, orig, n * sizeof(int));
+  double t0 = now_sec();
+  qsort(a, n, sizeof(int), cmp_int);
+  double t1 = now_sec();
+  parallel_sort(pool, b, n, sizeof(int), cmp_int_r, NULL);
+  double t2 = now_sec();
+  double par = t2 - t1;
+  report("parallel_sort vs qsort", t1 - t0, par);
+  if (memcmp(a, b, n * sizeof(int)) != 0) printf("  MISMATCH in parallel_sort\n");
+
+  memcpy(a, orig, n * sizeof(int));
+  t0 = now_sec();
+  quicksort(a, 0, (int)n - 1);
+  t1 = now_sec();
+  report("parallel_sort vs quicksort", t1 - t0, par);
+  if (memcmp(a, b, n * sizeof(int)) != 0) printf("  MISMATCH against quicksort\n");
+
+  free(orig);
+  free(a);
+  free(b);
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 0;
+  size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : 4000000;
+
+  pool = par_pool_create(threads);
+  printf("%d workers, n = %zu\n", par_pool_size(pool), n);
+
+  bench_race(n);
+  bench_scan(4 * n);
+  bench_sort(n);
+
+  par_pool_destroy(pool);
+  return 0;
+}
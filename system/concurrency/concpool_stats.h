@@ -0,0 +1,234 @@
+/*
+ * Thread pool instrumentation, shared by concfuture_threadpool.c and
+ * concfuture_threadpool_atomics.c
+ *
+ * Each task is timestamped at submit, start and finish. From those the pool
+ * records, without locks:
+ *  - a histogram of queue wait (start - submit),
+ *  - a histogram of run time (finish - start),
+ *  - a histogram of queue depth seen by each submit,
+ *  - per-worker busy time and task count, giving utilization.
+ *
+ * Histograms are HDR-style log-linear: exact below 32, then 16 buckets per
+ * power of two, so any recorded value is reported within 1/16 (~6%). Every
+ * bucket is an atomic counter bumped with a relaxed fetch_add, so recording
+ * costs one clock read and a few uncontended atomics.
+ *
+ * pool_stats_print() writes a snapshot as text or JSON. Counters are read one
+ * by one while the pool keeps running, so a snapshot is not atomic as a
+ * whole, but every number in it is one that was true at some point.
+ *
+ * Header-only so each example stays a single-file build.
+ */
+#ifndef CONCPOOL_STATS_H
+#define CONCPOOL_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define STATS_MAX_WORKERS 256
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)  // Exact values below this
+#define HIST_HALF (HIST_SUB / 2)       // Buckets per power of two above it
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_HALF + HIST_HALF)
+
+static inline uint64_t stats_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ----------------------- Histogram ----------------------- */
+
+typedef struct {
+  atomic_ulong counts[HIST_BUCKETS];
+  atomic_ulong total;
+  atomic_ulong sum;
+  atomic_ulong max;
+} Histogram;
+
+static inline int hist_index(uint64_t v) {
+  if (v < HIST_SUB) return (int)v;
+  int e = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);  // v >> e is in [16, 32)
+  return e * HIST_HALF + (int)(v >> e);
+}
+
+// Largest value that lands in bucket i.
+static inline uint64_t hist_upper(int i) {
+  if (i < HIST_SUB) return i;
+  int e = i / HIST_HALF - 1;
+  uint64_t m = i % HIST_HALF + HIST_HALF;
+  return ((m + 1) << e) - 1;
+}
+
+static inline void hist_record(Histogram *h, uint64_t v) {
+  atomic_fetch_add_explicit(&h->counts[hist_index(v)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+  uint64_t m = atomic_load_explicit(&h->max, memory_order_relaxed);
+  while (v > m && !atomic_compare_exchange_weak_explicit(&h->max, &m, v, memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+  }
+}
+
+// Value at or below which `p` percent of the recorded values fall.
+static inline uint64_t hist_percentile(Histogram *h, double p) {
+  uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+  if (total == 0) return 0;
+  uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+      return hist_upper(i) < max ? hist_upper(i) : max;
+    }
+  }
+  return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+/* ----------------------- Pool statistics ----------------------- */
+
+typedef struct {
+  _Alignas(64) atomic_ulong busy_ns;
+  atomic_ulong tasks;
+} WorkerStats;
+
+typedef struct {
+  uint64_t created_ns;
+  atomic_int next_worker;
+
+  atomic_ulong submitted;
+  atomic_ulong started;
+  atomic_ulong completed;
+
+  Histogram wait_ns;  // submit -> start
+  Histogram run_ns;   // start -> finish
+  Histogram depth;    // Tasks queued (including this one) at submit
+
+  WorkerStats workers[STATS_MAX_WORKERS];
+} PoolStats;
+
+// Timestamps carried by each task.
+typedef struct {
+  uint64_t submit_ns;
+  uint64_t start_ns;
+  uint64_t finish_ns;
+} TaskTimes;
+
+typedef enum { STATS_TEXT, STATS_JSON } StatsFormat;
+
+// PoolStats is large (histograms); allocate it with the pool, not on a stack.
+static inline void pool_stats_init(PoolStats *s) {
+  memset(s, 0, sizeof(*s));
+  s->created_ns = stats_now_ns();
+}
+
+// Called once by each worker thread at startup.
+static inline int pool_stats_worker_id(PoolStats *s) {
+  int id = atomic_fetch_add(&s->next_worker, 1);
+  return id < STATS_MAX_WORKERS ? id : STATS_MAX_WORKERS - 1;
+}
+
+static inline void pool_stats_submit(PoolStats *s, TaskTimes *t) {
+  t->submit_ns = stats_now_ns();
+  uint64_t submitted = atomic_fetch_add_explicit(&s->submitted, 1, memory_order_relaxed) + 1;
+  uint64_t started = atomic_load_explicit(&s->started, memory_order_relaxed);
+  hist_record(&s->depth, submitted > started ? submitted - started : 0);
+}
+
+static inline void pool_stats_start(PoolStats *s, TaskTimes *t) {
+  t->start_ns = stats_now_ns();
+  atomic_fetch_add_explicit(&s->started, 1, memory_order_relaxed);
+  hist_record(&s->wait_ns, t->start_ns - t->submit_ns);
+}
+
+static inline void pool_stats_finish(PoolStats *s, int worker, TaskTimes *t) {
+  t->finish_ns = stats_now_ns();
+  uint64_t run = t->finish_ns - t->start_ns;
+  atomic_fetch_add_explicit(&s->completed, 1, memory_order_relaxed);
+  hist_record(&s->run_ns, run);
+  atomic_fetch_add_explicit(&s->workers[worker].busy_ns, run, memory_order_relaxed);
+  atomic_fetch_add_explicit(&s->workers[worker].tasks, 1, memory_order_relaxed);
+}
+
+static const double stats_percentiles[] = {50, 90, 99, 99.9};
+
+static inline void hist_print(FILE *out, const char *name, Histogram *h, double scale,
+                              StatsFormat fmt) {
+  uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+  double mean = total ? (double)atomic_load_explicit(&h->sum, memory_order_relaxed) / total : 0;
+  double max = (double)atomic_load_explicit(&h->max, memory_order_relaxed);
+
+  if (fmt == STATS_JSON) {
+    fprintf(out, "\"%s\": {\"count\": %lu, \"mean\": %.3f, \"max\": %.3f", name,
+            (unsigned long)total, mean / scale, max / scale);
+    for (size_t i = 0; i < sizeof(stats_percentiles) / sizeof(double); i++) {
+      fprintf(out, ", \"p%g\": %.3f", stats_percentiles[i],
+              hist_percentile(h, stats_percentiles[i]) / scale);
+    }
+    fprintf(out, "}");
+    return;
+  }
+
+  fprintf(out, "  %-12s n=%-8lu mean=%-10.3f", name, (unsigned long)total, mean / scale);
+  for (size_t i = 0; i < sizeof(stats_percentiles) / sizeof(double); i++) {
+    fprintf(out, " p%g=%-10.3f", stats_percentiles[i],
+            hist_percentile(h, stats_percentiles[i]) / scale);
+  }
+  fprintf(out, " max=%.3f\n", max / scale);
+}
+
+/*
+ * Write a snapshot of `s` to `out`. Times are in microseconds.
+ */
+static inline void pool_stats_print(PoolStats *s, FILE *out, StatsFormat fmt) {
+  uint64_t elapsed = stats_now_ns() - s->created_ns;
+  unsigned long submitted = atomic_load(&s->submitted);
+  unsigned long started = atomic_load(&s->started);
+  unsigned long completed = atomic_load(&s->completed);
+  int nworkers = atomic_load(&s->next_worker);
+  if (nworkers > STATS_MAX_WORKERS) nworkers = STATS_MAX_WORKERS;
+
+  if (fmt == STATS_JSON) {
+    fprintf(out, "{\"elapsed_us\": %.3f, \"submitted\": %lu, \"started\": %lu, ", elapsed / 1e3,
+            submitted, started);
+    fprintf(out, "\"completed\": %lu, \"queued\": %lu, ", completed,
+            submitted > started ? submitted - started : 0);
+    hist_print(out, "wait_us", &s->wait_ns, 1e3, fmt);
+    fprintf(out, ", ");
+    hist_print(out, "run_us", &s->run_ns, 1e3, fmt);
+    fprintf(out, ", ");
+    hist_print(out, "queue_depth", &s->depth, 1, fmt);
+    fprintf(out, ", \"workers\": [");
+    for (int i = 0; i < nworkers; i++) {
+      uint64_t busy = atomic_load(&s->workers[i].busy_ns);
+      fprintf(out, "%s{\"tasks\": %lu, \"busy_us\": %.3f, \"utilization\": %.4f}", i ? ", " : "",
+              (unsigned long)atomic_load(&s->workers[i].tasks), busy / 1e3,
+              elapsed ? (double)busy / elapsed : 0);
+    }
+    fprintf(out, "]}\n");
+    return;
+  }
+
+  fprintf(out, "pool stats after %.3f s: submitted %lu, started %lu, completed %lu, queued %lu\n",
+          elapsed / 1e9, submitted, started, completed,
+          submitted > started ? submitted - started : 0);
+  hist_print(out, "wait (us)", &s->wait_ns, 1e3, fmt);
+  hist_print(out, "run (us)", &s->run_ns, 1e3, fmt);
+  hist_print(out, "queue depth", &s->depth, 1, fmt);
+  for (int i = 0; i < nworkers; i++) {
+    uint64_t busy = atomic_load(&s->workers[i].busy_ns);
+    fprintf(out, "  worker %-3d tasks=%-8lu utilization=%5.1f%%\n", i,
+            (unsigned long)atomic_load(&s->workers[i].tasks),
+            elapsed ? 100.0 * busy / elapsed : 0);
+  }
+}
+
+#endif /* CONCPOOL_STATS_H */
@@ -0,0 +1,383 @@
+/*
+ * ============================================================
+ * Scalable Reader-Writer Lock and Seqlock (C11 atomics / futex)
+ * ============================================================
+ *
+ * conclightswitch.c builds a readers-writers lock out of a mutex-protected
+ * counter and a semaphore. Every reader takes the same mutex twice, so the
+ * cache line holding it bounces between all CPUs, and a steady stream of
+ * readers keeps the counter above zero forever: writers starve.
+ *
+ * This program shows two alternatives for read-mostly data.
+ *
+ * 1. rwlock_t – sharded reader counters with writer preference
+ *  - Each thread is assigned one of RW_SHARDS reader slots. Slots live on
+ *    their own cache line, so readers on different CPUs never touch the same
+ *    line.
+ *  - A writer raises `writer_pending`; new readers see it and park on a
+ *    futex instead of entering (writer preference: no starvation).
+ *  - The writer then waits for every slot to drain to zero, parking on the
+ *    slot's futex word. The last reader leaving a slot wakes it.
+ *  - Reader fast path: one atomic increment on a private cache line plus one
+ *    load of a line that is only written by writers.
+ *
+ * 2. seqlock_t – for tiny records (a few words)
+ *  - Readers never write shared memory at all. They read a sequence number,
+ *    copy the data, and retry if the sequence changed or was odd (writer
+ *    in progress).
+ *  - Writers bump the sequence to odd, write, then bump it back to even.
+ *
+ * The main function benchmarks the LightSwitch pattern against both.
+ *
+ * Compilation:
+ *   gcc concrwlock.c -O2 -pthread -o concrwlock
+ *
+ * ============================================================
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+#define RW_SHARDS 16
+
+#define NUM_READERS 4
+#define READS_PER_THREAD 2000000
+#define NUM_WRITES 200
+
+static inline int futex_wait(atomic_int *futex, int expected) {
+  return syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static inline int futex_wake(atomic_int *futex, int count) {
+  return syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* ------------------------------------------------------------
+ * Futex mutex used to serialize writers
+ * ------------------------------------------------------------
+ * value: 0 = unlocked, 1 = locked, 2 = locked with waiters
+ */
+typedef struct {
+  atomic_int value;
+} futex_mutex_t;
+
+void futex_mutex_init(futex_mutex_t *m) { atomic_store(&m->value, 0); }
+
+void futex_mutex_lock(futex_mutex_t *m) {
+  int c = 0;
+  if (atomic_compare_exchange_strong(&m->value, &c, 1)) return;
+
+  // Contended: mark the lock as "has waiters" and sleep until released.
+  if (c != 2) c = atomic_exchange(&m->value, 2);
+  while (c != 0) {
+    futex_wait(&m->value, 2);
+    c = atomic_exchange(&m->value, 2);
+  }
+}
+
+void futex_mutex_unlock(futex_mutex_t *m) {
+  if (atomic_exchange(&m->value, 0) == 2) {
+    futex_wake(&m->value, 1);
+  }
+}
+
+/* ------------------------------------------------------------
+ * Sharded reader-writer lock
+ * ------------------------------------------------------------
+ * slots          : per-shard reader counts, one cache line each
+ * writer_pending : 1 while a writer holds or is acquiring the lock
+ * writer_mutex   : serializes writers among themselves
+ */
+typedef struct {
+  _Alignas(CACHE_LINE) atomic_int readers;
+  char pad[CACHE_LINE - sizeof(atomic_int)];
+} rw_slot_t;
+
+typedef struct {
+  rw_slot_t slots[RW_SHARDS];
+  _Alignas(CACHE_LINE) atomic_int writer_pending;
+  futex_mutex_t writer_mutex;
+} rwlock_t;
+
+/*
+ * Each thread picks its slot once, round-robin. Using a per-thread slot rather
+ * than sched_getcpu() keeps lock/unlock on the same slot even if the thread
+ * migrates while holding the lock.
+ */
+static atomic_int next_slot = 0;
+static _Thread_local int my_slot = -1;
+
+static inline rw_slot_t *rwlock_slot(rwlock_t *rw) {
+  if (my_slot < 0) {
+    my_slot = atomic_fetch_add_explicit(&next_slot, 1, memory_order_relaxed) % RW_SHARDS;
+  }
+  return &rw->slots[my_slot];
+}
+
+void rwlock_init(rwlock_t *rw) {
+  for (int i = 0; i < RW_SHARDS; i++) atomic_store(&rw->slots[i].readers, 0);
+  atomic_store(&rw->writer_pending, 0);
+  futex_mutex_init(&rw->writer_mutex);
+}
+
+/*
+ * rwlock_rdlock
+ * ------------------------------------------------------------
+ * Announce ourselves in our slot, then check for a writer. Both operations
+ * are seq_cst, pairing with the writer's store/loads below (Dekker style):
+ * either the writer sees our increment, or we see its flag.
+ */
+void rwlock_rdlock(rwlock_t *rw) {
+  rw_slot_t *slot = rwlock_slot(rw);
+
+  while (1) {
+    atomic_fetch_add(&slot->readers, 1);
+    if (!atomic_load(&rw->writer_pending)) return;  // fast path
+
+    // A writer is pending: back out, let it run, and wait for it to finish.
+    if (atomic_fetch_sub(&slot->readers, 1) == 1) {
+      futex_wake(&slot->readers, 1);
+    }
+    while (atomic_load(&rw->writer_pending)) {
+      futex_wait(&rw->writer_pending, 1);
+    }
+  }
+}
+
+void rwlock_rdunlock(rwlock_t *rw) {
+  rw_slot_t *slot = rwlock_slot(rw);
+
+  // The last reader in this slot wakes a writer that is draining it.
+  if (atomic_fetch_sub(&slot->readers, 1) == 1 && atomic_load(&rw->writer_pending)) {
+    futex_wake(&slot->readers, 1);
+  }
+}
+
+/*
+ * rwlock_wrlock
+ * ------------------------------------------------------------
+ * Block new readers, then wait until every slot has drained.
+ */
+void rwlock_wrlock(rwlock_t *rw) {
+  futex_mutex_lock(&rw->writer_mutex);
+  atomic_store(&rw->writer_pending, 1);
+
+  for (int i = 0; i < RW_SHARDS; i++) {
+    int n;
+    while ((n = atomic_load(&rw->slots[i].readers)) != 0) {
+      futex_wait(&rw->slots[i].readers, n);
+    }
+  }
+}
+
+void rwlock_wrunlock(rwlock_t *rw) {
+  atomic_store(&rw->writer_pending, 0);
+  futex_wake(&rw->writer_pending, INT_MAX);  // release parked readers
+  futex_mutex_unlock(&rw->writer_mutex);
+}
+
+/* ------------------------------------------------------------
+ * Seqlock
+ * ------------------------------------------------------------
+ * seq  : even = stable, odd = write in progress
+ * data : protected words, accessed with relaxed atomics so that a
+ *        reader racing with a writer is well-defined (it just retries)
+ */
+#define SEQ_WORDS 4
+
+typedef struct {
+  atomic_uint seq;
+  futex_mutex_t writer_mutex;
+  atomic_ulong data[SEQ_WORDS];
+} seqlock_t;
+
+void seqlock_init(seqlock_t *sl) {
+  atomic_store(&sl->seq, 0);
+  futex_mutex_init(&sl->writer_mutex);
+  for (int i = 0; i < SEQ_WORDS; i++) atomic_store(&sl->data[i], 0);
+}
+
+void seqlock_read(seqlock_t *sl, unsigned long out[SEQ_WORDS]) {
+  unsigned s0, s1;
+  do {
+    s0 = atomic_load_explicit(&sl->seq, memory_order_acquire);
+    for (int i = 0; i < SEQ_WORDS; i++) {
+      out[i] = atomic_load_explicit(&sl->data[i], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    s1 = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+  } while ((s0 & 1) || s0 != s1);
+}
+
+void seqlock_write(seqlock_t *sl, const unsigned long in[SEQ_WORDS]) {
+  futex_mutex_lock(&sl->writer_mutex);
+
+  unsigned s = atomic_load_explicit(&sl->seq, memory_order_relaxed);
+  atomic_store_explicit(&sl->seq, s + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (int i = 0; i < SEQ_WORDS; i++) {
+    atomic_store_explicit(&sl->data[i], in[i], memory_order_relaxed);
+  }
+  atomic_store_explicit(&sl->seq, s + 2, memory_order_release);
+
+  futex_mutex_unlock(&sl->writer_mutex);
+}
+
+/* ------------------------------------------------------------
+ * LightSwitch baseline (same as conclightswitch.c)
+ * ------------------------------------------------------------
+ */
+typedef struct {
+  int counter;
+  pthread_mutex_t mutex;
+} LightSwitch;
+
+void lightswitch_init(LightSwitch *ls) {
+  ls->counter = 0;
+  pthread_mutex_init(&ls->mutex, NULL);
+}
+
+void lightswitch_lock(LightSwitch *ls, sem_t *shared) {
+  pthread_mutex_lock(&ls->mutex);
+  if (++ls->counter == 1) sem_wait(shared);
+  pthread_mutex_unlock(&ls->mutex);
+}
+
+void lightswitch_unlock(LightSwitch *ls, sem_t *shared) {
+  pthread_mutex_lock(&ls->mutex);
+  if (--ls->counter == 0) sem_post(shared);
+  pthread_mutex_unlock(&ls->mutex);
+}
+
+/* ------------------------------------------------------------
+ * Benchmark
+ * ------------------------------------------------------------
+ * The protected "routing entry" holds {version, 2*version, 3*version,
+ * 4*version}. A reader that ever observes a mix of two versions has found a
+ * bug in the lock.
+ */
+typedef enum { MODE_LIGHTSWITCH, MODE_RWLOCK, MODE_SEQLOCK } Mode;
+
+static const char *mode_names[] = {"lightswitch", "rwlock", "seqlock"};
+
+Mode mode;
+sem_t roomEmpty;
+LightSwitch readSwitch;
+rwlock_t rwlock;
+seqlock_t seqlock;
+unsigned long entry[SEQ_WORDS];  // protected by lightswitch / rwlock
+
+atomic_int readers_done;
+atomic_long torn_reads;
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int consistent(const unsigned long e[SEQ_WORDS]) {
+  for (int i = 1; i < SEQ_WORDS; i++) {
+    if (e[i] != e[0] * (i + 1)) return 0;
+  }
+  return 1;
+}
+
+void *reader(void *arg) {
+  (void)arg;
+  unsigned long copy[SEQ_WORDS];
+
+  for (int n = 0; n < READS_PER_THREAD; n++) {
+    switch (mode) {
+      case MODE_LIGHTSWITCH:
+        lightswitch_lock(&readSwitch, &roomEmpty);
+        for (int i = 0; i < SEQ_WORDS; i++) copy[i] = entry[i];
+        lightswitch_unlock(&readSwitch, &roomEmpty);
+        break;
+      case MODE_RWLOCK:
+        rwlock_rdlock(&rwlock);
+        for (int i = 0; i < SEQ_WORDS; i++) copy[i] = entry[i];
+        rwlock_rdunlock(&rwlock);
+        break;
+      case MODE_SEQLOCK:
+        seqlock_read(&seqlock, copy);
+        break;
+    }
+    if (!consistent(copy)) atomic_fetch_add(&torn_reads, 1);
+  }
+
+  atomic_fetch_add(&readers_done, 1);
+  return NULL;
+}
+
+void *writer(void *arg) {
+  (void)arg;
+  unsigned long next[SEQ_WORDS];
+
+  // Keep writing (with a pause) until readers finish, at least NUM_WRITES times.
+  for (unsigned long v = 1; v <= NUM_WRITES || atomic_load(&readers_done) < NUM_READERS; v++) {
+    for (int i = 0; i < SEQ_WORDS; i++) next[i] = v * (i + 1);
+
+    switch (mode) {
+      case MODE_LIGHTSWITCH:
+        sem_wait(&roomEmpty);
+        for (int i = 0; i < SEQ_WORDS; i++) entry[i] = next[i];
+        sem_post(&roomEmpty);
+        break;
+      case MODE_RWLOCK:
+        rwlock_wrlock(&rwlock);
+        for (int i = 0; i < SEQ_WORDS; i++) entry[i] = next[i];
+        rwlock_wrunlock(&rwlock);
+        break;
+      case MODE_SEQLOCK:
+        seqlock_write(&seqlock, next);
+        break;
+    }
+    usleep(100);
+  }
+  return NULL;
+}
+
+static void run(Mode m) {
+  pthread_t readers[NUM_READERS], w;
+
+  mode = m;
+  atomic_store(&readers_done, 0);
+  atomic_store(&torn_reads, 0);
+  for (int i = 0; i < SEQ_WORDS; i++) entry[i] = 0;
+  sem_init(&roomEmpty, 0, 1);
+  lightswitch_init(&readSwitch);
+  rwlock_init(&rwlock);
+  seqlock_init(&seqlock);
+
+  double start = now_sec();
+  for (int i = 0; i < NUM_READERS; i++) pthread_create(&readers[i], NULL, reader, NULL);
+  pthread_create(&w, NULL, writer, NULL);
+  for (int i = 0; i < NUM_READERS; i++) pthread_join(readers[i], NULL);
+  double elapsed = now_sec() - start;
+  pthread_join(w, NULL);
+
+  printf("%-12s %8.2f Mreads/s  torn reads: %ld\n", mode_names[m],
+         NUM_READERS * (double)READS_PER_THREAD / elapsed / 1e6, atomic_load(&torn_reads));
+
+  sem_destroy(&roomEmpty);
+  pthread_mutex_destroy(&readSwitch.mutex);
+}
+
+int main(void) {
+  printf("%d readers x %d reads, 1 writer\n", NUM_READERS, READS_PER_THREAD);
+  run(MODE_LIGHTSWITCH);
+  run(MODE_RWLOCK);
+  run(MODE_SEQLOCK);
+  return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * Sharded counters and statistics
+ *
+ * A counter that every thread bumps with atomic_fetch_add (atomicex0*.c,
+ * concspinlock.c's counter, concprim01.c's globalVar) is one cache line that
+ * all cores fight over: each increment has to pull the line in exclusive
+ * state, so throughput drops as threads are added.
+ *
+ * Here each object is split into cache-line-padded slots. A thread is given
+ * a slot index the first time it touches any sharded object (round robin),
+ * and only ever updates that slot, so with at least as many slots as running
+ * threads no line is shared between writers. Reads visit every slot.
+ *
+ *  - ShardedCounter: add() is an uncontended fetch_add on the caller's slot.
+ *    Once a slot's delta reaches +-batch it is folded into a central total,
+ *    so shard_counter_read_approx() is a single load that is off by at most
+ *    slots * batch. shard_counter_read_exact() adds up the slots as well.
+ *  - ShardedStat: count, sum, min and max of recorded values.
+ *  - ShardedHist: the log-linear histogram of concpool_stats.h, one per slot,
+ *    merged into a single Histogram on snapshot.
+ *
+ * Header-only so each demo and server stays a single-file build.
+ */
+#ifndef CONCSHARD_H
+#define CONCSHARD_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "concpool_stats.h"  // Histogram, hist_index
+
+#define SHARD_CACHE_LINE 64
+#define SHARD_MAX_SLOTS 256
+
+static atomic_uint shard_next_slot;
+static _Thread_local int shard_slot_plus1;  // 0 = not assigned yet
+
+static inline unsigned shard_thread_slot(void) {
+  if (!shard_slot_plus1) shard_slot_plus1 = atomic_fetch_add(&shard_next_slot, 1) + 1;
+  return shard_slot_plus1 - 1;
+}
+
+// Default slot count: the next power of two >= online CPUs.
+static inline int shard_default_slots(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = 1;
+  while (n < cpus && n < SHARD_MAX_SLOTS) n *= 2;
+  return n;
+}
+
+static inline void *shard_alloc(size_t size) {
+  size = (size + SHARD_CACHE_LINE - 1) / SHARD_CACHE_LINE * SHARD_CACHE_LINE;
+  void *p = aligned_alloc(SHARD_CACHE_LINE, size);
+  memset(p, 0, size);
+  return p;
+}
+
+/* ----------------------- Counter ----------------------- */
+
+typedef struct {
+  _Alignas(SHARD_CACHE_LINE) atomic_long delta;
+} CounterSlot;
+
+typedef struct {
+  _Alignas(SHARD_CACHE_LINE) atomic_long total;  // Folded deltas
+  atomic_ulong folds;                            // Folds started (see read_exact)
+  atomic_ulong folds_done;
+  long batch;
+  unsigned mask;
+  CounterSlot *slots;
+} ShardedCounter;
+
+/*
+ * batch: how far a slot may drift before it is folded into the total.
+ * slots: 0 for shard_default_slots(); rounded up to a power of two.
+ */
+static inline ShardedCounter *shard_counter_create(long batch, int slots) {
+  int n = 1;
+  while (n < (slots > 0 ? slots : shard_default_slots())) n *= 2;
+  ShardedCounter *c = shard_alloc(sizeof(ShardedCounter));
+  c->batch = batch > 0 ? batch : 1;
+  c->mask = n - 1;
+  c->slots = shard_alloc(sizeof(CounterSlot) * n);
+  return c;
+}
+
+static inline void shard_counter_destroy(ShardedCounter *c) {
+  free(c->slots);
+  free(c);
+}
+
+static inline void shard_counter_add(ShardedCounter *c, long v) {
+  CounterSlot *s = &c->slots[shard_thread_slot() & c->mask];
+  long d = atomic_fetch_add_explicit(&s->delta, v, memory_order_relaxed) + v;
+  if (d >= c->batch || d <= -c->batch) {
+    // Move d from the slot to the total. d leaves the slot before it reaches
+    // the total, so a read_exact() overlapping the fold can miss d but never
+    // count it twice; it retries to avoid missing it.
+    atomic_fetch_add(&c->folds, 1);
+    atomic_fetch_sub(&s->delta, d);
+    atomic_fetch_add(&c->total, d);
+    atomic_fetch_add(&c->folds_done, 1);
+  }
+}
+
+// O(1); within (slots * batch) of the true value.
+static inline long shard_counter_read_approx(ShardedCounter *c) {
+  return atomic_load_explicit(&c->total, memory_order_relaxed);
+}
+
+/*
+ * O(slots). Includes every add that finished before the call. Retries while
+ * folds are in flight; after a few tries it accepts the last sum, which can
+ * then be short by the folds that overlapped it (never more than the true
+ * value). The total is read before the slots, which is what makes that hold
+ * given the order of a fold.
+ */
+static inline long shard_counter_read_exact(ShardedCounter *c) {
+  long sum = 0;
+  for (int attempt = 0; attempt < 16; attempt++) {
+    unsigned long done = atomic_load(&c->folds_done);
+    int quiet = atomic_load(&c->folds) == done;
+    sum = atomic_load(&c->total);
+    for (unsigned i = 0; i <= c->mask; i++) sum += atomic_load(&c->slots[i].delta);
+    if (quiet && atomic_load(&c->folds) == done) break;
+  }
+  return sum;
+}
+
+/* ----------------------- Count / sum / min / max ----------------------- */
+
+typedef struct {
+  _Alignas(SHARD_CACHE_LINE) atomic_long count;
+  atomic_long sum;
+  atomic_long min;
+  atomic_long max;
+} StatSlot;
+
+typedef struct {
+  unsigned mask;
+  StatSlot *slots;
+} ShardedStat;
+
+typedef struct {
+  long count;
+  long sum;
+  long min;
+  long max;
+  double mean;
+} StatSnapshot;
+
+static inline ShardedStat *shard_stat_create(int slots) {
+  int n = 1;
+  while (n < (slots > 0 ? slots : shard_default_slots())) n *= 2;
+  ShardedStat *s = shard_alloc(sizeof(ShardedStat));
+  s->mask = n - 1;
+  s->slots = shard_alloc(sizeof(StatSlot) * n);
+  for (int i = 0; i < n; i++) {
+    atomic_init(&s->slots[i].min, LONG_MAX);
+    atomic_init(&s->slots[i].max, LONG_MIN);
+  }
+  return s;
+}
+
+static inline void shard_stat_destroy(ShardedStat *s) {
+  free(s->slots);
+  free(s);
+}
+
+static inline void shard_stat_record(ShardedStat *s, long v) {
+  StatSlot *slot = &s->slots[shard_thread_slot() & s->mask];
+  atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&slot->sum, v, memory_order_relaxed);
+  long m = atomic_load_explicit(&slot->min, memory_order_relaxed);
+  while (v < m && !atomic_compare_exchange_weak_explicit(&slot->min, &m, v, memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+  }
+  m = atomic_load_explicit(&slot->max, memory_order_relaxed);
+  while (v > m && !atomic_compare_exchange_weak_explicit(&slot->max, &m, v, memory_order_relaxed,
+                                                         memory_order_relaxed)) {
+  }
+}
+
+// Fields are read slot by slot, so under concurrent updates count and sum
+// may be from slightly different moments.
+static inline StatSnapshot shard_stat_snapshot(ShardedStat *s) {
+  StatSnapshot out = {0, 0, LONG_MAX, LONG_MIN, 0};
+  for (unsigned i = 0; i <= s->mask; i++) {
+    StatSlot *slot = &s->slots[i];
+    out.count += atomic_load_explicit(&slot->count, memory_order_relaxed);
+    out.sum += atomic_load_explicit(&slot->sum, memory_order_relaxed);
+    long mn = atomic_load_explicit(&slot->min, memory_order_relaxed);
+    long mx = atomic_load_explicit(&slot->max, memory_order_relaxed);
+    if (mn < out.min) out.min = mn;
+    if (mx > out.max) out.max = mx;
+  }
+  if (out.count == 0) out.min = out.max = 0;
+  out.mean = out.count ? (double)out.sum / out.count : 0;
+  return out;
+}
+
+/* ----------------------- Histogram ----------------------- */
+
+typedef struct {
+  _Alignas(SHARD_CACHE_LINE) Histogram h;
+} HistSlot;
+
+typedef struct {
+  unsigned mask;
+  HistSlot *slots;
+} ShardedHist;
+
+static inline ShardedHist *shard_hist_create(int slots) {
+  int n = 1;
+  while (n < (slots > 0 ? slots : shard_default_slots())) n *= 2;
+  ShardedHist *h = shard_alloc(sizeof(ShardedHist));
+  h->mask = n - 1;
+  h->slots = shard_alloc(sizeof(HistSlot) * n);
+  return h;
+}
+
+static inline void shard_hist_destroy(ShardedHist *h) {
+  free(h->slots);
+  free(h);
+}
+
+static inline void shard_hist_record(ShardedHist *h, uint64_t v) {
+  hist_record(&h->slots[shard_thread_slot() & h->mask].h, v);
+}
+
+/*
+ * Merge all slots into `out` (zeroed first). Use hist_percentile() and
+ * hist_print() from concpool_stats.h on the result.
+ */
+static inline void shard_hist_snapshot(ShardedHist *h, Histogram *out) {
+  memset(out, 0, sizeof(*out));
+  uint64_t max = 0;
+  for (unsigned i = 0; i <= h->mask; i++) {
+    Histogram *s = &h->slots[i].h;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+      uint64_t n = atomic_load_explicit(&s->counts[b], memory_order_relaxed);
+      if (n) atomic_fetch_add_explicit(&out->counts[b], n, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&out->total, atomic_load(&s->total), memory_order_relaxed);
+    atomic_fetch_add_explicit(&out->sum, atomic_load(&s->sum), memory_order_relaxed);
+    uint64_t m = atomic_load_explicit(&s->max, memory_order_relaxed);
+    if (m > max) max = m;
+  }
+  atomic_store(&out->max, max);
+}
+
+#endif /* CONCSHARD_H */
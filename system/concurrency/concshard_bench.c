@@ -0,0 +1,223 @@
+/*
+ * Shared counter vs sharded counter
+ *
+ * Every thread adds 1 to a counter `iters` times, using:
+ *  1. a pthread mutex around a plain long (concprim01.c's globalVar),
+ *  2. the spinlock_t of concspinlock.c (test-and-set, usleep(10) backoff),
+ *  3. a single atomic_long with fetch_add (atomicex0*.c),
+ *  4. a ShardedCounter from concshard.h.
+ *
+ * The final value is checked in each case. For the sharded counter a reader
+ * thread also polls both read functions while the writers run, showing how
+ * far the O(1) approximate read lags the exact one. A second sharded run with
+ * batch 1 and few slots keeps folds in flight all the time, and checks that
+ * exact reads taken meanwhile stay between the approximate value read just
+ * before and the final count.
+ *
+ * Finally ShardedStat and ShardedHist record per-operation latencies from
+ * every thread and print a merged summary.
+ *
+ * Compilation:
+ *   gcc -O2 -pthread concshard_bench.c -o concshard_bench
+ *
+ * Usage:
+ *   ./concshard_bench [threads] [iters]
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "concshard.h"
+
+static int nthreads;
+static long iters;
+
+static double now_sec(void) { return stats_now_ns() / 1e9; }
+
+/* ----------------------- Contenders ----------------------- */
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static long mutex_counter;
+
+static void *mutex_worker(void *arg) {
+  (void)arg;
+  for (long i = 0; i < iters; i++) {
+    pthread_mutex_lock(&mutex);
+    mutex_counter++;
+    pthread_mutex_unlock(&mutex);
+  }
+  return NULL;
+}
+
+// concspinlock.c
+typedef struct {
+  atomic_flag lock;
+} spinlock_t;
+
+static spinlock_t spin = {ATOMIC_FLAG_INIT};
+static long spin_counter;
+
+static void spinlock_lock(spinlock_t *lock) {
+  while (atomic_flag_test_and_set(&lock->lock)) {
+    usleep(10);
+  }
+}
+
+static void spinlock_unlock(spinlock_t *lock) { atomic_flag_clear(&lock->lock); }
+
+static void *spin_worker(void *arg) {
+  (void)arg;
+  for (long i = 0; i < iters; i++) {
+    spinlock_lock(&spin);
+    spin_counter++;
+    spinlock_unlock(&spin);
+  }
+  return NULL;
+}
+
+static atomic_long atomic_counter;
+
+static void *atomic_worker(void *arg) {
+  (void)arg;
+  for (long i = 0; i < iters; i++) atomic_fetch_add(&atomic_counter, 1);
+  return NULL;
+}
+
+static ShardedCounter *sharded;
+
+static void *sharded_worker(void *arg) {
+  (void)arg;
+  for (long i = 0; i < iters; i++) shard_counter_add(sharded, 1);
+  return NULL;
+}
+
+/* ----------------------- Driver ----------------------- */
+
+static atomic_int writers_done;
+static long max_lag;
+static long polls;
+
+// Polls the sharded counter while the writers run.
+static void *reader(void *arg) {
+  (void)arg;
+  while (!atomic_load(&writers_done)) {
+    long approx = shard_counter_read_approx(sharded);
+    long exact = shard_counter_read_exact(sharded);
+    if (exact - approx > max_lag) max_lag = exact - approx;
+    polls++;
+    usleep(100);
+  }
+  return NULL;
+}
+
+// Reads taken while folds run constantly: each must be at least the total
+// read just before it, and none may exceed the final count (checked after).
+static long fold_reads;
+static long fold_bad;
+static long fold_max;
+
+static void *fold_reader(void *arg) {
+  (void)arg;
+  while (!atomic_load(&writers_done)) {
+    long before = shard_counter_read_approx(sharded);
+    long exact = shard_counter_read_exact(sharded);
+    if (exact < before || (before > 0 && exact == 0)) fold_bad++;
+    if (exact > fold_max) fold_max = exact;
+    fold_reads++;
+  }
+  return NULL;
+}
+
+static double run(void *(*worker)(void *), int with_reader) {
+  pthread_t threads[nthreads], rd;
+  atomic_store(&writers_done, 0);
+  if (with_reader) pthread_create(&rd, NULL, with_reader == 2 ? fold_reader : reader, NULL);
+
+  double t0 = now_sec();
+  for (int i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL)) {
+      perror("pthread_create failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+  double elapsed = now_sec() - t0;
+
+  atomic_store(&writers_done, 1);
+  if (with_reader) pthread_join(rd, NULL);
+  return elapsed;
+}
+
+static void report(const char *name, double elapsed, long value) {
+  long expected = nthreads * iters;
+  printf("  %-20s %8.1f ms  %7.1f Mops/s  value %ld%s\n", name, elapsed * 1e3,
+         expected / elapsed / 1e6, value, value == expected ? "" : "  WRONG");
+}
+
+/* ----------------------- Statistics ----------------------- */
+
+static ShardedStat *stat;
+static ShardedHist *hist;
+
+// Times batches of 100 sharded adds and records each batch.
+static void *latency_worker(void *arg) {
+  (void)arg;
+  for (long i = 0; i < iters / 100; i++) {
+    uint64_t t0 = stats_now_ns();
+    for (int j = 0; j < 100; j++) shard_counter_add(sharded, 1);
+    uint64_t ns = stats_now_ns() - t0;
+    shard_stat_record(stat, (long)ns);
+    shard_hist_record(hist, ns);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  nthreads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  iters = argc > 2 ? atol(argv[2]) : 1000000;
+  if (nthreads < 1) nthreads = 1;
+
+  sharded = shard_counter_create(1024, 0);
+  printf("%d threads x %ld increments, %u counter slots\n", nthreads, iters, sharded->mask + 1);
+
+  double t = run(mutex_worker, 0);
+  report("mutex", t, mutex_counter);
+  t = run(spin_worker, 0);
+  report("spinlock", t, spin_counter);
+  t = run(atomic_worker, 0);
+  report("atomic fetch_add", t, atomic_load(&atomic_counter));
+  t = run(sharded_worker, 1);
+  report("sharded", t, shard_counter_read_exact(sharded));
+  printf("  approx read after join: %ld (exact %ld); worst lag seen in %ld polls: %ld\n",
+         shard_counter_read_approx(sharded), shard_counter_read_exact(sharded), polls, max_lag);
+  shard_counter_destroy(sharded);
+
+  // Every add folds; 4 slots are shared by the writers.
+  sharded = shard_counter_create(1, 4);
+  t = run(sharded_worker, 2);
+  long final = shard_counter_read_exact(sharded);
+  report("sharded, batch 1", t, final);
+  printf("  %ld exact reads during folds: %ld below the total, max %ld%s\n", fold_reads,
+         fold_bad, fold_max, fold_bad == 0 && fold_max <= final ? "" : "  WRONG");
+  shard_counter_destroy(sharded);
+  sharded = shard_counter_create(1024, 0);
+
+  stat = shard_stat_create(0);
+  hist = shard_hist_create(0);
+  run(latency_worker, 0);
+
+  StatSnapshot s = shard_stat_snapshot(stat);
+  printf("\nbatches of 100 sharded adds: n=%ld mean=%.1f ns min=%ld ns max=%ld ns\n", s.count,
+         s.mean, s.min, s.max);
+  Histogram *merged = malloc(sizeof(Histogram));
+  shard_hist_snapshot(hist, merged);
+  hist_print(stdout, "batch (ns)", merged, 1, STATS_TEXT);
+
+  free(merged);
+  shard_hist_destroy(hist);
+  shard_stat_destroy(stat);
+  shard_counter_destroy(sharded);
+  return 0;
+}
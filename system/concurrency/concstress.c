@@ -0,0 +1,903 @@
+/*
+ * Stress and linearizability harness for the hand-rolled primitives
+ *
+ * The primitives below are copied unchanged from the demos that define them:
+ *   LFQueue        concfuture_threadpool_atomics.c  (Michael-Scott queue)
+ *   futex_mutex_t  concfutex.c
+ *   spinlock_t     concspinlock.c
+ *   barrier_t      concbarrier.c                    (two-turnstile barrier)
+ *   LightSwitch    conclightswitch.c                (readers-writers)
+ *
+ * Each thread runs a random mix of operations with random pauses (short
+ * spins, sched_yield, the odd usleep) between them, so every seed gives a
+ * different interleaving. Every operation is logged with a CLOCK_MONOTONIC
+ * timestamp taken just before it is invoked and just after it returns. An
+ * operation A precedes B when A returned before B was invoked; otherwise
+ * they overlap and may take effect in either order.
+ *
+ * After the run the history is checked against the primitive's sequential
+ * specification:
+ *
+ *  - LFQueue, exhaustively: many short rounds (a few threads, a few
+ *    operations each) are checked with the Wing & Gong search. It looks for
+ *    an order of the operations that respects precedence and replays
+ *    correctly on a sequential FIFO queue.
+ *  - LFQueue, at scale: long runs are too big for that search. They are
+ *    checked against the conditions a queue history with unique values
+ *    must meet (Henzinger, Sezgin & Vafeiadis): each value is dequeued at
+ *    most once, and only if it was enqueued and its enqueue was invoked
+ *    first; nothing is lost; if enq(a) precedes enq(b), deq(b) may not
+ *    precede deq(a); and a dequeue may not return empty while some value is
+ *    known to be in the queue for its whole duration.
+ *  - Locks: critical sections, timestamped inside the lock, must not
+ *    overlap, and a counter incremented non-atomically inside them must
+ *    come out exact.
+ *  - Barrier: in every episode the last arrival must come before the first
+ *    departure.
+ *  - LightSwitch: a writer's section may not overlap any other section.
+ *
+ * Each test also reports throughput, measured with the logging on (two
+ * clock reads per operation).
+ *
+ * Under ThreadSanitizer the only report is LFQueue freeing a node that a
+ * racing dequeuer may still read. The history checks cannot see that bug
+ * unless the freed node is reused mid-operation (ABA).
+ *
+ * A failed check prints the first violation and makes the program exit
+ * with status 1. Re-run with the printed seed to get the same schedule
+ * choices, though not the same interleaving.
+ *
+ * Compilation:
+ *   gcc -O2 -pthread concstress.c -o concstress
+ *   gcc -O1 -g -fsanitize=thread -pthread concstress.c -o concstress   (data races)
+ *
+ * Usage:
+ *   ./concstress [threads] [ops per thread] [seed]
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ----------------------- Primitives under test ----------------------- */
+
+// concfuture_threadpool_atomics.c
+typedef struct Node {
+  void *value;
+  _Atomic(struct Node *) next;
+} Node;
+
+typedef struct {
+  _Atomic(Node *) head;
+  _Atomic(Node *) tail;
+} LFQueue;
+
+void lfqueue_init(LFQueue *q) {
+  Node *dummy = malloc(sizeof(Node));
+  dummy->value = NULL;
+  atomic_store(&dummy->next, NULL);
+  atomic_store(&q->head, dummy);
+  atomic_store(&q->tail, dummy);
+}
+
+void lfqueue_enqueue(LFQueue *q, void *value) {
+  Node *node = malloc(sizeof(Node));
+  node->value = value;
+  atomic_store(&node->next, NULL);
+
+  while (1) {
+    Node *tail = atomic_load(&q->tail);
+    Node *next = atomic_load(&tail->next);
+
+    if (next == NULL) {
+      if (atomic_compare_exchange_weak(&tail->next, &next, node)) {
+        atomic_compare_exchange_weak(&q->tail, &tail, node);
+        return;
+      }
+    } else {
+      atomic_compare_exchange_weak(&q->tail, &tail, next);
+    }
+  }
+}
+
+void *lfqueue_dequeue(LFQueue *q) {
+  while (1) {
+    Node *head = atomic_load(&q->head);
+    Node *tail = atomic_load(&q->tail);
+    Node *next = atomic_load(&head->next);
+
+    if (!next) return NULL;
+
+    if (head == tail) {
+      atomic_compare_exchange_weak(&q->tail, &tail, next);
+      continue;
+    }
+
+    void *value = next->value;
+    if (atomic_compare_exchange_weak(&q->head, &head, next)) {
+      free(head);
+      return value;
+    }
+  }
+}
+
+// concfutex.c
+static inline int futex_wait(atomic_int *futex, int expected) {
+  return syscall(SYS_futex, futex, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+static inline int futex_wake(atomic_int *futex, int count) {
+  return syscall(SYS_futex, futex, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+typedef struct {
+  atomic_int value;
+} futex_mutex_t;
+
+void futex_mutex_init(futex_mutex_t *mutex) { atomic_store(&mutex->value, 0); }
+
+void futex_mutex_lock(futex_mutex_t *mutex) {
+  int expected = 0;
+  while (!atomic_compare_exchange_weak(&mutex->value, &expected, 1)) {
+    while (atomic_load(&mutex->value) != 0) {
+      futex_wait(&mutex->value, 1);
+    }
+    expected = 0;
+  }
+}
+
+void futex_mutex_unlock(futex_mutex_t *mutex) {
+  if (atomic_load(&mutex->value) != 1) {
+    return;
+  }
+  atomic_store(&mutex->value, 0);
+  futex_wake(&mutex->value, 1);
+}
+
+// concspinlock.c
+typedef struct {
+  atomic_flag lock;
+} spinlock_t;
+
+void spinlock_init(spinlock_t *lock) { atomic_flag_clear(&lock->lock); }
+
+void spinlock_lock(spinlock_t *lock) {
+  while (atomic_flag_test_and_set(&lock->lock)) {
+    usleep(10);
+  }
+}
+
+void spinlock_unlock(spinlock_t *lock) { atomic_flag_clear(&lock->lock); }
+
+// concbarrier.c. turnstile2 used to start at 1, letting a thread run into
+// the next episode early; this harness is what caught it.
+typedef struct {
+  int count;
+  int n_threads;
+  pthread_mutex_t mutex;
+  sem_t turnstile1;
+  sem_t turnstile2;
+} barrier_t;
+
+void barrier_init(barrier_t *b, int n) {
+  b->count = 0;
+  b->n_threads = n;
+  pthread_mutex_init(&b->mutex, NULL);
+  sem_init(&b->turnstile1, 0, 0);
+  sem_init(&b->turnstile2, 0, 0);
+}
+
+void barrier_wait(barrier_t *b) {
+  pthread_mutex_lock(&b->mutex);
+  b->count++;
+  if (b->count == b->n_threads) {
+    for (int i = 0; i < b->n_threads; i++) sem_post(&b->turnstile1);
+  }
+  pthread_mutex_unlock(&b->mutex);
+
+  sem_wait(&b->turnstile1);
+
+  pthread_mutex_lock(&b->mutex);
+  b->count--;
+  if (b->count == 0) {
+    for (int i = 0; i < b->n_threads; i++) sem_post(&b->turnstile2);
+  }
+  pthread_mutex_unlock(&b->mutex);
+
+  sem_wait(&b->turnstile2);
+}
+
+// conclightswitch.c
+typedef struct {
+  int counter;
+  pthread_mutex_t mutex;
+} LightSwitch;
+
+void lightswitch_init(LightSwitch *ls) {
+  ls->counter = 0;
+  pthread_mutex_init(&ls->mutex, NULL);
+}
+
+void lightswitch_lock(LightSwitch *ls, sem_t *shared) {
+  pthread_mutex_lock(&ls->mutex);
+  ls->counter++;
+  if (ls->counter == 1) {
+    sem_wait(shared);
+  }
+  pthread_mutex_unlock(&ls->mutex);
+}
+
+void lightswitch_unlock(LightSwitch *ls, sem_t *shared) {
+  pthread_mutex_lock(&ls->mutex);
+  ls->counter--;
+  if (ls->counter == 0) {
+    sem_post(shared);
+  }
+  pthread_mutex_unlock(&ls->mutex);
+}
+
+/* ----------------------- Harness ----------------------- */
+
+typedef enum { OP_ENQ, OP_DEQ, OP_CS, OP_READ, OP_WRITE, OP_ARRIVE } OpType;
+
+typedef struct {
+  uint64_t inv;  // Before the call
+  uint64_t res;  // After it returned
+  long val;      // Enqueued value, dequeued value (0 = empty), or episode
+  int type;
+  int thread;
+} Op;
+
+typedef struct {
+  _Alignas(64) int id;
+  uint64_t rng;
+  Op *ops;
+  long nops;
+  atomic_long progress;  // Completed operations, read by the watchdog
+} Thread;
+
+static int nthreads;
+static long nops;
+static uint64_t seed;
+static int failures;
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t next_rand(uint64_t *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545f4914f6cdd1dull;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// A random pause between operations, to vary the interleaving.
+static void jitter(uint64_t *rng) {
+  uint64_t r = next_rand(rng);
+  if (r % 1024 == 0) {
+    usleep(r % 50);
+  } else if (r % 32 == 0) {
+    sched_yield();
+  } else {
+    for (int i = r % 64; i > 0; i--) cpu_relax();
+  }
+}
+
+static Thread *threads_alloc(int n, long ops_each) {
+  Thread *t = aligned_alloc(64, sizeof(Thread) * n);
+  memset(t, 0, sizeof(Thread) * n);
+  for (int i = 0; i < n; i++) {
+    t[i].id = i;
+    t[i].rng = (seed + 1) * 0x9e3779b97f4a7c15ull ^ (uint64_t)(i + 1) * 0xbf58476d1ce4e5b9ull;
+    if (!t[i].rng) t[i].rng = 1;
+    t[i].ops = malloc(sizeof(Op) * (ops_each > 0 ? ops_each : 1));
+  }
+  return t;
+}
+
+static void threads_free(Thread *t, int n) {
+  for (int i = 0; i < n; i++) free(t[i].ops);
+  free(t);
+}
+
+#define STALL_SECONDS 5
+
+static atomic_int start_gate;
+static int stalled;
+
+/*
+ * Runs fn on n threads, released together; returns the wall time in seconds.
+ * If no thread completes an operation for STALL_SECONDS the run is declared
+ * deadlocked: `stalled` is set and the threads are cancelled and abandoned,
+ * along with t (the caller must not free it).
+ */
+static double run_threads(Thread *t, int n, void *(*fn)(void *)) {
+  pthread_t tid[n];
+  int joined[n];
+  atomic_store(&start_gate, 0);
+  stalled = 0;
+  for (int i = 0; i < n; i++) {
+    joined[i] = 0;
+    if (pthread_create(&tid[i], NULL, fn, &t[i])) {
+      perror("pthread_create failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  uint64_t t0 = now_ns(), last_change = t0;
+  long last_progress = -1;
+  atomic_store(&start_gate, 1);
+
+  for (int left = n; left;) {
+    long progress = 0;
+    for (int i = 0; i < n; i++) {
+      if (!joined[i] && pthread_tryjoin_np(tid[i], NULL) == 0) joined[i] = 1, left--;
+      progress += atomic_load_explicit(&t[i].progress, memory_order_relaxed);
+    }
+    if (!left) break;
+    uint64_t now = now_ns();
+    if (progress != last_progress) {
+      last_progress = progress;
+      last_change = now;
+    } else if (now - last_change > STALL_SECONDS * 1000000000ull) {
+      for (int i = 0; i < n; i++) {
+        if (!joined[i]) pthread_cancel(tid[i]), pthread_detach(tid[i]);
+      }
+      stalled = 1;
+      break;
+    }
+    usleep(now - t0 < 10000000 ? 50 : 1000);
+  }
+  return (now_ns() - t0) / 1e9;
+}
+
+static void wait_gate(void) {
+  while (!atomic_load(&start_gate)) sched_yield();
+}
+
+static inline Op *op_begin(Thread *t, int type, long val) {
+  Op *op = &t->ops[t->nops++];
+  op->type = type;
+  op->val = val;
+  op->thread = t->id;
+  op->inv = now_ns();
+  return op;
+}
+
+static inline void op_end(Thread *t, Op *op) {
+  op->res = now_ns();
+  atomic_store_explicit(&t->progress, t->nops, memory_order_relaxed);
+}
+
+// Concatenates every thread's log into one array.
+static Op *merge_history(Thread *t, int n, long extra, long *count) {
+  long total = extra;
+  for (int i = 0; i < n; i++) total += t[i].nops;
+  Op *all = malloc(sizeof(Op) * (total ? total : 1));
+  long k = 0;
+  for (int i = 0; i < n; i++) {
+    memcpy(all + k, t[i].ops, sizeof(Op) * t[i].nops);
+    k += t[i].nops;
+  }
+  *count = k;
+  return all;
+}
+
+static void report(const char *name, long ops, double secs, const char *error) {
+  printf("  %-26s %9ld ops %9.1f ms %8.3f Mops/s  %s\n", name, ops, secs * 1e3,
+         secs > 0 ? ops / secs / 1e6 : 0, error ? "FAILED" : "ok");
+  if (error) {
+    printf("    %s\n", error);
+    failures++;
+  }
+  fflush(stdout);
+}
+
+static char error_buf[256];
+
+#define FAIL(...) (snprintf(error_buf, sizeof(error_buf), __VA_ARGS__), error_buf)
+#define STALL_ERROR FAIL("no operation completed for %d s: deadlock", STALL_SECONDS)
+
+/* ----------------------- Queue: exhaustive check ----------------------- */
+
+/*
+ * Wing & Gong search with memoization (as in Lowe's "testing for
+ * linearizability"). An operation may be linearized next if it was invoked
+ * before every pending operation returned. Values are tiny here (< 64 ops),
+ * so the linearized set is a bitmask and the queue an array.
+ */
+#define WGL_MAX_OPS 64
+#define WGL_MEMO (1 << 16)
+
+typedef struct {
+  Op *ops;
+  int n;
+  uint64_t memo[WGL_MEMO];  // (mask, state hash) pairs seen, 0 = empty slot
+} Wgl;
+
+static int wgl_seen(Wgl *w, uint64_t mask, const long *q, int qh, int qt) {
+  uint64_t h = mask * 0x9e3779b97f4a7c15ull;
+  for (int i = qh; i < qt; i++) h = (h ^ (uint64_t)q[i]) * 0x100000001b3ull;
+  if (!h) h = 1;
+  for (uint64_t i = h & (WGL_MEMO - 1);; i = (i + 1) & (WGL_MEMO - 1)) {
+    if (w->memo[i] == h) return 1;
+    if (!w->memo[i]) {
+      w->memo[i] = h;
+      return 0;
+    }
+  }
+}
+
+static int wgl_search(Wgl *w, uint64_t done, long *q, int qh, int qt) {
+  if (done == (w->n == 64 ? ~0ull : (1ull << w->n) - 1)) return 1;
+  if (wgl_seen(w, done, q, qh, qt)) return 0;
+
+  uint64_t min_res = UINT64_MAX;
+  for (int i = 0; i < w->n; i++) {
+    if (!(done >> i & 1) && w->ops[i].res < min_res) min_res = w->ops[i].res;
+  }
+  for (int i = 0; i < w->n; i++) {
+    Op *op = &w->ops[i];
+    if (done >> i & 1 || op->inv > min_res) continue;
+    if (op->type == OP_ENQ) {
+      q[qt] = op->val;
+      if (wgl_search(w, done | 1ull << i, q, qh, qt + 1)) return 1;
+    } else if (qh == qt ? op->val == 0 : op->val == q[qh]) {
+      if (wgl_search(w, done | 1ull << i, q, qh + (qh < qt), qt)) return 1;
+    }
+  }
+  return 0;
+}
+
+static LFQueue round_queue;
+
+static void *queue_round_thread(void *arg) {
+  Thread *t = arg;
+  wait_gate();
+  for (long i = 0; i < nops; i++) {
+    if (next_rand(&t->rng) % 2) {
+      long v = ((long)t->id << 32 | i) + 1;
+      Op *op = op_begin(t, OP_ENQ, v);
+      lfqueue_enqueue(&round_queue, (void *)v);
+      op_end(t, op);
+    } else {
+      Op *op = op_begin(t, OP_DEQ, 0);
+      op->val = (long)lfqueue_dequeue(&round_queue);
+      op_end(t, op);
+    }
+    jitter(&t->rng);
+  }
+  return NULL;
+}
+
+static void test_queue_rounds(int threads, int ops_each, int rounds) {
+  long saved = nops;
+  nops = ops_each;
+  Wgl *w = malloc(sizeof(Wgl));
+  long *model = malloc(sizeof(long) * WGL_MAX_OPS);
+  const char *error = NULL;
+  double secs = 0;
+  long total = 0;
+
+  for (int r = 0; r < rounds && !error; r++) {
+    Thread *t = threads_alloc(threads, ops_each);
+    for (int i = 0; i < threads; i++) t[i].rng ^= (uint64_t)r * 0x94d049bb133111ebull;
+    lfqueue_init(&round_queue);
+    secs += run_threads(t, threads, queue_round_thread);
+    if (stalled) {
+      error = STALL_ERROR;
+      break;
+    }
+    while (lfqueue_dequeue(&round_queue)) {
+    }
+    free(atomic_load(&round_queue.head));
+
+    long n;
+    Op *ops = merge_history(t, threads, 0, &n);
+    total += n;
+    w->ops = ops;
+    w->n = (int)n;
+    memset(w->memo, 0, sizeof(w->memo));
+    if (!wgl_search(w, 0, model, 0, 0)) {
+      error = FAIL("round %d: no sequential FIFO order explains the %ld operations", r, n);
+    }
+    free(ops);
+    threads_free(t, threads);
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "LFQueue %dx%d x%d rounds", threads, ops_each, rounds);
+  report(name, total, secs, error);
+  free(model);
+  free(w);
+  nops = saved;
+}
+
+/* ----------------------- Queue: large histories ----------------------- */
+
+static LFQueue queue;
+
+static void *queue_thread(void *arg) {
+  Thread *t = arg;
+  wait_gate();
+  for (long i = 0; i < nops; i++) {
+    if (next_rand(&t->rng) % 2) {
+      long v = ((long)t->id << 32 | i) + 1;  // Unique and never NULL
+      Op *op = op_begin(t, OP_ENQ, v);
+      lfqueue_enqueue(&queue, (void *)v);
+      op_end(t, op);
+    } else {
+      Op *op = op_begin(t, OP_DEQ, 0);
+      op->val = (long)lfqueue_dequeue(&queue);
+      op_end(t, op);
+    }
+    jitter(&t->rng);
+  }
+  return NULL;
+}
+
+typedef struct {
+  Op *enq;
+  Op *deq;  // NULL while not dequeued
+} ValueLife;
+
+static int cmp_enq_res(const void *a, const void *b) {
+  uint64_t x = ((const ValueLife *)a)->enq->res, y = ((const ValueLife *)b)->enq->res;
+  return (x > y) - (x < y);
+}
+
+static int cmp_enq_inv(const void *a, const void *b) {
+  uint64_t x = ((const ValueLife *)a)->enq->inv, y = ((const ValueLife *)b)->enq->inv;
+  return (x > y) - (x < y);
+}
+
+static int cmp_op_inv(const void *a, const void *b) {
+  uint64_t x = (*(Op *const *)a)->inv, y = (*(Op *const *)b)->inv;
+  return (x > y) - (x < y);
+}
+
+static inline uint64_t deq_inv(const ValueLife *v) { return v->deq ? v->deq->inv : UINT64_MAX; }
+
+static const char *check_queue(Thread *t, int n) {
+  // Drain what is left, so every value gets a dequeue.
+  Thread drain = {.id = n, .ops = malloc(sizeof(Op) * (n * nops + 1))};
+  for (;;) {
+    Op *op = op_begin(&drain, OP_DEQ, 0);
+    op->val = (long)lfqueue_dequeue(&queue);
+    op_end(&drain, op);
+    if (!op->val) break;
+  }
+
+  long count;
+  Thread all[n + 1];
+  memcpy(all, t, sizeof(Thread) * n);
+  all[n] = drain;
+  Op *ops = merge_history(all, n + 1, 0, &count);
+  free(drain.ops);
+
+  // Index values by (thread, sequence number).
+  ValueLife *life = calloc(n * nops, sizeof(ValueLife));
+  long nvalues = 0;
+  const char *error = NULL;
+  for (long i = 0; i < count; i++) {
+    if (ops[i].type == OP_ENQ) {
+      long v = ops[i].val - 1;
+      life[(v >> 32) * nops + (v & 0xffffffff)].enq = &ops[i];
+      nvalues++;
+    }
+  }
+  for (long i = 0; i < count && !error; i++) {
+    if (ops[i].type != OP_DEQ || !ops[i].val) continue;
+    long v = ops[i].val - 1, tid = v >> 32, seq = v & 0xffffffff;
+    ValueLife *l = (tid >= 0 && tid < n && seq < nops) ? &life[tid * nops + seq] : NULL;
+    if (!l || !l->enq) {
+      error = FAIL("dequeued %#lx, which was never enqueued", ops[i].val);
+    } else if (l->deq) {
+      error = FAIL("value %#lx dequeued twice", ops[i].val);
+    } else if (ops[i].res < l->enq->inv) {
+      error = FAIL("value %#lx dequeued before its enqueue was invoked", ops[i].val);
+    } else {
+      l->deq = &ops[i];
+    }
+  }
+
+  // Compact to the values that were enqueued.
+  long k = 0;
+  for (long i = 0; i < n * nops; i++) {
+    if (life[i].enq) life[k++] = life[i];
+  }
+  for (long i = 0; i < k && !error; i++) {
+    if (!life[i].deq) error = FAIL("value %#lx was enqueued but never dequeued", life[i].enq->val);
+  }
+
+  /*
+   * FIFO: if enq(a) precedes enq(b), deq(b) must not precede deq(a).
+   * Sweep the b's by enq.inv; the a's with enq.res < enq(b).inv form a
+   * growing prefix of the values sorted by enq.res. Track the latest
+   * deq.inv among them.
+   */
+  if (!error) {
+    ValueLife *by_res = malloc(sizeof(ValueLife) * k), *by_inv = malloc(sizeof(ValueLife) * k);
+    memcpy(by_res, life, sizeof(ValueLife) * k);
+    memcpy(by_inv, life, sizeof(ValueLife) * k);
+    qsort(by_res, k, sizeof(ValueLife), cmp_enq_res);
+    qsort(by_inv, k, sizeof(ValueLife), cmp_enq_inv);
+    long j = 0;
+    ValueLife *latest = NULL;
+    for (long i = 0; i < k && !error; i++) {
+      ValueLife *b = &by_inv[i];
+      for (; j < k && by_res[j].enq->res < b->enq->inv; j++) {
+        if (!latest || deq_inv(&by_res[j]) > deq_inv(latest)) latest = &by_res[j];
+      }
+      if (latest && deq_inv(latest) > b->deq->res) {
+        error = FAIL("FIFO violated: %#lx was enqueued before %#lx but dequeued after it",
+                     latest->enq->val, b->enq->val);
+      }
+    }
+
+    /*
+     * Empty dequeues: wrong if some value was enqueued before the dequeue
+     * was invoked and was not dequeued until after it returned.
+     */
+    long nempty = 0;
+    for (long i = 0; i < count; i++) nempty += ops[i].type == OP_DEQ && !ops[i].val;
+    Op **empty = malloc(sizeof(Op *) * (nempty + 1));
+    nempty = 0;
+    for (long i = 0; i < count; i++) {
+      if (ops[i].type == OP_DEQ && !ops[i].val) empty[nempty++] = &ops[i];
+    }
+    qsort(empty, nempty, sizeof(Op *), cmp_op_inv);
+    j = 0;
+    latest = NULL;
+    for (long i = 0; i < nempty && !error; i++) {
+      for (; j < k && by_res[j].enq->res < empty[i]->inv; j++) {
+        if (!latest || deq_inv(&by_res[j]) > deq_inv(latest)) latest = &by_res[j];
+      }
+      if (latest && deq_inv(latest) > empty[i]->res) {
+        error = FAIL("dequeue by thread %d returned empty while %#lx was in the queue",
+                     empty[i]->thread, latest->enq->val);
+      }
+    }
+    free(empty);
+    free(by_res);
+    free(by_inv);
+  }
+
+  free(life);
+  free(ops);
+  return error;
+}
+
+static void test_queue(void) {
+  Thread *t = threads_alloc(nthreads, nops);
+  lfqueue_init(&queue);
+  double secs = run_threads(t, nthreads, queue_thread);
+  if (stalled) {
+    report("LFQueue", nthreads * nops, secs, STALL_ERROR);
+    return;
+  }
+  const char *error = check_queue(t, nthreads);
+  free(atomic_load(&queue.head));
+  report("LFQueue", nthreads * nops, secs, error);
+  threads_free(t, nthreads);
+}
+
+/* ----------------------- Locks ----------------------- */
+
+typedef struct {
+  const char *name;
+  void (*lock)(void *);
+  void (*unlock)(void *);
+  void *obj;
+} LockUnderTest;
+
+static LockUnderTest *lut;
+static long shared_counter;  // Deliberately not atomic
+static atomic_int owner;
+
+static void *lock_thread(void *arg) {
+  Thread *t = arg;
+  wait_gate();
+  for (long i = 0; i < nops; i++) {
+    lut->lock(lut->obj);
+    Op *op = op_begin(t, OP_CS, 0);
+    atomic_store_explicit(&owner, t->id + 1, memory_order_relaxed);
+    long c = shared_counter;
+    if (next_rand(&t->rng) % 8 == 0) sched_yield();  // Widen the window
+    shared_counter = c + 1;
+    if (atomic_load_explicit(&owner, memory_order_relaxed) != t->id + 1) op->val = 1;
+    op_end(t, op);
+    lut->unlock(lut->obj);
+    jitter(&t->rng);
+  }
+  return NULL;
+}
+
+// Sections sorted by start must each begin after the previous one ended.
+static const char *check_exclusive(Op *ops, long n) {
+  Op **sorted = malloc(sizeof(Op *) * (n ? n : 1));
+  for (long i = 0; i < n; i++) sorted[i] = &ops[i];
+  qsort(sorted, n, sizeof(Op *), cmp_op_inv);
+  const char *error = NULL;
+  uint64_t max_end = 0, max_writer_end = 0;
+  for (long i = 0; i < n && !error; i++) {
+    Op *op = sorted[i];
+    if (op->val) {
+      error = FAIL("thread %d saw another owner inside its critical section", op->thread);
+    } else if (op->type == OP_READ ? op->inv < max_writer_end : op->inv < max_end) {
+      error = FAIL("section of thread %d started %lu ns before an earlier one ended", op->thread,
+                   (unsigned long)((op->type == OP_READ ? max_writer_end : max_end) - op->inv));
+    }
+    if (op->res > max_end) max_end = op->res;
+    if (op->type != OP_READ && op->res > max_writer_end) max_writer_end = op->res;
+  }
+  free(sorted);
+  return error;
+}
+
+static void test_lock(LockUnderTest *l) {
+  Thread *t = threads_alloc(nthreads, nops);
+  lut = l;
+  shared_counter = 0;
+  double secs = run_threads(t, nthreads, lock_thread);
+  if (stalled) {
+    report(l->name, nthreads * nops, secs, STALL_ERROR);
+    return;
+  }
+  long n;
+  Op *ops = merge_history(t, nthreads, 0, &n);
+  const char *error = check_exclusive(ops, n);
+  if (!error && shared_counter != nthreads * nops) {
+    error = FAIL("counter is %ld, expected %ld", shared_counter, nthreads * nops);
+  }
+  report(l->name, n, secs, error);
+  free(ops);
+  threads_free(t, nthreads);
+}
+
+static void spin_lock_fn(void *l) { spinlock_lock(l); }
+static void spin_unlock_fn(void *l) { spinlock_unlock(l); }
+static void futex_lock_fn(void *l) { futex_mutex_lock(l); }
+static void futex_unlock_fn(void *l) { futex_mutex_unlock(l); }
+
+/* ----------------------- Barrier ----------------------- */
+
+static barrier_t barrier;
+static long episodes;
+
+static void *barrier_thread(void *arg) {
+  Thread *t = arg;
+  wait_gate();
+  for (long e = 0; e < episodes; e++) {
+    Op *op = op_begin(t, OP_ARRIVE, e);
+    barrier_wait(&barrier);
+    op_end(t, op);
+    jitter(&t->rng);
+  }
+  return NULL;
+}
+
+static void test_barrier(void) {
+  episodes = nops / 10 > 0 ? nops / 10 : 1;
+  Thread *t = threads_alloc(nthreads, episodes);
+  barrier_init(&barrier, nthreads);
+  double secs = run_threads(t, nthreads, barrier_thread);
+
+  // After a stall, check the episodes every thread got through.
+  long completed = episodes;
+  for (int i = 0; i < nthreads; i++) {
+    long p = atomic_load(&t[i].progress);
+    if (p < completed) completed = p;
+  }
+  const char *error = NULL;
+  for (long e = 0; e < completed && !error; e++) {
+    uint64_t last_arrival = 0, first_departure = UINT64_MAX;
+    int late = 0, early = 0;
+    for (int i = 0; i < nthreads; i++) {
+      Op *op = &t[i].ops[e];
+      if (op->inv > last_arrival) last_arrival = op->inv, late = i;
+      if (op->res < first_departure) first_departure = op->res, early = i;
+    }
+    if (first_departure < last_arrival) {
+      error = FAIL("episode %ld: thread %d left before thread %d arrived", e, early, late);
+    }
+  }
+  if (!error && stalled) {
+    error = FAIL("no episode completed for %d s after %ld: deadlock", STALL_SECONDS, completed);
+  }
+  report("barrier_t (episodes)", completed, secs, error);
+  if (!stalled) threads_free(t, nthreads);
+}
+
+/* ----------------------- LightSwitch ----------------------- */
+
+static LightSwitch read_switch;
+static sem_t room_empty;
+
+static void *rw_thread(void *arg) {
+  Thread *t = arg;
+  wait_gate();
+  for (long i = 0; i < nops; i++) {
+    int writer = next_rand(&t->rng) % 8 == 0;
+    if (writer) {
+      sem_wait(&room_empty);
+      Op *op = op_begin(t, OP_WRITE, 0);
+      if (next_rand(&t->rng) % 4 == 0) sched_yield();
+      op_end(t, op);
+      sem_post(&room_empty);
+    } else {
+      lightswitch_lock(&read_switch, &room_empty);
+      Op *op = op_begin(t, OP_READ, 0);
+      if (next_rand(&t->rng) % 4 == 0) sched_yield();
+      op_end(t, op);
+      lightswitch_unlock(&read_switch, &room_empty);
+    }
+    jitter(&t->rng);
+  }
+  return NULL;
+}
+
+static void test_lightswitch(void) {
+  Thread *t = threads_alloc(nthreads, nops);
+  lightswitch_init(&read_switch);
+  sem_init(&room_empty, 0, 1);
+  double secs = run_threads(t, nthreads, rw_thread);
+  if (stalled) {
+    report("LightSwitch (1/8 writers)", nthreads * nops, secs, STALL_ERROR);
+    return;
+  }
+  long n;
+  Op *ops = merge_history(t, nthreads, 0, &n);
+  report("LightSwitch (1/8 writers)", n, secs, check_exclusive(ops, n));
+  free(ops);
+  threads_free(t, nthreads);
+  sem_destroy(&room_empty);
+}
+
+/* ----------------------- Main ----------------------- */
+
+int main(int argc, char **argv) {
+  nthreads = argc > 1 ? atoi(argv[1]) : 4;
+  nops = argc > 2 ? atol(argv[2]) : 100000;
+  seed = argc > 3 ? strtoull(argv[3], NULL, 10) : (uint64_t)time(NULL);
+  if (nthreads < 2) nthreads = 2;
+  if (nops < 1) nops = 1;
+
+  printf("%d threads, %ld ops per thread, seed %lu\n", nthreads, nops, (unsigned long)seed);
+
+  test_queue_rounds(3, 6, 2000);
+  test_queue_rounds(4, 12, 200);
+  test_queue();
+
+  spinlock_t spin;
+  spinlock_init(&spin);
+  test_lock(&(LockUnderTest){"spinlock_t", spin_lock_fn, spin_unlock_fn, &spin});
+
+  futex_mutex_t fm;
+  futex_mutex_init(&fm);
+  test_lock(&(LockUnderTest){"futex_mutex_t", futex_lock_fn, futex_unlock_fn, &fm});
+
+  test_barrier();
+  test_lightswitch();
+
+  printf(failures ? "%d test(s) FAILED\n" : "all checks passed\n", failures);
+  return failures ? 1 : 0;
+}
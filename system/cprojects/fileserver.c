@@ -1,5 +1,11 @@
 /*
  * fileserver
+ *
+ * Connections are served by a fixed pool of NUM_WORKERS threads, fed through a
+ * bounded queue by the accept loop. When all workers are busy and the queue is
+ * full, the accept loop stops accepting (new clients wait in the listen
+ * backlog) for up to ADMIT_WAIT_MS; if no room frees up by then the client is
+ * told "BUSY" and disconnected.
  */
 #include <arpa/inet.h>
 #include <errno.h>
@@ -13,10 +19,22 @@
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define BUFSIZE 4096
 #define PORT 9090
+#define NUM_WORKERS 8
+#define QUEUE_SIZE 32
+#define ADMIT_WAIT_MS 500
+
+/* Accepted connections waiting for a worker, as a ring buffer */
+static int queue[QUEUE_SIZE];
+static int queue_head = 0;
+static int queue_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
 
 /* Extract filename from request: "GET filename\n" */
 bool get_filename(const char *request, char *filename, size_t size) {
@@ -56,32 +74,71 @@ bool send_file(int sockfd, const char *filename) {
   return true;
 }
 
-void *connection_handler(void *arg) {
-  int sockfd = *(int *)arg;
-  free(arg);
-
+void handle_connection(int sockfd) {
   char buffer[BUFSIZE];
   char filename[256];
 
   ssize_t received = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
   if (received <= 0) {
     close(sockfd);
-    return NULL;
+    return;
   }
 
   buffer[received] = '\0';
 
   if (!get_filename(buffer, filename, sizeof(filename))) {
-    send(sockfd, "ERR\n", 4, 0);
+    send(sockfd, "ERR\n", 4, MSG_NOSIGNAL);
     close(sockfd);
-    return NULL;
+    return;
   }
 
   if (!send_file(sockfd, filename)) {
-    send(sockfd, "NO\n", 3, 0);
+    send(sockfd, "NO\n", 3, MSG_NOSIGNAL);
   }
 
   close(sockfd);
+}
+
+/* Queue a connection, waiting up to wait_ms for room; false if none came */
+bool enqueue_connection(int sockfd, int wait_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += wait_ms / 1000;
+  deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&queue_lock);
+  while (queue_count == QUEUE_SIZE) {
+    if (pthread_cond_timedwait(&queue_not_full, &queue_lock, &deadline) ==
+        ETIMEDOUT)
+      break;
+  }
+  bool queued = queue_count < QUEUE_SIZE;
+  if (queued) {
+    queue[(queue_head + queue_count) % QUEUE_SIZE] = sockfd;
+    queue_count++;
+    pthread_cond_signal(&queue_not_empty);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return queued;
+}
+
+void *worker(void *arg) {
+  (void)arg;
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count == 0) pthread_cond_wait(&queue_not_empty, &queue_lock);
+    int sockfd = queue[queue_head];
+    queue_head = (queue_head + 1) % QUEUE_SIZE;
+    queue_count--;
+    pthread_cond_signal(&queue_not_full);
+    pthread_mutex_unlock(&queue_lock);
+
+    handle_connection(sockfd);
+  }
   return NULL;
 }
 
@@ -110,6 +167,15 @@ int main(void) {
 
   printf("Server listening on port %d\n", PORT);
 
+  for (int i = 0; i < NUM_WORKERS; i++) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker, NULL) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+  }
+
   while (1) {
     int client_fd = accept(server_fd, NULL, NULL);
     if (client_fd < 0) {
@@ -117,11 +183,10 @@ int main(void) {
       continue;
     }
 
-    int *pclient = malloc(sizeof(int));
-    *pclient = client_fd;
-
-    pthread_t tid;
-    pthread_create(&tid, NULL, connection_handler, pclient);
-    pthread_detach(tid);  // real concurrency
+    /* Blocks accepting while the pool is saturated: that's the backpressure */
+    if (!enqueue_connection(client_fd, ADMIT_WAIT_MS)) {
+      send(client_fd, "BUSY\n", 5, MSG_NOSIGNAL);
+      close(client_fd);
+    }
   }
 }
@@ -0,0 +1,125 @@
+// Connection table for the socket servers.
+//
+// This code is in the public domain.
+#include "conntable.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Free states and idle send buffers are kept on intrusive singly-linked lists:
+// the first bytes of a free object point to the next one.
+typedef struct free_node {
+  struct free_node* next;
+} free_node_t;
+
+struct conn_table {
+  void** states;  // Indexed by fd; NULL for fds not in the table
+  int capacity;
+  int count;
+
+  size_t state_size;
+  free_node_t* free_states;
+
+  size_t sendbuf_size;
+  free_node_t* free_sendbufs;
+  int num_free_sendbufs;
+};
+
+conn_table_t* conn_table_create(size_t state_size, size_t sendbuf_size) {
+  conn_table_t* t = xmalloc(sizeof(*t));
+  memset(t, 0, sizeof(*t));
+
+  // Keep every state in a slab pointer-aligned, and big enough to hold a
+  // free list link.
+  size_t align = sizeof(void*);
+  t->state_size = (state_size + align - 1) / align * align;
+  if (t->state_size < sizeof(free_node_t)) {
+    t->state_size = sizeof(free_node_t);
+  }
+  t->sendbuf_size =
+      sendbuf_size < sizeof(free_node_t) ? sizeof(free_node_t) : sendbuf_size;
+  return t;
+}
+
+// Allocates a slab and puts its states on the free list. Slabs live as long
+// as the table: their states are recycled, never freed.
+static void add_slab(conn_table_t* t) {
+  uint8_t* slab = xmalloc(t->state_size * CONN_SLAB_STATES);
+  for (int i = CONN_SLAB_STATES - 1; i >= 0; --i) {
+    free_node_t* node = (free_node_t*)(slab + i * t->state_size);
+    node->next = t->free_states;
+    t->free_states = node;
+  }
+}
+
+void* conn_table_add(conn_table_t* t, int fd) {
+  assert(fd >= 0);
+  if (fd >= t->capacity) {
+    int cap = t->capacity ? t->capacity : 1024;
+    while (cap <= fd) {
+      cap *= 2;
+    }
+    t->states = realloc(t->states, cap * sizeof(void*));
+    if (!t->states) {
+      die("OOM growing connection table");
+    }
+    memset(t->states + t->capacity, 0, (cap - t->capacity) * sizeof(void*));
+    t->capacity = cap;
+  }
+  assert(t->states[fd] == NULL);
+
+  if (!t->free_states) {
+    add_slab(t);
+  }
+  void* state = t->free_states;
+  t->free_states = t->free_states->next;
+  memset(state, 0, t->state_size);
+
+  t->states[fd] = state;
+  t->count++;
+  return state;
+}
+
+void* conn_table_get(conn_table_t* t, int fd) {
+  if (fd < 0 || fd >= t->capacity) {
+    return NULL;
+  }
+  return t->states[fd];
+}
+
+void conn_table_remove(conn_table_t* t, int fd) {
+  free_node_t* node = conn_table_get(t, fd);
+  assert(node);
+  node->next = t->free_states;
+  t->free_states = node;
+  t->states[fd] = NULL;
+  t->count--;
+}
+
+int conn_table_count(conn_table_t* t) {
+  return t->count;
+}
+
+uint8_t* conn_sendbuf_get(conn_table_t* t) {
+  if (t->free_sendbufs) {
+    free_node_t* node = t->free_sendbufs;
+    t->free_sendbufs = node->next;
+    t->num_free_sendbufs--;
+    return (uint8_t*)node;
+  }
+  return xmalloc(t->sendbuf_size);
+}
+
+void conn_sendbuf_put(conn_table_t* t, uint8_t* buf) {
+  if (t->num_free_sendbufs >= CONN_SENDBUF_POOL_MAX) {
+    free(buf);
+    return;
+  }
+  free_node_t* node = (free_node_t*)buf;
+  node->next = t->free_sendbufs;
+  t->free_sendbufs = node;
+  t->num_free_sendbufs++;
+}
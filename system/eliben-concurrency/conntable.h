@@ -0,0 +1,53 @@
+// Connection table for the socket servers: per-connection state looked up by
+// fd, with memory that follows the number of live connections instead of a
+// fixed global_state[MAXFDS] array.
+//
+// * The fd index is an array of pointers, grown by doubling to cover the
+//   largest fd seen: 8 bytes per fd rather than a whole peer state.
+// * States are carved out of slabs of CONN_SLAB_STATES, and freed states go
+//   on a free list for the next connection. A burst of connections thus costs
+//   one malloc per slab rather than one per connection.
+// * Send buffers are separate from the states and allocated only while there
+//   is output pending. A server that is waiting for its peers to talk, which
+//   is most of the time for most of them, holds no send buffers at all. Freed
+//   buffers are pooled for reuse, up to CONN_SENDBUF_POOL_MAX idle ones.
+//
+// A table is not thread-safe; each thread serving connections has its own.
+//
+// This code is in the public domain.
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONN_SLAB_STATES 64
+#define CONN_SENDBUF_POOL_MAX 256
+
+typedef struct conn_table conn_table_t;
+
+// Creates a table holding states of state_size bytes each, and handing out
+// send buffers of sendbuf_size bytes.
+conn_table_t* conn_table_create(size_t state_size, size_t sendbuf_size);
+
+// Returns a zeroed state for fd, which must not be in the table already.
+void* conn_table_add(conn_table_t* t, int fd);
+
+// Returns the state for fd, or NULL if fd is not in the table.
+void* conn_table_get(conn_table_t* t, int fd);
+
+// Removes fd from the table. The caller releases the state's send buffer, if
+// it has one, beforehand.
+void conn_table_remove(conn_table_t* t, int fd);
+
+// Number of connections in the table.
+int conn_table_count(conn_table_t* t);
+
+// Returns a send buffer of the table's sendbuf_size; its contents are
+// undefined.
+uint8_t* conn_sendbuf_get(conn_table_t* t);
+
+// Returns a send buffer obtained from conn_sendbuf_get.
+void conn_sendbuf_put(conn_table_t* t, uint8_t* buf);
+
+#endif /* CONNTABLE_H */
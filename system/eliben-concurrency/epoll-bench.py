@@ -0,0 +1,151 @@
+# Compares the syscall cost and throughput of the event-driven servers:
+# epoll-server in its level-triggered (lt) and edge-triggered (et) modes, and
+# uring-server with (uring-sqpoll) and without (uring) SQPOLL.
+#
+# For each mode, starts the server, connects a number of clients, and has each
+# one send messages in a request/response loop (or pipelined in bursts with
+# --burst), checking every reply. The server prints its syscall counts when the
+# last client disconnects; this script collects and tabulates them.
+#
+# Run with -h for full usage.
+#
+# This code is in the public domain.
+import argparse
+import os
+import selectors
+import socket
+import subprocess
+import sys
+import time
+
+
+def expected_reply(msg):
+    return bytes(b + 1 for b in msg[1:-1])
+
+
+def run_clients(port, nclients, nmsgs, burst):
+    socks = []
+    for _ in range(nclients):
+        s = socket.create_connection(("localhost", port))
+        socks.append(s)
+    for s in socks:
+        if s.recv(1) != b"*":
+            sys.exit("expected '*' from the server")
+        s.setblocking(False)
+
+    sel = selectors.DefaultSelector()
+    state = {}
+    for i, s in enumerate(socks):
+        state[s] = {"sent": 0, "pending": b"", "want": b""}
+        sel.register(s, selectors.EVENT_READ)
+
+    def send_batch(s):
+        st = state[s]
+        n = min(burst, nmsgs - st["sent"])
+        msgs = [b"^msg%04d$" % ((st["sent"] + k) % 10000) for k in range(n)]
+        st["sent"] += n
+        st["want"] += b"".join(expected_reply(m) for m in msgs)
+        s.setblocking(True)
+        s.sendall(b"".join(msgs))
+        s.setblocking(False)
+
+    for s in socks:
+        send_batch(s)
+
+    active = len(socks)
+    t0 = time.time()
+    while active:
+        for key, _ in sel.select():
+            s = key.fileobj
+            st = state[s]
+            data = s.recv(65536)
+            if not data:
+                sys.exit("server closed a connection early")
+            st["pending"] += data
+            if len(st["pending"]) < len(st["want"]):
+                continue
+            if st["pending"] != st["want"]:
+                sys.exit("wrong reply: {0!r}".format(st["pending"][:64]))
+            st["pending"] = st["want"] = b""
+            if st["sent"] < nmsgs:
+                send_batch(s)
+            else:
+                sel.unregister(s)
+                active -= 1
+    elapsed = time.time() - t0
+    for s in socks:
+        s.close()
+    return elapsed
+
+
+# Mode name -> server binary and its extra arguments. The server labels its
+# statistics line with the mode name.
+MODES = {
+    "lt": ["epoll-server", "lt"],
+    "et": ["epoll-server", "et"],
+    "uring": ["uring-server"],
+    "uring-sqpoll": ["uring-server", "sqpoll"],
+}
+
+
+def wait_port_free(port, timeout=5.0):
+    """Waits until nothing listens on port.
+
+    io_uring tears down a ring's requests asynchronously, so uring-server's
+    listening socket may outlive the process for a moment.
+    """
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        with socket.socket() as s:
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            try:
+                s.bind(("", port))
+                return
+            except OSError:
+                time.sleep(0.05)
+    sys.exit("port {0} still in use".format(port))
+
+
+def bench_mode(args, mode):
+    server, *server_args = MODES[mode]
+    proc = subprocess.Popen(
+        [os.path.join(args.dir, server), str(args.port)] + server_args,
+        stdout=subprocess.PIPE,
+        universal_newlines=True,
+    )
+    time.sleep(0.3)
+    try:
+        elapsed = run_clients(args.port, args.clients, args.messages, args.burst)
+        for line in proc.stdout:
+            if line.startswith(mode + ":"):
+                return line.strip(), elapsed
+    finally:
+        proc.terminate()
+        proc.wait()
+        wait_port_free(args.port)
+
+
+if __name__ == "__main__":
+    argparser = argparse.ArgumentParser("event-driven server benchmark")
+    argparser.add_argument("modes", nargs="*",
+                           help="servers to run, out of {0} (default: lt et "
+                                "uring)".format(", ".join(MODES)))
+    argparser.add_argument("--dir", default=".",
+                           help="directory with the server binaries")
+    argparser.add_argument("-p", "--port", type=int, default=9090,
+                           help="server port")
+    argparser.add_argument("-n", "--clients", type=int, default=50,
+                           help="number of concurrent clients")
+    argparser.add_argument("-m", "--messages", type=int, default=200,
+                           help="messages per client")
+    argparser.add_argument("-b", "--burst", type=int, default=1,
+                           help="messages sent before waiting for replies")
+    args = argparser.parse_args()
+    for mode in args.modes:
+        if mode not in MODES:
+            argparser.error("unknown mode {0!r}".format(mode))
+
+    for mode in args.modes or ["lt", "et", "uring"]:
+        line, elapsed = bench_mode(args, mode)
+        rate = args.clients * args.messages / elapsed
+        print("{0}  [{1:.2f}s, {2:.0f} msgs/s]".format(line, elapsed, rate))
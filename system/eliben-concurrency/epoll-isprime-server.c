@@ -0,0 +1,327 @@
+// Primality testing server, like uv-isprime-server but on a raw epoll loop.
+// Accepts numbers, one per line, and sends back "prime" or "composite" for
+// each after testing it for primality (in the naive, slow way).
+//
+// The test runs on a thread pool through offload.h, so a slow one doesn't hold
+// up the other peers: while a peer's number is being tested its socket is
+// taken out of the epoll set, and the reply is sent once the pool's eventfd
+// reports the test done. Requests a peer sends in the meantime wait in its
+// input buffer and are served in order.
+//
+// With the environment variable MODE=BLOCK the test runs on the loop itself,
+// as in uv-isprime-server, to show the difference.
+//
+// Usage:
+//   ./epoll-isprime-server [port] [threads]
+//
+// This code is in the public domain.
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conntable.h"
+#include "offload.h"
+#include "utils.h"
+
+#define MAXEVENTS 1024
+
+// Room for a request line: 20 digits of a uint64_t and a newline, with some
+// slack for a CR and pipelined requests.
+#define INBUF_SIZE 64
+#define SENDBUF_SIZE 16
+
+#define DEFAULT_THREADS 4
+
+typedef struct {
+  int fd;
+  // The request being worked on; its data points back to this state.
+  offload_task_t task;
+  uint64_t number;
+  bool busy;
+
+  // Received bytes not yet consumed as requests.
+  char inbuf[INBUF_SIZE];
+  int inbuf_len;
+
+  char sendbuf[SENDBUF_SIZE];
+  int sendbuf_end;
+  int sendptr;
+} peer_state_t;
+
+conn_table_t* peers;
+offload_pool_t* pool;
+int epollfd;
+bool blocking = false;
+
+typedef struct {
+  bool want_read;
+  bool want_write;
+} fd_status_t;
+
+const fd_status_t fd_status_R = {.want_read = true, .want_write = false};
+const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
+const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
+
+// Naive primality test, iterating all the way to sqrt(n) to find numbers that
+// divide n. The bound is r <= n / r rather than r * r <= n: for primes above
+// (2^32 - 1)^2, r * r wraps around before it passes n and the loop would
+// never end.
+bool isprime(uint64_t n) {
+  if (n < 2) {
+    return false;
+  }
+  if (n % 2 == 0) {
+    return n == 2 ? true : false;
+  }
+
+  for (uint64_t r = 3; r <= n / r; r += 2) {
+    if (n % r == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void set_peer_sendbuf(peer_state_t* peerstate, const char* str) {
+  peerstate->sendbuf_end = strlen(str);
+  memcpy(peerstate->sendbuf, str, peerstate->sendbuf_end);
+  peerstate->sendptr = 0;
+}
+
+void set_epoll_interest(int op, int fd, fd_status_t status) {
+  struct epoll_event event = {0};
+  event.data.fd = fd;
+  if (status.want_read) {
+    event.events |= EPOLLIN;
+  }
+  if (status.want_write) {
+    event.events |= EPOLLOUT;
+  }
+  if (epoll_ctl(epollfd, op, fd, &event) < 0) {
+    perror_die("epoll_ctl");
+  }
+}
+
+void close_peer(int fd) {
+  printf("socket %d closing\n", fd);
+  if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+    perror_die("epoll_ctl EPOLL_CTL_DEL");
+  }
+  close(fd);
+  conn_table_remove(peers, fd);
+}
+
+// Runs on a pool thread.
+void on_work_submitted(offload_task_t* task) {
+  peer_state_t* peerstate = (peer_state_t*)task->data;
+  printf("work submitted: %" PRIu64 "\n", peerstate->number);
+  set_peer_sendbuf(peerstate, isprime(peerstate->number) ? "prime\n"
+                                                         : "composite\n");
+}
+
+// Runs on the loop, from offload_run_completions.
+void on_work_completed(offload_task_t* task) {
+  peer_state_t* peerstate = (peer_state_t*)task->data;
+  printf("work completed: %" PRIu64 "\n", peerstate->number);
+  peerstate->busy = false;
+  // The socket left the epoll set when the work was submitted.
+  set_epoll_interest(EPOLL_CTL_ADD, peerstate->fd, fd_status_W);
+}
+
+// Starts on the next complete request in the peer's input buffer, if there is
+// one. Returns the epoll interest for the peer (irrelevant if the request was
+// offloaded, which the caller tells by peerstate->busy).
+fd_status_t start_next_request(peer_state_t* peerstate) {
+  char* newline = memchr(peerstate->inbuf, '\n', peerstate->inbuf_len);
+  if (!newline) {
+    if (peerstate->inbuf_len == INBUF_SIZE) {
+      printf("socket %d: request too long\n", peerstate->fd);
+      return fd_status_NORW;
+    }
+    return fd_status_R;
+  }
+
+  // As in uv-isprime-server, the number is the leading digits of the line.
+  uint64_t number = 0;
+  for (char* p = peerstate->inbuf; p < newline && *p >= '0' && *p <= '9';
+       ++p) {
+    number = number * 10 + (*p - '0');
+  }
+  int consumed = newline + 1 - peerstate->inbuf;
+  memmove(peerstate->inbuf, newline + 1, peerstate->inbuf_len - consumed);
+  peerstate->inbuf_len -= consumed;
+  peerstate->number = number;
+
+  if (blocking) {
+    struct timespec t1, t2;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    set_peer_sendbuf(peerstate, isprime(number) ? "prime\n" : "composite\n");
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    printf("Num %" PRIu64 ", elapsed %ld ns\n", number,
+           (t2.tv_sec - t1.tv_sec) * 1000000000L + (t2.tv_nsec - t1.tv_nsec));
+    return fd_status_W;
+  }
+  peerstate->busy = true;
+  offload_submit(pool, &peerstate->task, on_work_submitted, on_work_completed);
+  return fd_status_NORW;
+}
+
+fd_status_t on_peer_ready_recv(int sockfd) {
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
+  int nbytes = recv(sockfd, peerstate->inbuf + peerstate->inbuf_len,
+                    INBUF_SIZE - peerstate->inbuf_len, 0);
+  if (nbytes == 0) {
+    // The peer disconnected.
+    return fd_status_NORW;
+  } else if (nbytes < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return fd_status_R;
+    }
+    perror("recv");
+    return fd_status_NORW;
+  }
+  peerstate->inbuf_len += nbytes;
+  return start_next_request(peerstate);
+}
+
+fd_status_t on_peer_ready_send(int sockfd) {
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
+  int sendlen = peerstate->sendbuf_end - peerstate->sendptr;
+  int nsent =
+      send(sockfd, &peerstate->sendbuf[peerstate->sendptr], sendlen,
+           MSG_NOSIGNAL);
+  if (nsent == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return fd_status_W;
+    }
+    perror("send");
+    return fd_status_NORW;
+  }
+  peerstate->sendptr += nsent;
+  if (peerstate->sendptr < peerstate->sendbuf_end) {
+    return fd_status_W;
+  }
+  peerstate->sendptr = peerstate->sendbuf_end = 0;
+  // A request may have arrived while this one was being served.
+  return start_next_request(peerstate);
+}
+
+// Applies what a peer callback returned.
+void update_peer(int fd, fd_status_t status) {
+  peer_state_t* peerstate = conn_table_get(peers, fd);
+  if (peerstate->busy) {
+    // Out of the epoll set until on_work_completed. The fd stays open, so it
+    // can't be reused by another peer in the meantime; a hangup shows up in
+    // the recv after the reply.
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+      perror_die("epoll_ctl EPOLL_CTL_DEL");
+    }
+  } else if (!status.want_read && !status.want_write) {
+    close_peer(fd);
+  } else {
+    set_epoll_interest(EPOLL_CTL_MOD, fd, status);
+  }
+}
+
+int main(int argc, const char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 8070;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+  int nthreads = DEFAULT_THREADS;
+  if (argc >= 3) {
+    nthreads = atoi(argv[2]);
+    if (nthreads < 1) {
+      die("usage: %s [port] [threads]; threads must be at least 1", argv[0]);
+    }
+  }
+  char* mode = getenv("MODE");
+  blocking = mode && !strcmp(mode, "BLOCK");
+  if (blocking) {
+    printf("Serving on port %d, testing on the loop\n", portnum);
+  } else {
+    printf("Serving on port %d, testing on %d threads\n", portnum, nthreads);
+    pool = offload_pool_create(nthreads);
+  }
+
+  int listener_sockfd = listen_inet_socket(portnum);
+  make_socket_non_blocking(listener_sockfd);
+
+  epollfd = epoll_create1(0);
+  if (epollfd < 0) {
+    perror_die("epoll_create1");
+  }
+
+  struct epoll_event accept_event;
+  accept_event.data.fd = listener_sockfd;
+  accept_event.events = EPOLLIN;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, listener_sockfd, &accept_event) < 0) {
+    perror_die("epoll_ctl EPOLL_CTL_ADD");
+  }
+
+  // Completed work is just another event.
+  int offload_eventfd = -1;
+  if (pool) {
+    offload_eventfd = offload_fd(pool);
+    struct epoll_event offload_event;
+    offload_event.data.fd = offload_eventfd;
+    offload_event.events = EPOLLIN;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, offload_eventfd, &offload_event) <
+        0) {
+      perror_die("epoll_ctl EPOLL_CTL_ADD");
+    }
+  }
+
+  peers = conn_table_create(sizeof(peer_state_t), 0);
+
+  struct epoll_event* events = calloc(MAXEVENTS, sizeof(struct epoll_event));
+  if (events == NULL) {
+    die("Unable to allocate memory for epoll_events");
+  }
+
+  while (1) {
+    int nready = epoll_wait(epollfd, events, MAXEVENTS, -1);
+    for (int i = 0; i < nready; i++) {
+      int fd = events[i].data.fd;
+      if (fd == offload_eventfd) {
+        offload_run_completions(pool);
+      } else if (fd == listener_sockfd) {
+        struct sockaddr_in peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        int newsockfd = accept(listener_sockfd, (struct sockaddr*)&peer_addr,
+                               &peer_addr_len);
+        if (newsockfd < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror_die("accept");
+          }
+          continue;
+        }
+        make_socket_non_blocking(newsockfd);
+        report_peer_connected(&peer_addr, peer_addr_len);
+        peer_state_t* peerstate = conn_table_add(peers, newsockfd);
+        peerstate->fd = newsockfd;
+        peerstate->task.data = peerstate;
+        set_epoll_interest(EPOLL_CTL_ADD, newsockfd, fd_status_R);
+      } else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        peer_state_t* peerstate = conn_table_get(peers, fd);
+        update_peer(fd, peerstate->sendbuf_end > 0 ? on_peer_ready_send(fd)
+                                                   : on_peer_ready_recv(fd));
+      } else if (events[i].events & EPOLLOUT) {
+        update_peer(fd, on_peer_ready_send(fd));
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,340 @@
+// Multi-reactor epoll server - the protocol and callbacks of epoll-server.c,
+// run by N reactor threads instead of one.
+//
+// Each reactor owns an epoll instance, a listening socket and a table of its
+// connections, and serves every connection it accepts until it closes. No
+// state is shared between reactors, so there are no locks on the data path
+// and throughput grows with the number of cores instead of saturating one.
+//
+// New connections are spread over the reactors in one of two ways:
+//
+//   reuseport (default): every reactor binds its own SO_REUSEPORT socket to
+//     the port, and the kernel hashes each incoming connection to one of them.
+//   exclusive: a single listening socket is added to every reactor's epoll
+//     with EPOLLEXCLUSIVE, so each new connection wakes one reactor rather
+//     than all of them (older kernels without SO_REUSEPORT).
+//
+// Reactor i is pinned to CPU i (mod the number of CPUs).
+//
+// Usage:
+//   ./epoll-server-reactors [port] [reactors] [reuseport|exclusive]
+//
+// This code is in the public domain.
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "conntable.h"
+#include "utils.h"
+
+#define MAX_EVENTS 1024
+
+typedef enum { INITIAL_ACK, WAIT_FOR_MSG, IN_MSG } ProcessingState;
+
+#define SENDBUF_SIZE 1024
+
+typedef struct {
+  ProcessingState state;
+  uint8_t* sendbuf;  // From the reactor's pool while output is pending
+  int sendbuf_end;
+  int sendptr;
+} peer_state_t;
+
+typedef struct {
+  int id;
+  int epollfd;
+  int listener_sockfd;
+  // The reactor's connections, indexed by fd. An fd belongs to exactly one
+  // reactor, so each table only has entries for its own reactor's fds and is
+  // only ever touched by that reactor's thread.
+  conn_table_t* conns;
+  pthread_t thread;
+} __attribute__((aligned(64))) reactor_t;
+
+typedef struct {
+  bool want_read;
+  bool want_write;
+} fd_status_t;
+
+const fd_status_t fd_status_R = {.want_read = true, .want_write = false};
+const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
+const fd_status_t fd_status_RW = {.want_read = true, .want_write = true};
+const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
+
+fd_status_t on_peer_connected(reactor_t* r, int sockfd,
+                              const struct sockaddr_in* peer_addr,
+                              socklen_t peer_addr_len) {
+  report_peer_connected(peer_addr, peer_addr_len);
+
+  // Initialize state to send back a '*' to the peer immediately.
+  peer_state_t* peerstate = conn_table_add(r->conns, sockfd);
+  peerstate->state = INITIAL_ACK;
+  peerstate->sendbuf = conn_sendbuf_get(r->conns);
+  peerstate->sendbuf[0] = '*';
+  peerstate->sendptr = 0;
+  peerstate->sendbuf_end = 1;
+
+  // Signal that this socket is ready for writing now.
+  return fd_status_W;
+}
+
+fd_status_t on_peer_ready_recv(reactor_t* r, int sockfd) {
+  peer_state_t* peerstate = conn_table_get(r->conns, sockfd);
+
+  if (peerstate->state == INITIAL_ACK ||
+      peerstate->sendptr < peerstate->sendbuf_end) {
+    // Until the initial ACK has been sent to the peer, there's nothing we
+    // want to receive. Also, wait until all data staged for sending is sent to
+    // receive more data.
+    return fd_status_W;
+  }
+
+  uint8_t buf[1024];
+  int nbytes = recv(sockfd, buf, sizeof buf, 0);
+  if (nbytes == 0) {
+    // The peer disconnected.
+    return fd_status_NORW;
+  } else if (nbytes < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // The socket is not *really* ready for recv; wait until it is.
+      return fd_status_R;
+    }
+    // One peer's error (typically ECONNRESET) must not bring down the whole
+    // server; drop the connection.
+    perror("recv");
+    return fd_status_NORW;
+  }
+  bool ready_to_send = false;
+  for (int i = 0; i < nbytes; ++i) {
+    switch (peerstate->state) {
+    case INITIAL_ACK:
+      assert(0 && "can't reach here");
+      break;
+    case WAIT_FOR_MSG:
+      if (buf[i] == '^') {
+        peerstate->state = IN_MSG;
+      }
+      break;
+    case IN_MSG:
+      if (buf[i] == '$') {
+        peerstate->state = WAIT_FOR_MSG;
+      } else {
+        if (!peerstate->sendbuf) {
+          peerstate->sendbuf = conn_sendbuf_get(r->conns);
+        }
+        assert(peerstate->sendbuf_end < SENDBUF_SIZE);
+        peerstate->sendbuf[peerstate->sendbuf_end++] = buf[i] + 1;
+        ready_to_send = true;
+      }
+      break;
+    }
+  }
+  // Report reading readiness iff there's nothing to send to the peer as a
+  // result of the latest recv.
+  return (fd_status_t){.want_read = !ready_to_send,
+                       .want_write = ready_to_send};
+}
+
+fd_status_t on_peer_ready_send(reactor_t* r, int sockfd) {
+  peer_state_t* peerstate = conn_table_get(r->conns, sockfd);
+
+  if (peerstate->sendptr >= peerstate->sendbuf_end) {
+    // Nothing to send.
+    return fd_status_RW;
+  }
+  int sendlen = peerstate->sendbuf_end - peerstate->sendptr;
+  int nsent = send(sockfd, &peerstate->sendbuf[peerstate->sendptr], sendlen,
+                   MSG_NOSIGNAL);
+  if (nsent == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return fd_status_W;
+    }
+    perror("send");
+    return fd_status_NORW;
+  }
+  if (nsent < sendlen) {
+    peerstate->sendptr += nsent;
+    return fd_status_W;
+  } else {
+    // Everything was sent successfully; reset the send queue.
+    conn_sendbuf_put(r->conns, peerstate->sendbuf);
+    peerstate->sendbuf = NULL;
+    peerstate->sendptr = 0;
+    peerstate->sendbuf_end = 0;
+
+    // Special-case state transition in if we were in INITIAL_ACK until now.
+    if (peerstate->state == INITIAL_ACK) {
+      peerstate->state = WAIT_FOR_MSG;
+    }
+
+    return fd_status_R;
+  }
+}
+
+// Applies a callback's verdict: change the fd's epoll interest, or close it.
+void update_interest(reactor_t* r, int fd, fd_status_t status) {
+  struct epoll_event event = {0};
+  event.data.fd = fd;
+  if (status.want_read) {
+    event.events |= EPOLLIN;
+  }
+  if (status.want_write) {
+    event.events |= EPOLLOUT;
+  }
+  if (event.events == 0) {
+    printf("reactor %d: socket %d closing\n", r->id, fd);
+    if (epoll_ctl(r->epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+      perror_die("epoll_ctl EPOLL_CTL_DEL");
+    }
+    peer_state_t* peerstate = conn_table_get(r->conns, fd);
+    if (peerstate->sendbuf) {
+      conn_sendbuf_put(r->conns, peerstate->sendbuf);
+    }
+    conn_table_remove(r->conns, fd);
+    close(fd);
+  } else if (epoll_ctl(r->epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
+    perror_die("epoll_ctl EPOLL_CTL_MOD");
+  }
+}
+
+void accept_peer(reactor_t* r) {
+  struct sockaddr_in peer_addr;
+  socklen_t peer_addr_len = sizeof(peer_addr);
+  int newsockfd = accept4(r->listener_sockfd, (struct sockaddr*)&peer_addr,
+                          &peer_addr_len, SOCK_NONBLOCK);
+  if (newsockfd < 0) {
+    // EAGAIN is normal here: with a shared listener another reactor may
+    // have taken the connection first.
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("accept");
+    }
+    return;
+  }
+
+  fd_status_t status =
+      on_peer_connected(r, newsockfd, &peer_addr, peer_addr_len);
+  struct epoll_event event = {0};
+  event.data.fd = newsockfd;
+  if (status.want_read) {
+    event.events |= EPOLLIN;
+  }
+  if (status.want_write) {
+    event.events |= EPOLLOUT;
+  }
+  if (epoll_ctl(r->epollfd, EPOLL_CTL_ADD, newsockfd, &event) < 0) {
+    perror_die("epoll_ctl EPOLL_CTL_ADD");
+  }
+}
+
+void* reactor_thread(void* arg) {
+  reactor_t* r = arg;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (1) {
+    int nready = epoll_wait(r->epollfd, events, MAX_EVENTS, -1);
+    if (nready < 0 && errno != EINTR) {
+      perror_die("epoll_wait");
+    }
+    for (int i = 0; i < nready; i++) {
+      int fd = events[i].data.fd;
+      if (fd == r->listener_sockfd) {
+        accept_peer(r);
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        // An error or hangup shows up as a failed send if output is pending,
+        // and as a failed or empty recv otherwise. on_peer_ready_recv would
+        // just ask for EPOLLOUT while output is pending, which a level-
+        // triggered hangup would report again forever.
+        peer_state_t* peerstate = conn_table_get(r->conns, fd);
+        bool pending = peerstate->state == INITIAL_ACK ||
+                       peerstate->sendptr < peerstate->sendbuf_end;
+        update_interest(r, fd, pending ? on_peer_ready_send(r, fd)
+                                       : on_peer_ready_recv(r, fd));
+      } else if (events[i].events & EPOLLIN) {
+        update_interest(r, fd, on_peer_ready_recv(r, fd));
+      } else if (events[i].events & EPOLLOUT) {
+        update_interest(r, fd, on_peer_ready_send(r, fd));
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, const char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 9090;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+  int nreactors = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (argc >= 3) {
+    nreactors = atoi(argv[2]);
+  }
+  bool exclusive = argc >= 4 && strcmp(argv[3], "exclusive") == 0;
+  if (nreactors < 1) {
+    nreactors = 1;
+  }
+  printf("Serving on port %d with %d reactors (%s)\n", portnum, nreactors,
+         exclusive ? "shared listener, EPOLLEXCLUSIVE" : "SO_REUSEPORT");
+
+  int shared_listener = -1;
+  if (exclusive) {
+    shared_listener = listen_inet_socket(portnum);
+    make_socket_non_blocking(shared_listener);
+  }
+
+  reactor_t* reactors = aligned_alloc(64, sizeof(reactor_t) * nreactors);
+  if (!reactors) {
+    die("OOM");
+  }
+  memset(reactors, 0, sizeof(reactor_t) * nreactors);
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 0; i < nreactors; i++) {
+    reactor_t* r = &reactors[i];
+    r->id = i;
+    r->conns = conn_table_create(sizeof(peer_state_t), SENDBUF_SIZE);
+    r->epollfd = epoll_create1(0);
+    if (r->epollfd < 0) {
+      perror_die("epoll_create1");
+    }
+    if (exclusive) {
+      r->listener_sockfd = shared_listener;
+    } else {
+      r->listener_sockfd = listen_inet_socket_reuseport(portnum);
+      make_socket_non_blocking(r->listener_sockfd);
+    }
+
+    struct epoll_event accept_event;
+    accept_event.data.fd = r->listener_sockfd;
+    accept_event.events = EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0);
+    if (epoll_ctl(r->epollfd, EPOLL_CTL_ADD, r->listener_sockfd,
+                  &accept_event) < 0) {
+      perror_die("epoll_ctl EPOLL_CTL_ADD");
+    }
+
+    if (pthread_create(&r->thread, NULL, reactor_thread, r) != 0) {
+      die("pthread_create failed");
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(i % ncpus, &cpus);
+    pthread_setaffinity_np(r->thread, sizeof(cpus), &cpus);
+  }
+
+  for (int i = 0; i < nreactors; i++) {
+    pthread_join(reactors[i].thread, NULL);
+  }
+  return 0;
+}
@@ -1,6 +1,25 @@
 // Asynchronous socket server - accepting multiple clients concurrently,
 // multiplexing the connections with epoll.
 //
+// Two modes, picked by the second argument:
+//
+//   lt (default): level-triggered. After every recv or send the fd's interest
+//     is flipped between EPOLLIN and EPOLLOUT with EPOLL_CTL_MOD, which costs
+//     an extra syscall per event.
+//   et: edge-triggered. Each peer is registered once for both directions with
+//     EPOLLET, and readiness is tracked in peer_state_t. On an event we flush
+//     pending output and read until the socket runs dry, since epoll will not
+//     report the same readiness again.
+//
+// Replies are staged in an outbuf_t (see outbuf.h) and sent with sendmsg.
+// With "zerocopy" as the third argument, large sends use MSG_ZEROCOPY.
+//
+// When the last peer disconnects, the server prints how many syscalls it made
+// per message ('^...$') served, broken down by call.
+//
+// Usage:
+//   ./epoll-server [port] [lt|et] [zerocopy]
+//
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
 #include <assert.h>
@@ -15,27 +34,64 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "conntable.h"
+#include "framing.h"
+#include "outbuf.h"
 #include "utils.h"
 
-#define MAXFDS 16 * 1024
+// Maximal number of events returned by a single epoll_wait.
+#define MAXEVENTS 1024
 
 typedef enum { INITIAL_ACK, WAIT_FOR_MSG, IN_MSG } ProcessingState;
 
-#define SENDBUF_SIZE 1024
+// Bytes read per recv. Replies are no longer bounded by a fixed send buffer,
+// so reads can be large enough for the replies to one of them to reach
+// OUTBUF_ZEROCOPY_MIN.
+#define RECVBUF_SIZE (64 * 1024)
 
 typedef struct {
   ProcessingState state;
-  uint8_t sendbuf[SENDBUF_SIZE];
-  int sendbuf_end;
-  int sendptr;
+  // Replies waiting to be sent to the peer.
+  outbuf_t out;
+
+  // Edge-triggered mode only: what epoll last told us, until a syscall shows
+  // otherwise.
+  bool readable;
+  bool writable;
+  bool peer_closed;  // EPOLLRDHUP seen: keep reading until recv returns 0
 } peer_state_t;
 
 // Each peer is globally identified by the file descriptor (fd) it's connected
 // on. As long as the peer is connected, the fd is unique to it. When a peer
 // disconnects, a new peer may connect and get the same fd. on_peer_connected
-// should initialize the state properly to remove any trace of the old peer on
-// the same fd.
-peer_state_t global_state[MAXFDS];
+// adds the peer's state to this table, and close_peer removes it.
+conn_table_t* peers;
+
+bool edge_triggered = false;
+bool zerocopy = false;
+
+// The '*' every peer is greeted with. Peers' outbufs all reference this one
+// slice.
+slice_t* ack_slice;
+
+// Syscalls made on behalf of peers, and the messages they served.
+struct {
+  long epoll_wait;
+  long epoll_ctl;
+  long recv;
+  long send;
+  long messages;
+} stats;
+
+void report_stats(void) {
+  long total = stats.epoll_wait + stats.epoll_ctl + stats.recv + stats.send;
+  printf("%s: %ld messages, %ld syscalls, %.2f per message "
+         "(epoll_wait %ld, epoll_ctl %ld, recv %ld, send %ld)\n",
+         edge_triggered ? "et" : "lt", stats.messages, total,
+         stats.messages ? (double)total / stats.messages : 0, stats.epoll_wait,
+         stats.epoll_ctl, stats.recv, stats.send);
+  memset(&stats, 0, sizeof(stats));
+}
 
 // Callbacks (on_XXX functions) return this status to the main loop; the status
 // instructs the loop about the next steps for the fd for which the callback was
@@ -56,33 +112,75 @@ const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
 
 fd_status_t on_peer_connected(int sockfd, const struct sockaddr_in* peer_addr,
                               socklen_t peer_addr_len) {
-  assert(sockfd < MAXFDS);
   report_peer_connected(peer_addr, peer_addr_len);
 
   // Initialize state to send back a '*' to the peer immediately.
-  peer_state_t* peerstate = &global_state[sockfd];
+  peer_state_t* peerstate = conn_table_add(peers, sockfd);
   peerstate->state = INITIAL_ACK;
-  peerstate->sendbuf[0] = '*';
-  peerstate->sendptr = 0;
-  peerstate->sendbuf_end = 1;
+  outbuf_init(&peerstate->out);
+  if (zerocopy && !outbuf_enable_zerocopy(&peerstate->out, sockfd)) {
+    perror("setsockopt SO_ZEROCOPY");
+  }
+  outbuf_append_slice(&peerstate->out, ack_slice, 0, 1);
+  peerstate->readable = false;
+  peerstate->writable = true;  // A fresh socket has send buffer space
+  peerstate->peer_closed = false;
 
   // Signal that this socket is ready for writing now.
   return fd_status_W;
 }
 
+// Runs received bytes through the protocol state machine, writing the replies
+// straight into the peer's outbuf. Returns true if there is something to send.
+//
+// Rather than stepping byte by byte, each state skips ahead to the byte that
+// ends it, using the vectorized helpers of framing.h: '^' while waiting for a
+// message, '$' while transforming one. A message may be any length; its reply
+// streams into as many outbuf slices as it takes.
+bool process_input(peer_state_t* peerstate, const uint8_t* buf, int nbytes) {
+  assert(peerstate->state != INITIAL_ACK);
+  bool ready_to_send = false;
+  const uint8_t* p = buf;
+  const uint8_t* end = buf + nbytes;
+  while (p < end) {
+    if (peerstate->state == WAIT_FOR_MSG) {
+      p = framing_find(p, end, '^');
+      if (p == end) {
+        break;
+      }
+      p++;
+      peerstate->state = IN_MSG;
+    } else {
+      size_t room;
+      uint8_t* out = outbuf_reserve(&peerstate->out, 1, &room);
+      size_t avail = (size_t)(end - p) < room ? (size_t)(end - p) : room;
+      size_t n = framing_transform(out, p, avail);
+      outbuf_commit(&peerstate->out, n);
+      ready_to_send |= n > 0;
+      p += n;
+      if (n < avail) {
+        // Stopped at the '$'.
+        p++;
+        peerstate->state = WAIT_FOR_MSG;
+        stats.messages++;
+      }
+    }
+  }
+  return ready_to_send;
+}
+
 fd_status_t on_peer_ready_recv(int sockfd) {
-  assert(sockfd < MAXFDS);
-  peer_state_t* peerstate = &global_state[sockfd];
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
 
-  if (peerstate->state == INITIAL_ACK ||
-      peerstate->sendptr < peerstate->sendbuf_end) {
+  if (peerstate->state == INITIAL_ACK || outbuf_pending(&peerstate->out) > 0) {
     // Until the initial ACK has been sent to the peer, there's nothing we
     // want to receive. Also, wait until all data staged for sending is sent to
     // receive more data.
     return fd_status_W;
   }
 
-  uint8_t buf[1024];
+  uint8_t buf[RECVBUF_SIZE];
+  stats.recv++;
   int nbytes = recv(sockfd, buf, sizeof buf, 0);
   if (nbytes == 0) {
     // The peer disconnected.
@@ -91,32 +189,12 @@ fd_status_t on_peer_ready_recv(int sockfd) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
       // The socket is not *really* ready for recv; wait until it is.
       return fd_status_R;
-    } else {
-      perror_die("recv");
-    }
-  }
-  bool ready_to_send = false;
-  for (int i = 0; i < nbytes; ++i) {
-    switch (peerstate->state) {
-    case INITIAL_ACK:
-      assert(0 && "can't reach here");
-      break;
-    case WAIT_FOR_MSG:
-      if (buf[i] == '^') {
-        peerstate->state = IN_MSG;
-      }
-      break;
-    case IN_MSG:
-      if (buf[i] == '$') {
-        peerstate->state = WAIT_FOR_MSG;
-      } else {
-        assert(peerstate->sendbuf_end < SENDBUF_SIZE);
-        peerstate->sendbuf[peerstate->sendbuf_end++] = buf[i] + 1;
-        ready_to_send = true;
-      }
-      break;
     }
+    // One peer's error (typically ECONNRESET) only closes that peer.
+    perror("recv");
+    return fd_status_NORW;
   }
+  bool ready_to_send = process_input(peerstate, buf, nbytes);
   // Report reading readiness iff there's nothing to send to the peer as a
   // result of the latest recv.
   return (fd_status_t){.want_read = !ready_to_send,
@@ -124,30 +202,24 @@ fd_status_t on_peer_ready_recv(int sockfd) {
 }
 
 fd_status_t on_peer_ready_send(int sockfd) {
-  assert(sockfd < MAXFDS);
-  peer_state_t* peerstate = &global_state[sockfd];
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
 
-  if (peerstate->sendptr >= peerstate->sendbuf_end) {
+  if (outbuf_pending(&peerstate->out) == 0) {
     // Nothing to send.
     return fd_status_RW;
   }
-  int sendlen = peerstate->sendbuf_end - peerstate->sendptr;
-  int nsent = send(sockfd, &peerstate->sendbuf[peerstate->sendptr], sendlen, 0);
+  stats.send++;
+  ssize_t nsent = outbuf_send(&peerstate->out, sockfd, MSG_NOSIGNAL);
   if (nsent == -1) {
     if (errno == EAGAIN || errno == EWOULDBLOCK) {
       return fd_status_W;
-    } else {
-      perror_die("send");
     }
+    perror("send");
+    return fd_status_NORW;
   }
-  if (nsent < sendlen) {
-    peerstate->sendptr += nsent;
+  if (outbuf_pending(&peerstate->out) > 0) {
     return fd_status_W;
   } else {
-    // Everything was sent successfully; reset the send queue.
-    peerstate->sendptr = 0;
-    peerstate->sendbuf_end = 0;
-
     // Special-case state transition in if we were in INITIAL_ACK until now.
     if (peerstate->state == INITIAL_ACK) {
       peerstate->state = WAIT_FOR_MSG;
@@ -157,6 +229,87 @@ fd_status_t on_peer_ready_send(int sockfd) {
   }
 }
 
+// Edge-triggered counterpart of on_peer_ready_recv/on_peer_ready_send: makes
+// as much progress as the socket allows. Staged output is flushed first; then
+// input is read and processed, one buffer at a time, until the socket is
+// drained or the replies can't be sent yet (the same backpressure as the
+// level-triggered path: nothing is read while output is pending). Returns
+// false when the connection should be closed.
+//
+// A short recv means the socket was drained at that moment: anything that
+// arrives later raises a new edge, so there's no need to spend another recv
+// on the EAGAIN. The exception is a pending EOF, whose edge may already have
+// been consumed, hence peer_closed. Sends, on the other hand, go on until
+// everything is out or EAGAIN: a single sendmsg only covers OUTBUF_IOV_MAX
+// segments, so a partial send doesn't prove that the socket buffer is full.
+bool on_peer_ready_et(int sockfd) {
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
+
+  while (1) {
+    if (outbuf_pending(&peerstate->out) > 0) {
+      if (!peerstate->writable) {
+        return true;
+      }
+      stats.send++;
+      if (outbuf_send(&peerstate->out, sockfd, MSG_NOSIGNAL) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          peerstate->writable = false;
+          return true;
+        }
+        perror("send");
+        return false;
+      }
+      if (outbuf_pending(&peerstate->out) > 0) {
+        continue;
+      }
+      if (peerstate->state == INITIAL_ACK) {
+        peerstate->state = WAIT_FOR_MSG;
+      }
+    }
+
+    if (!peerstate->readable) {
+      return true;
+    }
+    uint8_t buf[RECVBUF_SIZE];
+    stats.recv++;
+    int nbytes = recv(sockfd, buf, sizeof buf, 0);
+    if (nbytes == 0) {
+      return false;
+    } else if (nbytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        peerstate->readable = false;
+        return true;
+      }
+      perror("recv");
+      return false;
+    }
+    if (nbytes < (int)sizeof buf && !peerstate->peer_closed) {
+      peerstate->readable = false;
+    }
+    process_input(peerstate, buf, nbytes);
+  }
+}
+
+void close_peer(int epollfd, int fd) {
+  printf("socket %d closing\n", fd);
+  stats.epoll_ctl++;
+  if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+    perror_die("epoll_ctl EPOLL_CTL_DEL");
+  }
+  // Collect the zero-copy completions that have already arrived; slices
+  // still pinned after that are leaked by outbuf_free rather than reused.
+  peer_state_t* peerstate = conn_table_get(peers, fd);
+  if (outbuf_zerocopy_inflight(&peerstate->out)) {
+    outbuf_reap_zerocopy(&peerstate->out, fd);
+  }
+  close(fd);
+  outbuf_free(&peerstate->out);
+  conn_table_remove(peers, fd);
+  if (conn_table_count(peers) == 0) {
+    report_stats();
+  }
+}
+
 int main(int argc, const char** argv) {
   setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -164,7 +317,24 @@ int main(int argc, const char** argv) {
   if (argc >= 2) {
     portnum = atoi(argv[1]);
   }
-  printf("Serving on port %d\n", portnum);
+  if (argc >= 3) {
+    if (strcmp(argv[2], "et") == 0) {
+      edge_triggered = true;
+    } else if (strcmp(argv[2], "lt") != 0) {
+      die("usage: %s [port] [lt|et] [zerocopy]", argv[0]);
+    }
+  }
+  if (argc >= 4) {
+    if (strcmp(argv[3], "zerocopy") != 0) {
+      die("usage: %s [port] [lt|et] [zerocopy]", argv[0]);
+    }
+    zerocopy = true;
+  }
+  printf("Serving on port %d (%s-triggered%s)\n", portnum,
+         edge_triggered ? "edge" : "level", zerocopy ? ", zero-copy" : "");
+
+  ack_slice = slice_new(1);
+  ack_slice->data[0] = '*';
 
   int listener_sockfd = listen_inet_socket(portnum);
   make_socket_non_blocking(listener_sockfd);
@@ -181,14 +351,58 @@ int main(int argc, const char** argv) {
     perror_die("epoll_ctl EPOLL_CTL_ADD");
   }
 
-  struct epoll_event* events = calloc(MAXFDS, sizeof(struct epoll_event));
+  // Send buffers come from the peers' outbufs, not the table's pool.
+  peers = conn_table_create(sizeof(peer_state_t), 0);
+
+  struct epoll_event* events = calloc(MAXEVENTS, sizeof(struct epoll_event));
   if (events == NULL) {
     die("Unable to allocate memory for epoll_events");
   }
 
   while (1) {
-    int nready = epoll_wait(epollfd, events, MAXFDS, -1);
+    stats.epoll_wait++;
+    int nready = epoll_wait(epollfd, events, MAXEVENTS, -1);
     for (int i = 0; i < nready; i++) {
+      if (events[i].data.fd != listener_sockfd &&
+          (events[i].events & EPOLLERR)) {
+        // Zero-copy completions arrive on the socket's error queue, which
+        // epoll reports as EPOLLERR; so does a failed connection.
+        int fd = events[i].data.fd;
+        peer_state_t* peerstate = conn_table_get(peers, fd);
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        if (outbuf_reap_zerocopy(&peerstate->out, fd) < 0 ||
+            (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 &&
+             err != 0)) {
+          printf("socket %d: %s\n", fd, strerror(err ? err : errno));
+          close_peer(epollfd, fd);
+          continue;
+        }
+        events[i].events &= ~EPOLLERR;
+        if (events[i].events == 0) {
+          continue;
+        }
+      }
+
+      if (edge_triggered && events[i].data.fd != listener_sockfd) {
+        // Hangups surface through the next recv or send.
+        int fd = events[i].data.fd;
+        peer_state_t* peerstate = conn_table_get(peers, fd);
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+          peerstate->readable = true;
+        }
+        if (events[i].events & (EPOLLRDHUP | EPOLLHUP)) {
+          peerstate->peer_closed = true;
+        }
+        if (events[i].events & (EPOLLOUT | EPOLLHUP)) {
+          peerstate->writable = true;
+        }
+        if (!on_peer_ready_et(fd)) {
+          close_peer(epollfd, fd);
+        }
+        continue;
+      }
+
       if (events[i].events & EPOLLERR) {
         perror_die("epoll_wait returned EPOLLERR");
       }
@@ -211,30 +425,46 @@ int main(int argc, const char** argv) {
           }
         } else {
           make_socket_non_blocking(newsockfd);
-          if (newsockfd >= MAXFDS) {
-            die("socket fd (%d) >= MAXFDS (%d)", newsockfd, MAXFDS);
-          }
 
           fd_status_t status =
               on_peer_connected(newsockfd, &peer_addr, peer_addr_len);
           struct epoll_event event = {0};
           event.data.fd = newsockfd;
-          if (status.want_read) {
-            event.events |= EPOLLIN;
-          }
-          if (status.want_write) {
-            event.events |= EPOLLOUT;
+          if (edge_triggered) {
+            // Both directions, once and for all.
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+          } else {
+            if (status.want_read) {
+              event.events |= EPOLLIN;
+            }
+            if (status.want_write) {
+              event.events |= EPOLLOUT;
+            }
           }
 
+          stats.epoll_ctl++;
           if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &event) < 0) {
             perror_die("epoll_ctl EPOLL_CTL_ADD");
           }
+          // In edge-triggered mode send the '*' right away rather than
+          // waiting for the first EPOLLOUT.
+          if (edge_triggered && !on_peer_ready_et(newsockfd)) {
+            close_peer(epollfd, newsockfd);
+          }
         }
       } else {
-        // A peer socket is ready.
+        // A peer socket is ready. A hangup comes with EPOLLIN, but while
+        // output is pending on_peer_ready_recv would only ask for EPOLLOUT
+        // again; let the send fail instead, which closes the peer.
+        int fd = events[i].data.fd;
+        peer_state_t* peerstate = conn_table_get(peers, fd);
+        if ((events[i].events & EPOLLHUP) &&
+            (peerstate->state == INITIAL_ACK ||
+             outbuf_pending(&peerstate->out) > 0)) {
+          events[i].events = EPOLLOUT;
+        }
         if (events[i].events & EPOLLIN) {
           // Ready for reading.
-          int fd = events[i].data.fd;
           fd_status_t status = on_peer_ready_recv(fd);
           struct epoll_event event = {0};
           event.data.fd = fd;
@@ -245,17 +475,13 @@ int main(int argc, const char** argv) {
             event.events |= EPOLLOUT;
           }
           if (event.events == 0) {
-            printf("socket %d closing\n", fd);
-            if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-              perror_die("epoll_ctl EPOLL_CTL_DEL");
-            }
-            close(fd);
-          } else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
+            close_peer(epollfd, fd);
+          } else if (stats.epoll_ctl++,
+                     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
             perror_die("epoll_ctl EPOLL_CTL_MOD");
           }
         } else if (events[i].events & EPOLLOUT) {
           // Ready for writing.
-          int fd = events[i].data.fd;
           fd_status_t status = on_peer_ready_send(fd);
           struct epoll_event event = {0};
           event.data.fd = fd;
@@ -267,12 +493,9 @@ int main(int argc, const char** argv) {
             event.events |= EPOLLOUT;
           }
           if (event.events == 0) {
-            printf("socket %d closing\n", fd);
-            if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-              perror_die("epoll_ctl EPOLL_CTL_DEL");
-            }
-            close(fd);
-          } else if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
+            close_peer(epollfd, fd);
+          } else if (stats.epoll_ctl++,
+                     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
             perror_die("epoll_ctl EPOLL_CTL_MOD");
           }
         }
@@ -0,0 +1,130 @@
+// Fiber socket server - the thread-per-connection model of threaded-server.c,
+// with each connection served by a fiber (see fiber.h) instead of an OS
+// thread. serve_connection is written as straight blocking code, but a fiber
+// waiting on its socket only holds a small stack, so the server can keep
+// 100k mostly idle connections open on a handful of worker threads.
+//
+// Usage:
+//   ./fiber-server [port] [worker threads]
+//
+// This code is in the public domain.
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "fiber.h"
+#include "utils.h"
+
+typedef enum { WAIT_FOR_MSG, IN_MSG } ProcessingState;
+
+// fiber_send until all of buf is out. Returns false on error.
+bool send_all(int sockfd, const uint8_t* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = fiber_send(sockfd, buf, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+void serve_connection(int sockfd) {
+  if (fiber_send(sockfd, "*", 1, MSG_NOSIGNAL) < 1) {
+    perror("send");
+    close(sockfd);
+    return;
+  }
+
+  ProcessingState state = WAIT_FOR_MSG;
+
+  while (1) {
+    uint8_t buf[1024];
+    int len = fiber_recv(sockfd, buf, sizeof buf, 0);
+    if (len < 0) {
+      perror("recv");
+      break;
+    } else if (len == 0) {
+      break;
+    }
+
+    // The replies to everything in buf go out with one send, not one per
+    // byte; there can't be more of them than bytes received.
+    uint8_t reply[sizeof buf];
+    size_t replylen = 0;
+    for (int i = 0; i < len; ++i) {
+      switch (state) {
+      case WAIT_FOR_MSG:
+        if (buf[i] == '^') {
+          state = IN_MSG;
+        }
+        break;
+      case IN_MSG:
+        if (buf[i] == '$') {
+          state = WAIT_FOR_MSG;
+        } else {
+          reply[replylen++] = buf[i] + 1;
+        }
+        break;
+      }
+    }
+    if (!send_all(sockfd, reply, replylen)) {
+      perror("send error");
+      break;
+    }
+  }
+
+  close(sockfd);
+}
+
+void connection_fiber(void* arg) { serve_connection((int)(intptr_t)arg); }
+
+void accept_fiber(void* arg) {
+  int sockfd = *(int*)arg;
+
+  while (1) {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+
+    int newsockfd =
+        fiber_accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+
+    if (newsockfd < 0) {
+      perror_die("ERROR on accept");
+    }
+
+    report_peer_connected(&peer_addr, peer_addr_len);
+
+    if (!fiber_spawn(connection_fiber, (void*)(intptr_t)newsockfd)) {
+      perror("fiber_spawn");
+      close(newsockfd);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 9090;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+  int nthreads = 0;
+  if (argc >= 3) {
+    nthreads = atoi(argv[2]);
+  }
+  printf("Serving on port %d\n", portnum);
+  fflush(stdout);
+
+  int sockfd = listen_inet_socket(portnum);
+  make_socket_non_blocking(sockfd);
+
+  fiber_run(accept_fiber, &sockfd, nthreads);
+  return 0;
+}
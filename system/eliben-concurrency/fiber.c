@@ -0,0 +1,701 @@
+// Fiber runtime: context switch, stacks, M:N scheduler and I/O poller.
+// See fiber.h for the interface.
+//
+// Each worker thread loops: pop a runnable fiber from the shared run queue,
+// switch to it, and when the fiber switches back, run the "after" action the
+// fiber left behind. A fiber that is about to block cannot make itself
+// findable (push itself on a wait list, arm epoll, ...) before it has
+// switched away, or another worker could resume it while its registers are
+// still being saved. So it passes that step to its worker as the after
+// action, which runs once the fiber's context is safely stored.
+//
+// This code is in the public domain.
+#define _GNU_SOURCE
+#include "fiber.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#if !defined(__x86_64__)
+#error "fiber.c: the context switch is written for x86-64"
+#endif
+
+// ----------------------------------------------------------------------------
+// Context switch
+//
+// fiber_switch(save, to) pushes the callee-saved registers and the SSE/x87
+// control words on the current stack, stores the stack pointer in *save, then
+// loads `to` and pops the same frame from there. Everything else is
+// caller-saved in the SysV ABI, so the C compiler has already spilled it.
+void fiber_switch(void** save, void* to);
+
+__asm__(
+    ".text\n"
+    ".globl fiber_switch\n"
+    ".hidden fiber_switch\n"
+    ".type fiber_switch, @function\n"
+    "fiber_switch:\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  subq $8, %rsp\n"
+    "  stmxcsr (%rsp)\n"
+    "  fnstcw 4(%rsp)\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  ldmxcsr (%rsp)\n"
+    "  fldcw 4(%rsp)\n"
+    "  addq $8, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".size fiber_switch, .-fiber_switch\n");
+
+// ----------------------------------------------------------------------------
+// Fibers and stacks
+
+struct Fiber {
+  void* sp;  // Saved stack pointer while not running
+  void (*fn)(void*);
+  void* arg;
+  Fiber* next;     // Link in the run queue, a mutex wait list or the cache
+  char* map_base;  // Start of the mapping (the guard page)
+  uint64_t wake_at;  // CLOCK_MONOTONIC ns, while sleeping
+};
+
+// Every fiber is one mapping: a PROT_NONE guard page, then the stack, with
+// the Fiber struct itself in the last bytes at the top. Finished fibers are
+// cached and reused whole, which saves the mmap/mprotect/munmap calls.
+#define STACK_CACHE_MAX 4096
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Fiber* cache_head;
+static int cache_count;
+
+static Fiber* fiber_alloc(void) {
+  pthread_mutex_lock(&cache_lock);
+  Fiber* f = cache_head;
+  if (f) {
+    cache_head = f->next;
+    cache_count--;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (f) {
+    return f;
+  }
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = page + FIBER_STACK_SIZE;
+  char* base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  if (mprotect(base, page, PROT_NONE) < 0) {
+    munmap(base, size);
+    return NULL;
+  }
+  f = (Fiber*)((uintptr_t)(base + size - sizeof(Fiber)) & ~(uintptr_t)63);
+  f->map_base = base;
+  return f;
+}
+
+static void fiber_free(Fiber* f) {
+  pthread_mutex_lock(&cache_lock);
+  if (cache_count < STACK_CACHE_MAX) {
+    f->next = cache_head;
+    cache_head = f;
+    cache_count++;
+    f = NULL;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (f) {
+    munmap(f->map_base, sysconf(_SC_PAGESIZE) + FIBER_STACK_SIZE);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Workers and the run queue
+
+typedef struct {
+  void* sched_sp;  // The worker loop's context while a fiber runs
+  Fiber* current;
+  void (*after)(Fiber*, void*);
+  void* after_arg;
+} Worker;
+
+static __thread Worker* tls_worker;
+
+// A fiber can resume on a different thread than it parked on, so the
+// thread-local must be re-read after every switch. The empty volatile asm
+// keeps the compiler from treating this as a pure function and reusing an
+// old result.
+static __attribute__((noinline)) Worker* this_worker(void) {
+  __asm__ volatile("" ::: "memory");
+  return tls_worker;
+}
+
+static pthread_mutex_t runq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t runq_cond = PTHREAD_COND_INITIALIZER;
+static Fiber* runq_head;
+static Fiber* runq_tail;
+static int runq_idle;  // Workers waiting on runq_cond
+static int runq_done;  // No fibers left; workers exit
+static long live_fibers;
+
+static int epfd = -1;
+static int wakefd = -1;  // eventfd that interrupts the poller's epoll_wait
+
+static void runq_push(Fiber* f) {
+  f->next = NULL;
+  pthread_mutex_lock(&runq_lock);
+  if (runq_tail) {
+    runq_tail->next = f;
+  } else {
+    runq_head = f;
+  }
+  runq_tail = f;
+  if (runq_idle) {
+    pthread_cond_signal(&runq_cond);
+  }
+  pthread_mutex_unlock(&runq_lock);
+}
+
+// Returns NULL once every fiber has finished.
+static Fiber* runq_pop(void) {
+  pthread_mutex_lock(&runq_lock);
+  while (!runq_head && !runq_done) {
+    runq_idle++;
+    pthread_cond_wait(&runq_cond, &runq_lock);
+    runq_idle--;
+  }
+  Fiber* f = runq_head;
+  if (f) {
+    runq_head = f->next;
+    if (!runq_head) {
+      runq_tail = NULL;
+    }
+  }
+  pthread_mutex_unlock(&runq_lock);
+  return f;
+}
+
+static void wake_poller(void) {
+  uint64_t one = 1;
+  if (wakefd >= 0 && write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("fiber: eventfd write");
+  }
+}
+
+static void* worker_main(void* arg) {
+  Worker* w = arg;
+  tls_worker = w;
+  Fiber* f;
+  while ((f = runq_pop())) {
+    w->current = f;
+    w->after = NULL;
+    fiber_switch(&w->sched_sp, f->sp);
+    w->current = NULL;
+    if (w->after) {
+      w->after(f, w->after_arg);
+    }
+  }
+  return NULL;
+}
+
+// Switches from the running fiber back to its worker, which then calls
+// after(self, arg). Returns when something makes the fiber runnable again.
+static void park(void (*after)(Fiber*, void*), void* arg) {
+  Worker* w = this_worker();
+  Fiber* self = w->current;
+  w->after = after;
+  w->after_arg = arg;
+  fiber_switch(&self->sp, w->sched_sp);
+}
+
+static void after_exit(Fiber* f, void* arg) {
+  (void)arg;
+  fiber_free(f);
+  if (__atomic_sub_fetch(&live_fibers, 1, __ATOMIC_ACQ_REL) == 0) {
+    pthread_mutex_lock(&runq_lock);
+    __atomic_store_n(&runq_done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&runq_cond);
+    pthread_mutex_unlock(&runq_lock);
+    wake_poller();
+  }
+}
+
+static void fiber_entry(void) {
+  Fiber* self = this_worker()->current;
+  self->fn(self->arg);
+  park(after_exit, NULL);
+  abort();  // Not reached: an exited fiber is never resumed
+}
+
+Fiber* fiber_spawn(void (*fn)(void*), void* arg) {
+  Fiber* f = fiber_alloc();
+  if (!f) {
+    return NULL;
+  }
+  f->fn = fn;
+  f->arg = arg;
+
+  // Build the frame fiber_switch pops: control words, six zeroed registers,
+  // then fiber_entry as the return address. The zero above it stands in for
+  // fiber_entry's own return address and leaves the stack aligned the way
+  // the ABI expects at function entry.
+  uint64_t* sp = (uint64_t*)((uintptr_t)f & ~(uintptr_t)15);
+  *--sp = 0;
+  *--sp = (uint64_t)(uintptr_t)fiber_entry;
+  for (int i = 0; i < 6; i++) {
+    *--sp = 0;
+  }
+  *--sp = 0x037f00001f80ull;  // Default MXCSR, then the default x87 control word
+  f->sp = sp;
+
+  __atomic_add_fetch(&live_fibers, 1, __ATOMIC_RELAXED);
+  runq_push(f);
+  return f;
+}
+
+Fiber* fiber_self(void) {
+  Worker* w = this_worker();
+  return w ? w->current : NULL;
+}
+
+static void after_requeue(Fiber* f, void* arg) {
+  (void)arg;
+  runq_push(f);
+}
+
+void fiber_yield(void) {
+  if (fiber_self()) {
+    park(after_requeue, NULL);
+  } else {
+    sched_yield();
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Sleeping: a binary min-heap on wake_at, owned by the poller
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static Fiber** timers;
+static size_t ntimers, timers_cap;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void timer_push(Fiber* f) {
+  if (ntimers == timers_cap) {
+    timers_cap = timers_cap ? 2 * timers_cap : 256;
+    timers = realloc(timers, timers_cap * sizeof(Fiber*));
+    if (!timers) {
+      die("fiber: out of memory for timers");
+    }
+  }
+  size_t i = ntimers++;
+  while (i > 0 && timers[(i - 1) / 2]->wake_at > f->wake_at) {
+    timers[i] = timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  timers[i] = f;
+}
+
+static Fiber* timer_pop(void) {
+  Fiber* top = timers[0];
+  Fiber* last = timers[--ntimers];
+  size_t i = 0;
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= ntimers) {
+      break;
+    }
+    if (c + 1 < ntimers && timers[c + 1]->wake_at < timers[c]->wake_at) {
+      c++;
+    }
+    if (timers[c]->wake_at >= last->wake_at) {
+      break;
+    }
+    timers[i] = timers[c];
+    i = c;
+  }
+  if (ntimers) {
+    timers[i] = last;
+  }
+  return top;
+}
+
+static void after_sleep(Fiber* f, void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&timer_lock);
+  timer_push(f);
+  int earliest = timers[0] == f;
+  pthread_mutex_unlock(&timer_lock);
+  if (earliest) {
+    wake_poller();
+  }
+}
+
+void fiber_sleep_ms(long ms) {
+  Fiber* self = fiber_self();
+  if (!self) {
+    usleep(ms * 1000);
+    return;
+  }
+  self->wake_at = now_ns() + (ms > 0 ? ms : 0) * 1000000ull;
+  park(after_sleep, NULL);
+}
+
+// ----------------------------------------------------------------------------
+// I/O: one-shot epoll registrations, resumed by the poller thread
+//
+// Each fd has a reader and a writer slot, so one fiber can wait to read a
+// socket while another waits to write it. The fd's registration asks for the
+// union of what its waiters want and is re-armed by the poller while any of
+// them is still waiting.
+
+typedef struct {
+  int fd;
+  unsigned events;
+} WaitReq;
+
+typedef struct {
+  Fiber* reader;
+  Fiber* writer;
+} FdWaiters;
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static FdWaiters* fd_waiters;  // Indexed by fd, under io_lock
+static int fd_waiters_cap;
+
+static FdWaiters* waiters_for(int fd) {
+  if (fd >= fd_waiters_cap) {
+    int cap = fd_waiters_cap ? fd_waiters_cap : 1024;
+    while (cap <= fd) {
+      cap *= 2;
+    }
+    fd_waiters = realloc(fd_waiters, cap * sizeof(FdWaiters));
+    if (!fd_waiters) {
+      die("fiber: out of memory for fd waiters");
+    }
+    memset(&fd_waiters[fd_waiters_cap], 0,
+           (cap - fd_waiters_cap) * sizeof(FdWaiters));
+    fd_waiters_cap = cap;
+  }
+  return &fd_waiters[fd];
+}
+
+// Points fd's registration at its current waiters. Called with io_lock held.
+static int rearm(int fd, FdWaiters* w) {
+  struct epoll_event ev = {.events = EPOLLONESHOT, .data.fd = fd};
+  if (w->reader) {
+    ev.events |= EPOLLIN;
+  }
+  if (w->writer) {
+    ev.events |= EPOLLOUT;
+  }
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+    return 0;
+  }
+  if (errno == ENOENT && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+static void after_arm(Fiber* f, void* arg) {
+  WaitReq* req = arg;  // On f's stack, which stays put while f is parked
+  if (req->fd < 0) {
+    runq_push(f);
+    return;
+  }
+  pthread_mutex_lock(&io_lock);
+  FdWaiters* w = waiters_for(req->fd);
+  if (((req->events & EPOLLIN) && w->reader) ||
+      ((req->events & EPOLLOUT) && w->writer)) {
+    die("fiber: two fibers waiting to %s fd %d",
+        req->events & EPOLLIN ? "read" : "write", req->fd);
+  }
+  if (req->events & EPOLLIN) {
+    w->reader = f;
+  }
+  if (req->events & EPOLLOUT) {
+    w->writer = f;
+  }
+  if (rearm(req->fd, w) < 0) {
+    // Bad fd: let the fiber retry its call and see the error itself.
+    if (w->reader == f) {
+      w->reader = NULL;
+    }
+    if (w->writer == f) {
+      w->writer = NULL;
+    }
+    pthread_mutex_unlock(&io_lock);
+    runq_push(f);
+    return;
+  }
+  pthread_mutex_unlock(&io_lock);
+}
+
+// Wakes the waiters an epoll event on fd is for, and re-arms fd for the rest.
+static void wake_waiters(int fd, unsigned events) {
+  Fiber* woken[2] = {NULL, NULL};
+  pthread_mutex_lock(&io_lock);
+  FdWaiters* w = waiters_for(fd);
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    woken[0] = w->reader;
+  }
+  if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+    woken[1] = w->writer;
+  }
+  // A fiber waiting for either direction sits in both slots.
+  for (int i = 0; i < 2; i++) {
+    if (woken[i]) {
+      if (w->reader == woken[i]) {
+        w->reader = NULL;
+      }
+      if (w->writer == woken[i]) {
+        w->writer = NULL;
+      }
+    }
+  }
+  if (woken[0] == woken[1]) {
+    woken[1] = NULL;
+  }
+  if ((w->reader || w->writer) && rearm(fd, w) < 0) {
+    perror("fiber: epoll_ctl");
+  }
+  pthread_mutex_unlock(&io_lock);
+  for (int i = 0; i < 2; i++) {
+    if (woken[i]) {
+      runq_push(woken[i]);
+    }
+  }
+}
+
+void fiber_wait_fd(int fd, unsigned events) {
+  if (!fiber_self()) {
+    struct pollfd p = {.fd = fd,
+                       .events = (events & EPOLLIN ? POLLIN : 0) |
+                                 (events & EPOLLOUT ? POLLOUT : 0)};
+    poll(&p, 1, -1);
+    return;
+  }
+  WaitReq req = {fd, events};
+  park(after_arm, &req);
+}
+
+int fiber_accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen) {
+  for (;;) {
+    int fd = accept4(sockfd, addr, addrlen, SOCK_NONBLOCK);
+    if (fd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return fd;
+    }
+    fiber_wait_fd(sockfd, EPOLLIN);
+  }
+}
+
+ssize_t fiber_recv(int sockfd, void* buf, size_t len, int flags) {
+  for (;;) {
+    ssize_t n = recv(sockfd, buf, len, flags);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+    fiber_wait_fd(sockfd, EPOLLIN);
+  }
+}
+
+ssize_t fiber_send(int sockfd, const void* buf, size_t len, int flags) {
+  for (;;) {
+    ssize_t n = send(sockfd, buf, len, flags);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return n;
+    }
+    fiber_wait_fd(sockfd, EPOLLOUT);
+  }
+}
+
+static void* poller_main(void* arg) {
+  (void)arg;
+  struct epoll_event events[256];
+  while (!__atomic_load_n(&runq_done, __ATOMIC_ACQUIRE)) {
+    int timeout = -1;
+    pthread_mutex_lock(&timer_lock);
+    if (ntimers) {
+      uint64_t now = now_ns();
+      // Round up, so we never wake before the deadline and spin.
+      timeout = timers[0]->wake_at > now
+                    ? (int)((timers[0]->wake_at - now + 999999) / 1000000)
+                    : 0;
+    }
+    pthread_mutex_unlock(&timer_lock);
+
+    int n = epoll_wait(epfd, events, 256, timeout);
+    if (n < 0 && errno != EINTR) {
+      perror_die("fiber: epoll_wait");
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd != wakefd) {
+        wake_waiters(events[i].data.fd, events[i].events);
+      } else {
+        uint64_t count;
+        if (read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+          perror("fiber: eventfd read");
+        }
+      }
+    }
+
+    pthread_mutex_lock(&timer_lock);
+    uint64_t now = now_ns();
+    while (ntimers && timers[0]->wake_at <= now) {
+      runq_push(timer_pop());
+    }
+    pthread_mutex_unlock(&timer_lock);
+  }
+  return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// Mutex
+
+static void guard_lock(int* g) {
+  for (int spins = 0; __atomic_exchange_n(g, 1, __ATOMIC_ACQUIRE); spins++) {
+    while (__atomic_load_n(g, __ATOMIC_RELAXED)) {
+      if (++spins > 1000) {
+        sched_yield();  // The holder's thread was probably preempted
+      } else {
+        __builtin_ia32_pause();
+      }
+    }
+  }
+}
+
+static void guard_unlock(int* g) { __atomic_store_n(g, 0, __ATOMIC_RELEASE); }
+
+static void after_release_guard(Fiber* f, void* arg) {
+  (void)f;
+  guard_unlock(arg);
+}
+
+void fiber_mutex_init(fiber_mutex_t* m) {
+  memset(m, 0, sizeof(*m));
+}
+
+void fiber_mutex_lock(fiber_mutex_t* m) {
+  Fiber* self = fiber_self();
+  if (!self) {
+    // Waiting parks the caller, and only a fiber can be parked.
+    die("fiber_mutex_lock called outside a fiber");
+  }
+  guard_lock(&m->guard);
+  if (!m->owner) {
+    m->owner = self;
+    guard_unlock(&m->guard);
+    return;
+  }
+  self->next = NULL;
+  if (m->tail) {
+    m->tail->next = self;
+  } else {
+    m->head = self;
+  }
+  m->tail = self;
+  // Still holding the guard: the worker drops it once we are switched out.
+  // fiber_mutex_unlock makes us the owner before waking us.
+  park(after_release_guard, &m->guard);
+}
+
+void fiber_mutex_unlock(fiber_mutex_t* m) {
+  guard_lock(&m->guard);
+  Fiber* next = m->head;
+  if (next) {
+    m->head = next->next;
+    if (!m->head) {
+      m->tail = NULL;
+    }
+  }
+  m->owner = next;
+  guard_unlock(&m->guard);
+  if (next) {
+    runq_push(next);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// Startup
+
+void fiber_run(void (*fn)(void*), void* arg, int nthreads) {
+  if (nthreads <= 0) {
+    nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror_die("fiber: epoll_create1");
+  }
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakefd < 0) {
+    perror_die("fiber: eventfd");
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.fd = wakefd};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+    perror_die("fiber: epoll_ctl");
+  }
+
+  if (!fiber_spawn(fn, arg)) {
+    perror_die("fiber: spawn");
+  }
+
+  pthread_t poller;
+  pthread_create(&poller, NULL, poller_main, NULL);
+
+  // The calling thread is worker 0.
+  Worker* workers = xmalloc(sizeof(Worker) * nthreads);
+  pthread_t* threads = xmalloc(sizeof(pthread_t) * nthreads);
+  memset(workers, 0, sizeof(Worker) * nthreads);
+  for (int i = 1; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+  }
+  worker_main(&workers[0]);
+  tls_worker = NULL;
+  for (int i = 1; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_join(poller, NULL);
+
+  free(threads);
+  free(workers);
+  free(timers);
+  timers = NULL;
+  free(fd_waiters);
+  fd_waiters = NULL;
+  fd_waiters_cap = 0;
+  ntimers = timers_cap = 0;
+  close(wakefd);
+  close(epfd);
+  wakefd = epfd = -1;
+  runq_done = 0;
+}
@@ -0,0 +1,77 @@
+// Stackful fibers (green threads) scheduled M:N onto a few OS threads.
+//
+// A fiber is a function running on its own small mmap'd stack. Fibers are
+// multiplexed onto a pool of worker threads: switching between them is a
+// user-space register swap (no syscall, no kernel scheduler), and a parked
+// fiber costs only the stack pages it has touched. That allows
+// thread-per-connection code, as in threaded-server.c, to run with 100k
+// connections where threadspammer.c shows OS threads running out long before.
+//
+// Blocking calls must go through the fiber_* wrappers below: they park the
+// calling fiber instead of the worker thread. A dedicated poller thread waits
+// in epoll for the sockets and sleep deadlines fibers are blocked on, and
+// makes those fibers runnable again.
+//
+// Limits worth knowing for very many fibers: each stack is two mappings (the
+// guard page and the stack), so 100k fibers need vm.max_map_count above 200k,
+// and each connection needs a file descriptor (ulimit -n).
+//
+// This code is in the public domain.
+#ifndef FIBER_H
+#define FIBER_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+typedef struct Fiber Fiber;
+
+// Usable stack per fiber. Touched pages only are resident.
+#define FIBER_STACK_SIZE (64 * 1024)
+
+// Runs fn(arg) as the first fiber on nthreads workers (0 = number of online
+// CPUs) and returns once every fiber has finished.
+void fiber_run(void (*fn)(void*), void* arg, int nthreads);
+
+// Creates a runnable fiber. May be called from fibers or, before fiber_run,
+// from the main thread.
+Fiber* fiber_spawn(void (*fn)(void*), void* arg);
+
+// The calling fiber, or NULL on a non-fiber thread.
+Fiber* fiber_self(void);
+
+// Lets other runnable fibers run.
+void fiber_yield(void);
+
+// Parks the calling fiber for at least ms milliseconds.
+void fiber_sleep_ms(long ms);
+
+// Like their namesakes, but a call that would block parks the fiber until the
+// fd is ready. The fd must be in non-blocking mode; fiber_accept returns
+// sockets that already are.
+int fiber_accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen);
+ssize_t fiber_recv(int sockfd, void* buf, size_t len, int flags);
+ssize_t fiber_send(int sockfd, const void* buf, size_t len, int flags);
+
+// Waits until fd is readable (EPOLLIN) or writable (EPOLLOUT). At most one
+// fiber may wait to read a given fd and one to write it at a time; a second
+// one is a fatal error rather than a lost wakeup.
+void fiber_wait_fd(int fd, unsigned events);
+
+// A mutex that parks waiting fibers rather than their threads. Unlock hands
+// the mutex directly to the longest waiter.
+typedef struct {
+  int guard;  // Spinlock protecting the fields below; held only briefly
+  Fiber* owner;
+  Fiber* head;  // Waiters, FIFO
+  Fiber* tail;
+} fiber_mutex_t;
+
+#define FIBER_MUTEX_INITIALIZER {0, NULL, NULL, NULL}
+
+void fiber_mutex_init(fiber_mutex_t* m);
+// Must be called from a fiber.
+void fiber_mutex_lock(fiber_mutex_t* m);
+void fiber_mutex_unlock(fiber_mutex_t* m);
+
+#endif /* FIBER_H */
@@ -0,0 +1,78 @@
+// Fiber counterpart of threadspammer.c: starts a large number of idle fibers
+// that wake up every 50 ms, then reports how long that took and how much
+// memory it costs.
+//
+// $ ./fiberspammer 100000
+//
+// Compare with ./threadspammer at the same count. More than ~30k fibers need
+// a higher vm.max_map_count (two mappings per fiber stack).
+//
+// This code is in the public domain.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fiber.h"
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rss_kb(void) {
+  long pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void fiberfunc(void* p) {
+  (void)p;
+  while (1) {
+    fiber_sleep_ms(50);
+  }
+}
+
+void spawner(void* p) {
+  long nfibers = (long)p;
+  long rss_before = rss_kb();
+  double t0 = now_sec();
+
+  for (long i = 0; i < nfibers; ++i) {
+    if (!fiber_spawn(fiberfunc, (void*)i)) {
+      perror("fiber_spawn");
+      printf("stopped after %ld fibers\n", i);
+      break;
+    }
+  }
+  fiber_yield();
+
+  double elapsed = now_sec() - t0;
+  long rss = rss_kb() - rss_before;
+  printf("spawned %ld fibers in %.1f ms (%.2f us each), RSS +%ld KB (%.1f KB each)\n",
+         nfibers, elapsed * 1e3, elapsed * 1e6 / nfibers, rss,
+         (double)rss / nfibers);
+
+  printf("... waiting ... \n");
+  while (1) {
+    fiber_sleep_ms(200);
+  }
+}
+
+int main(int argc, const char** argv) {
+  long nfibers = 10;
+  if (argc > 1) {
+    nfibers = atol(argv[1]);
+  }
+  printf("Running with nfibers = %ld\n", nfibers);
+
+  fiber_run(spawner, (void*)nfibers, 0);
+  return 0;
+}
@@ -0,0 +1,159 @@
+// Vectorized scanning and transformation for the ^...$ protocol.
+//
+// This code is in the public domain.
+#include "framing.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAMING_X86 1
+#endif
+
+static const uint8_t* find_scalar(const uint8_t* p, const uint8_t* end,
+                                  uint8_t c) {
+  while (p < end && *p != c) {
+    p++;
+  }
+  return p;
+}
+
+static size_t transform_scalar(uint8_t* dst, const uint8_t* src, size_t n) {
+  size_t i = 0;
+  for (; i < n && src[i] != '$'; ++i) {
+    dst[i] = src[i] + 1;
+  }
+  return i;
+}
+
+#ifdef FRAMING_X86
+
+// Each vector step compares a block against the byte searched for; movemask
+// turns the comparison into a bit per byte, so a zero mask means the whole
+// block can be skipped (or transformed) at once, and otherwise the lowest set
+// bit is the position of the match.
+
+__attribute__((target("sse2"))) static const uint8_t*
+find_sse2(const uint8_t* p, const uint8_t* end, uint8_t c) {
+  const __m128i needle = _mm_set1_epi8((char)c);
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return find_scalar(p, end, c);
+}
+
+__attribute__((target("sse2"))) static size_t
+transform_sse2(uint8_t* dst, const uint8_t* src, size_t n) {
+  const __m128i dollar = _mm_set1_epi8('$');
+  const __m128i one = _mm_set1_epi8(1);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, dollar));
+    // The whole block is stored even if it holds the '$'; only the bytes
+    // before it count.
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_add_epi8(v, one));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + transform_scalar(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static const uint8_t*
+find_avx2(const uint8_t* p, const uint8_t* end, uint8_t c) {
+  const __m256i needle = _mm256_set1_epi8((char)c);
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return find_sse2(p, end, c);
+}
+
+__attribute__((target("avx2"))) static size_t
+transform_avx2(uint8_t* dst, const uint8_t* src, size_t n) {
+  const __m256i dollar = _mm256_set1_epi8('$');
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dollar));
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_add_epi8(v, one));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + transform_sse2(dst + i, src + i, n - i);
+}
+
+#endif  // FRAMING_X86
+
+typedef struct {
+  const char* name;
+  const uint8_t* (*find)(const uint8_t*, const uint8_t*, uint8_t);
+  size_t (*transform)(uint8_t*, const uint8_t*, size_t);
+} framing_impl_t;
+
+static const framing_impl_t impls[] = {
+#ifdef FRAMING_X86
+    {"avx2", find_avx2, transform_avx2},
+    {"sse2", find_sse2, transform_sse2},
+#endif
+    {"scalar", find_scalar, transform_scalar},
+};
+
+static bool supported(const framing_impl_t* impl) {
+#ifdef FRAMING_X86
+  __builtin_cpu_init();
+  if (strcmp(impl->name, "avx2") == 0) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (strcmp(impl->name, "sse2") == 0) {
+    return __builtin_cpu_supports("sse2");
+  }
+#endif
+  (void)impl;
+  return true;
+}
+
+// The active implementation: the first (fastest) supported one, chosen before
+// main runs so that threads never race to pick it.
+static const framing_impl_t* active;
+
+__attribute__((constructor)) static void pick_impl(void) {
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+    if (supported(&impls[i])) {
+      active = &impls[i];
+      return;
+    }
+  }
+}
+
+const uint8_t* framing_find(const uint8_t* p, const uint8_t* end, uint8_t c) {
+  return active->find(p, end, c);
+}
+
+size_t framing_transform(uint8_t* dst, const uint8_t* src, size_t n) {
+  return active->transform(dst, src, n);
+}
+
+const char* framing_impl(void) {
+  return active->name;
+}
+
+bool framing_set_impl(const char* name) {
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); ++i) {
+    if (strcmp(impls[i].name, name) == 0 && supported(&impls[i])) {
+      active = &impls[i];
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,38 @@
+// Vectorized scanning and transformation for the ^...$ protocol.
+//
+// The servers' byte-at-a-time state machine does a compare and a branch per
+// input byte. These helpers do the same work 16 (SSE2) or 32 (AVX2) bytes at
+// a time: framing_find skips to the next '^' between messages, and
+// framing_transform copies a message body to the output, adding 1 to every
+// byte, up to its closing '$'. A caller alternates between the two as it
+// moves between the WAIT_FOR_MSG and IN_MSG states.
+//
+// The implementation is picked at startup from what the CPU supports (AVX2,
+// else SSE2, else a scalar loop), and can be overridden with
+// framing_set_impl, e.g. for benchmarking.
+//
+// This code is in the public domain.
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Returns a pointer to the first c in [p, end), or end if there is none.
+const uint8_t* framing_find(const uint8_t* p, const uint8_t* end, uint8_t c);
+
+// Writes src[i] + 1 to dst[i] for each i < n up to the first '$' in src.
+// Returns the number of bytes transformed: the index of that '$', or n if
+// there is none. dst must have room for n bytes (which may all be written to,
+// even if fewer are transformed).
+size_t framing_transform(uint8_t* dst, const uint8_t* src, size_t n);
+
+// The active implementation: "avx2", "sse2" or "scalar".
+const char* framing_impl(void);
+
+// Switches to the named implementation. Returns false if it's unknown or not
+// supported by this CPU.
+bool framing_set_impl(const char* name);
+
+#endif /* FRAMING_H */
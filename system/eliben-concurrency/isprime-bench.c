@@ -0,0 +1,118 @@
+// Benchmarks the primality tests of primality.h against the naive trial
+// division of uv-isprime-server.
+//
+// Times a worst case, a prime just below 2^63, and the throughput of
+// isprime_fast and isprime_batch on random odd 64-bit numbers (about 4.5% of
+// which are prime) and on 64-bit primes alone, checking that the two agree.
+// Trial division is only run on the worst case when given "naive", since it
+// takes seconds.
+//
+// Usage:
+//   ./isprime-bench [count] [naive]
+//
+// This code is in the public domain.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "primality.h"
+#include "utils.h"
+
+double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The naive test from uv-isprime-server.
+bool isprime_naive(uint64_t n) {
+  if (n % 2 == 0) {
+    return n == 2 ? true : false;
+  }
+
+  for (uint64_t r = 3; r * r <= n; r += 2) {
+    if (n % r == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint64_t xorshift64(uint64_t* state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+void bench(const char* label, const uint64_t* nums, int count) {
+  bool* single = xmalloc(count * sizeof(bool));
+  bool* batch = xmalloc(count * sizeof(bool));
+
+  double t0 = now_sec();
+  for (int i = 0; i < count; ++i) {
+    single[i] = isprime_fast(nums[i]);
+  }
+  double t_single = now_sec() - t0;
+
+  t0 = now_sec();
+  isprime_batch(nums, batch, count);
+  double t_batch = now_sec() - t0;
+
+  int nprimes = 0;
+  for (int i = 0; i < count; ++i) {
+    nprimes += single[i];
+  }
+  bool ok = memcmp(single, batch, count * sizeof(bool)) == 0;
+  printf("%-14s %d primes  isprime_fast %7.1f ns/number  "
+         "isprime_batch %7.1f ns/number%s\n",
+         label, nprimes, t_single / count * 1e9, t_batch / count * 1e9,
+         ok ? "" : "  MISMATCH");
+  free(batch);
+  free(single);
+}
+
+int main(int argc, char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int count = argc >= 2 ? atoi(argv[1]) : 1000000;
+  bool naive = argc >= 3 && strcmp(argv[2], "naive") == 0;
+  if (count < 1) {
+    die("usage: %s [count] [naive]", argv[0]);
+  }
+
+  // The largest prime below 2^63. For primes above (2^32 - 1)^2, r * r in
+  // the naive loop overflows before it passes n, and the loop never ends.
+  const uint64_t worst = 9223372036854775783ULL;
+  double t0 = now_sec();
+  bool p = isprime_fast(worst);
+  printf("%lu: isprime_fast says %s in %.1f us\n", worst,
+         p ? "prime" : "composite", (now_sec() - t0) * 1e6);
+  if (naive) {
+    t0 = now_sec();
+    p = isprime_naive(worst);
+    printf("%lu: trial division says %s in %.1f s\n", worst,
+           p ? "prime" : "composite", now_sec() - t0);
+  }
+
+  uint64_t* nums = xmalloc(count * sizeof(uint64_t));
+  uint64_t state = 88172645463325252ULL;
+  for (int i = 0; i < count; ++i) {
+    nums[i] = xorshift64(&state) | 1;
+  }
+  bench("random odd", nums, count);
+
+  int nprimes = 0;
+  while (nprimes < count) {
+    uint64_t n = xorshift64(&state) | 1;
+    if (isprime_fast(n)) {
+      nums[nprimes++] = n;
+    }
+  }
+  bench("primes", nums, count);
+
+  free(nums);
+  return 0;
+}
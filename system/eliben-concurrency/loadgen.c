@@ -0,0 +1,705 @@
+// Load generator and latency benchmark for the ^...$ servers in this
+// directory.
+//
+// Opens a number of connections, waits for each server's '*' ack, and sends
+// '^<body>$' messages, checking that every reply is the body with each byte
+// incremented. Up to a given number of messages (the pipelining depth) may be
+// outstanding on a connection at once.
+//
+// Without -r, each connection sends a new message as soon as a reply frees a
+// slot (closed loop). With -r, messages are sent on a fixed schedule at the
+// given total rate (open loop), handed round-robin to connections that have a
+// free slot. A message that is due while every connection is full waits, and
+// its latency is counted from the time the schedule said it should have been
+// sent, not from when it went out. A stalled server thus can't hide its stall
+// by holding back the requests that would have seen it ("coordinated
+// omission"). Both that corrected latency and the latency measured from the
+// actual send are reported.
+//
+// Latencies are recorded in HDR histograms (3 significant digits, up to an
+// hour). -H writes the corrected histogram as a percentile distribution in
+// HdrHistogram's .hgrm format, in microseconds.
+//
+// Usage:
+//   ./loadgen [options] [port]
+//
+//   -a addr      server IPv4 address (default 127.0.0.1)
+//   -c N         connections (default 16)
+//   -T N         client threads (default 1)
+//   -d N         pipelining depth per connection (default 1)
+//   -s N         message body size in bytes (default 64)
+//   -r N         total rate in messages/s; 0 for closed loop (default 0)
+//   -D sec       measured duration (default 10)
+//   -w sec       warmup before measuring (default 1)
+//   -H file      write the corrected histogram to file
+//
+// This code is in the public domain.
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define MAXEVENTS 256
+#define RECVBUF_SIZE (64 * 1024)
+#define IOV_MAX_PER_SEND 64
+
+// How long to wait for outstanding replies after the run.
+#define DRAIN_NS (2 * 1000000000ULL)
+
+// HDR histogram: a value v in bucket b = log2(v) - 10 is stored with its low b
+// bits dropped, which keeps 2048 distinct values (3 significant digits) per
+// power of two. Values are nanoseconds; 2^42 ns is over an hour.
+#define HIST_SUB_BUCKETS 2048
+#define HIST_HALF 1024
+#define HIST_BUCKETS 32
+#define HIST_COUNTS ((HIST_BUCKETS + 1) * HIST_HALF)
+#define HIST_MAX_VALUE ((1ULL << (HIST_BUCKETS + 10)) - 1)
+
+typedef struct {
+  uint64_t counts[HIST_COUNTS];
+  uint64_t total;
+  uint64_t max;
+  double sum;
+  double sumsq;
+} hist_t;
+
+static int hist_index(uint64_t v) {
+  int bucket = 64 - __builtin_clzll(v | (HIST_SUB_BUCKETS - 1)) - 11;
+  int sub = v >> bucket;
+  return (bucket + 1) * HIST_HALF + sub - HIST_HALF;
+}
+
+// The largest value stored at index i.
+static uint64_t hist_value_at_index(int i) {
+  int bucket = 0;
+  uint64_t sub = i;
+  if (i >= HIST_SUB_BUCKETS) {
+    bucket = i / HIST_HALF - 1;
+    sub = i % HIST_HALF + HIST_HALF;
+  }
+  return ((sub + 1) << bucket) - 1;
+}
+
+static void hist_record(hist_t* h, uint64_t v) {
+  if (v > HIST_MAX_VALUE) {
+    v = HIST_MAX_VALUE;
+  }
+  h->counts[hist_index(v)]++;
+  h->total++;
+  if (v > h->max) {
+    h->max = v;
+  }
+  h->sum += v;
+  h->sumsq += (double)v * v;
+}
+
+static void hist_merge(hist_t* dst, const hist_t* src) {
+  for (int i = 0; i < HIST_COUNTS; ++i) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+  dst->sum += src->sum;
+  dst->sumsq += src->sumsq;
+}
+
+// The value at percentile p (0..100), with the number of values at or below
+// it stored in *count if count isn't NULL.
+static uint64_t hist_percentile(const hist_t* h, double p, uint64_t* count) {
+  uint64_t target = (uint64_t)ceil(p / 100.0 * h->total);
+  if (target == 0) {
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_COUNTS; ++i) {
+    seen += h->counts[i];
+    if (seen >= target) {
+      if (count) {
+        *count = seen;
+      }
+      uint64_t v = hist_value_at_index(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+  if (count) {
+    *count = h->total;
+  }
+  return h->max;
+}
+
+// Writes h as HdrHistogram's percentile distribution text, which its plotting
+// tools read: more rows the closer the percentile gets to 100.
+static void hist_write_hgrm(const hist_t* h, FILE* f) {
+  fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+          "1/(1-Percentile)");
+  double p = 0;
+  while (1) {
+    uint64_t count;
+    uint64_t v = hist_percentile(h, p, &count);
+    if (count >= h->total) {
+      fprintf(f, "%12.3f %2.12f %10lu\n", v / 1e3, 1.0, count);
+      break;
+    }
+    fprintf(f, "%12.3f %2.12f %10lu %14.2f\n", v / 1e3, p / 100, count,
+            1 / (1 - p / 100));
+    // 5 rows per halving of the distance to 100%.
+    double half_distance = pow(2, floor(log2(100 / (100 - p))) + 1);
+    p += 100 / (half_distance * 5);
+  }
+  double mean = h->sum / h->total;
+  double stddev = sqrt(fmax(h->sumsq / h->total - mean * mean, 0));
+  fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e3,
+          stddev / 1e3);
+  fprintf(f, "#[Max     = %12.3f, Total count    = %12lu]\n", h->max / 1e3,
+          h->total);
+  fprintf(f, "#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_BUCKETS,
+          HIST_SUB_BUCKETS);
+}
+
+typedef struct {
+  uint64_t intended;  // When the schedule had this message go out
+  uint64_t sent;      // When it was handed to the socket
+} msg_times_t;
+
+typedef struct {
+  int fd;
+  bool connected;
+  bool ready;  // The '*' arrived
+  bool writable;
+  bool closed;
+
+  // Outstanding messages, oldest first, in a ring of depth entries. The last
+  // `unsent` of them haven't been fully written to the socket yet; send_off
+  // bytes of the first of those have.
+  msg_times_t* inflight;
+  int head;
+  int count;
+  int unsent;
+  size_t send_off;
+
+  // Reply bytes of the oldest outstanding message received so far, and
+  // whether any of them were wrong.
+  size_t recv_off;
+  bool bad;
+} conn_t;
+
+typedef struct {
+  struct sockaddr_in addr;
+  int nconns;
+  int nthreads;
+  int depth;
+  int msgsize;
+  double rate;
+  double duration;
+  double warmup;
+  char* hgrm_path;
+} config_t;
+
+static config_t config = {
+    .nconns = 16,
+    .nthreads = 1,
+    .depth = 1,
+    .msgsize = 64,
+    .rate = 0,
+    .duration = 10,
+    .warmup = 1,
+};
+
+// '^<body>$' as sent, and the reply expected for it.
+static uint8_t* frame;
+static uint8_t* expected;
+
+// Start of the schedule, start of measurement and end of the run.
+static uint64_t start_ns;
+static uint64_t measure_ns;
+static uint64_t end_ns;
+
+typedef struct {
+  pthread_t thread;
+  conn_t* conns;
+  int nconns;
+  int epollfd;
+
+  // Open loop: the schedule's next message and the time between messages on
+  // this thread, and the connection to try first for it.
+  uint64_t next_due;
+  uint64_t interval;
+  int rr;
+
+  hist_t corrected;
+  hist_t measured;
+  uint64_t replies;      // Received within the measurement window
+  uint64_t bad_replies;  // Anywhere
+  uint64_t timed_out;
+  uint64_t never_sent;
+  int failed_conns;
+} worker_t;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void close_conn(worker_t* w, conn_t* c) {
+  if (!c->closed) {
+    close(c->fd);
+    c->closed = true;
+    if (!c->ready) {
+      w->failed_conns++;
+    }
+  }
+}
+
+// Writes as much of the connection's unsent messages as the socket takes.
+static void flush_conn(worker_t* w, conn_t* c) {
+  size_t framelen = config.msgsize + 2;
+  while (c->unsent > 0 && c->writable) {
+    struct iovec iov[IOV_MAX_PER_SEND];
+    int niov = 0;
+    for (int i = 0; i < c->unsent && niov < IOV_MAX_PER_SEND; ++i) {
+      size_t off = i == 0 ? c->send_off : 0;
+      iov[niov].iov_base = frame + off;
+      iov[niov].iov_len = framelen - off;
+      niov++;
+    }
+    ssize_t nsent = writev(c->fd, iov, niov);
+    if (nsent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        c->writable = false;
+        return;
+      }
+      perror("writev");
+      close_conn(w, c);
+      return;
+    }
+    size_t left = c->send_off + nsent;
+    c->unsent -= left / framelen;
+    c->send_off = left % framelen;
+  }
+}
+
+// Queues a message on c, due at intended, and tries to send it.
+static void admit(worker_t* w, conn_t* c, uint64_t intended, uint64_t now) {
+  int slot = (c->head + c->count) % config.depth;
+  c->inflight[slot] = (msg_times_t){intended, now};
+  c->count++;
+  c->unsent++;
+  flush_conn(w, c);
+}
+
+static bool has_room(const conn_t* c) {
+  return c->ready && !c->closed && c->count < config.depth;
+}
+
+// Open loop: hands out every message that is due by now, as long as some
+// connection has room.
+static void dispatch(worker_t* w, uint64_t now) {
+  while (w->next_due <= now && w->next_due < end_ns) {
+    conn_t* c = NULL;
+    for (int i = 0; i < w->nconns; ++i) {
+      conn_t* candidate = &w->conns[(w->rr + i) % w->nconns];
+      if (has_room(candidate)) {
+        c = candidate;
+        w->rr = (w->rr + i + 1) % w->nconns;
+        break;
+      }
+    }
+    if (!c) {
+      return;
+    }
+    admit(w, c, w->next_due, now);
+    w->next_due += w->interval;
+  }
+}
+
+// Closed loop: fills c's pipeline.
+static void refill(worker_t* w, conn_t* c, uint64_t now) {
+  while (has_room(c) && now < end_ns) {
+    admit(w, c, now, now);
+  }
+}
+
+static void on_reply_done(worker_t* w, conn_t* c, uint64_t now) {
+  msg_times_t* t = &c->inflight[c->head];
+  if (c->bad) {
+    w->bad_replies++;
+  }
+  if (t->intended >= measure_ns) {
+    hist_record(&w->corrected, now - t->intended);
+    hist_record(&w->measured, now - t->sent);
+  }
+  if (now >= measure_ns && now < end_ns) {
+    w->replies++;
+  }
+  c->head = (c->head + 1) % config.depth;
+  c->count--;
+  c->recv_off = 0;
+  c->bad = false;
+}
+
+static void on_readable(worker_t* w, conn_t* c, uint8_t* buf, uint64_t* now) {
+  while (!c->closed) {
+    ssize_t nbytes = recv(c->fd, buf, RECVBUF_SIZE, 0);
+    if (nbytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      perror("recv");
+      close_conn(w, c);
+      return;
+    }
+    if (nbytes == 0) {
+      if (now_ns() < end_ns) {
+        fprintf(stderr, "server closed a connection\n");
+      }
+      close_conn(w, c);
+      return;
+    }
+    *now = now_ns();
+
+    uint8_t* p = buf;
+    uint8_t* end = buf + nbytes;
+    if (!c->ready) {
+      if (*p != '*') {
+        die("expected '*' from the server, got 0x%02x", *p);
+      }
+      c->ready = true;
+      p++;
+      if (config.rate == 0) {
+        refill(w, c, *now);
+      }
+    }
+    while (p < end) {
+      if (c->count == 0) {
+        die("server sent %ld bytes no message asked for", (long)(end - p));
+      }
+      size_t want = config.msgsize - c->recv_off;
+      size_t n = (size_t)(end - p) < want ? (size_t)(end - p) : want;
+      if (memcmp(p, expected + c->recv_off, n) != 0) {
+        c->bad = true;
+      }
+      p += n;
+      c->recv_off += n;
+      if (c->recv_off == (size_t)config.msgsize) {
+        on_reply_done(w, c, *now);
+        if (config.rate == 0) {
+          refill(w, c, *now);
+        }
+      }
+    }
+  }
+}
+
+static void on_connected(worker_t* w, conn_t* c) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  if (err) {
+    fprintf(stderr, "connect: %s\n", strerror(err));
+    close_conn(w, c);
+    return;
+  }
+  c->connected = true;
+}
+
+static void open_conn(worker_t* w, conn_t* c) {
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd < 0) {
+    perror_die("socket");
+  }
+  int one = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  make_socket_non_blocking(c->fd);
+  if (connect(c->fd, (struct sockaddr*)&config.addr, sizeof(config.addr)) <
+          0 &&
+      errno != EINPROGRESS) {
+    perror_die("connect");
+  }
+  c->inflight = xmalloc(config.depth * sizeof(msg_times_t));
+
+  struct epoll_event event = {0};
+  event.data.ptr = c;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &event) < 0) {
+    perror_die("epoll_ctl EPOLL_CTL_ADD");
+  }
+}
+
+static bool outstanding(const worker_t* w) {
+  for (int i = 0; i < w->nconns; ++i) {
+    if (!w->conns[i].closed && w->conns[i].count > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void* worker_thread(void* arg) {
+  worker_t* w = arg;
+  // The default 50us of timer slack would make every scheduled send late by
+  // about that much, which the corrected latencies would then include.
+  prctl(PR_SET_TIMERSLACK, 1);
+  w->epollfd = epoll_create1(0);
+  if (w->epollfd < 0) {
+    perror_die("epoll_create1");
+  }
+  for (int i = 0; i < w->nconns; ++i) {
+    open_conn(w, &w->conns[i]);
+  }
+
+  uint8_t* buf = xmalloc(RECVBUF_SIZE);
+  struct epoll_event* events = calloc(MAXEVENTS, sizeof(struct epoll_event));
+  if (events == NULL) {
+    die("Unable to allocate memory for epoll_events");
+  }
+
+  uint64_t now = now_ns();
+  while (1) {
+    if (config.rate > 0) {
+      dispatch(w, now);
+    }
+    // Once the run is over, wait only for the replies still outstanding.
+    if (now >= end_ns && (now >= end_ns + DRAIN_NS || !outstanding(w))) {
+      break;
+    }
+
+    uint64_t wake = now < end_ns ? end_ns : end_ns + DRAIN_NS;
+    if (config.rate > 0 && w->next_due > now && w->next_due < wake) {
+      wake = w->next_due;
+    }
+    struct timespec timeout = {(wake - now) / 1000000000ULL,
+                               (wake - now) % 1000000000ULL};
+    int nready = epoll_pwait2(w->epollfd, events, MAXEVENTS, &timeout, NULL);
+    if (nready < 0 && errno != EINTR) {
+      perror_die("epoll_pwait2");
+    }
+    now = now_ns();
+    for (int i = 0; i < nready; i++) {
+      conn_t* c = events[i].data.ptr;
+      if (c->closed) {
+        continue;
+      }
+      if (!c->connected && (events[i].events & (EPOLLOUT | EPOLLERR))) {
+        on_connected(w, c);
+        if (c->closed) {
+          continue;
+        }
+      }
+      if (events[i].events & EPOLLOUT) {
+        c->writable = true;
+        flush_conn(w, c);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        on_readable(w, c, buf, &now);
+      }
+    }
+  }
+
+  // Whatever is still outstanding never got a reply; whatever the schedule
+  // had due before the end but couldn't send is lost too.
+  for (int i = 0; i < w->nconns; ++i) {
+    conn_t* c = &w->conns[i];
+    w->timed_out += c->closed ? 0 : c->count;
+    close_conn(w, c);
+    free(c->inflight);
+  }
+  if (config.rate > 0 && w->next_due < end_ns) {
+    w->never_sent += (end_ns - w->next_due + w->interval - 1) / w->interval;
+  }
+  free(events);
+  free(buf);
+  close(w->epollfd);
+  return NULL;
+}
+
+static void print_latencies(const hist_t* corrected, const hist_t* measured) {
+  static const double percentiles[] = {50, 75, 90, 99, 99.9, 99.99, 100};
+  if (config.rate > 0) {
+    printf("  latency (us)   corrected    measured\n");
+  } else {
+    printf("  latency (us)    measured\n");
+  }
+  for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+    printf("  %10.2f%%", percentiles[i]);
+    if (config.rate > 0) {
+      printf("  %10.1f", hist_percentile(corrected, percentiles[i], NULL) / 1e3);
+    }
+    printf("  %10.1f\n", hist_percentile(measured, percentiles[i], NULL) / 1e3);
+  }
+  printf("  %11s", "mean");
+  if (config.rate > 0) {
+    printf("  %10.1f", corrected->sum / corrected->total / 1e3);
+  }
+  printf("  %10.1f\n", measured->sum / measured->total / 1e3);
+}
+
+int main(int argc, char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  const char* addr = "127.0.0.1";
+  int opt;
+  while ((opt = getopt(argc, argv, "a:c:T:d:s:r:D:w:H:")) != -1) {
+    switch (opt) {
+    case 'a':
+      addr = optarg;
+      break;
+    case 'c':
+      config.nconns = atoi(optarg);
+      break;
+    case 'T':
+      config.nthreads = atoi(optarg);
+      break;
+    case 'd':
+      config.depth = atoi(optarg);
+      break;
+    case 's':
+      config.msgsize = atoi(optarg);
+      break;
+    case 'r':
+      config.rate = atof(optarg);
+      break;
+    case 'D':
+      config.duration = atof(optarg);
+      break;
+    case 'w':
+      config.warmup = atof(optarg);
+      break;
+    case 'H':
+      config.hgrm_path = optarg;
+      break;
+    default:
+      die("usage: %s [-a addr] [-c connections] [-T threads] [-d depth] "
+          "[-s size] [-r rate] [-D seconds] [-w seconds] [-H file] [port]",
+          argv[0]);
+    }
+  }
+  int portnum = optind < argc ? atoi(argv[optind]) : 9090;
+  if (config.nconns < 1 || config.nthreads < 1 || config.depth < 1 ||
+      config.msgsize < 1 || config.rate < 0 || config.duration <= 0) {
+    die("connections, threads, depth, size and duration must be positive");
+  }
+  if (config.nthreads > config.nconns) {
+    config.nthreads = config.nconns;
+  }
+  config.addr.sin_family = AF_INET;
+  config.addr.sin_port = htons(portnum);
+  if (inet_pton(AF_INET, addr, &config.addr.sin_addr) != 1) {
+    die("bad address %s", addr);
+  }
+
+  // Bodies cycle through the alphabet; neither they nor their replies contain
+  // '^' or '$'.
+  frame = xmalloc(config.msgsize + 2);
+  expected = xmalloc(config.msgsize);
+  frame[0] = '^';
+  for (int i = 0; i < config.msgsize; ++i) {
+    frame[i + 1] = 'a' + i % 25;
+    expected[i] = frame[i + 1] + 1;
+  }
+  frame[config.msgsize + 1] = '$';
+
+  printf("%s:%d, %d connections, %d threads, depth %d, %d-byte messages, ",
+         addr, portnum, config.nconns, config.nthreads, config.depth,
+         config.msgsize);
+  if (config.rate > 0) {
+    printf("open loop at %.0f msgs/s\n", config.rate);
+  } else {
+    printf("closed loop\n");
+  }
+
+  // Give the connections a moment to be set up before the schedule starts.
+  start_ns = now_ns() + 100 * 1000000ULL;
+  measure_ns = start_ns + (uint64_t)(config.warmup * 1e9);
+  end_ns = measure_ns + (uint64_t)(config.duration * 1e9);
+
+  worker_t* workers = xmalloc(config.nthreads * sizeof(worker_t));
+  conn_t* conns = calloc(config.nconns, sizeof(conn_t));
+  if (conns == NULL) {
+    die("Unable to allocate memory for connections");
+  }
+  int first = 0;
+  for (int i = 0; i < config.nthreads; ++i) {
+    worker_t* w = &workers[i];
+    memset(w, 0, sizeof(*w));
+    w->conns = &conns[first];
+    w->nconns = config.nconns / config.nthreads +
+                (i < config.nconns % config.nthreads);
+    first += w->nconns;
+    if (config.rate > 0) {
+      // Threads get equal shares of the rate, offset so their messages
+      // interleave.
+      w->interval = (uint64_t)(config.nthreads * 1e9 / config.rate);
+      if (w->interval == 0) {
+        w->interval = 1;
+      }
+      w->next_due = start_ns + w->interval * i / config.nthreads;
+    }
+    if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+      die("pthread_create failed");
+    }
+  }
+
+  hist_t* corrected = calloc(1, sizeof(hist_t));
+  hist_t* measured = calloc(1, sizeof(hist_t));
+  if (corrected == NULL || measured == NULL) {
+    die("Unable to allocate memory for histograms");
+  }
+  uint64_t replies = 0, bad_replies = 0, timed_out = 0, never_sent = 0;
+  int failed_conns = 0;
+  for (int i = 0; i < config.nthreads; ++i) {
+    worker_t* w = &workers[i];
+    pthread_join(w->thread, NULL);
+    hist_merge(corrected, &w->corrected);
+    hist_merge(measured, &w->measured);
+    replies += w->replies;
+    bad_replies += w->bad_replies;
+    timed_out += w->timed_out;
+    never_sent += w->never_sent;
+    failed_conns += w->failed_conns;
+  }
+
+  double rate = replies / config.duration;
+  printf("  %.1f s: %lu replies, %.0f msgs/s, %.1f MB/s each way\n",
+         config.duration, replies, rate, rate * config.msgsize / 1e6);
+  printf("  %lu bad replies, %lu timed out, %lu never sent, "
+         "%d connections never acked\n",
+         bad_replies, timed_out, never_sent, failed_conns);
+  if (measured->total > 0) {
+    print_latencies(corrected, measured);
+  }
+  if (config.hgrm_path && measured->total > 0) {
+    FILE* f = fopen(config.hgrm_path, "w");
+    if (f == NULL) {
+      perror_die(config.hgrm_path);
+    }
+    hist_write_hgrm(config.rate > 0 ? corrected : measured, f);
+    fclose(f);
+  }
+
+  free(measured);
+  free(corrected);
+  free(conns);
+  free(workers);
+  free(expected);
+  free(frame);
+  return bad_replies > 0 || failed_conns > 0 ? 1 : 0;
+}
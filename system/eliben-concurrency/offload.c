@@ -0,0 +1,142 @@
+// Offloading CPU-bound work from an epoll loop to a thread pool.
+//
+// This code is in the public domain.
+#include "offload.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+struct offload_pool {
+  int efd;
+
+  // Submitted tasks, oldest first.
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  offload_task_t* queue_head;
+  offload_task_t* queue_tail;
+
+  // Finished tasks, newest first. Workers push; the loop takes them all.
+  offload_task_t* done_list;
+
+  int pending;  // Touched by the loop's thread only
+};
+
+static void* worker_thread(void* arg) {
+  offload_pool_t* pool = (offload_pool_t*)arg;
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->queue_head) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    offload_task_t* task = pool->queue_head;
+    pool->queue_head = task->next;
+    if (!pool->queue_head) {
+      pool->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    task->work(task);
+
+    // The release makes what work wrote visible to the loop once it has
+    // taken the list.
+    offload_task_t* head = __atomic_load_n(&pool->done_list, __ATOMIC_RELAXED);
+    do {
+      task->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->done_list, &head, task, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // If the list wasn't empty, whoever made it non-empty has signaled
+    // already and the loop hasn't taken the list since.
+    if (!head) {
+      uint64_t one = 1;
+      while (write(pool->efd, &one, sizeof(one)) < 0 && errno == EINTR) {
+      }
+    }
+  }
+  return NULL;
+}
+
+offload_pool_t* offload_pool_create(int nthreads) {
+  offload_pool_t* pool = xmalloc(sizeof(*pool));
+  pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (pool->efd < 0) {
+    perror_die("eventfd");
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->queue_head = pool->queue_tail = NULL;
+  pool->done_list = NULL;
+  pool->pending = 0;
+
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_thread, pool) != 0) {
+      die("pthread_create failed");
+    }
+    pthread_detach(thread);
+  }
+  return pool;
+}
+
+int offload_fd(offload_pool_t* pool) {
+  return pool->efd;
+}
+
+void offload_submit(offload_pool_t* pool, offload_task_t* task,
+                    offload_fn work, offload_fn done) {
+  task->work = work;
+  task->done = done;
+  task->next = NULL;
+  pool->pending++;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->queue_tail) {
+    pool->queue_tail->next = task;
+  } else {
+    pool->queue_head = task;
+  }
+  pool->queue_tail = task;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int offload_run_completions(offload_pool_t* pool) {
+  // Reset the eventfd before taking the list: a task pushed after the
+  // exchange finds the list empty and signals again, so none is missed.
+  uint64_t count;
+  if (read(pool->efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    perror_die("read eventfd");
+  }
+  offload_task_t* list = __atomic_exchange_n(&pool->done_list, NULL,
+                                             __ATOMIC_ACQUIRE);
+
+  // Reverse into the order the tasks finished in.
+  offload_task_t* ordered = NULL;
+  while (list) {
+    offload_task_t* next = list->next;
+    list->next = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  int ncompleted = 0;
+  while (ordered) {
+    offload_task_t* task = ordered;
+    ordered = task->next;
+    pool->pending--;
+    ncompleted++;
+    // done may resubmit the task, which reuses its next field.
+    task->done(task);
+  }
+  return ncompleted;
+}
+
+int offload_pending(offload_pool_t* pool) {
+  return pool->pending;
+}
@@ -0,0 +1,59 @@
+// Offloading CPU-bound work from an epoll loop to a thread pool.
+//
+// This is the raw counterpart of libuv's uv_queue_work. offload_submit hands
+// a task to the pool. Its work function runs on one of the pool's threads.
+// Once it returns, the task's done function runs back on the loop's thread,
+// from offload_run_completions. The pool signals finished tasks through an
+// eventfd (offload_fd), which the loop watches for EPOLLIN alongside its
+// sockets. Waiting for work is thus just another event, and a slow task never
+// holds up the loop.
+//
+// Finished tasks come back through a lock-free list. Workers push onto it with
+// compare-and-swap, and the loop takes all of it with a single exchange. Only
+// a worker that finds the list empty writes to the eventfd, so a burst of
+// completions wakes the loop once. Submissions go through a mutex-protected
+// queue that idle workers sleep on; the loop holds the mutex just long enough
+// to link a task in.
+//
+// Like uv_work_t, an offload_task_t is owned by the caller, typically
+// embedded in per-connection state, and must stay alive until its done
+// function has run.
+//
+// This code is in the public domain.
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+typedef struct offload_task offload_task_t;
+typedef struct offload_pool offload_pool_t;
+
+typedef void (*offload_fn)(offload_task_t* task);
+
+struct offload_task {
+  void* data;  // For the caller
+
+  // Private.
+  offload_fn work;
+  offload_fn done;
+  offload_task_t* next;
+};
+
+// Creates a pool of nthreads worker threads.
+offload_pool_t* offload_pool_create(int nthreads);
+
+// The eventfd that becomes readable when tasks have finished. It's
+// non-blocking.
+int offload_fd(offload_pool_t* pool);
+
+// Queues task to have work run on a worker, then done on the loop's thread.
+// Call from the loop's thread.
+void offload_submit(offload_pool_t* pool, offload_task_t* task,
+                    offload_fn work, offload_fn done);
+
+// Runs the done functions of all finished tasks, oldest first. Call when
+// offload_fd is readable. Returns the number of tasks completed.
+int offload_run_completions(offload_pool_t* pool);
+
+// Number of tasks submitted whose done function hasn't run yet.
+int offload_pending(offload_pool_t* pool);
+
+#endif /* OFFLOAD_H */
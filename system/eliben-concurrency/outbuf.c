@@ -0,0 +1,320 @@
+// Chained output buffers for the socket servers.
+//
+// This code is in the public domain.
+#include "outbuf.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "utils.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// Freed default-size slices are cached per thread, so that the steady state
+// of a busy connection (reserve, send, release) doesn't touch malloc. A
+// thread-specific key with a destructor frees the cache when its thread exits,
+// which for threaded-server is after every connection.
+#define SLICE_CACHE_MAX 64
+
+static __thread slice_t* slice_cache[SLICE_CACHE_MAX];
+static __thread int slice_cache_len;
+static pthread_key_t slice_cache_key;
+static pthread_once_t slice_cache_once = PTHREAD_ONCE_INIT;
+
+static void free_slice_cache(void* unused) {
+  (void)unused;
+  while (slice_cache_len > 0) {
+    free(slice_cache[--slice_cache_len]);
+  }
+}
+
+static void create_slice_cache_key(void) {
+  pthread_key_create(&slice_cache_key, free_slice_cache);
+}
+
+slice_t* slice_new(size_t size) {
+  slice_t* s;
+  if (size == OUTBUF_SLICE_SIZE && slice_cache_len > 0) {
+    s = slice_cache[--slice_cache_len];
+  } else {
+    s = xmalloc(sizeof(slice_t) + size);
+    s->size = size;
+  }
+  s->refcount = 1;
+  return s;
+}
+
+void slice_ref(slice_t* s) {
+  __atomic_add_fetch(&s->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void slice_unref(slice_t* s) {
+  if (__atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  if (s->size == OUTBUF_SLICE_SIZE && slice_cache_len < SLICE_CACHE_MAX) {
+    if (slice_cache_len == 0) {
+      // Any non-NULL value makes the destructor run at thread exit.
+      pthread_once(&slice_cache_once, create_slice_cache_key);
+      pthread_setspecific(slice_cache_key, slice_cache);
+    }
+    slice_cache[slice_cache_len++] = s;
+  } else {
+    free(s);
+  }
+}
+
+void outbuf_init(outbuf_t* ob) {
+  memset(ob, 0, sizeof(*ob));
+}
+
+void outbuf_free(outbuf_t* ob) {
+  for (int i = ob->head; i < ob->tail; ++i) {
+    slice_unref(ob->segs[i].slice);
+  }
+  // Pins are deliberately not dropped: the kernel may still read from those
+  // slices, so they must never be reused (see outbuf.h).
+  if (ob->wslice) {
+    slice_unref(ob->wslice);
+  }
+  free(ob->segs);
+  free(ob->pins);
+  outbuf_init(ob);
+}
+
+// Makes room for one more element at the end of a [head, tail) window into a
+// growable array: slides the window down if it has drifted, else doubles.
+static void* grow_window(void* array, size_t elem_size, int* head, int* tail,
+                         int* cap) {
+  if (*tail < *cap) {
+    return array;
+  }
+  if (*head > 0) {
+    memmove(array, (char*)array + *head * elem_size,
+            (*tail - *head) * elem_size);
+    *tail -= *head;
+    *head = 0;
+    return array;
+  }
+  *cap = *cap ? *cap * 2 : 8;
+  array = realloc(array, *cap * elem_size);
+  if (!array) {
+    die("OOM growing outbuf");
+  }
+  return array;
+}
+
+static void push_seg(outbuf_t* ob, slice_t* s, size_t off, size_t len) {
+  ob->segs = grow_window(ob->segs, sizeof(outbuf_seg_t), &ob->head, &ob->tail,
+                         &ob->cap);
+  ob->segs[ob->tail++] = (outbuf_seg_t){s, off, len};
+  ob->pending += len;
+}
+
+uint8_t* outbuf_reserve(outbuf_t* ob, size_t min, size_t* room) {
+  if (!ob->wslice || ob->wslice->size - ob->wpos < min) {
+    if (ob->wslice) {
+      slice_unref(ob->wslice);
+    }
+    ob->wslice = slice_new(min > OUTBUF_SLICE_SIZE ? min : OUTBUF_SLICE_SIZE);
+    ob->wpos = 0;
+  }
+  *room = ob->wslice->size - ob->wpos;
+  return &ob->wslice->data[ob->wpos];
+}
+
+void outbuf_commit(outbuf_t* ob, size_t n) {
+  if (n == 0) {
+    return;
+  }
+  // Extend the last segment if this continues it; otherwise start a new one.
+  outbuf_seg_t* last = ob->tail > ob->head ? &ob->segs[ob->tail - 1] : NULL;
+  if (last && last->slice == ob->wslice && last->off + last->len == ob->wpos) {
+    last->len += n;
+    ob->pending += n;
+  } else {
+    slice_ref(ob->wslice);
+    push_seg(ob, ob->wslice, ob->wpos, n);
+  }
+  ob->wpos += n;
+}
+
+void outbuf_append_slice(outbuf_t* ob, slice_t* s, size_t off, size_t len) {
+  slice_ref(s);
+  push_seg(ob, s, off, len);
+}
+
+static void push_pin(outbuf_t* ob, uint32_t seq, slice_t* s) {
+  ob->pins = grow_window(ob->pins, sizeof(outbuf_pin_t), &ob->pins_head,
+                         &ob->pins_tail, &ob->pins_cap);
+  slice_ref(s);
+  ob->pins[ob->pins_tail++] = (outbuf_pin_t){seq, s};
+}
+
+ssize_t outbuf_send(outbuf_t* ob, int sockfd, int flags) {
+  struct iovec iov[OUTBUF_IOV_MAX];
+  int niov = 0;
+  size_t total = 0;
+  for (int i = ob->head; i < ob->tail && niov < OUTBUF_IOV_MAX; ++i) {
+    iov[niov].iov_base = &ob->segs[i].slice->data[ob->segs[i].off];
+    iov[niov].iov_len = ob->segs[i].len;
+    total += ob->segs[i].len;
+    niov++;
+  }
+  if (niov == 0) {
+    return 0;
+  }
+
+  bool zerocopy = ob->zerocopy && total >= OUTBUF_ZEROCOPY_MIN;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = niov;
+  ssize_t nsent = sendmsg(sockfd, &msg, flags | (zerocopy ? MSG_ZEROCOPY : 0));
+  if (nsent <= 0) {
+    return nsent;
+  }
+
+  // Consume what was sent. With zero-copy, every slice the kernel now reads
+  // from is pinned until the completion for this send comes back.
+  size_t left = nsent;
+  while (left > 0) {
+    outbuf_seg_t* seg = &ob->segs[ob->head];
+    if (zerocopy) {
+      push_pin(ob, ob->zc_seq, seg->slice);
+    }
+    if (seg->len <= left) {
+      left -= seg->len;
+      slice_unref(seg->slice);
+      ob->head++;
+    } else {
+      seg->off += left;
+      seg->len -= left;
+      left = 0;
+    }
+  }
+  if (zerocopy) {
+    ob->zc_seq++;
+  }
+  ob->pending -= nsent;
+
+  if (ob->head == ob->tail) {
+    ob->head = ob->tail = 0;
+    // Nothing left to send: hand the write slice back too, unless zero-copy
+    // sends still read from it.
+    if (ob->wslice && !outbuf_zerocopy_inflight(ob)) {
+      slice_unref(ob->wslice);
+      ob->wslice = NULL;
+    }
+  }
+  return nsent;
+}
+
+bool outbuf_enable_zerocopy(outbuf_t* ob, int sockfd) {
+  int one = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+    return false;
+  }
+  ob->zerocopy = true;
+  return true;
+}
+
+// Drops the pins of the sends numbered lo..hi (inclusive, wrapping).
+static void release_pins(outbuf_t* ob, uint32_t lo, uint32_t hi) {
+  for (int i = ob->pins_head; i < ob->pins_tail; ++i) {
+    outbuf_pin_t* pin = &ob->pins[i];
+    if (pin->slice && pin->seq - lo <= hi - lo) {
+      slice_unref(pin->slice);
+      pin->slice = NULL;
+    }
+  }
+  // Completions normally arrive in order; pop everything released at the
+  // front.
+  while (ob->pins_head < ob->pins_tail && !ob->pins[ob->pins_head].slice) {
+    ob->pins_head++;
+  }
+  if (ob->pins_head == ob->pins_tail) {
+    ob->pins_head = ob->pins_tail = 0;
+  }
+}
+
+int outbuf_reap_zerocopy(outbuf_t* ob, int sockfd) {
+  int ncompletions = 0;
+  while (1) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return ncompletions;
+      }
+      return -1;
+    }
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm;
+         cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      struct sock_extended_err* serr = (void*)CMSG_DATA(cm);
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        errno = serr->ee_errno;
+        return -1;
+      }
+      release_pins(ob, serr->ee_info, serr->ee_data);
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        // The kernel copied after all, so we paid for pinning for nothing.
+        ob->zerocopy = false;
+      }
+      ncompletions++;
+    }
+  }
+}
+
+bool outbuf_drain_zerocopy(outbuf_t* ob, int sockfd, int timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while (outbuf_zerocopy_inflight(ob)) {
+    // A socket error (e.g. a reset) doesn't end the wait: it frees the queued
+    // data, so the completions follow shortly.
+    outbuf_reap_zerocopy(ob, sockfd);
+    if (!outbuf_zerocopy_inflight(ob)) {
+      break;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+                   (deadline.tv_nsec - now.tv_nsec) / 1000000;
+    if (left_ms <= 0) {
+      return false;
+    }
+    // The error queue becoming non-empty shows up as POLLERR, which poll
+    // reports whatever events are asked for.
+    struct pollfd pfd = {.fd = sockfd, .events = 0};
+    poll(&pfd, 1, left_ms);
+  }
+  return true;
+}
@@ -0,0 +1,138 @@
+// Chained output buffers for the socket servers.
+//
+// An outbuf_t is a queue of segments, each a (slice, offset, length) view into
+// a reference-counted slice of memory. Replies are assembled in place:
+// outbuf_reserve hands out writable room at the tail and outbuf_commit appends
+// what was written, so payload bytes are written once and never copied into a
+// staging buffer. Data that many peers send, like the initial '*' ack, lives
+// in one slice that every outbuf references instead of copying.
+//
+// outbuf_send pushes out as many segments as possible with a single sendmsg
+// (gather I/O), however the reply was split across slices.
+//
+// Zero-copy: after outbuf_enable_zerocopy, sends of at least
+// OUTBUF_ZEROCOPY_MIN bytes use MSG_ZEROCOPY. The kernel then transmits
+// straight from our slices, so it holds an extra reference ("pin") on every
+// slice involved until it reports completion on the socket's error queue.
+// Call outbuf_reap_zerocopy when the socket has an error pending (EPOLLERR)
+// or after sending, to drop those references. Smaller sends are copied as
+// usual: pinning pages and processing a completion costs more than copying a
+// few KB. When the kernel reports that it had to copy anyway (e.g. over
+// loopback), zero-copy is turned off for that outbuf.
+//
+// An outbuf belongs to one thread at a time; slices may be shared between
+// outbufs on different threads.
+//
+// This code is in the public domain.
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Default slice size for outbuf_reserve.
+#define OUTBUF_SLICE_SIZE 4096
+
+// Segments sent per sendmsg.
+#define OUTBUF_IOV_MAX 64
+
+// Smallest send that uses MSG_ZEROCOPY.
+#define OUTBUF_ZEROCOPY_MIN (16 * 1024)
+
+typedef struct slice {
+  int refcount;
+  size_t size;
+  uint8_t data[];
+} slice_t;
+
+// Allocates a slice of size bytes with a reference count of 1.
+slice_t* slice_new(size_t size);
+void slice_ref(slice_t* s);
+void slice_unref(slice_t* s);
+
+typedef struct {
+  slice_t* slice;
+  uint32_t off;
+  uint32_t len;
+} outbuf_seg_t;
+
+// A reference held for an in-flight zero-copy send.
+typedef struct {
+  uint32_t seq;
+  slice_t* slice;
+} outbuf_pin_t;
+
+typedef struct {
+  // Segments [head, tail) of a growable array, oldest first.
+  outbuf_seg_t* segs;
+  int head;
+  int tail;
+  int cap;
+  size_t pending;  // Bytes not sent yet
+
+  // The slice outbuf_reserve hands out room from, written only through this
+  // outbuf, and the offset of its first unwritten byte. Dropped once
+  // everything is sent, so an idle connection holds no memory.
+  slice_t* wslice;
+  size_t wpos;
+
+  bool zerocopy;
+  uint32_t zc_seq;  // Sequence number the kernel gives the next MSG_ZEROCOPY
+  outbuf_pin_t* pins;  // FIFO of pins, oldest first
+  int pins_head;
+  int pins_tail;
+  int pins_cap;
+} outbuf_t;
+
+void outbuf_init(outbuf_t* ob);
+
+// Releases all segments. Slices still pinned by zero-copy sends are leaked
+// instead: closing the socket doesn't stop the kernel from transmitting from
+// them, and once it's closed there is no error queue left to say when it's
+// done. Reap (or outbuf_drain_zerocopy) before closing to keep this rare.
+void outbuf_free(outbuf_t* ob);
+
+// Number of bytes queued and not yet sent.
+static inline size_t outbuf_pending(const outbuf_t* ob) {
+  return ob->pending;
+}
+
+// Returns writable memory for at least min bytes at the end of the queue,
+// storing the amount available in *room. Nothing is queued until
+// outbuf_commit.
+uint8_t* outbuf_reserve(outbuf_t* ob, size_t min, size_t* room);
+
+// Queues the first n bytes of the room returned by the last outbuf_reserve.
+void outbuf_commit(outbuf_t* ob, size_t n);
+
+// Queues len bytes of slice s starting at off, taking a reference on s.
+void outbuf_append_slice(outbuf_t* ob, slice_t* s, size_t off, size_t len);
+
+// Sends as much of the queue as one sendmsg takes, with the given flags
+// (plus MSG_ZEROCOPY when applicable). Returns the number of bytes sent, or -1
+// with errno set by sendmsg.
+ssize_t outbuf_send(outbuf_t* ob, int sockfd, int flags);
+
+// Sets SO_ZEROCOPY on sockfd and makes sends from ob use MSG_ZEROCOPY when
+// large enough. Returns false (and leaves zero-copy off) if the kernel
+// doesn't support it.
+bool outbuf_enable_zerocopy(outbuf_t* ob, int sockfd);
+
+// True while zero-copy sends from ob are awaiting completion.
+static inline bool outbuf_zerocopy_inflight(const outbuf_t* ob) {
+  return ob->pins_head != ob->pins_tail;
+}
+
+// Reads zero-copy completions from sockfd's error queue and drops the pins
+// they cover. Returns the number of completions read, or -1 with errno set if
+// the error queue reported a real socket error.
+int outbuf_reap_zerocopy(outbuf_t* ob, int sockfd);
+
+// Waits up to timeout_ms for the completions of all zero-copy sends from ob,
+// reaping them as they arrive. Returns true if none are left in flight. Meant
+// for just before closing the socket, where the thread can afford to block.
+bool outbuf_drain_zerocopy(outbuf_t* ob, int sockfd, int timeout_ms);
+
+#endif /* OUTBUF_H */
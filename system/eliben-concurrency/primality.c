@@ -0,0 +1,236 @@
+// Fast deterministic primality testing for 64-bit numbers.
+//
+// This code is in the public domain.
+#include "primality.h"
+
+#include <string.h>
+
+// Bit i is set if 2i+1 is composite (or 1).
+static uint8_t sieve[PRIMALITY_SIEVE_LIMIT / 16];
+
+// The odd primes below 256, each as its inverse modulo 2^64 and the largest
+// quotient a 64-bit number divided by it can have. p divides n iff
+// n * inverse (mod 2^64) <= that limit, which costs a multiply where n % p
+// costs a division.
+#define NUM_SMALL_PRIMES 53
+static struct {
+  uint64_t inverse;
+  uint64_t limit;
+} small_primes[NUM_SMALL_PRIMES];
+
+// Inverse of odd n modulo 2^64, by Newton's iteration: n is its own inverse
+// modulo 8, and each step doubles the number of correct bits.
+static uint64_t inverse64(uint64_t n) {
+  uint64_t inv = n;
+  for (int i = 0; i < 5; ++i) {
+    inv *= 2 - n * inv;
+  }
+  return inv;
+}
+
+__attribute__((constructor)) static void build_sieve(void) {
+  memset(sieve, 0, sizeof(sieve));
+  sieve[0] |= 1;  // 1 isn't prime
+  int nsmall = 0;
+  for (uint32_t p = 3; p < PRIMALITY_SIEVE_LIMIT; p += 2) {
+    if (sieve[p / 16] & (1 << (p / 2 % 8))) {
+      continue;
+    }
+    if (p < 256) {
+      small_primes[nsmall].inverse = inverse64(p);
+      small_primes[nsmall].limit = UINT64_MAX / p;
+      nsmall++;
+    }
+    for (uint32_t q = p * p; q < PRIMALITY_SIEVE_LIMIT; q += 2 * p) {
+      sieve[q / 16] |= 1 << (q / 2 % 8);
+    }
+  }
+}
+
+// Returns 1 if n is prime, 0 if composite and -1 if it takes Miller-Rabin to
+// tell.
+static int prefilter(uint64_t n) {
+  if (n < PRIMALITY_SIEVE_LIMIT) {
+    if (n % 2 == 0) {
+      return n == 2;
+    }
+    return !(sieve[n / 16] & (1 << (n / 2 % 8)));
+  }
+  if (n % 2 == 0) {
+    return 0;
+  }
+  for (int i = 0; i < NUM_SMALL_PRIMES; ++i) {
+    if (n * small_primes[i].inverse <= small_primes[i].limit) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Montgomery arithmetic modulo odd n, with R = 2^64: x is represented as
+// xR mod n, and a product of two representations is reduced by REDC, which
+// divides by R with shifts and multiplications only.
+typedef struct {
+  uint64_t n;
+  uint64_t ninv;  // n^-1 mod 2^64
+  uint64_t one;   // R mod n: 1 in Montgomery form
+  uint64_t r2;    // R^2 mod n, to convert into Montgomery form
+} mont_t;
+
+static void mont_init(mont_t* m, uint64_t n) {
+  m->n = n;
+  m->ninv = inverse64(n);
+  m->one = -n % n;
+  m->r2 = (unsigned __int128)m->one * m->one % n;
+}
+
+// abR^-1 mod n, for a, b < n. With q = (ab mod R) * n^-1 mod R, ab - qn is
+// divisible by R, and the quotient is the difference of the high halves of ab
+// and qn; it's within (-n, n).
+static inline uint64_t mont_mul(const mont_t* m, uint64_t a, uint64_t b) {
+  unsigned __int128 t = (unsigned __int128)a * b;
+  uint64_t q = (uint64_t)t * m->ninv;
+  uint64_t hi = t >> 64;
+  uint64_t qn_hi = ((unsigned __int128)q * m->n) >> 64;
+  return hi >= qn_hi ? hi - qn_hi : hi - qn_hi + m->n;
+}
+
+#define MAX_LANES 8
+
+// A Miller-Rabin round per lane: lane i checks whether n_i = d_i * 2^s_i + 1
+// is a strong probable prime to base a_i. All lanes step through their
+// exponentiations together, so each iteration issues independent
+// multiplications the CPU can overlap. Lanes with shorter exponents start
+// from 1 and spend their leading iterations squaring it.
+static void mr_lanes(const mont_t* const* m, const uint64_t* a,
+                     const uint64_t* d, const int* s, bool* pass, int k) {
+  uint64_t base[MAX_LANES];
+  uint64_t x[MAX_LANES];
+  int bits = 0;
+  for (int i = 0; i < k; ++i) {
+    base[i] = mont_mul(m[i], a[i] % m[i]->n, m[i]->r2);
+    x[i] = m[i]->one;
+    int b = 64 - __builtin_clzll(d[i]);
+    if (b > bits) {
+      bits = b;
+    }
+  }
+
+  for (int bit = bits - 1; bit >= 0; --bit) {
+    for (int i = 0; i < k; ++i) {
+      x[i] = mont_mul(m[i], x[i], x[i]);
+      // Multiplying by 1 instead of branching keeps the lanes' different
+      // exponent bits from costing mispredictions.
+      uint64_t mask = -((d[i] >> bit) & 1);
+      x[i] = mont_mul(m[i], x[i], (base[i] & mask) | (m[i]->one & ~mask));
+    }
+  }
+
+  for (int i = 0; i < k; ++i) {
+    if (base[i] == 0) {
+      // n divides the base, which tells nothing about n.
+      pass[i] = true;
+      continue;
+    }
+    uint64_t minus_one = m[i]->n - m[i]->one;
+    bool p = x[i] == m[i]->one || x[i] == minus_one;
+    for (int r = 1; r < s[i] && !p; ++r) {
+      x[i] = mont_mul(m[i], x[i], x[i]);
+      if (x[i] == m[i]->one) {
+        break;
+      }
+      p = x[i] == minus_one;
+    }
+    pass[i] = p;
+  }
+}
+
+// Together with 2, these make Miller-Rabin exact for n < 2^64 (Jim Sinclair's
+// set).
+static const uint64_t more_bases[] = {325,     9375,    28178,     450775,
+                                      9780504, 1795265022};
+#define NUM_MORE_BASES (sizeof(more_bases) / sizeof(more_bases[0]))
+
+// Decides the k numbers the prefilter couldn't. Nearly every composite fails
+// base 2, so that round runs for all of them together, and only numbers that
+// pass it go on to the other bases, one number at a time with its bases in
+// lockstep.
+static void mr_batch(const uint64_t* n, bool* results, int k) {
+  mont_t mont[MAX_LANES];
+  // Only the first k lanes are used, but gcc can't see that k >= 1 and warns
+  // about the rest at -O2.
+  const mont_t* m[MAX_LANES] = {0};
+  uint64_t a[MAX_LANES] = {0};
+  uint64_t d[MAX_LANES] = {0};
+  int s[MAX_LANES] = {0};
+  for (int i = 0; i < k; ++i) {
+    mont_init(&mont[i], n[i]);
+    m[i] = &mont[i];
+    a[i] = 2;
+    s[i] = __builtin_ctzll(n[i] - 1);
+    d[i] = (n[i] - 1) >> s[i];
+  }
+  mr_lanes(m, a, d, s, results, k);
+
+  for (int i = 0; i < k; ++i) {
+    if (!results[i]) {
+      continue;
+    }
+    const mont_t* mb[NUM_MORE_BASES];
+    uint64_t db[NUM_MORE_BASES];
+    int sb[NUM_MORE_BASES];
+    bool pass[NUM_MORE_BASES];
+    for (size_t j = 0; j < NUM_MORE_BASES; ++j) {
+      mb[j] = &mont[i];
+      db[j] = d[i];
+      sb[j] = s[i];
+    }
+    mr_lanes(mb, more_bases, db, sb, pass, NUM_MORE_BASES);
+    for (size_t j = 0; j < NUM_MORE_BASES; ++j) {
+      results[i] &= pass[j];
+    }
+  }
+}
+
+// Numbers tested together in the base-2 round of isprime_batch.
+#define BATCH_LANES 4
+
+void isprime_batch(const uint64_t* nums, bool* results, size_t count) {
+  uint64_t pending[BATCH_LANES];
+  size_t pending_idx[BATCH_LANES];
+  bool pending_results[BATCH_LANES];
+  int npending = 0;
+  for (size_t i = 0; i < count; ++i) {
+    int r = prefilter(nums[i]);
+    if (r >= 0) {
+      results[i] = r;
+      continue;
+    }
+    pending[npending] = nums[i];
+    pending_idx[npending] = i;
+    npending++;
+    if (npending == BATCH_LANES) {
+      mr_batch(pending, pending_results, npending);
+      for (int j = 0; j < npending; ++j) {
+        results[pending_idx[j]] = pending_results[j];
+      }
+      npending = 0;
+    }
+  }
+  if (npending > 0) {
+    mr_batch(pending, pending_results, npending);
+    for (int j = 0; j < npending; ++j) {
+      results[pending_idx[j]] = pending_results[j];
+    }
+  }
+}
+
+bool isprime_fast(uint64_t n) {
+  int r = prefilter(n);
+  if (r >= 0) {
+    return r;
+  }
+  bool result;
+  mr_batch(&n, &result, 1);
+  return result;
+}
@@ -0,0 +1,28 @@
+// Fast deterministic primality testing for 64-bit numbers.
+//
+// Numbers below PRIMALITY_SIEVE_LIMIT are looked up in a sieve of
+// Eratosthenes. Larger ones are first checked for divisibility by the primes
+// below 256, which rules out most composites with a multiply and a compare
+// per prime. The rest go through Miller-Rabin with the seven bases known to
+// make it exact for all n < 2^64, in Montgomery arithmetic so that modular
+// multiplication needs no division. A prime takes a few microseconds, where
+// trial division up to sqrt(n) can take seconds.
+//
+// This code is in the public domain.
+#ifndef PRIMALITY_H
+#define PRIMALITY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PRIMALITY_SIEVE_LIMIT (1 << 16)
+
+bool isprime_fast(uint64_t n);
+
+// Tests count numbers, storing whether nums[i] is prime in results[i]. The
+// modular exponentiations of several numbers are interleaved, so the CPU can
+// overlap their multiplications instead of waiting on one chain at a time.
+void isprime_batch(const uint64_t* nums, bool* results, size_t count);
+
+#endif /* PRIMALITY_H */
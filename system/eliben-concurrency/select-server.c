@@ -15,12 +15,9 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "conntable.h"
 #include "utils.h"
 
-// Note: FD_SETSIZE is 1024 on Linux, which is tricky to change. This provides a
-// natural limit to the number of simultaneous FDs monitored by select().
-#define MAXFDS 1000
-
 typedef enum { INITIAL_ACK, WAIT_FOR_MSG, IN_MSG } ProcessingState;
 
 #define SENDBUF_SIZE 1024
@@ -31,8 +28,9 @@ typedef struct {
   // sendbuf contains data the server has to send back to the client. The
   // on_peer_ready_recv handler populates this buffer, and on_peer_ready_send
   // drains it. sendbuf_end points to the last valid byte in the buffer, and
-  // sendptr at the next byte to send.
-  uint8_t sendbuf[SENDBUF_SIZE];
+  // sendptr at the next byte to send. The buffer is taken from the connection
+  // table's pool while there is output pending, and is NULL otherwise.
+  uint8_t* sendbuf;
   int sendbuf_end;
   int sendptr;
 } peer_state_t;
@@ -40,9 +38,12 @@ typedef struct {
 // Each peer is globally identified by the file descriptor (fd) it's connected
 // on. As long as the peer is connected, the fd is unique to it. When a peer
 // disconnects, a new peer may connect and get the same fd. on_peer_connected
-// should initialize the state properly to remove any trace of the old peer on
-// the same fd.
-peer_state_t global_state[MAXFDS];
+// adds the peer's state to this table, and close_peer removes it.
+//
+// Note: FD_SETSIZE is 1024 on Linux, which is tricky to change. This provides a
+// natural limit to the number of simultaneous FDs monitored by select(); the
+// table itself has no limit.
+conn_table_t* peers;
 
 // Callbacks (on_XXX functions) return this status to the main loop; the status
 // instructs the loop about the next steps for the fd for which the callback was
@@ -63,12 +64,12 @@ const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
 
 fd_status_t on_peer_connected(int sockfd, const struct sockaddr_in* peer_addr,
                               socklen_t peer_addr_len) {
-  assert(sockfd < MAXFDs);
   report_peer_connected(peer_addr, peer_addr_len);
 
   // Initialize state to send back a '*' to the peer immediately.
-  peer_state_t* peerstate = &global_state[sockfd];
+  peer_state_t* peerstate = conn_table_add(peers, sockfd);
   peerstate->state = INITIAL_ACK;
+  peerstate->sendbuf = conn_sendbuf_get(peers);
   peerstate->sendbuf[0] = '*';
   peerstate->sendptr = 0;
   peerstate->sendbuf_end = 1;
@@ -78,8 +79,7 @@ fd_status_t on_peer_connected(int sockfd, const struct sockaddr_in* peer_addr,
 }
 
 fd_status_t on_peer_ready_recv(int sockfd) {
-  assert(sockfd < MAXFDs);
-  peer_state_t* peerstate = &global_state[sockfd];
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
 
   if (peerstate->state == INITIAL_ACK ||
       peerstate->sendptr < peerstate->sendbuf_end) {
@@ -117,6 +117,9 @@ fd_status_t on_peer_ready_recv(int sockfd) {
       if (buf[i] == '$') {
         peerstate->state = WAIT_FOR_MSG;
       } else {
+        if (!peerstate->sendbuf) {
+          peerstate->sendbuf = conn_sendbuf_get(peers);
+        }
         assert(peerstate->sendbuf_end < SENDBUF_SIZE);
         peerstate->sendbuf[peerstate->sendbuf_end++] = buf[i] + 1;
         ready_to_send = true;
@@ -131,8 +134,7 @@ fd_status_t on_peer_ready_recv(int sockfd) {
 }
 
 fd_status_t on_peer_ready_send(int sockfd) {
-  assert(sockfd < MAXFDs);
-  peer_state_t* peerstate = &global_state[sockfd];
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
 
   if (peerstate->sendptr >= peerstate->sendbuf_end) {
     // Nothing to send.
@@ -151,7 +153,10 @@ fd_status_t on_peer_ready_send(int sockfd) {
     peerstate->sendptr += nsent;
     return fd_status_W;
   } else {
-    // Everything was sent successfully; reset the send queue.
+    // Everything was sent successfully; reset the send queue, returning the
+    // buffer to the pool until there is something to send again.
+    conn_sendbuf_put(peers, peerstate->sendbuf);
+    peerstate->sendbuf = NULL;
     peerstate->sendptr = 0;
     peerstate->sendbuf_end = 0;
 
@@ -164,6 +169,16 @@ fd_status_t on_peer_ready_send(int sockfd) {
   }
 }
 
+void close_peer(int fd) {
+  printf("socket %d closing\n", fd);
+  close(fd);
+  peer_state_t* peerstate = conn_table_get(peers, fd);
+  if (peerstate->sendbuf) {
+    conn_sendbuf_put(peers, peerstate->sendbuf);
+  }
+  conn_table_remove(peers, fd);
+}
+
 int main(int argc, char** argv) {
   setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -174,6 +189,7 @@ int main(int argc, char** argv) {
   printf("Serving on port %d\n", portnum);
 
   int listener_sockfd = listen_inet_socket(portnum);
+  peers = conn_table_create(sizeof(peer_state_t), SENDBUF_SIZE);
 
   // The select() manpage warns that select() can return a read notification
   // for a socket that isn't actually readable. Thus using blocking I/O isn't
@@ -269,8 +285,12 @@ int main(int argc, char** argv) {
             FD_CLR(fd, &writefds_master);
           }
           if (!status.want_read && !status.want_write) {
-            printf("socket %d closing\n", fd);
-            close(fd);
+            close_peer(fd);
+            // The peer's state is gone, so skip the writability check below.
+            if (FD_ISSET(fd, &writefds)) {
+              nready--;
+              FD_CLR(fd, &writefds);
+            }
           }
         }
       }
@@ -290,8 +310,7 @@ int main(int argc, char** argv) {
           FD_CLR(fd, &writefds_master);
         }
         if (!status.want_read && !status.want_write) {
-          printf("socket %d closing\n", fd);
-          close(fd);
+          close_peer(fd);
         }
       }
     }
@@ -34,6 +34,9 @@ void serve_connection(int sockfd) {
       break;
     }
 
+    // Replies are gathered at the front of buf (a reply byte never overtakes
+    // the input byte it's made from) and sent together.
+    int replylen = 0;
     for (int i = 0; i < len; ++i) {
       switch (state) {
       case WAIT_FOR_MSG:
@@ -45,16 +48,20 @@ void serve_connection(int sockfd) {
         if (buf[i] == '$') {
           state = WAIT_FOR_MSG;
         } else {
-          buf[i] += 1;
-          if (send(sockfd, &buf[i], 1, 0) < 1) {
-            perror("send error");
-            close(sockfd);
-            return;
-          }
+          buf[replylen++] = buf[i] + 1;
         }
         break;
       }
     }
+    for (int sent = 0; sent < replylen;) {
+      int n = send(sockfd, &buf[sent], replylen - sent, 0);
+      if (n < 1) {
+        perror("send error");
+        close(sockfd);
+        return;
+      }
+      sent += n;
+    }
   }
 
   close(sockfd);
@@ -0,0 +1,134 @@
+# Runs loadgen against each server in this directory in turn and tabulates
+# throughput and latency, to compare the designs under the same load.
+#
+# Options after "--" are passed to loadgen, e.g.
+#
+#   python3 server-bench.py select epoll-et uring -- -c 64 -d 4 -r 50000
+#
+# With -r in the loadgen options, the latency columns are the corrected ones
+# (measured from when each message was scheduled to be sent); otherwise
+# they're measured from the actual send. Servers whose binary isn't built
+# (e.g. uv-server without libuv) are skipped.
+#
+# sequential-server serves one connection at a time, so it is only useful
+# with "-c 1".
+#
+# This code is in the public domain.
+import argparse
+import os
+import socket
+import subprocess
+import sys
+import time
+
+# Name -> server binary and its extra arguments.
+SERVERS = {
+    "sequential": ["sequential-server"],
+    "select": ["select-server"],
+    "epoll-lt": ["epoll-server", "lt"],
+    "epoll-et": ["epoll-server", "et"],
+    "reactors": ["epoll-server-reactors"],
+    "threaded": ["threaded-server"],
+    "fiber": ["fiber-server"],
+    "uv": ["uv-server"],
+    "uring": ["uring-server"],
+    "uring-sqpoll": ["uring-server", "sqpoll"],
+}
+
+DEFAULT_SERVERS = [name for name in SERVERS if name != "sequential"]
+
+PERCENTILES = ["50.00%", "99.00%", "99.90%", "100.00%"]
+
+
+def wait_port_free(port, timeout=5.0):
+    """Waits until nothing listens on port.
+
+    io_uring tears down a ring's requests asynchronously, so uring-server's
+    listening socket may outlive the process for a moment.
+    """
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        with socket.socket() as s:
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            try:
+                s.bind(("", port))
+                return
+            except OSError:
+                time.sleep(0.05)
+    sys.exit("port {0} still in use".format(port))
+
+
+def parse_loadgen(output):
+    """Returns (msgs/s, {percentile: latency in us}, problems line)."""
+    rate, latencies, problems = 0.0, {}, ""
+    for line in output.splitlines():
+        fields = line.split()
+        if "bad" in fields:
+            problems = line.strip()
+        elif "replies," in fields:
+            rate = float(fields[fields.index("replies,") + 1])
+        elif fields and fields[0] in PERCENTILES:
+            # With two columns the first is the corrected one.
+            latencies[fields[0]] = float(fields[1])
+    return rate, latencies, problems
+
+
+def bench_server(args, name):
+    server, *server_args = SERVERS[name]
+    path = os.path.join(args.dir, server)
+    if not os.path.exists(path):
+        return None
+    proc = subprocess.Popen([path, str(args.port)] + server_args,
+                            stdout=subprocess.DEVNULL)
+    time.sleep(0.3)
+    try:
+        result = subprocess.run(
+            [os.path.join(args.dir, "loadgen")] + args.loadgen_args +
+            [str(args.port)],
+            stdout=subprocess.PIPE, universal_newlines=True)
+        if args.verbose:
+            print(result.stdout)
+        return parse_loadgen(result.stdout)
+    finally:
+        proc.terminate()
+        proc.wait()
+        wait_port_free(args.port)
+
+
+if __name__ == "__main__":
+    argv = sys.argv[1:]
+    loadgen_args = []
+    if "--" in argv:
+        loadgen_args = argv[argv.index("--") + 1:]
+        argv = argv[:argv.index("--")]
+
+    argparser = argparse.ArgumentParser("server comparison with loadgen")
+    argparser.add_argument("servers", nargs="*",
+                           help="servers to run, out of {0} (default: all but "
+                                "sequential)".format(", ".join(SERVERS)))
+    argparser.add_argument("--dir", default=".",
+                           help="directory with the binaries")
+    argparser.add_argument("-p", "--port", type=int, default=9090,
+                           help="server port")
+    argparser.add_argument("-v", "--verbose", action="store_true",
+                           help="print loadgen's full output")
+    args = argparser.parse_args(argv)
+    args.loadgen_args = loadgen_args
+    for name in args.servers:
+        if name not in SERVERS:
+            argparser.error("unknown server {0!r}".format(name))
+
+    print("{0:<14}{1:>10}".format("server", "msgs/s") +
+          "".join("{0:>10}".format(p) for p in PERCENTILES) + "  (us)")
+    for name in args.servers or DEFAULT_SERVERS:
+        result = bench_server(args, name)
+        if result is None:
+            print("{0:<14}{1:>10}".format(name, "not built"))
+            continue
+        rate, latencies, problems = result
+        print("{0:<14}{1:>10.0f}".format(name, rate) +
+              "".join("{0:>10.1f}".format(latencies.get(p, float("nan")))
+                      for p in PERCENTILES))
+        if problems and not problems.startswith("0 bad replies, 0 timed out, "
+                                                "0 never sent, 0 connections"):
+            print("  " + problems)
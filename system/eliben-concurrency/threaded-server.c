@@ -1,63 +1,160 @@
 // Threaded socket server - accepting multiple clients concurrently, by creating
 // a new thread for each connecting client.
 //
+// The replies to each recv'd chunk are assembled in an outbuf_t (see outbuf.h)
+// and sent with one sendmsg, rather than with a send per byte. With "zerocopy",
+// large sends use MSG_ZEROCOPY.
+//
+// With "pool", connections are instead served by a fixed number of worker
+// threads, created up front, which take accepted sockets from a bounded queue.
+// A worker serves one connection until it closes, so at most `workers`
+// connections are served at once and up to `queue` more wait for a worker
+// (without their '*' yet). When the queue is full the accept loop stops
+// accepting for up to `wait-ms` milliseconds: new clients back up in the
+// kernel's listen backlog and then in their connect. If no worker frees up by
+// then, the connection is closed right away instead of being queued. This
+// bounds the server's threads and memory no matter how many clients come,
+// which thread-per-connection doesn't (see threadspammer.c).
+//
+// Usage:
+//   ./threaded-server [port] [zerocopy] [pool [workers] [queue] [wait-ms]]
+//
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
+#include <errno.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "framing.h"
+#include "outbuf.h"
 #include "utils.h"
 
 typedef struct { int sockfd; } thread_config_t;
 
 typedef enum { WAIT_FOR_MSG, IN_MSG } ProcessingState;
 
+// Bytes read per recv. Replies are no longer bounded by a fixed send buffer,
+// so reads can be large enough for the replies to one of them to reach
+// OUTBUF_ZEROCOPY_MIN.
+#define RECVBUF_SIZE (64 * 1024)
+
+bool zerocopy = false;
+
+// How long a closing connection waits for its zero-copy completions.
+#define ZEROCOPY_DRAIN_MS 1000
+
+// Pool mode defaults.
+#define POOL_WORKERS 64
+#define POOL_QUEUE 64
+#define POOL_WAIT_MS 1000
+
+// Accepted sockets waiting for a pool worker: a ring of cap entries.
+typedef struct {
+  int* fds;
+  int cap;
+  int head;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} conn_queue_t;
+
+// Sends everything queued in out. The socket is blocking, so each sendmsg
+// goes as far as the socket buffer allows.
+bool flush_outbuf(outbuf_t* out, int sockfd) {
+  while (outbuf_pending(out) > 0) {
+    if (outbuf_send(out, sockfd, MSG_NOSIGNAL) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+  }
+  // Collect whatever zero-copy completions have arrived; this doesn't block.
+  if (outbuf_zerocopy_inflight(out) && outbuf_reap_zerocopy(out, sockfd) < 0) {
+    return false;
+  }
+  return true;
+}
+
 void serve_connection(int sockfd) {
-  if (send(sockfd, "*", 1, 0) < 1) {
-    perror_die("send");
+  // Errors end just this connection: in pool mode a client may well have
+  // given up and gone by the time a worker gets to it.
+  if (send(sockfd, "*", 1, MSG_NOSIGNAL) < 1) {
+    perror("send");
+    close(sockfd);
+    return;
   }
 
   ProcessingState state = WAIT_FOR_MSG;
+  outbuf_t out;
+  outbuf_init(&out);
+  if (zerocopy && !outbuf_enable_zerocopy(&out, sockfd)) {
+    perror("setsockopt SO_ZEROCOPY");
+  }
 
   while (1) {
-    uint8_t buf[1024];
+    uint8_t buf[RECVBUF_SIZE];
     int len = recv(sockfd, buf, sizeof buf, 0);
     if (len < 0) {
-      perror_die("recv");
+      perror("recv");
+      break;
     } else if (len == 0) {
       break;
     }
 
-    for (int i = 0; i < len; ++i) {
-      switch (state) {
-      case WAIT_FOR_MSG:
-        if (buf[i] == '^') {
-          state = IN_MSG;
+    // Transformed bytes go straight into the outbuf's room. framing.h's
+    // helpers skip from '^' to '$' and back a vector at a time.
+    size_t room;
+    uint8_t* reply = outbuf_reserve(&out, len, &room);
+    size_t replylen = 0;
+    const uint8_t* p = buf;
+    const uint8_t* end = buf + len;
+    while (p < end) {
+      if (state == WAIT_FOR_MSG) {
+        p = framing_find(p, end, '^');
+        if (p == end) {
+          break;
         }
-        break;
-      case IN_MSG:
-        if (buf[i] == '$') {
+        p++;
+        state = IN_MSG;
+      } else {
+        size_t n = framing_transform(reply + replylen, p, end - p);
+        replylen += n;
+        p += n;
+        if (p < end) {
+          // Stopped at the '$'.
+          p++;
           state = WAIT_FOR_MSG;
-        } else {
-          buf[i] += 1;
-          if (send(sockfd, &buf[i], 1, 0) < 1) {
-            perror("send error");
-            close(sockfd);
-            return;
-          }
         }
-        break;
       }
     }
+    outbuf_commit(&out, replylen);
+    if (!flush_outbuf(&out, sockfd)) {
+      perror("send error");
+      break;
+    }
   }
 
+  // The kernel may still be transmitting from zero-copy slices; give their
+  // completions a chance to arrive so the slices can be reused. Whatever is
+  // still pinned after that is leaked by outbuf_free.
+  if (outbuf_zerocopy_inflight(&out)) {
+    shutdown(sockfd, SHUT_WR);
+    if (!outbuf_drain_zerocopy(&out, sockfd, ZEROCOPY_DRAIN_MS)) {
+      fprintf(stderr, "socket %d: zero-copy sends still in flight\n", sockfd);
+    }
+  }
   close(sockfd);
+  outbuf_free(&out);
 }
 
 void* server_thread(void* arg) {
@@ -75,6 +172,70 @@ void* server_thread(void* arg) {
   return 0;
 }
 
+void conn_queue_init(conn_queue_t* q, int cap) {
+  q->fds = xmalloc(cap * sizeof(int));
+  q->cap = cap;
+  q->head = 0;
+  q->count = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+}
+
+// Queues sockfd, waiting up to wait_ms for room if the queue is full. Returns
+// false if there was no room in time.
+bool conn_queue_push(conn_queue_t* q, int sockfd, int wait_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += wait_ms / 1000;
+  deadline.tv_nsec += (wait_ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->cap) {
+    if (pthread_cond_timedwait(&q->not_full, &q->lock, &deadline) ==
+        ETIMEDOUT) {
+      break;
+    }
+  }
+  bool queued = q->count < q->cap;
+  if (queued) {
+    q->fds[(q->head + q->count) % q->cap] = sockfd;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return queued;
+}
+
+int conn_queue_pop(conn_queue_t* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0) {
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  }
+  int sockfd = q->fds[q->head];
+  q->head = (q->head + 1) % q->cap;
+  q->count--;
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return sockfd;
+}
+
+void* pool_worker_thread(void* arg) {
+  conn_queue_t* q = (conn_queue_t*)arg;
+  unsigned long id = (unsigned long)pthread_self();
+  while (1) {
+    int sockfd = conn_queue_pop(q);
+    printf("Worker %lu serving connection with socket %d\n", id, sockfd);
+    serve_connection(sockfd);
+    printf("Worker %lu done with socket %d\n", id, sockfd);
+  }
+  return 0;
+}
+
 int main(int argc, char** argv) {
   setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -82,11 +243,49 @@ int main(int argc, char** argv) {
   if (argc >= 2) {
     portnum = atoi(argv[1]);
   }
-  printf("Serving on port %d\n", portnum);
+  bool pool = false;
+  int pool_params[] = {POOL_WORKERS, POOL_QUEUE, POOL_WAIT_MS};
+  for (int i = 2; i < argc; ++i) {
+    if (strcmp(argv[i], "zerocopy") == 0 && !pool) {
+      zerocopy = true;
+    } else if (strcmp(argv[i], "pool") == 0 && !pool) {
+      pool = true;
+      for (int k = 0; k < 3 && i + 1 < argc; ++k) {
+        pool_params[k] = atoi(argv[++i]);
+      }
+    } else {
+      die("usage: %s [port] [zerocopy] [pool [workers] [queue] [wait-ms]]",
+          argv[0]);
+    }
+  }
+  int nworkers = pool_params[0];
+  int queue_size = pool_params[1];
+  int wait_ms = pool_params[2];
+  if (pool && (nworkers < 1 || queue_size < 1 || wait_ms < 0)) {
+    die("pool needs at least one worker and a queue of at least one");
+  }
+  printf("Serving on port %d%s\n", portnum, zerocopy ? " (zero-copy)" : "");
+  if (pool) {
+    printf("Pool of %d workers, queue of %d, waiting up to %d ms for room\n",
+           nworkers, queue_size, wait_ms);
+  }
   fflush(stdout);
 
   int sockfd = listen_inet_socket(portnum);
 
+  conn_queue_t queue;
+  if (pool) {
+    conn_queue_init(&queue, queue_size);
+    for (int i = 0; i < nworkers; ++i) {
+      pthread_t worker;
+      if (pthread_create(&worker, NULL, pool_worker_thread, &queue) != 0) {
+        die("pthread_create failed");
+      }
+      pthread_detach(worker);
+    }
+  }
+  unsigned long rejected = 0;
+
   while (1) {
     struct sockaddr_in peer_addr;
     socklen_t peer_addr_len = sizeof(peer_addr);
@@ -99,6 +298,19 @@ int main(int argc, char** argv) {
     }
 
     report_peer_connected(&peer_addr, peer_addr_len);
+
+    if (pool) {
+      // Until there's room in the queue this loop doesn't accept, which
+      // leaves new clients waiting in the listen backlog.
+      if (!conn_queue_push(&queue, newsockfd, wait_ms)) {
+        close(newsockfd);
+        printf("Rejected connection with socket %d: all workers busy and "
+               "queue full (%lu rejected so far)\n",
+               newsockfd, ++rejected);
+      }
+      continue;
+    }
+
     pthread_t the_thread;
 
     thread_config_t* config = (thread_config_t*)malloc(sizeof(*config));
@@ -0,0 +1,531 @@
+// Asynchronous socket server on io_uring, serving the same protocol as
+// epoll-server.c.
+//
+// Where epoll tells us a socket is ready and we then make the recv/send
+// syscall ourselves, io_uring takes the operations themselves: we queue recv,
+// send and accept requests in a submission ring shared with the kernel and
+// later pick up their results from a completion ring. One io_uring_enter call
+// both submits everything queued since the last one and waits for more
+// completions, so the syscall count no longer grows with the number of
+// operations.
+//
+// Features used (talking to the kernel directly, without liburing):
+//
+// * Multishot accept: a single accept request keeps producing a completion for
+//   every incoming connection.
+// * A provided buffer ring: recvs don't carry a buffer; the kernel picks one
+//   from a ring we register up front, only once data arrives. Idle
+//   connections thus don't pin any receive memory.
+// * Batched submission, as described above.
+// * SQPOLL (optional): a kernel thread polls the submission ring, so while
+//   the server is busy even submitting needs no syscall.
+//
+// Each peer has at most one request in flight, and goes through the same
+// states as with epoll-server: send the '*', then alternate between receiving
+// and sending back the replies. As in epoll-server, we don't receive while
+// replies are still pending, which keeps a peer that doesn't read from making
+// us buffer without bound. (That's also why peers use single-shot rather than
+// multishot recvs.) With a single request per peer, a peer's fd is only
+// closed after its last completion has arrived, so completions can't get
+// mixed up between a closed peer and a new one on the same fd.
+//
+// When the last peer disconnects, the server prints how many syscalls it made
+// per message, in the same format as epoll-server.
+//
+// Usage:
+//   ./uring-server [port] [sqpoll]
+//
+// This code is in the public domain.
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "conntable.h"
+#include "utils.h"
+
+// Peers the completion ring is sized for. More may connect: the kernel keeps
+// completions that don't fit until the ring has room (IORING_FEAT_NODROP).
+#define MAXFDS (16 * 1024)
+
+// Submission ring entries. The completion ring is sized for every peer having
+// a request in flight.
+#define SQ_ENTRIES 4096
+#define CQ_ENTRIES (2 * MAXFDS)
+
+// Provided receive buffers: count (a power of two) and size. A recv fills at
+// most one buffer, and each received byte yields at most one byte to send
+// back, so SENDBUF_SIZE == RECVBUF_SIZE can never overflow.
+#define NUM_RECVBUFS 4096
+#define RECVBUF_SIZE 1024
+#define BUF_GROUP 0
+
+typedef enum { INITIAL_ACK, WAIT_FOR_MSG, IN_MSG } ProcessingState;
+
+#define SENDBUF_SIZE RECVBUF_SIZE
+
+typedef struct {
+  ProcessingState state;
+  // Taken from the connection table's pool while there is output pending,
+  // NULL otherwise; a send in flight points into it.
+  uint8_t* sendbuf;
+  int sendbuf_end;
+  int sendptr;
+} peer_state_t;
+
+// Each peer is globally identified by the file descriptor (fd) it's connected
+// on, as in epoll-server. on_peer_connected adds the peer's state to this
+// table, and close_peer removes it.
+conn_table_t* peers;
+
+// Requests are tagged with the fd and the operation, and the tag comes back in
+// the completion's user_data.
+typedef enum { OP_ACCEPT, OP_RECV, OP_SEND } op_t;
+
+static inline uint64_t make_user_data(int fd, op_t op) {
+  return ((uint64_t)fd << 8) | op;
+}
+
+// The rings shared with the kernel. The head/tail indices are free-running;
+// only their low bits (& mask) index the arrays.
+typedef struct {
+  int fd;
+  bool sqpoll;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_flags;
+  unsigned* sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe* sqes;
+  unsigned sqe_tail;  // Our tail: SQEs up to here are filled in
+  unsigned to_submit;  // SQEs not yet passed to io_uring_enter
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+
+  struct io_uring_buf_ring* buf_ring;
+  uint8_t* recvbufs;
+  unsigned short buf_tail;
+} uring_t;
+
+uring_t ring;
+
+struct {
+  long enter;
+  long messages;
+} stats;
+int num_peers = 0;
+
+void report_stats(void) {
+  printf("%s: %ld messages, %ld syscalls, %.2f per message "
+         "(io_uring_enter %ld)\n",
+         ring.sqpoll ? "uring-sqpoll" : "uring", stats.messages, stats.enter,
+         stats.messages ? (double)stats.enter / stats.messages : 0,
+         stats.enter);
+  memset(&stats, 0, sizeof(stats));
+}
+
+void* mmap_ring(size_t size, off_t offset) {
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring.fd, offset);
+  if (p == MAP_FAILED) {
+    perror_die("mmap");
+  }
+  return p;
+}
+
+void uring_init(bool sqpoll) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = CQ_ENTRIES;
+  if (sqpoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 1000;  // ms before the poller thread sleeps
+  }
+  ring.fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+  if (ring.fd < 0) {
+    perror_die("io_uring_setup");
+  }
+  ring.sqpoll = sqpoll;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  uint8_t* sq_ptr;
+  uint8_t* cq_ptr;
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_size > sq_size) {
+      sq_size = cq_size;
+    }
+    sq_ptr = cq_ptr = mmap_ring(sq_size, IORING_OFF_SQ_RING);
+  } else {
+    sq_ptr = mmap_ring(sq_size, IORING_OFF_SQ_RING);
+    cq_ptr = mmap_ring(cq_size, IORING_OFF_CQ_RING);
+  }
+
+  ring.sq_head = (unsigned*)(sq_ptr + params.sq_off.head);
+  ring.sq_tail = (unsigned*)(sq_ptr + params.sq_off.tail);
+  ring.sq_flags = (unsigned*)(sq_ptr + params.sq_off.flags);
+  ring.sq_array = (unsigned*)(sq_ptr + params.sq_off.array);
+  ring.sq_mask = *(unsigned*)(sq_ptr + params.sq_off.ring_mask);
+  ring.sq_entries = params.sq_entries;
+  ring.sqes = mmap_ring(params.sq_entries * sizeof(struct io_uring_sqe),
+                        IORING_OFF_SQES);
+  ring.sqe_tail = *ring.sq_tail;
+
+  ring.cq_head = (unsigned*)(cq_ptr + params.cq_off.head);
+  ring.cq_tail = (unsigned*)(cq_ptr + params.cq_off.tail);
+  ring.cq_mask = *(unsigned*)(cq_ptr + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+
+  // The provided buffer ring: an array of buffer descriptors in page-aligned
+  // memory, which the kernel consumes from the head while we refill it at
+  // the tail.
+  size_t buf_ring_size = NUM_RECVBUFS * sizeof(struct io_uring_buf);
+  ring.buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (ring.buf_ring == MAP_FAILED) {
+    perror_die("mmap");
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring.buf_ring;
+  reg.ring_entries = NUM_RECVBUFS;
+  reg.bgid = BUF_GROUP;
+  if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) < 0) {
+    perror_die("io_uring_register IORING_REGISTER_PBUF_RING");
+  }
+
+  ring.recvbufs = xmalloc(NUM_RECVBUFS * RECVBUF_SIZE);
+  for (int bid = 0; bid < NUM_RECVBUFS; ++bid) {
+    struct io_uring_buf* buf = &ring.buf_ring->bufs[bid];
+    buf->addr = (uint64_t)(uintptr_t)&ring.recvbufs[bid * RECVBUF_SIZE];
+    buf->len = RECVBUF_SIZE;
+    buf->bid = bid;
+  }
+  ring.buf_tail = NUM_RECVBUFS;
+  __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+// Hands a receive buffer back to the kernel.
+void recycle_recvbuf(unsigned short bid) {
+  struct io_uring_buf* buf =
+      &ring.buf_ring->bufs[ring.buf_tail & (NUM_RECVBUFS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)&ring.recvbufs[bid * RECVBUF_SIZE];
+  buf->len = RECVBUF_SIZE;
+  buf->bid = bid;
+  ring.buf_tail++;
+  __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+// Makes the queued SQEs visible to the kernel and, unless SQPOLL takes care
+// of that, submits them; then waits for at least wait_nr completions.
+void uring_enter(unsigned wait_nr) {
+  __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+
+  unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  unsigned to_submit = ring.to_submit;
+  if (ring.sqpoll) {
+    // The poller thread submits; it only needs waking up if it went to sleep.
+    // The fence orders our tail store before the flags load, pairing with the
+    // poller's store of NEED_WAKEUP before its last look at the tail.
+    to_submit = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(ring.sq_flags, __ATOMIC_RELAXED) &
+        IORING_SQ_NEED_WAKEUP) {
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+    if (flags == 0) {
+      ring.to_submit = 0;
+      return;
+    }
+  } else if (to_submit == 0 && wait_nr == 0) {
+    return;
+  }
+
+  stats.enter++;
+  int rc =
+      syscall(__NR_io_uring_enter, ring.fd, to_submit, wait_nr, flags, NULL, 0);
+  if (rc < 0) {
+    if (errno == EINTR) {
+      rc = 0;
+    } else {
+      perror_die("io_uring_enter");
+    }
+  }
+  if (!ring.sqpoll) {
+    ring.to_submit -= rc;
+  } else {
+    ring.to_submit = 0;
+  }
+}
+
+struct io_uring_sqe* get_sqe(void) {
+  // The submission ring is full: push it to the kernel to make room. With
+  // SQPOLL, SQ_WAIT waits until the poller has consumed some entries.
+  while (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >=
+         ring.sq_entries) {
+    if (ring.sqpoll) {
+      __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+      stats.enter++;
+      syscall(__NR_io_uring_enter, ring.fd, 0, 0, IORING_ENTER_SQ_WAIT, NULL,
+              0);
+    } else {
+      uring_enter(0);
+    }
+  }
+
+  unsigned index = ring.sqe_tail & ring.sq_mask;
+  struct io_uring_sqe* sqe = &ring.sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sq_array[index] = index;
+  ring.sqe_tail++;
+  ring.to_submit++;
+  return sqe;
+}
+
+void queue_accept(int listener_sockfd) {
+  struct io_uring_sqe* sqe = get_sqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listener_sockfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = make_user_data(listener_sockfd, OP_ACCEPT);
+}
+
+void queue_recv(int sockfd) {
+  struct io_uring_sqe* sqe = get_sqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sockfd;
+  sqe->len = RECVBUF_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  sqe->user_data = make_user_data(sockfd, OP_RECV);
+}
+
+void queue_send(int sockfd) {
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
+  struct io_uring_sqe* sqe = get_sqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = sockfd;
+  sqe->addr = (uint64_t)(uintptr_t)&peerstate->sendbuf[peerstate->sendptr];
+  sqe->len = peerstate->sendbuf_end - peerstate->sendptr;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = make_user_data(sockfd, OP_SEND);
+}
+
+// Callbacks (on_XXX functions) return this status to the main loop, telling it
+// which request to queue next for the peer, as in epoll-server. When both are
+// false the peer is done and its fd can be closed.
+typedef struct {
+  bool want_read;
+  bool want_write;
+} fd_status_t;
+
+// These constants make creating fd_status_t values less verbose.
+const fd_status_t fd_status_R = {.want_read = true, .want_write = false};
+const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
+const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
+
+fd_status_t on_peer_connected(int sockfd) {
+  // Multishot accept has no per-connection address buffer, so ask for it.
+  struct sockaddr_in peer_addr;
+  socklen_t peer_addr_len = sizeof(peer_addr);
+  if (getpeername(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len) == 0) {
+    report_peer_connected(&peer_addr, peer_addr_len);
+  }
+
+  // Initialize state to send back a '*' to the peer immediately.
+  peer_state_t* peerstate = conn_table_add(peers, sockfd);
+  peerstate->state = INITIAL_ACK;
+  peerstate->sendbuf = conn_sendbuf_get(peers);
+  peerstate->sendbuf[0] = '*';
+  peerstate->sendptr = 0;
+  peerstate->sendbuf_end = 1;
+
+  return fd_status_W;
+}
+
+// Called with the data a recv completed with.
+fd_status_t on_peer_ready_recv(int sockfd, const uint8_t* buf, int nbytes) {
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
+  bool ready_to_send = false;
+  for (int i = 0; i < nbytes; ++i) {
+    switch (peerstate->state) {
+    case INITIAL_ACK:
+      assert(0 && "can't reach here");
+      break;
+    case WAIT_FOR_MSG:
+      if (buf[i] == '^') {
+        peerstate->state = IN_MSG;
+      }
+      break;
+    case IN_MSG:
+      if (buf[i] == '$') {
+        peerstate->state = WAIT_FOR_MSG;
+        stats.messages++;
+      } else {
+        if (!peerstate->sendbuf) {
+          peerstate->sendbuf = conn_sendbuf_get(peers);
+        }
+        assert(peerstate->sendbuf_end < SENDBUF_SIZE);
+        peerstate->sendbuf[peerstate->sendbuf_end++] = buf[i] + 1;
+        ready_to_send = true;
+      }
+      break;
+    }
+  }
+  return ready_to_send ? fd_status_W : fd_status_R;
+}
+
+// Called when a send completed, having sent nsent bytes.
+fd_status_t on_peer_ready_send(int sockfd, int nsent) {
+  peer_state_t* peerstate = conn_table_get(peers, sockfd);
+  peerstate->sendptr += nsent;
+  if (peerstate->sendptr < peerstate->sendbuf_end) {
+    // Partial send: send the rest.
+    return fd_status_W;
+  }
+  // Everything was sent; the buffer goes back to the pool until there is
+  // something to send again.
+  conn_sendbuf_put(peers, peerstate->sendbuf);
+  peerstate->sendbuf = NULL;
+  peerstate->sendptr = 0;
+  peerstate->sendbuf_end = 0;
+  if (peerstate->state == INITIAL_ACK) {
+    peerstate->state = WAIT_FOR_MSG;
+  }
+  return fd_status_R;
+}
+
+void close_peer(int fd) {
+  printf("socket %d closing\n", fd);
+  close(fd);
+  peer_state_t* peerstate = conn_table_get(peers, fd);
+  if (peerstate->sendbuf) {
+    conn_sendbuf_put(peers, peerstate->sendbuf);
+  }
+  conn_table_remove(peers, fd);
+  if (--num_peers == 0) {
+    report_stats();
+  }
+}
+
+void apply_status(int sockfd, fd_status_t status) {
+  if (status.want_write) {
+    queue_send(sockfd);
+  } else if (status.want_read) {
+    queue_recv(sockfd);
+  } else {
+    close_peer(sockfd);
+  }
+}
+
+void handle_completion(const struct io_uring_cqe* cqe, int listener_sockfd) {
+  int fd = cqe->user_data >> 8;
+  op_t op = cqe->user_data & 0xff;
+
+  switch (op) {
+  case OP_ACCEPT:
+    if (cqe->res < 0) {
+      printf("accept failed: %s\n", strerror(-cqe->res));
+    } else {
+      num_peers++;
+      apply_status(cqe->res, on_peer_connected(cqe->res));
+    }
+    // The kernel ends a multishot request on errors (or on overflow); rearm.
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      queue_accept(listener_sockfd);
+    }
+    break;
+  case OP_RECV:
+    if (cqe->res == -ENOBUFS) {
+      // Every receive buffer was taken; ours are recycled as completions are
+      // handled, so just retry.
+      queue_recv(fd);
+    } else if (cqe->res <= 0) {
+      // The peer disconnected (0) or the connection failed.
+      if (cqe->res < 0) {
+        printf("recv on socket %d: %s\n", fd, strerror(-cqe->res));
+      }
+      apply_status(fd, fd_status_NORW);
+    } else {
+      assert(cqe->flags & IORING_CQE_F_BUFFER);
+      unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      fd_status_t status = on_peer_ready_recv(
+          fd, &ring.recvbufs[bid * RECVBUF_SIZE], cqe->res);
+      recycle_recvbuf(bid);
+      apply_status(fd, status);
+    }
+    break;
+  case OP_SEND:
+    if (cqe->res < 0) {
+      printf("send on socket %d: %s\n", fd, strerror(-cqe->res));
+      apply_status(fd, fd_status_NORW);
+    } else {
+      apply_status(fd, on_peer_ready_send(fd, cqe->res));
+    }
+    break;
+  }
+}
+
+int main(int argc, const char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  int portnum = 9090;
+  if (argc >= 2) {
+    portnum = atoi(argv[1]);
+  }
+  bool sqpoll = false;
+  if (argc >= 3) {
+    if (strcmp(argv[2], "sqpoll") != 0) {
+      die("usage: %s [port] [sqpoll]", argv[0]);
+    }
+    sqpoll = true;
+  }
+  printf("Serving on port %d (io_uring%s)\n", portnum,
+         sqpoll ? ", SQPOLL" : "");
+
+  int listener_sockfd = listen_inet_socket(portnum);
+  peers = conn_table_create(sizeof(peer_state_t), SENDBUF_SIZE);
+  uring_init(sqpoll);
+  queue_accept(listener_sockfd);
+
+  while (1) {
+    // One syscall submits whatever the previous batch of completions queued
+    // and waits for the next batch.
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      uring_enter(1);
+      continue;
+    }
+
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      handle_completion(&ring.cqes[head & ring.cq_mask], listener_sockfd);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    // With SQPOLL, let the poller see the new requests right away rather than
+    // when we next run out of completions.
+    if (ring.sqpoll) {
+      uring_enter(0);
+    }
+  }
+
+  return 0;
+}
@@ -49,7 +49,7 @@ void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen) {
   }
 }
 
-int listen_inet_socket(int portnum) {
+static int listen_inet_socket_opts(int portnum, int reuseport) {
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (sockfd < 0) {
     perror_die("ERROR opening socket");
@@ -61,6 +61,10 @@ int listen_inet_socket(int portnum) {
   if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
     perror_die("setsockopt");
   }
+  if (reuseport &&
+      setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+    perror_die("setsockopt SO_REUSEPORT");
+  }
 
   struct sockaddr_in serv_addr;
   memset(&serv_addr, 0, sizeof(serv_addr));
@@ -79,6 +83,14 @@ int listen_inet_socket(int portnum) {
   return sockfd;
 }
 
+int listen_inet_socket(int portnum) {
+  return listen_inet_socket_opts(portnum, 0);
+}
+
+int listen_inet_socket_reuseport(int portnum) {
+  return listen_inet_socket_opts(portnum, 1);
+}
+
 void make_socket_non_blocking(int sockfd) {
   int flags = fcntl(sockfd, F_GETFL, 0);
   if (flags == -1) {
@@ -28,6 +28,11 @@ void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen);
 // the socket fd when successful; dies in case of errors.
 int listen_inet_socket(int portnum);
 
+// Like listen_inet_socket, but also sets SO_REUSEPORT so that several sockets
+// (typically one per thread) can listen on the same port. The kernel spreads
+// incoming connections across them.
+int listen_inet_socket_reuseport(int portnum);
+
 // Sets the given socket into non-blocking mode.
 void make_socket_non_blocking(int sockfd);
 
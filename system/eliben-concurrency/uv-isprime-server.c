@@ -1,5 +1,18 @@
 // Primality testing server. Accepts a number and sends back "prime" or
-// "composite" after testing the number for primality (in the naive, slow way).
+// "composite" after testing the number for primality.
+//
+// A read may carry several numbers (separated by newlines or any other
+// non-digits), which are answered in order, one line each, and tested in
+// isprime_batch calls of up to MAX_BATCH numbers (see primality.h:
+// Miller-Rabin in Montgomery arithmetic, behind a small-prime sieve). Digits
+// at the end of a read are held until a separator arrives, so a number may be
+// split across reads. Recent results are kept in a cache
+// on the loop thread; a read whose numbers are all cached is answered without
+// going to the work queue at all.
+//
+// Replies go out in the order the reads came in, even when a later read is
+// answered from the cache, or finishes on the work queue, before an earlier
+// one.
 //
 // Can be configured via an environment variable to do this in a blocking way,
 // without using libuv's work queue (MODE=BLOCK).
@@ -16,29 +29,102 @@
 #include <unistd.h>
 #include "uv.h"
 
+#include "primality.h"
 #include "utils.h"
 
 #define N_BACKLOG 64
 
-#define SENDBUF_SIZE 1024
+// Numbers per request; a read with more is split over several requests.
+#define MAX_BATCH 64
+
+#define SENDBUF_SIZE (MAX_BATCH * sizeof("composite\n"))
+
+typedef struct client client_t;
+
+// Up to MAX_BATCH numbers from one read, from parsing through the reply being
+// written. Each read gets its own, so a peer can send more while one is being
+// served.
+typedef struct request {
+  uv_work_t work_req;
+  uv_write_t write_req;
+  client_t* client;
+  struct request* next;  // Next read from the same client
+  bool done;             // results are all filled in
+  int count;
+  uint64_t numbers[MAX_BATCH];
+  bool results[MAX_BATCH];
+
+  // Indices of the numbers that weren't in the cache, and the numbers
+  // themselves, which is what the work queue tests.
+  int nmissed;
+  int missed_idx[MAX_BATCH];
+  uint64_t missed[MAX_BATCH];
+  bool missed_results[MAX_BATCH];
 
-// State maintained for each connected client.
-typedef struct {
-  uint64_t number;
-  uv_tcp_t* client;
   char sendbuf[SENDBUF_SIZE];
   int sendbuf_end;
-} peer_state_t;
+} request_t;
+
+// A connected peer. Its reads are queued in arrival order, and only the head
+// of the queue may be written, once it's done. The client outlives its
+// handle's close until the last of its requests is freed, since the work
+// queue may still be testing numbers for it.
+struct client {
+  uv_tcp_t handle;
+  request_t* head;
+  request_t* tail;
+  int nrequests;  // Requests allocated and not yet freed
+  bool closing;   // uv_close was called; nothing more is written
+  bool closed;    // The close callback has run
+
+  // A number whose digits ended the last read, to be continued by the next.
+  bool in_number;
+  uint64_t number;
+};
+
+// Direct-mapped cache of recent results, only touched on the loop thread: a
+// number's slot holds whichever number hashing to it was tested last.
+#define CACHE_BITS 14
+
+typedef struct {
+  uint64_t number;
+  bool valid;
+  bool prime;
+} cache_entry_t;
+
+cache_entry_t cache[1 << CACHE_BITS];
+
+cache_entry_t* cache_slot(uint64_t number) {
+  return &cache[(number * 0x9e3779b97f4a7c15ULL) >> (64 - CACHE_BITS)];
+}
 
-// Sets sendbuf/sendbuf_end in the given state to the contents of the
-// NULL-terminated string passed as 'str'.
-void set_peer_sendbuf(peer_state_t* state, const char* str) {
-  int i = 0;
-  for (; str[i]; ++i) {
-    assert(i < SENDBUF_SIZE);
-    state->sendbuf[i] = str[i];
+// Looks number up in the cache, storing the result in *prime on a hit.
+bool cache_lookup(uint64_t number, bool* prime) {
+  cache_entry_t* e = cache_slot(number);
+  if (e->valid && e->number == number) {
+    *prime = e->prime;
+    return true;
+  }
+  return false;
+}
+
+void cache_insert(uint64_t number, bool prime) {
+  cache_entry_t* e = cache_slot(number);
+  e->number = number;
+  e->prime = prime;
+  e->valid = true;
+}
+
+// Fills the request's sendbuf with a line per number.
+void set_request_sendbuf(request_t* req) {
+  req->sendbuf_end = 0;
+  for (int i = 0; i < req->count; ++i) {
+    const char* line = req->results[i] ? "prime\n" : "composite\n";
+    int len = strlen(line);
+    assert(req->sendbuf_end + len <= (int)SENDBUF_SIZE);
+    memcpy(&req->sendbuf[req->sendbuf_end], line, len);
+    req->sendbuf_end += len;
   }
-  state->sendbuf_end = i;
 }
 
 void on_alloc_buffer(uv_handle_t* handle, size_t suggested_size,
@@ -47,72 +133,157 @@ void on_alloc_buffer(uv_handle_t* handle, size_t suggested_size,
   buf->len = suggested_size;
 }
 
+void maybe_free_client(client_t* client) {
+  if (client->closed && client->nrequests == 0) {
+    free(client);
+  }
+}
+
+void free_request(request_t* req) {
+  client_t* client = req->client;
+  free(req);
+  client->nrequests--;
+  maybe_free_client(client);
+}
+
 void on_client_closed(uv_handle_t* handle) {
-  uv_tcp_t* client = (uv_tcp_t*)handle;
-  // The client handle owns the peer state storing its address in the data
-  // field, so we free it here.
-  if (client->data) {
-    free(client->data);
+  client_t* client = (client_t*)handle;
+  client->closed = true;
+  maybe_free_client(client);
+}
+
+void close_client(client_t* client) {
+  if (!client->closing) {
+    client->closing = true;
+    uv_close((uv_handle_t*)&client->handle, on_client_closed);
   }
-  free(client);
 }
 
-// Naive primality test, iterating all the way to sqrt(n) to find numbers that
-// divide n.
-bool isprime(uint64_t n) {
-  if (n % 2 == 0) {
-    return n == 2 ? true : false;
+void on_sent_response(uv_write_t* write_req, int status) {
+  request_t* req = (request_t*)write_req->data;
+  if (status < 0 && status != UV_ECANCELED) {
+    fprintf(stderr, "Write error: %s\n", uv_strerror(status));
+    close_client(req->client);
   }
+  free_request(req);
+}
 
-  for (uint64_t r = 3; r * r <= n; r += 2) {
-    if (n % r == 0) {
-      return false;
+// Writes the replies of the client's finished reads from the head of its
+// queue, stopping at the first one still being worked on. Once the client is
+// closing, finished reads are just freed.
+void flush_client(client_t* client) {
+  while (client->head && client->head->done) {
+    request_t* req = client->head;
+    client->head = req->next;
+    if (!client->head) {
+      client->tail = NULL;
+    }
+    if (client->closing) {
+      free_request(req);
+      continue;
+    }
+
+    set_request_sendbuf(req);
+    uv_buf_t writebuf = uv_buf_init(req->sendbuf, req->sendbuf_end);
+    req->write_req.data = req;
+    int rc;
+    if ((rc = uv_write(&req->write_req, (uv_stream_t*)&client->handle,
+                       &writebuf, 1, on_sent_response)) < 0) {
+      fprintf(stderr, "uv_write failed: %s\n", uv_strerror(rc));
+      free_request(req);
+      close_client(client);
     }
   }
-  return true;
 }
 
-void on_sent_response(uv_write_t* req, int status) {
-  if (status) {
-    die("Write error: %s\n", uv_strerror(status));
+// Caches the results the work queue computed, marks req done and writes
+// whatever replies are now in order.
+void complete_request(request_t* req) {
+  for (int i = 0; i < req->nmissed; ++i) {
+    req->results[req->missed_idx[i]] = req->missed_results[i];
+    cache_insert(req->missed[i], req->missed_results[i]);
   }
-  free(req);
+  req->done = true;
+  flush_client(req->client);
 }
 
 // Runs in a separate thread, can do blocking/time-consuming operations.
-void on_work_submitted(uv_work_t* req) {
-  peer_state_t* peerstate = (peer_state_t*)req->data;
-  printf("work submitted: %" PRIu64 "\n", peerstate->number);
-  if (isprime(peerstate->number)) {
-    set_peer_sendbuf(peerstate, "prime\n");
-  } else {
-    set_peer_sendbuf(peerstate, "composite\n");
-  }
+void on_work_submitted(uv_work_t* work_req) {
+  request_t* req = (request_t*)work_req->data;
+  printf("work submitted: %d numbers, first %" PRIu64 "\n", req->nmissed,
+         req->missed[0]);
+  isprime_batch(req->missed, req->missed_results, req->nmissed);
 }
 
-void on_work_completed(uv_work_t* req, int status) {
+void on_work_completed(uv_work_t* work_req, int status) {
   if (status) {
     die("on_work_completed error: %s\n", uv_strerror(status));
   }
-  peer_state_t* peerstate = (peer_state_t*)req->data;
-  printf("work completed: %" PRIu64 "\n", peerstate->number);
-  uv_buf_t writebuf = uv_buf_init(peerstate->sendbuf, peerstate->sendbuf_end);
-  uv_write_t* writereq = (uv_write_t*)xmalloc(sizeof(*writereq));
-  writereq->data = peerstate;
-  int rc;
-  if ((rc = uv_write(writereq, (uv_stream_t*)peerstate->client, &writebuf, 1,
-                     on_sent_response)) < 0) {
-    die("uv_write failed: %s", uv_strerror(rc));
+  request_t* req = (request_t*)work_req->data;
+  printf("work completed: %d numbers, first %" PRIu64 "\n", req->nmissed,
+         req->missed[0]);
+  complete_request(req);
+}
+
+// Allocates a request for client, queued behind its earlier ones.
+request_t* new_request(client_t* client) {
+  request_t* req = (request_t*)xmalloc(sizeof(*req));
+  req->client = client;
+  req->next = NULL;
+  req->done = false;
+  req->count = 0;
+
+  if (client->tail) {
+    client->tail->next = req;
+  } else {
+    client->head = req;
+  }
+  client->tail = req;
+  client->nrequests++;
+  return req;
+}
+
+// Answers what the cache can of req's numbers and tests the rest in one
+// batch: right here in BLOCK mode, otherwise on the work queue.
+void start_request(request_t* req, bool block) {
+  req->nmissed = 0;
+  for (int i = 0; i < req->count; ++i) {
+    if (!cache_lookup(req->numbers[i], &req->results[i])) {
+      req->missed_idx[req->nmissed] = i;
+      req->missed[req->nmissed] = req->numbers[i];
+      req->nmissed++;
+    }
+  }
+
+  if (req->nmissed == 0) {
+    complete_request(req);
+  } else if (block) {
+    // BLOCK mode: test synchronously, blocking the callback.
+    printf("Nums %d, first %" PRIu64 "\n", req->count, req->numbers[0]);
+
+    uint64_t t1 = uv_hrtime();
+    isprime_batch(req->missed, req->missed_results, req->nmissed);
+    uint64_t t2 = uv_hrtime();
+    printf("Elapsed %" PRIu64 " ns\n", t2 - t1);
+    complete_request(req);
+  } else {
+    // Otherwise, test on the work queue, without blocking the callback.
+    req->work_req.data = req;
+    int rc;
+    if ((rc = uv_queue_work(uv_default_loop(), &req->work_req,
+                            on_work_submitted, on_work_completed)) < 0) {
+      die("uv_queue_work failed: %s", uv_strerror(rc));
+    }
   }
-  free(req);
 }
 
-void on_peer_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf) {
+void on_peer_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+  client_t* client = (client_t*)stream;
   if (nread < 0) {
     if (nread != UV_EOF) {
       fprintf(stderr, "Read error: %s\n", uv_strerror(nread));
     }
-    uv_close((uv_handle_t*)client, on_client_closed);
+    close_client(client);
   } else if (nread == 0) {
     // From the documentation of uv_read_cb: nread might be 0, which does not
     // indicate an error or EOF. This is equivalent to EAGAIN or EWOULDBLOCK
@@ -120,57 +291,47 @@ void on_peer_read(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf) {
   } else {
     // nread > 0
     assert(buf->len >= nread);
-    int rc;
 
-    // Parse the number from client request: assume for simplicity the request
-    // all arrives at the same time and contains only digits (possibly followed
-    // by non-digits like a newline).
-    uint64_t number = 0;
+    char* mode = getenv("MODE");
+    bool block = mode && !strcmp(mode, "BLOCK");
+    if (block) {
+      printf("Got %zu bytes\n", nread);
+    }
+
+    // Every run of digits is a number, ended by any non-digit; one still
+    // open at the end of the read carries over to the next. A read that
+    // neither ends nor starts a number counts as 0, as it used to.
+    request_t* req = NULL;
+    bool any = false;
     for (int i = 0; i < nread; ++i) {
       char c = buf->base[i];
       if (isdigit(c)) {
-        number = number * 10 + (c - '0');
-      } else {
-        break;
+        client->number = client->number * 10 + (c - '0');
+        client->in_number = true;
+        continue;
       }
-    }
-    peer_state_t* peerstate = (peer_state_t*)client->data;
-    peerstate->client = (uv_tcp_t*)client;
-    peerstate->number = number;
-
-    char* mode = getenv("MODE");
-    if (mode && !strcmp(mode, "BLOCK")) {
-      // BLOCK mode: compute isprime synchronously, blocking the callback.
-      printf("Got %zu bytes\n", nread);
-      printf("Num %" PRIu64 "\n", number);
-
-      uint64_t t1 = uv_hrtime();
-      if (isprime(number)) {
-        set_peer_sendbuf(peerstate, "prime\n");
-      } else {
-        set_peer_sendbuf(peerstate, "composite\n");
+      if (!client->in_number) {
+        continue;
       }
-      uint64_t t2 = uv_hrtime();
-      printf("Elapsed %" PRIu64 " ns\n", t2 - t1);
-
-      uv_buf_t writebuf =
-          uv_buf_init(peerstate->sendbuf, peerstate->sendbuf_end);
-      uv_write_t* writereq = (uv_write_t*)xmalloc(sizeof(*writereq));
-      writereq->data = peerstate;
-      if ((rc = uv_write(writereq, (uv_stream_t*)client, &writebuf, 1,
-                         on_sent_response)) < 0) {
-        die("uv_write failed: %s", uv_strerror(rc));
+      if (!req) {
+        req = new_request(client);
       }
-    } else {
-      // Otherwise, compute isprime on the work queue, without blocking the
-      // callback.
-      uv_work_t* work_req = (uv_work_t*)xmalloc(sizeof(*work_req));
-      work_req->data = peerstate;
-      if ((rc = uv_queue_work(uv_default_loop(), work_req, on_work_submitted,
-                              on_work_completed)) < 0) {
-        die("uv_queue_work failed: %s", uv_strerror(rc));
+      req->numbers[req->count++] = client->number;
+      client->number = 0;
+      client->in_number = false;
+      any = true;
+      if (req->count == MAX_BATCH) {
+        start_request(req, block);
+        req = NULL;
       }
     }
+    if (!any && !client->in_number) {
+      req = new_request(client);
+      req->numbers[req->count++] = 0;
+    }
+    if (req) {
+      start_request(req, block);
+    }
   }
   free(buf->base);
 }
@@ -182,37 +343,33 @@ void on_peer_connected(uv_stream_t* server, int status) {
   }
 
   // client will represent this peer; it's allocated on the heap and only
-  // released when the client disconnects. The client holds a pointer to
-  // peer_state_t in its data field; this peer state tracks the protocol state
-  // with this client throughout interaction.
-  uv_tcp_t* client = (uv_tcp_t*)xmalloc(sizeof(*client));
+  // released once the client has disconnected and its last request is done.
+  client_t* client = (client_t*)xmalloc(sizeof(*client));
+  memset(client, 0, sizeof(*client));
   int rc;
-  if ((rc = uv_tcp_init(uv_default_loop(), client)) < 0) {
+  if ((rc = uv_tcp_init(uv_default_loop(), &client->handle)) < 0) {
     die("uv_tcp_init failed: %s", uv_strerror(rc));
   }
-  client->data = NULL;
 
-  if (uv_accept(server, (uv_stream_t*)client) == 0) {
+  if (uv_accept(server, (uv_stream_t*)&client->handle) == 0) {
     struct sockaddr_storage peername;
     int namelen = sizeof(peername);
-    if ((rc = uv_tcp_getpeername(client, (struct sockaddr*)&peername,
+    if ((rc = uv_tcp_getpeername(&client->handle, (struct sockaddr*)&peername,
                                  &namelen)) < 0) {
-      die("uv_tcp_getpeername failed: %s", uv_strerror(rc));
+      // The peer may have reset the connection already.
+      fprintf(stderr, "uv_tcp_getpeername failed: %s\n", uv_strerror(rc));
+      close_client(client);
+      return;
     }
     report_peer_connected((const struct sockaddr_in*)&peername, namelen);
 
-    // Initialize the peer state for a new client.
-    peer_state_t* peerstate = (peer_state_t*)xmalloc(sizeof(*peerstate));
-    peerstate->sendbuf_end = 0;
-    client->data = peerstate;
-
     // Start reading on the peer socket.
-    if ((rc = uv_read_start((uv_stream_t*)client, on_alloc_buffer,
+    if ((rc = uv_read_start((uv_stream_t*)&client->handle, on_alloc_buffer,
                             on_peer_read)) < 0) {
       die("uv_read_start failed: %s", uv_strerror(rc));
     }
   } else {
-    uv_close((uv_handle_t*)client, on_client_closed);
+    close_client(client);
   }
 }
 
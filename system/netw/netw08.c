@@ -196,26 +196,36 @@ int main(void) {
       } else {
         int fd = events[i].data.fd;
         if (events[i].events & EPOLLIN) {
-          nbytes = recv(fd, buf, sizeof buf, 0);
-          if (nbytes <= 0) {
-            if (nbytes < 0) {
-              perror("recv");
-            } else {
-              printf("epoll: socket %d hung up\n", fd);
-              if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
-                perror("epoll_ctl EPOLL_CTL_DEL");
-                exit(EXIT_FAILURE);
+          // Edge-triggered: we are told about new data only once, so keep
+          // reading until the socket is drained (EAGAIN) or closed.
+          for (;;) {
+            nbytes = recv(fd, buf, sizeof buf, 0);
+            if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+              break;
+            }
+            if (nbytes <= 0) {
+              if (nbytes < 0) {
+                perror("recv");
+              } else {
+                printf("epoll: socket %d hung up\n", fd);
               }
+              // close() also removes fd from the epoll set
+              close(fd);
+              del_from_fds(&fds, fd, &fd_count);
+              break;
             }
-            close(fd);
-            del_from_fds(&fds, fd, &fd_count);
-          } else {
             for (j = 0; j < fd_count; j++) {
               int dest_fd = fds[j];
               if (dest_fd != fd && dest_fd != listener) {
                 if (send(dest_fd, buf, nbytes, 0) == -1) {
-                  perror("send failed");
-                  exit(EXIT_FAILURE);
+                  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // A slow reader with a full socket buffer; it misses
+                    // this chunk rather than stalling everyone else.
+                    printf("epoll: socket %d is full, dropping\n", dest_fd);
+                  } else {
+                    perror("send failed");
+                    exit(EXIT_FAILURE);
+                  }
                 }
               }
             }